@@ -0,0 +1,216 @@
+#include "rpn_protocol.hpp"
+#include "librpn.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace librpn::server;
+using Clock = std::chrono::steady_clock;
+
+//==============================================================================
+// rpn_server 用の負荷生成クライアント
+//==============================================================================
+//
+// 接続ごとにスレッドを1本立て、常に depth 個の要求を送りっぱなしにする
+// （パイプライン）。全要求の往復時間から p50 / p99 とスループットを表示する。
+
+struct Options {
+    std::string socketPath = DEFAULT_SOCKET;
+    unsigned connections = 4;
+    size_t requests = 100000;       // 接続あたり
+    size_t depth = 32;              // 接続あたりの未応答の要求数の上限
+    std::vector<std::string> expressions = {
+        "x * y + sin(x)",
+        "sqrt(x ^ 2 + y ^ 2)",
+        "mean{x, y, 3} * exp(0 - x)",
+        "(x + 1) / (y + 2) - cos(y)",
+    };
+};
+
+struct WorkerResult {
+    std::vector<double> latencies;  // マイクロ秒
+    size_t errors = 0;
+    bool failed = false;
+};
+
+static void usage() {
+    std::cerr << "usage: rpn_loadgen [--socket PATH] [--connections N] [--requests N] [--depth N] [--expr EXPR]...\n";
+}
+
+static bool parseOptions(int argc, char** argv, Options& options) {
+    bool customExpressions = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        if (arg == "--socket") options.socketPath = value;
+        else if (arg == "--connections") options.connections = std::max(1, std::atoi(value.c_str()));
+        else if (arg == "--requests") options.requests = std::strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--depth") options.depth = std::max(1, std::atoi(value.c_str()));
+        else if (arg == "--expr") {
+            if (!customExpressions) options.expressions.clear();
+            customExpressions = true;
+            options.expressions.push_back(value);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int connectTo(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        close(fd);
+        return -1;
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool sendAll(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static void runConnection(const Options& options, const std::vector<size_t>& variableCounts,
+                          unsigned seed, WorkerResult& result) {
+    int fd = connectTo(options.socketPath);
+    if (fd < 0) {
+        result.failed = true;
+        return;
+    }
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> dist(0.1, 10.0);
+    std::vector<Clock::time_point> sentAt(options.requests);
+    std::vector<double> variables;
+    std::string out;
+    std::string in;
+    char buffer[65536];
+    size_t sent = 0;
+    size_t received = 0;
+    result.latencies.reserve(options.requests);
+
+    while (received < options.requests) {
+        // 未応答が depth 未満になるまで要求を積んでまとめて送る
+        out.clear();
+        auto now = Clock::now();
+        while (sent < options.requests && sent - received < options.depth) {
+            size_t e = sent % options.expressions.size();
+            variables.resize(variableCounts[e]);
+            for (double& v : variables) v = dist(rng);
+            encodeRequest(out, static_cast<uint32_t>(sent), options.expressions[e], variables);
+            sentAt[sent++] = now;
+        }
+        if (!out.empty() && !sendAll(fd, out)) {
+            result.failed = true;
+            break;
+        }
+
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            result.failed = true;
+            break;
+        }
+        in.append(buffer, static_cast<size_t>(n));
+
+        size_t offset = 0;
+        const char* payload = nullptr;
+        uint32_t length = 0;
+        auto arrived = Clock::now();
+        while (nextFrame(in.data() + offset, in.size() - offset, payload, length) == FrameStatus::Complete) {
+            uint32_t id = getU32(payload);
+            if (length < 5 || id >= sentAt.size()) {
+                result.failed = true;
+                break;
+            }
+            if (static_cast<uint8_t>(payload[4]) != STATUS_OK) ++result.errors;
+            result.latencies.push_back(std::chrono::duration<double, std::micro>(arrived - sentAt[id]).count());
+            ++received;
+            offset += 4 + static_cast<size_t>(length);
+        }
+        in.erase(0, offset);
+        if (result.failed) break;
+    }
+    close(fd);
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options) || options.expressions.empty()) {
+        usage();
+        return 2;
+    }
+
+    // 各式の変数の数（変数の値はスロット順に乱数で与える）
+    std::vector<size_t> variableCounts;
+    for (const auto& expr : options.expressions) {
+        try {
+            variableCounts.push_back(librpn::compile(expr).variables.size());
+        } catch (const std::exception& e) {
+            std::cerr << "rpn_loadgen: invalid expression '" << expr << "': " << e.what() << "\n";
+            return 2;
+        }
+    }
+
+    std::vector<WorkerResult> results(options.connections);
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (unsigned i = 0; i < options.connections; ++i) {
+        threads.emplace_back(runConnection, std::cref(options), std::cref(variableCounts), 12345u + i,
+                             std::ref(results[i]));
+    }
+    for (auto& t : threads) t.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<double> latencies;
+    size_t errors = 0;
+    bool failed = false;
+    for (auto& r : results) {
+        latencies.insert(latencies.end(), r.latencies.begin(), r.latencies.end());
+        errors += r.errors;
+        failed = failed || r.failed;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    std::printf("connections %u  depth %zu  requests %zu  errors %zu\n",
+                options.connections, options.depth, latencies.size(), errors);
+    std::printf("throughput  %.0f req/s (%.2fs)\n", latencies.size() / seconds, seconds);
+    if (!latencies.empty()) {
+        std::printf("latency     p50 %.1fus  p99 %.1fus  max %.1fus\n",
+                    percentileOfSorted(latencies, 50), percentileOfSorted(latencies, 99), latencies.back());
+    }
+    if (failed) {
+        std::fprintf(stderr, "rpn_loadgen: connection to %s failed\n", options.socketPath.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace librpn {
+namespace server {
+
+//==============================================================================
+// rpn_server のワイヤプロトコル（長さ付きフレーム、リトルエンディアン）
+//==============================================================================
+//
+// フレーム : u32 ペイロード長 | ペイロード
+//
+// 要求     : u32 要求ID | u16 変数の数 n | f64 × n 変数の値 | 中置記法の式（UTF-8、残り全部）
+//            変数の値は式に現れる順（compile() のスロット順）に並べる
+// 応答     : u32 要求ID | u8 状態 | 状態 = 0: f64 結果
+//                                   状態 = 1: エラーメッセージ（UTF-8、残り全部）
+//                                   状態 = 2: 予算の超過・取り消しで打ち切った（メッセージは状態 1 と同じ形式）
+//
+// 1つの接続で応答を待たずに続けて要求を送ってよい（パイプライン）。
+// 応答は要求の順とは限らないため、要求IDで対応を取ること。
+
+constexpr uint32_t MAX_FRAME = 1 << 20;     // これを超えるフレームは接続を切る
+constexpr uint8_t STATUS_OK = 0;
+constexpr uint8_t STATUS_ERROR = 1;
+constexpr uint8_t STATUS_ABORTED = 2;
+
+// 既定のソケットパス
+constexpr const char* DEFAULT_SOCKET = "/tmp/rpn_server.sock";
+
+inline void putU16(std::string& out, uint16_t v) {
+    char b[2] = {static_cast<char>(v), static_cast<char>(v >> 8)};
+    out.append(b, 2);
+}
+
+inline void putU32(std::string& out, uint32_t v) {
+    char b[4];
+    for (int i = 0; i < 4; ++i) b[i] = static_cast<char>(v >> (8 * i));
+    out.append(b, 4);
+}
+
+inline void putF64(std::string& out, double v) {
+    uint64_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    char b[8];
+    for (int i = 0; i < 8; ++i) b[i] = static_cast<char>(bits >> (8 * i));
+    out.append(b, 8);
+}
+
+inline uint16_t getU16(const char* p) {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint16_t>(u[0] | (u[1] << 8));
+}
+
+inline uint32_t getU32(const char* p) {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint32_t>(u[0]) | (static_cast<uint32_t>(u[1]) << 8) |
+           (static_cast<uint32_t>(u[2]) << 16) | (static_cast<uint32_t>(u[3]) << 24);
+}
+
+inline double getF64(const char* p) {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; ++i) bits |= static_cast<uint64_t>(u[i]) << (8 * i);
+    double v;
+    std::memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+// 要求フレームを out に追加
+inline void encodeRequest(std::string& out, uint32_t id, const std::string& expression,
+                          const std::vector<double>& variables) {
+    putU32(out, static_cast<uint32_t>(4 + 2 + 8 * variables.size() + expression.size()));
+    putU32(out, id);
+    putU16(out, static_cast<uint16_t>(variables.size()));
+    for (double v : variables) putF64(out, v);
+    out += expression;
+}
+
+// 成功の応答フレームを out に追加
+inline void encodeResult(std::string& out, uint32_t id, double value) {
+    putU32(out, 4 + 1 + 8);
+    putU32(out, id);
+    out.push_back(static_cast<char>(STATUS_OK));
+    putF64(out, value);
+}
+
+// エラー（status は STATUS_ERROR か STATUS_ABORTED）の応答フレームを out に追加
+inline void encodeError(std::string& out, uint32_t id, const std::string& message,
+                        uint8_t status = STATUS_ERROR) {
+    putU32(out, static_cast<uint32_t>(4 + 1 + message.size()));
+    putU32(out, id);
+    out.push_back(static_cast<char>(status));
+    out += message;
+}
+
+// フレームの取り出し結果
+enum class FrameStatus {
+    Complete,      // 完全なフレームがある
+    Incomplete,    // データが足りない（続きを受信する）
+    TooLarge       // 長さが MAX_FRAME を超える（接続を切る）
+};
+
+// buffer の先頭のフレームを調べ、完全ならペイロードの位置と長さを返す
+inline FrameStatus nextFrame(const char* buffer, size_t size, const char*& payload, uint32_t& length) {
+    if (size < 4) return FrameStatus::Incomplete;
+    length = getU32(buffer);
+    if (length > MAX_FRAME) return FrameStatus::TooLarge;
+    if (size < 4 + static_cast<size_t>(length)) return FrameStatus::Incomplete;
+    payload = buffer + 4;
+    return FrameStatus::Complete;
+}
+
+//==============================================================================
+// 計測（サーバー・負荷生成クライアント共通）
+//==============================================================================
+
+// 昇順に並べた標本の p パーセンタイル（0 ≤ p ≤ 100、最近接順位法）
+inline double percentileOfSorted(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t rank = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[rank < sorted.size() ? rank : sorted.size() - 1];
+}
+
+} // namespace server
+} // namespace librpn
@@ -0,0 +1,530 @@
+#include "rpn_protocol.hpp"
+#include "librpn.hpp"
+#include "librpn_cost.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace librpn::server;
+using Clock = std::chrono::steady_clock;
+
+//==============================================================================
+// 要求・応答
+//==============================================================================
+
+struct Request {
+    uint64_t connection;            // 接続ID（fd は再利用されるため別に採番）
+    uint32_t id;
+    std::vector<double> variables;
+    std::string expression;
+    Clock::time_point received;
+};
+
+struct Response {
+    uint64_t connection;
+    std::string frame;
+    Clock::time_point received;
+};
+
+//==============================================================================
+// コンパイル済み式のキャッシュ（全ワーカーで共有）
+//==============================================================================
+
+// コンパイル済みプログラムとコストの見積もり（受け入れ判定は見積もりだけで行う）
+struct CompiledExpression {
+    librpn::Program program;
+    librpn::CostEstimate cost;
+};
+
+class ProgramCache {
+public:
+    ProgramCache(size_t capacity, const librpn::CostModel& model) : capacity_(capacity), model_(model) {}
+
+    // 式をコンパイル済みプログラムにする（キャッシュになければコンパイル・見積もりをして登録）
+    // 構文エラーなどの例外はそのまま呼び出し側に投げる（失敗はキャッシュしない）
+    std::shared_ptr<const CompiledExpression> get(const std::string& expression) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            auto it = programs_.find(expression);
+            if (it != programs_.end()) return it->second;
+        }
+        librpn::Program compiled = librpn::compile(expression);
+        librpn::CostEstimate cost = librpn::estimateCost(compiled, model_);
+        auto program = std::make_shared<const CompiledExpression>(CompiledExpression{std::move(compiled), cost});
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        // 上限に達したら全部捨てる（よく使う式はすぐに再登録される）
+        if (programs_.size() >= capacity_) programs_.clear();
+        return programs_.emplace(expression, program).first->second;
+    }
+
+private:
+    size_t capacity_;
+    librpn::CostModel model_;
+    std::shared_mutex mutex_;
+    std::unordered_map<std::string, std::shared_ptr<const CompiledExpression>> programs_;
+};
+
+//==============================================================================
+// ワーカープール（マイクロバッチ単位で評価）
+//==============================================================================
+
+// policy があれば評価の前に見積もりで判定し、Reject はエラーを返し、Isolate は
+// isolated のプールに回す（重い式が通常の要求の待ち時間を延ばさないように）。
+// 評価は budget（0なら制限なし）の作業量で打ち切り、プールを止めるときは評価中の式も取り消す。
+class WorkerPool {
+public:
+    WorkerPool(unsigned threads, ProgramCache& cache, int wakeFd, uint64_t budget,
+               librpn::AdmissionPolicy policy = nullptr, WorkerPool* isolated = nullptr)
+        : cache_(cache), wakeFd_(wakeFd), limits_{budget, &cancel_}, policy_(std::move(policy)),
+          isolated_(isolated) {
+        for (unsigned i = 0; i < threads; ++i) {
+            threads_.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cancel_.cancel();
+        ready_.notify_all();
+        for (auto& t : threads_) t.join();
+    }
+
+    // バッチを投入（1バッチは1つのワーカーがまとめて評価する）
+    void submit(std::vector<Request> batch) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            batches_.push_back(std::move(batch));
+        }
+        ready_.notify_one();
+    }
+
+    // 完了した応答をすべて取り出す
+    void drain(std::vector<Response>& out) {
+        std::lock_guard<std::mutex> lock(doneMutex_);
+        out.swap(done_);
+    }
+
+private:
+    void run() {
+        std::vector<Response> responses;
+        std::vector<Request> isolated;
+        for (;;) {
+            std::vector<Request> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this]() { return stopping_ || !batches_.empty(); });
+                if (batches_.empty()) return;
+                batch = std::move(batches_.front());
+                batches_.pop_front();
+            }
+
+            responses.clear();
+            for (Request& request : batch) {
+                Response response{request.connection, {}, request.received};
+                try {
+                    auto compiled = cache_.get(request.expression);
+                    librpn::Admission admission = policy_ ? policy_(compiled->cost) : librpn::Admission::Accept;
+                    if (admission == librpn::Admission::Isolate && isolated_) {
+                        isolated.push_back(std::move(request));
+                        continue;
+                    }
+                    if (admission == librpn::Admission::Reject) {
+                        const librpn::CostEstimate& cost = compiled->cost;
+                        throw std::runtime_error(
+                            "rpn_server: expression rejected (estimated " +
+                            std::to_string(static_cast<long long>(cost.nanoseconds / 1000)) + "us" +
+                            (cost.unboundedLists ? ", list size depends on variables)" : ")"));
+                    }
+                    encodeResult(response.frame, request.id,
+                                 librpn::evaluate(compiled->program, request.variables, limits_));
+                } catch (const librpn::EvaluationAborted& e) {
+                    encodeError(response.frame, request.id, e.what(), STATUS_ABORTED);
+                } catch (const std::exception& e) {
+                    encodeError(response.frame, request.id, e.what());
+                }
+                responses.push_back(std::move(response));
+            }
+            if (!isolated.empty()) {
+                isolated_->submit(std::move(isolated));
+                isolated.clear();
+            }
+
+            // バッチ単位で完了を通知（ロックとイベントループの起床は1バッチ1回）
+            {
+                std::lock_guard<std::mutex> lock(doneMutex_);
+                for (auto& r : responses) done_.push_back(std::move(r));
+            }
+            uint64_t one = 1;
+            ssize_t ignored = write(wakeFd_, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+
+    ProgramCache& cache_;
+    int wakeFd_;
+    librpn::CancellationToken cancel_;
+    librpn::EvaluationLimits limits_;
+    librpn::AdmissionPolicy policy_;
+    WorkerPool* isolated_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::vector<Request>> batches_;
+    bool stopping_ = false;
+
+    std::mutex doneMutex_;
+    std::vector<Response> done_;
+};
+
+//==============================================================================
+// イベントループ
+//==============================================================================
+
+struct Connection {
+    int fd;
+    std::string in;             // 受信済みで未処理のバイト列
+    std::string out;            // 送信待ちのバイト列
+    bool wantWrite = false;     // EPOLLOUT を監視しているか
+};
+
+// epoll に登録する特別なID（接続IDは2から）
+constexpr uint64_t LISTEN_ID = 0;
+constexpr uint64_t WAKE_ID = 1;
+
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void onSignal(int) {
+    stopRequested = 1;
+}
+
+struct Options {
+    std::string socketPath = DEFAULT_SOCKET;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t batchSize = 64;
+    double reportInterval = 5.0;    // 秒（0なら終了時のみ）
+    size_t cacheCapacity = 4096;
+    double maxCostUs = 0;           // 見積もりがこれを超える式は拒否する（0なら制限なし）
+    double isolateCostUs = 0;       // 見積もりがこれを超える式は別のプールで評価する（0なら振り分けない）
+    unsigned isolateThreads = 1;
+    uint64_t budget = 0;            // 1要求の評価の作業量の上限（0なら制限なし）
+};
+
+static void usage() {
+    std::cerr << "usage: rpn_server [--socket PATH] [--threads N] [--batch N] [--report SEC] [--cache N]\n"
+                 "                  [--max-cost-us US] [--isolate-cost-us US] [--isolate-threads N] [--budget N]\n";
+}
+
+static bool parseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        if (arg == "--socket") options.socketPath = value;
+        else if (arg == "--threads") options.threads = std::max(1, std::atoi(value.c_str()));
+        else if (arg == "--batch") options.batchSize = std::max(1, std::atoi(value.c_str()));
+        else if (arg == "--report") options.reportInterval = std::atof(value.c_str());
+        else if (arg == "--cache") options.cacheCapacity = std::max(1, std::atoi(value.c_str()));
+        else if (arg == "--max-cost-us") options.maxCostUs = std::atof(value.c_str());
+        else if (arg == "--isolate-cost-us") options.isolateCostUs = std::atof(value.c_str());
+        else if (arg == "--isolate-threads") options.isolateThreads = std::max(1, std::atoi(value.c_str()));
+        else if (arg == "--budget") options.budget = std::strtoull(value.c_str(), nullptr, 10);
+        else return false;
+    }
+    return true;
+}
+
+// 区間の統計（スループットと p50 / p99）を表示して標本を捨てる
+static void report(std::vector<double>& latencies, double seconds) {
+    if (latencies.empty()) return;
+    std::sort(latencies.begin(), latencies.end());
+    std::fprintf(stderr, "rpn_server: %zu req in %.1fs (%.0f req/s)  p50 %.1fus  p99 %.1fus  max %.1fus\n",
+                 latencies.size(), seconds, latencies.size() / seconds,
+                 percentileOfSorted(latencies, 50), percentileOfSorted(latencies, 99), latencies.back());
+    latencies.clear();
+}
+
+// 要求フレームを解析（不正なら false）
+static bool parseRequest(const char* payload, uint32_t length, Request& request) {
+    if (length < 6) return false;
+    request.id = getU32(payload);
+    uint16_t count = getU16(payload + 4);
+    size_t header = 6 + 8 * static_cast<size_t>(count);
+    if (length < header) return false;
+    request.variables.resize(count);
+    for (uint16_t k = 0; k < count; ++k) request.variables[k] = getF64(payload + 6 + 8 * k);
+    request.expression.assign(payload + header, length - header);
+    return true;
+}
+
+static int listenOn(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        close(fd);
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage();
+        return 2;
+    }
+
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    int listenFd = listenOn(options.socketPath);
+    if (listenFd < 0) {
+        std::perror("rpn_server: listen");
+        return 1;
+    }
+    int wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (wakeFd < 0 || epollFd < 0) {
+        std::perror("rpn_server: epoll");
+        return 1;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTEN_ID;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+    ev.data.u64 = WAKE_ID;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+    // 受け入れ判定（上限を指定したときだけ。係数は起動時にこの環境で求める）
+    bool admission = options.maxCostUs > 0 || options.isolateCostUs > 0;
+    librpn::CostModel model = admission ? librpn::calibrateCostModel() : librpn::CostModel();
+    librpn::AdmissionLimits limits;
+    limits.maxTokens = limits.maxStackDepth = limits.maxListSize = std::numeric_limits<size_t>::max();
+    limits.maxNanoseconds = options.maxCostUs > 0 ? options.maxCostUs * 1000 : HUGE_VAL;
+    limits.isolateNanoseconds = options.isolateCostUs > 0 ? options.isolateCostUs * 1000 : HUGE_VAL;
+    limits.rejectUnboundedLists = options.maxCostUs > 0;
+    librpn::AdmissionPolicy policy;
+    if (admission) {
+        policy = [limits](const librpn::CostEstimate& cost) { return librpn::admit(cost, limits); };
+        std::fprintf(stderr, "rpn_server: cost model %.1fns/eval %.1fns/token %.1fns/list %.2fns/element "
+                             "%.1fns/transcendental %.1fns/ordered\n",
+                     model.evaluationNs, model.tokenNs, model.listNs, model.elementNs,
+                     model.transcendentalNs, model.orderedNs);
+    }
+
+    ProgramCache cache(options.cacheCapacity, model);
+    std::unordered_map<uint64_t, Connection> connections;
+    uint64_t nextConnection = 2;
+    std::vector<Request> pending;       // このループ周回で受け取った要求（マイクロバッチの元）
+    std::vector<Response> completed;
+    std::vector<double> latencies;      // 要求受信から応答送信までの時間（マイクロ秒）
+    std::vector<epoll_event> events(256);
+    auto intervalStart = Clock::now();
+
+    std::fprintf(stderr, "rpn_server: listening on %s (%u workers, batch %zu)\n",
+                 options.socketPath.c_str(), options.threads, options.batchSize);
+
+    {
+        // 重い式のプール（振り分けるときだけ作る）。通常のプールより先に作り、あとで壊す
+        std::unique_ptr<WorkerPool> isolatedPool;
+        if (options.isolateCostUs > 0) {
+            isolatedPool.reset(new WorkerPool(options.isolateThreads, cache, wakeFd, options.budget));
+        }
+        WorkerPool pool(options.threads, cache, wakeFd, options.budget, policy, isolatedPool.get());
+
+        auto closeConnection = [&](uint64_t id) {
+            auto it = connections.find(id);
+            if (it == connections.end()) return;
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+            close(it->second.fd);
+            connections.erase(it);
+        };
+
+        // 送信待ちのデータを書けるだけ書く（残れば EPOLLOUT を監視）
+        auto flush = [&](uint64_t id, Connection& c) {
+            while (!c.out.empty()) {
+                ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+                if (n > 0) {
+                    c.out.erase(0, static_cast<size_t>(n));
+                } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                } else if (n < 0 && errno == EINTR) {
+                    continue;
+                } else {
+                    closeConnection(id);
+                    return;
+                }
+            }
+            bool wantWrite = !c.out.empty();
+            if (wantWrite != c.wantWrite) {
+                epoll_event mod{};
+                mod.events = EPOLLIN | (wantWrite ? EPOLLOUT : 0);
+                mod.data.u64 = id;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, c.fd, &mod);
+                c.wantWrite = wantWrite;
+            }
+        };
+
+        // 受信バッファから完全なフレームをすべて要求にする（パイプライン）
+        auto parseFrames = [&](uint64_t id, Connection& c) {
+            size_t offset = 0;
+            for (;;) {
+                const char* payload = nullptr;
+                uint32_t length = 0;
+                FrameStatus status = nextFrame(c.in.data() + offset, c.in.size() - offset, payload, length);
+                if (status == FrameStatus::Incomplete) break;
+                Request request;
+                if (status == FrameStatus::TooLarge || !parseRequest(payload, length, request)) {
+                    closeConnection(id);
+                    return;
+                }
+                request.connection = id;
+                request.received = Clock::now();
+                pending.push_back(std::move(request));
+                offset += 4 + static_cast<size_t>(length);
+            }
+            c.in.erase(0, offset);
+        };
+
+        while (!stopRequested) {
+            int timeout = options.reportInterval > 0 ? 200 : -1;
+            int n = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), timeout);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                std::perror("rpn_server: epoll_wait");
+                break;
+            }
+
+            for (int i = 0; i < n; ++i) {
+                uint64_t id = events[i].data.u64;
+                if (id == LISTEN_ID) {
+                    for (;;) {
+                        int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                        if (fd < 0) break;
+                        uint64_t cid = nextConnection++;
+                        connections.emplace(cid, Connection{fd, {}, {}, false});
+                        epoll_event add{};
+                        add.events = EPOLLIN;
+                        add.data.u64 = cid;
+                        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &add);
+                    }
+                    continue;
+                }
+                if (id == WAKE_ID) {
+                    uint64_t count;
+                    ssize_t ignored = read(wakeFd, &count, sizeof(count));
+                    (void)ignored;
+                    continue;
+                }
+
+                auto it = connections.find(id);
+                if (it == connections.end()) continue;
+                Connection& c = it->second;
+                if (events[i].events & EPOLLOUT) {
+                    flush(id, c);
+                    if (connections.find(id) == connections.end()) continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    char buffer[65536];
+                    bool closed = false;
+                    for (;;) {
+                        ssize_t r = read(c.fd, buffer, sizeof(buffer));
+                        if (r > 0) {
+                            c.in.append(buffer, static_cast<size_t>(r));
+                        } else if (r < 0 && errno == EINTR) {
+                            continue;
+                        } else {
+                            closed = (r == 0) || (errno != EAGAIN && errno != EWOULDBLOCK);
+                            break;
+                        }
+                    }
+                    parseFrames(id, c);
+                    if (closed) closeConnection(id);
+                }
+            }
+
+            // この周回で届いた要求をバッチに分けてワーカーに渡す
+            for (size_t begin = 0; begin < pending.size(); begin += options.batchSize) {
+                size_t end = std::min(pending.size(), begin + options.batchSize);
+                pool.submit(std::vector<Request>(std::make_move_iterator(pending.begin() + begin),
+                                                 std::make_move_iterator(pending.begin() + end)));
+            }
+            pending.clear();
+
+            // 完了した応答を接続ごとの送信バッファに積んで送る
+            pool.drain(completed);
+            if (isolatedPool) {
+                std::vector<Response> isolatedResponses;
+                isolatedPool->drain(isolatedResponses);
+                for (Response& r : isolatedResponses) completed.push_back(std::move(r));
+            }
+            auto now = Clock::now();
+            for (Response& r : completed) {
+                latencies.push_back(std::chrono::duration<double, std::micro>(now - r.received).count());
+                auto it = connections.find(r.connection);
+                if (it != connections.end()) it->second.out += r.frame;
+            }
+            completed.clear();
+            for (auto it = connections.begin(); it != connections.end();) {
+                uint64_t id = it->first;
+                Connection& c = it->second;
+                ++it;   // flush が接続を閉じても反復を続けられるよう先に進める
+                if (!c.out.empty()) flush(id, c);
+            }
+
+            double elapsed = std::chrono::duration<double>(now - intervalStart).count();
+            if (options.reportInterval > 0 && elapsed >= options.reportInterval) {
+                report(latencies, elapsed);
+                intervalStart = now;
+            }
+        }
+    }
+
+    report(latencies, std::chrono::duration<double>(Clock::now() - intervalStart).count());
+    for (auto& entry : connections) close(entry.second.fd);
+    close(epollFd);
+    close(wakeFd);
+    close(listenFd);
+    unlink(options.socketPath.c_str());
+    return 0;
+}
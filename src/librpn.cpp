@@ -1,9 +1,27 @@
 #include "librpn.hpp"
-#include <stack>
+#include "librpn_alloc.hpp"
+#include "librpn_quantile.hpp"
+#include "librpn_simd.hpp"
+#include "librpn_source.hpp"
+#include "librpn_stats.hpp"
 #include <cctype>
 #include <cmath>
-#include <unordered_set>
+#include <cstring>
 #include <algorithm>
+#include <stdexcept>
+#include <limits>
+#include <type_traits>
+#include <istream>
+#include <system_error>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace librpn {
 
@@ -11,176 +29,780 @@ namespace librpn {
 // グローバルテーブルの定義
 //==============================================================================
 
-// ASCII演算子の文字セット（トークナイザ用）
-static const std::unordered_set<char> ASCII_OPERATOR_CHARS = {'+', '-', '*', '/', '%', '^'};
+// 比較・論理演算の結果（真は1、偽は0）
+template <typename T>
+static inline T truth(bool b) {
+    return b ? T(1) : T(0);
+}
+
+// 各テーブルは値の型 T ごとに生成する（double 版が公開テーブル）
 
 // 演算子テーブル（ASCII + Unicode）
-const std::unordered_map<std::string, OperatorInfo> OPERATORS = {
-    // ASCII演算子
-    {"+", {1, false, [](double a, double b) { return a + b; }}},
-    {"-", {1, false, [](double a, double b) { return a - b; }}},
-    {"*", {2, false, [](double a, double b) { return a * b; }}},
-    {"/", {2, false, [](double a, double b) { return a / b; }}},
-    {"%", {2, false, [](double a, double b) { return std::fmod(a, b); }}},
-    {"^", {3, true,  [](double a, double b) { return std::pow(a, b); }}},
-    // Unicode演算子
-    {"×", {2, false, [](double a, double b) { return a * b; }}},      // U+00D7
-    {"÷", {2, false, [](double a, double b) { return a / b; }}},      // U+00F7
-    {"·", {2, false, [](double a, double b) { return a * b; }}},      // U+00B7 (middle dot)
-};
+template <typename T>
+static std::unordered_map<std::string, BasicOperatorInfo<T>> makeOperators() {
+    return {
+        // ASCII演算子
+        {"+", {1, false, [](T a, T b) { return a + b; }}},
+        {"-", {1, false, [](T a, T b) { return a - b; }}},
+        {"*", {2, false, [](T a, T b) { return a * b; }}},
+        {"/", {2, false, [](T a, T b) { return a / b; }}},
+        {"%", {2, false, [](T a, T b) { return std::fmod(a, b); }}},
+        {"^", {3, true,  [](T a, T b) { return std::pow(a, b); }}},
+        // Unicode演算子
+        {"×", {2, false, [](T a, T b) { return a * b; }}},      // U+00D7
+        {"÷", {2, false, [](T a, T b) { return a / b; }}},      // U+00F7
+        {"·", {2, false, [](T a, T b) { return a * b; }}},      // U+00B7 (middle dot)
+        // 比較演算子（算術演算子より低い。結果は 1 / 0）
+        {"<",  {-1, false, [](T a, T b) { return truth<T>(a < b); }}},
+        {"<=", {-1, false, [](T a, T b) { return truth<T>(a <= b); }}},
+        {">",  {-1, false, [](T a, T b) { return truth<T>(a > b); }}},
+        {">=", {-1, false, [](T a, T b) { return truth<T>(a >= b); }}},
+        {"≤",  {-1, false, [](T a, T b) { return truth<T>(a <= b); }}},    // U+2264
+        {"≥",  {-1, false, [](T a, T b) { return truth<T>(a >= b); }}},    // U+2265
+        {"==", {-2, false, [](T a, T b) { return truth<T>(a == b); }}},
+        {"!=", {-2, false, [](T a, T b) { return truth<T>(a != b); }}},
+        {"≠",  {-2, false, [](T a, T b) { return truth<T>(a != b); }}},    // U+2260
+        // 論理演算子（0 以外を真とする。両辺とも評価する）
+        {"and", {-3, false, [](T a, T b) { return truth<T>(a != 0 && b != 0); }}},
+        {"&&",  {-3, false, [](T a, T b) { return truth<T>(a != 0 && b != 0); }}},
+        {"∧",   {-3, false, [](T a, T b) { return truth<T>(a != 0 && b != 0); }}},  // U+2227
+        {"or",  {-4, false, [](T a, T b) { return truth<T>(a != 0 || b != 0); }}},
+        {"||",  {-4, false, [](T a, T b) { return truth<T>(a != 0 || b != 0); }}},
+        {"∨",   {-4, false, [](T a, T b) { return truth<T>(a != 0 || b != 0); }}},  // U+2228
+    };
+}
 
 // 単項関数テーブル（ASCII + Unicode）
-const std::unordered_map<std::string, UnaryFunctionInfo> UNARY_FUNCTIONS = {
-    // ASCII関数
-    {"sqrt",  {[](double a) { return std::sqrt(a); }}},
-    {"sin",   {[](double a) { return std::sin(a); }}},
-    {"cos",   {[](double a) { return std::cos(a); }}},
-    {"tan",   {[](double a) { return std::tan(a); }}},
-    {"log",   {[](double a) { return std::log(a); }}},
-    {"ln",    {[](double a) { return std::log(a); }}},
-    {"log10", {[](double a) { return std::log10(a); }}},
-    {"abs",   {[](double a) { return std::abs(a); }}},
-    {"exp",   {[](double a) { return std::exp(a); }}},
-    {"floor", {[](double a) { return std::floor(a); }}},
-    {"ceil",  {[](double a) { return std::ceil(a); }}},
-    // Unicode関数（記号として使用）
-    {"√", {[](double a) { return std::sqrt(a); }}},                   // U+221A
-};
+template <typename T>
+static std::unordered_map<std::string, BasicUnaryFunctionInfo<T>> makeUnaryFunctions() {
+    return {
+        // ASCII関数
+        {"sqrt",  {[](T a) { return std::sqrt(a); }}},
+        {"sin",   {[](T a) { return std::sin(a); }}},
+        {"cos",   {[](T a) { return std::cos(a); }}},
+        {"tan",   {[](T a) { return std::tan(a); }}},
+        {"log",   {[](T a) { return std::log(a); }}},
+        {"ln",    {[](T a) { return std::log(a); }}},
+        {"log10", {[](T a) { return std::log10(a); }}},
+        {"abs",   {[](T a) { return std::abs(a); }}},
+        {"exp",   {[](T a) { return std::exp(a); }}},
+        {"floor", {[](T a) { return std::floor(a); }}},
+        {"ceil",  {[](T a) { return std::ceil(a); }}},
+        // 論理否定（0 なら 1、それ以外は 0）
+        {"not",   {[](T a) { return truth<T>(a == 0); }}},
+        {"!",     {[](T a) { return truth<T>(a == 0); }}},
+        // Unicode関数（記号として使用）
+        {"√", {[](T a) { return std::sqrt(a); }}},                   // U+221A
+        {"¬", {[](T a) { return truth<T>(a == 0); }}},               // U+00AC
+    };
+}
 
 // 二項関数テーブル
-const std::unordered_map<std::string, BinaryFunctionInfo> BINARY_FUNCTIONS = {
-    {"pow",   {[](double a, double b) { return std::pow(a, b); }}},
-    {"max",   {[](double a, double b) { return std::max(a, b); }}},
-    {"min",   {[](double a, double b) { return std::min(a, b); }}},
-    {"atan2", {[](double a, double b) { return std::atan2(a, b); }}},
-    {"mod",   {[](double a, double b) { return std::fmod(a, b); }}},
-};
+template <typename T>
+static std::unordered_map<std::string, BasicBinaryFunctionInfo<T>> makeBinaryFunctions() {
+    return {
+        {"pow",   {[](T a, T b) { return std::pow(a, b); }}},
+        {"max",   {[](T a, T b) { return std::max(a, b); }}},
+        {"min",   {[](T a, T b) { return std::min(a, b); }}},
+        {"atan2", {[](T a, T b) { return std::atan2(a, b); }}},
+        {"mod",   {[](T a, T b) { return std::fmod(a, b); }}},
+    };
+}
+
+// 3引数の関数テーブル
+// if(c, a, b) は c が 0 以外なら a、0 なら b（中置記法の c ? a : b も同じ）。
+// a・b はどちらも評価済みで、分岐ではなく値の選択になる。
+template <typename T>
+static std::unordered_map<std::string, BasicTernaryFunctionInfo<T>> makeTernaryFunctions() {
+    return {
+        {"if", {[](T c, T a, T b) { return c != 0 ? a : b; }}},
+    };
+}
+
+// リストの要素をブロックごとに f に渡す（ListView は全体が1ブロック、遅延リストは生成しながら）
+template <typename T, typename F>
+static inline void forEachBlock(BasicListView<T> v, F&& f) {
+    f(v);
+}
+
+template <typename T, typename F>
+static inline void forEachBlock(const BasicListStream<T>& v, F&& f) {
+    v.forEachBlock(f);
+}
+
+// 集約関数（ListView と遅延リストのどちらも受け取る汎用ラムダ）からテーブルの項目を作る
+// 要素を1回ずつ順に読むだけの関数は、遅延リストでも全体を作らずに同じ結果になる
+template <typename T, typename F>
+static BasicListFunctionInfo<T> reduction(F f) {
+    return {[f](BasicListView<T> v) -> T { return f(v); },
+            [f](const BasicListStream<T>& v) -> T { return f(v); }};
+}
 
 // リスト関数テーブル（HP電卓方式）
-const std::unordered_map<std::string, ListFunctionInfo> LIST_FUNCTIONS = {
+template <typename T>
+static std::unordered_map<std::string, BasicListFunctionInfo<T>> makeListFunctions() {
+    using List = std::vector<T>;
+    using View = BasicListView<T>;
+
     // 合計
-    {"sum", {[](const std::vector<double>& v) {
-        double total = 0;
-        for (double x : v) total += x;
-        return total;
-    }}},
-    {"ΣLIST", {[](const std::vector<double>& v) {
-        double total = 0;
-        for (double x : v) total += x;
+    auto sum = [](const auto& v) -> T {
+        T total = 0;
+        forEachBlock<T>(v, [&](View b) {
+            for (T x : b) total += x;
+        });
         return total;
-    }}},
+    };
 
     // 積
-    {"product", {[](const std::vector<double>& v) {
-        double total = 1;
-        for (double x : v) total *= x;
+    auto product = [](const auto& v) -> T {
+        T total = 1;
+        forEachBlock<T>(v, [&](View b) {
+            for (T x : b) total *= x;
+        });
         return total;
-    }}},
-    {"ΠLIST", {[](const std::vector<double>& v) {
-        double total = 1;
-        for (double x : v) total *= x;
-        return total;
-    }}},
-
-    // 平均
-    {"mean", {[](const std::vector<double>& v) {
-        if (v.empty()) return 0.0;
-        double total = 0;
-        for (double x : v) total += x;
-        return total / v.size();
-    }}},
-
-    // 母分散
-    {"var", {[](const std::vector<double>& v) {
-        if (v.empty()) return 0.0;
-        double mean = 0;
-        for (double x : v) mean += x;
-        mean /= v.size();
-        double variance = 0;
-        for (double x : v) variance += (x - mean) * (x - mean);
-        return variance / v.size();
-    }}},
-
-    // 標本分散
-    {"svar", {[](const std::vector<double>& v) {
-        if (v.size() < 2) return 0.0;
-        double mean = 0;
-        for (double x : v) mean += x;
-        mean /= v.size();
-        double variance = 0;
-        for (double x : v) variance += (x - mean) * (x - mean);
-        return variance / (v.size() - 1);
-    }}},
-
-    // 母標準偏差
-    {"stddev", {[](const std::vector<double>& v) {
-        if (v.empty()) return 0.0;
-        double mean = 0;
-        for (double x : v) mean += x;
-        mean /= v.size();
-        double variance = 0;
-        for (double x : v) variance += (x - mean) * (x - mean);
-        return std::sqrt(variance / v.size());
-    }}},
-
-    // 標本標準偏差
-    {"sstddev", {[](const std::vector<double>& v) {
-        if (v.size() < 2) return 0.0;
-        double mean = 0;
-        for (double x : v) mean += x;
-        mean /= v.size();
-        double variance = 0;
-        for (double x : v) variance += (x - mean) * (x - mean);
-        return std::sqrt(variance / (v.size() - 1));
-    }}},
-
-    // 中央値
-    {"median", {[](const std::vector<double>& v) {
-        if (v.empty()) return 0.0;
-        std::vector<double> sorted = v;
-        std::sort(sorted.begin(), sorted.end());
-        size_t n = sorted.size();
-        if (n % 2 == 0) {
-            return (sorted[n/2 - 1] + sorted[n/2]) / 2.0;
+    };
+
+    // 偏差平方和（平均を求めてからもう一度読む）
+    auto squaredDeviations = [sum](const auto& v) -> T {
+        T mean = sum(v) / v.size();
+        T variance = 0;
+        forEachBlock<T>(v, [&](View b) {
+            for (T x : b) variance += (x - mean) * (x - mean);
+        });
+        return variance;
+    };
+
+    // 最大値・最小値（先頭から順に比べ、等しければ先の要素。std::max_element と同じ）
+    auto extreme = [](const auto& v, bool greatest) -> T {
+        T best = 0;
+        bool first = true;
+        forEachBlock<T>(v, [&](View b) {
+            for (T x : b) {
+                if (first || (greatest ? best < x : x < best)) best = x;
+                first = false;
+            }
+        });
+        return best;
+    };
+
+    return {
+        {"sum", reduction<T>(sum)},
+        {"ΣLIST", reduction<T>(sum)},
+        {"product", reduction<T>(product)},
+        {"ΠLIST", reduction<T>(product)},
+
+        // 平均
+        {"mean", reduction<T>([sum](const auto& v) -> T {
+            if (v.empty()) return 0;
+            return sum(v) / v.size();
+        })},
+
+        // 母分散
+        {"var", reduction<T>([squaredDeviations](const auto& v) -> T {
+            if (v.empty()) return 0;
+            return squaredDeviations(v) / v.size();
+        })},
+
+        // 標本分散
+        {"svar", reduction<T>([squaredDeviations](const auto& v) -> T {
+            if (v.size() < 2) return 0;
+            return squaredDeviations(v) / (v.size() - 1);
+        })},
+
+        // 母標準偏差
+        {"stddev", reduction<T>([squaredDeviations](const auto& v) -> T {
+            if (v.empty()) return 0;
+            return std::sqrt(squaredDeviations(v) / v.size());
+        })},
+
+        // 標本標準偏差
+        {"sstddev", reduction<T>([squaredDeviations](const auto& v) -> T {
+            if (v.size() < 2) return 0;
+            return std::sqrt(squaredDeviations(v) / (v.size() - 1));
+        })},
+
+        // 中央値（全体を並べ替えず中央の要素だけを選ぶ）
+        {"median", {[](View v) -> T {
+            if (v.empty()) return 0;
+            List values(v.begin(), v.end());
+            size_t n = values.size();
+            auto middle = values.begin() + n / 2;
+            std::nth_element(values.begin(), middle, values.end());
+            if (n % 2 == 0) {
+                return (*std::max_element(values.begin(), middle) + *middle) / 2;
+            } else {
+                return *middle;
+            }
+        }}},
+
+        // 四分位範囲（75パーセンタイル - 25パーセンタイル）
+        {"iqr", {[](View v) -> T {
+            List values(v.begin(), v.end());
+            List quartiles;
+            percentilesInPlace(values, List{25, 75}, quartiles);
+            return quartiles[1] - quartiles[0];
+        }}},
+
+        // 最大値
+        {"lmax", reduction<T>([extreme](const auto& v) -> T {
+            return extreme(v, true);
+        })},
+
+        // 最小値
+        {"lmin", reduction<T>([extreme](const auto& v) -> T {
+            return extreme(v, false);
+        })},
+
+        // 範囲（最大 - 最小）
+        {"range", reduction<T>([extreme](const auto& v) -> T {
+            return extreme(v, true) - extreme(v, false);
+        })},
+
+        // 要素数
+        {"count", reduction<T>([](const auto& v) -> T {
+            return static_cast<T>(v.size());
+        })},
+    };
+}
+
+// 複数の結果を返すリスト関数テーブル
+// stats は count mean stddev lmin lmax median を1回の計算でまとめて求め、この順のリストを返す
+template <typename T>
+static std::unordered_map<std::string, BasicListSummaryFunctionInfo<T>> makeListSummaryFunctions() {
+    return {
+        {"stats", {[](BasicListView<T> v, std::vector<T>& out) {
+            StatisticSet which = 0;
+            for (Statistic s : STATS_RESULTS) which |= statisticBit(s);
+            BasicListStatistics<T> statistics = computeStatistics(v, which);
+            out.clear();
+            for (Statistic s : STATS_RESULTS) out.push_back(statistics[s]);
+        }}},
+    };
+}
+
+// 数列を作る関数テーブル（結果は遅延リスト。要素は使うときにブロックごとに作る）
+// seq(a, b) は a, a+1, a+2, …（b 以下、b < a なら空）、
+// linspace(a, b, n) は a から b までを等間隔に並べた n 個（最後は b そのもの）
+template <typename T>
+static std::unordered_map<std::string, BasicSequenceFunctionInfo<T>> makeSequenceFunctions() {
+    // 要素数の上限（添字が T で正確に表せる範囲）
+    constexpr T maxCount = T(1) * (uint64_t(1) << std::min(std::numeric_limits<T>::digits, 62));
+    auto checkFinite = [](const T* args, int n, const char* name) {
+        for (int i = 0; i < n; ++i) {
+            if (!std::isfinite(args[i])) {
+                throw std::invalid_argument(std::string("librpn: '") + name + "' requires finite numbers");
+            }
+        }
+    };
+    return {
+        {"seq", {2, [checkFinite](const T* args) {
+            checkFinite(args, 2, "seq");
+            T a = args[0], b = args[1];
+            if (b < a) return BasicSequence<T>{a, 1, a, 0};
+            T span = std::floor(b - a);
+            if (!(span < maxCount)) throw std::invalid_argument("librpn: 'seq' has too many elements");
+            return BasicSequence<T>{a, 1, a + span, static_cast<size_t>(span) + 1};
+        }}},
+        {"linspace", {3, [checkFinite](const T* args) {
+            checkFinite(args, 3, "linspace");
+            T a = args[0], b = args[1], n = args[2];
+            if (n < 0 || n != std::floor(n)) {
+                throw std::invalid_argument("librpn: 'linspace' requires a non-negative integer count");
+            }
+            if (!(n <= maxCount)) throw std::invalid_argument("librpn: 'linspace' has too many elements");
+            size_t count = static_cast<size_t>(n);
+            if (count < 2) return BasicSequence<T>{a, 0, a, count};
+            return BasicSequence<T>{a, (b - a) / static_cast<T>(count - 1), b, count};
+        }}},
+    };
+}
+
+// 窓関数（移動平均など）の窓幅。1以上の整数でなければ std::invalid_argument
+template <typename T>
+static size_t windowSize(const std::vector<T>& params) {
+    T k = params.empty() ? T(0) : params[0];
+    if (params.size() != 1 || !(k >= 1) || std::floor(k) != k ||
+        k > static_cast<T>(std::numeric_limits<uint32_t>::max())) {
+        throw std::invalid_argument("librpn: window must be a positive integer");
+    }
+    return static_cast<size_t>(k);
+}
+
+// 窓を1つずつずらしながら足し引きする合計（Neumaier の補償付き加算で誤差の蓄積を抑える）
+template <typename T>
+struct RunningSum {
+    T sum = 0;
+    T compensation = 0;
+
+    void add(T x) {
+        T t = sum + x;
+        compensation += (std::abs(sum) >= std::abs(x)) ? (sum - t) + x : (x - t) + sum;
+        sum = t;
+    }
+
+    T value() const { return sum + compensation; }
+};
+
+// 長さ k の各窓の合計（結果は n - k + 1 個、k > n なら空）
+template <typename T>
+static void movingSum(const std::vector<T>& v, size_t k, std::vector<T>& out) {
+    out.clear();
+    if (k > v.size()) return;
+    out.reserve(v.size() - k + 1);
+    RunningSum<T> sum;
+    for (size_t i = 0; i < v.size(); ++i) {
+        sum.add(v[i]);
+        if (i >= k) sum.add(-v[i - k]);
+        if (i + 1 >= k) out.push_back(sum.value());
+    }
+}
+
+// 長さ k の各窓の最小値（less）または最大値（greater）
+// 窓内の候補の添字を単調なキューに保持する（各要素の出し入れは1回ずつ）
+template <typename T, typename Compare>
+static void movingExtreme(const std::vector<T>& v, size_t k, std::vector<T>& out, Compare better) {
+    out.clear();
+    if (k > v.size()) return;
+    out.reserve(v.size() - k + 1);
+    std::vector<size_t> queue(v.size());
+    size_t head = 0, tail = 0;
+    for (size_t i = 0; i < v.size(); ++i) {
+        while (tail > head && !better(v[queue[tail - 1]], v[i])) --tail;
+        queue[tail++] = i;
+        if (queue[head] + k <= i) ++head;
+        if (i + 1 >= k) out.push_back(v[queue[head]]);
+    }
+}
+
+// 長さ k の各窓の母標準偏差
+// 平均と偏差平方和を入れ替えの差分で更新し、窓が一巡するごとに計算し直して
+// 誤差の蓄積を防ぐ（計算し直しは k 個ごとに O(k) なので全体で O(n) のまま）
+template <typename T>
+static void movingStddev(const std::vector<T>& v, size_t k, std::vector<T>& out) {
+    out.clear();
+    if (k > v.size()) return;
+    out.reserve(v.size() - k + 1);
+    T mean = 0;
+    T m2 = 0;
+    auto recompute = [&](size_t first) {
+        T total = 0;
+        for (size_t i = first; i < first + k; ++i) total += v[i];
+        mean = total / static_cast<T>(k);
+        m2 = 0;
+        for (size_t i = first; i < first + k; ++i) m2 += (v[i] - mean) * (v[i] - mean);
+    };
+    recompute(0);
+    out.push_back(std::sqrt(m2 / static_cast<T>(k)));
+    for (size_t i = k; i < v.size(); ++i) {
+        size_t first = i + 1 - k;
+        if (first % k == 0) {
+            recompute(first);
         } else {
-            return sorted[n/2];
-        }
-    }}},
-
-    // 最大値
-    {"lmax", {[](const std::vector<double>& v) {
-        if (v.empty()) return 0.0;
-        return *std::max_element(v.begin(), v.end());
-    }}},
-
-    // 最小値
-    {"lmin", {[](const std::vector<double>& v) {
-        if (v.empty()) return 0.0;
-        return *std::min_element(v.begin(), v.end());
-    }}},
-
-    // 範囲（最大 - 最小）
-    {"range", {[](const std::vector<double>& v) {
-        if (v.empty()) return 0.0;
-        return *std::max_element(v.begin(), v.end()) - *std::min_element(v.begin(), v.end());
-    }}},
-
-    // 要素数
-    {"count", {[](const std::vector<double>& v) {
-        return static_cast<double>(v.size());
-    }}},
+            T x = v[i];
+            T y = v[i - k];
+            T next = mean + (x - y) / static_cast<T>(k);
+            m2 += (x - y) * (x - next + y - mean);
+            mean = next;
+        }
+        out.push_back(std::sqrt(std::max(m2, T(0)) / static_cast<T>(k)));
+    }
+}
+
+// t-digest による近似パーセンタイル（add で全要素を digest に加える）
+template <typename T, typename Add>
+static void approxPercentiles(const std::vector<T>& ps, std::vector<T>& out, Add add) {
+    for (T p : ps) {
+        if (!(p >= 0 && p <= 100)) {
+            throw std::invalid_argument("librpn: percentile must be between 0 and 100");
+        }
+    }
+    TDigest digest;
+    add(digest);
+    out.resize(ps.size());
+    for (size_t i = 0; i < ps.size(); ++i) {
+        out[i] = static_cast<T>(digest.percentile(static_cast<double>(ps[i])));
+    }
+}
+
+// パラメータ付きリスト関数テーブル（{ リスト } パラメータ 関数名）
+// パラメータがリストなら、各値についての結果をリストで返す。
+// listResult の関数（窓関数）はパラメータが窓幅で、結果は常にリスト。
+template <typename T>
+static std::unordered_map<std::string, BasicListQueryFunctionInfo<T>> makeListQueryFunctions() {
+    using List = std::vector<T>;
+    return {
+        // パーセンタイル（厳密。必要な順位だけを選ぶ）
+        {"percentile", {[](List& v, const List& ps, List& out) {
+            percentilesInPlace(v, ps, out);
+        }}},
+
+        // パーセンタイル（t-digest による近似。要素を読むだけなので、遅延リスト・登録済みの
+        // リストは複製せずに読み、メモリはリストの長さによらず一定）
+        {"approxpercentile", {[](List& v, const List& ps, List& out) {
+            approxPercentiles(ps, out, [&](TDigest& digest) {
+                for (T x : v) digest.add(static_cast<double>(x));
+            });
+        }, false, nullptr, [](const BasicListStream<T>& values, const List& ps, List& out) {
+            approxPercentiles(ps, out, [&](TDigest& digest) {
+                values.forEachBlock([&](BasicListView<T> block) {
+                    for (T x : block) digest.add(static_cast<double>(x));
+                });
+            });
+        }}},
+
+        // 移動合計・移動平均（窓幅 k の各窓について。結果は n - k + 1 個）
+        {"movsum", {[](List& v, const List& params, List& out) {
+            movingSum(v, windowSize(params), out);
+        }, true}},
+        {"movavg", {[](List& v, const List& params, List& out) {
+            size_t k = windowSize(params);
+            movingSum(v, k, out);
+            for (T& x : out) x /= static_cast<T>(k);
+        }, true}},
+
+        // 移動最小値・移動最大値
+        {"movmin", {[](List& v, const List& params, List& out) {
+            movingExtreme(v, windowSize(params), out, [](T a, T b) { return a < b; });
+        }, true}},
+        {"movmax", {[](List& v, const List& params, List& out) {
+            movingExtreme(v, windowSize(params), out, [](T a, T b) { return a > b; });
+        }, true}},
+
+        // 移動標準偏差（母標準偏差）
+        {"movstd", {[](List& v, const List& params, List& out) {
+            movingStddev(v, windowSize(params), out);
+        }, true}},
+
+        // 指数移動平均（スパン k、α = 2 / (k + 1)。結果は n 個）
+        {"ewma", {[](List& v, const List& params, List& out) {
+            T alpha = 2 / static_cast<T>(windowSize(params) + 1);
+            out.resize(v.size());
+            for (size_t i = 0; i < v.size(); ++i) {
+                out[i] = (i == 0) ? v[0] : out[i - 1] + alpha * (v[i] - out[i - 1]);
+            }
+        }, true}},
+    };
+}
+
+// 定数テーブル（long double の精度で定義し、各型に丸める）
+static constexpr long double PI_L = 3.141592653589793238462643383279502884L;
+static constexpr long double E_L  = 2.718281828459045235360287471352662498L;
+
+template <typename T>
+static std::unordered_map<std::string, T> makeConstants() {
+    return {
+        {"pi",  static_cast<T>(PI_L)},
+        {"PI",  static_cast<T>(PI_L)},
+        {"π",   static_cast<T>(PI_L)},      // U+03C0
+        {"e",   static_cast<T>(E_L)},
+        {"E",   static_cast<T>(E_L)},
+        {"τ",   static_cast<T>(2 * PI_L)},  // U+03C4 (tau = 2π)
+    };
+}
+
+// 登録済みのリスト（@name）をそのまま渡したときの版を加える（ListData が保持する累積和・並べ替えた複製を使う）
+// 2回目以降は O(1)（median）・O(|params|)（percentile）で、結果は func と同じ
+// （NaN を含むリストの順位統計量を除く）
+static std::unordered_map<std::string, ListFunctionInfo> withCachedVersions(
+        std::unordered_map<std::string, ListFunctionInfo> functions) {
+    auto sum = [](const ListData& data) { return data.prefixSums()[data.view.size()]; };
+    functions.at("sum").cached = sum;
+    functions.at("ΣLIST").cached = sum;
+    functions.at("mean").cached = [](const ListData& data) {
+        size_t n = data.view.size();
+        return n == 0 ? 0.0 : data.prefixSums()[n] / n;
+    };
+    functions.at("median").cached = [](const ListData& data) {
+        ListView sorted = data.sorted();
+        size_t n = sorted.size();
+        if (n == 0) return 0.0;
+        return n % 2 == 0 ? (sorted[n / 2 - 1] + sorted[n / 2]) / 2 : sorted[n / 2];
+    };
+    functions.at("iqr").cached = [](const ListData& data) {
+        ListView sorted = data.sorted();
+        return sortedPercentile(sorted.data(), sorted.size(), 75.0) -
+               sortedPercentile(sorted.data(), sorted.size(), 25.0);
+    };
+    return functions;
+}
+
+static std::unordered_map<std::string, ListQueryFunctionInfo> withCachedVersions(
+        std::unordered_map<std::string, ListQueryFunctionInfo> functions) {
+    functions.at("percentile").cached = [](const ListData& data, const std::vector<double>& ps,
+                                           std::vector<double>& out) {
+        ListView sorted = data.sorted();
+        out.resize(ps.size());
+        for (size_t i = 0; i < ps.size(); ++i) out[i] = sortedPercentile(sorted.data(), sorted.size(), ps[i]);
+    };
+    return functions;
+}
+
+const std::unordered_map<std::string, OperatorInfo> OPERATORS = makeOperators<double>();
+const std::unordered_map<std::string, UnaryFunctionInfo> UNARY_FUNCTIONS = makeUnaryFunctions<double>();
+const std::unordered_map<std::string, BinaryFunctionInfo> BINARY_FUNCTIONS = makeBinaryFunctions<double>();
+const std::unordered_map<std::string, TernaryFunctionInfo> TERNARY_FUNCTIONS = makeTernaryFunctions<double>();
+const std::unordered_map<std::string, ListFunctionInfo> LIST_FUNCTIONS =
+    withCachedVersions(makeListFunctions<double>());
+const std::unordered_map<std::string, ListQueryFunctionInfo> LIST_QUERY_FUNCTIONS =
+    withCachedVersions(makeListQueryFunctions<double>());
+const std::unordered_map<std::string, ListSummaryFunctionInfo> LIST_SUMMARY_FUNCTIONS =
+    makeListSummaryFunctions<double>();
+const std::unordered_map<std::string, SequenceFunctionInfo> SEQUENCE_FUNCTIONS = makeSequenceFunctions<double>();
+const std::unordered_map<std::string, double> CONSTANTS = makeConstants<double>();
+
+//==============================================================================
+// シンボル表（名前 → ID → 属性）
+//==============================================================================
+
+// テーブルのキーを名前順に取り出す（IDを実行ごとに安定させるため）
+template <typename Table>
+static std::vector<std::string> sortedNames(const Table& table) {
+    std::vector<std::string> names;
+    names.reserve(table.size());
+    for (const auto& entry : table) names.push_back(entry.first);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+static std::vector<SymbolInfo> buildSymbols() {
+    std::vector<SymbolInfo> symbols;
+    for (const auto& name : sortedNames(OPERATORS)) {
+        const OperatorInfo& info = OPERATORS.at(name);
+        symbols.push_back({name, TokenType::Operator, info.precedence, info.rightAssociative, 2, 0.0});
+    }
+    for (const auto& name : sortedNames(UNARY_FUNCTIONS)) {
+        symbols.push_back({name, TokenType::UnaryFunction, 0, false, 1, 0.0});
+    }
+    for (const auto& name : sortedNames(BINARY_FUNCTIONS)) {
+        symbols.push_back({name, TokenType::BinaryFunction, 0, false, 2, 0.0});
+    }
+    for (const auto& name : sortedNames(TERNARY_FUNCTIONS)) {
+        symbols.push_back({name, TokenType::TernaryFunction, 0, false, 3, 0.0});
+    }
+    for (const auto& name : sortedNames(LIST_FUNCTIONS)) {
+        symbols.push_back({name, TokenType::ListFunction, 0, false, -1, 0.0});
+    }
+    for (const auto& name : sortedNames(LIST_QUERY_FUNCTIONS)) {
+        symbols.push_back({name, TokenType::ListFunction, 0, false, 2, 0.0,
+                           LIST_QUERY_FUNCTIONS.at(name).listResult});
+    }
+    for (const auto& name : sortedNames(LIST_SUMMARY_FUNCTIONS)) {
+        symbols.push_back({name, TokenType::ListFunction, 0, false, -1, 0.0, true});
+    }
+    for (const auto& name : sortedNames(SEQUENCE_FUNCTIONS)) {
+        int arity = SEQUENCE_FUNCTIONS.at(name).arity;
+        symbols.push_back({name, arity == 2 ? TokenType::BinaryFunction : TokenType::TernaryFunction, 0, false,
+                           arity, 0.0, true});
+    }
+    for (const auto& name : sortedNames(CONSTANTS)) {
+        symbols.push_back({name, TokenType::Constant, 0, false, 0, CONSTANTS.at(name)});
+    }
+    return symbols;
+}
+
+const std::vector<SymbolInfo> SYMBOLS = buildSymbols();
+
+//==============================================================================
+// シンボルのトライ（名前 → シンボルID）
+//==============================================================================
+//
+// 全シンボル名をバイト単位で並べたトライ。字句解析は入力の位置からトライをたどり、
+// 一致する最長の名前を1回の走査で求める（"<=" と "<"、"ΣLIST" と "Σ" など）。
+// 各ノードの子はバイト順に連続して並べ、根だけは先頭バイトで直接引く表を持つ。
+
+// 英字・数字・'_'（識別子を構成するバイト）
+static inline bool isWordByte(unsigned char c) {
+    return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || c == '_';
+}
+
+class SymbolTrie {
+public:
+    explicit SymbolTrie(const std::vector<SymbolInfo>& symbols) {
+        std::vector<std::pair<std::string, SymbolId>> names;
+        names.reserve(symbols.size());
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            names.emplace_back(symbols[i].name, static_cast<SymbolId>(i));
+        }
+        std::sort(names.begin(), names.end());
+        nodes_.push_back({});
+        build(names, 0, names.size(), 0, 0);
+        std::fill(std::begin(root_), std::end(root_), NO_NODE);
+        const Node& root = nodes_[0];
+        for (uint32_t e = root.firstEdge; e < root.firstEdge + root.edgeCount; ++e) {
+            root_[edgeBytes_[e]] = edgeTargets_[e];
+        }
+    }
+
+    // text[0 … size-1] の先頭に一致する最長のシンボル（length にバイト数。なければ NO_SYMBOL）
+    // 英字・数字・'_' で終わる名前は、直後も英字・数字・'_' なら一致としない（sin と sinh、pi と pix）
+    SymbolId longestMatch(const char* text, size_t size, size_t& length) const {
+        SymbolId best = NO_SYMBOL;
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(text);
+        uint32_t node = size > 0 ? root_[p[0]] : NO_NODE;
+        for (size_t k = 0; node != NO_NODE; node = ++k < size ? child(node, p[k]) : NO_NODE) {
+            SymbolId id = nodes_[node].id;
+            if (id != NO_SYMBOL && (k + 1 == size || !isWordByte(p[k]) || !isWordByte(p[k + 1]))) {
+                best = id;
+                length = k + 1;
+            }
+        }
+        return best;
+    }
+
+    // 完全に一致するシンボル
+    SymbolId find(const char* text, size_t size) const {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(text);
+        uint32_t node = size > 0 ? root_[p[0]] : NO_NODE;
+        for (size_t k = 1; k < size && node != NO_NODE; ++k) node = child(node, p[k]);
+        return node != NO_NODE ? nodes_[node].id : NO_SYMBOL;
+    }
+
+private:
+    static constexpr uint32_t NO_NODE = static_cast<uint32_t>(-1);
+
+    struct Node {
+        SymbolId id = NO_SYMBOL;    // この位置で終わる名前
+        uint32_t firstEdge = 0;     // 子の辺の先頭（edgeBytes_ / edgeTargets_ の添字）
+        uint32_t edgeCount = 0;
+    };
+
+    uint32_t child(uint32_t node, unsigned char byte) const {
+        const Node& n = nodes_[node];
+        for (uint32_t e = n.firstEdge; e < n.firstEdge + n.edgeCount; ++e) {
+            if (edgeBytes_[e] == byte) return edgeTargets_[e];
+        }
+        return NO_NODE;
+    }
+
+    // names[first, last)（depth バイト目まで共通）からノード node の子を作る
+    void build(const std::vector<std::pair<std::string, SymbolId>>& names, size_t first, size_t last,
+               size_t depth, uint32_t node) {
+        if (first < last && names[first].first.size() == depth) {
+            nodes_[node].id = names[first++].second;
+        }
+        // 先に子の辺をまとめて確保し、辺を連続させる
+        std::vector<size_t> groups;
+        for (size_t i = first; i < last; ++i) {
+            if (i == first || names[i].first[depth] != names[i - 1].first[depth]) groups.push_back(i);
+        }
+        groups.push_back(last);
+        nodes_[node].firstEdge = static_cast<uint32_t>(edgeBytes_.size());
+        nodes_[node].edgeCount = static_cast<uint32_t>(groups.size() - 1);
+        for (size_t g = 0; g + 1 < groups.size(); ++g) {
+            edgeBytes_.push_back(static_cast<unsigned char>(names[groups[g]].first[depth]));
+            edgeTargets_.push_back(NO_NODE);
+        }
+        for (size_t g = 0; g + 1 < groups.size(); ++g) {
+            uint32_t next = static_cast<uint32_t>(nodes_.size());
+            nodes_.push_back({});
+            edgeTargets_[nodes_[node].firstEdge + g] = next;
+            build(names, groups[g], groups[g + 1], depth + 1, next);
+        }
+    }
+
+    std::vector<Node> nodes_;                // nodes_[0] が根
+    std::vector<unsigned char> edgeBytes_;
+    std::vector<uint32_t> edgeTargets_;
+    uint32_t root_[256];                     // 根の子（先頭バイト → ノード）
 };
 
-// 定数テーブル
-const std::unordered_map<std::string, double> CONSTANTS = {
-    {"pi",  M_PI},
-    {"PI",  M_PI},
-    {"π",   M_PI},      // U+03C0
-    {"e",   M_E},
-    {"E",   M_E},
-    {"τ",   2 * M_PI},  // U+03C4 (tau = 2π)
+static const SymbolTrie SYMBOL_TRIE(SYMBOLS);
+
+// シンボルIDから計算関数・定数値を引くための表（SYMBOLSと同じ添字）
+template <typename T>
+struct BasicSymbolFunctions {
+    const std::function<T(T, T)>* binary = nullptr;             // 演算子・二項関数
+    const std::function<T(T)>* unary = nullptr;                 // 単項関数
+    const std::function<T(T, T, T)>* ternary = nullptr;         // 3引数の関数
+    const std::function<T(BasicListView<T>)>* list = nullptr;      // リスト関数
+    const std::function<T(const BasicListStream<T>&)>* stream = nullptr;   // リスト関数の遅延リスト版
+    const std::function<BasicSequence<T>(const T*)>* sequence = nullptr;  // 数列を作る関数
+    const std::function<void(std::vector<T>&, const std::vector<T>&, std::vector<T>&)>* query = nullptr;
+                                                                 // パラメータ付きリスト関数
+    const std::function<T(const ListData&)>* cached = nullptr;   // リスト関数の登録済みリスト版
+    const std::function<void(const ListData&, const std::vector<T>&, std::vector<T>&)>* cachedQuery = nullptr;
+                                                                 // パラメータ付きリスト関数の登録済みリスト版
+    const std::function<void(const BasicListStream<T>&, const std::vector<T>&, std::vector<T>&)>* streamQuery = nullptr;
+                                                                 // パラメータ付きリスト関数の読み取り専用版
+    const std::function<void(BasicListView<T>, std::vector<T>&)>* summary = nullptr;
+                                                                 // 複数の結果を返すリスト関数
+    T constant = 0;                                              // 定数の値
 };
 
+using SymbolFunctions = BasicSymbolFunctions<double>;
+
+template <typename T>
+static std::vector<BasicSymbolFunctions<T>> buildSymbolFunctions(
+        const std::unordered_map<std::string, BasicOperatorInfo<T>>& operators,
+        const std::unordered_map<std::string, BasicUnaryFunctionInfo<T>>& unaryFunctions,
+        const std::unordered_map<std::string, BasicBinaryFunctionInfo<T>>& binaryFunctions,
+        const std::unordered_map<std::string, BasicTernaryFunctionInfo<T>>& ternaryFunctions,
+        const std::unordered_map<std::string, BasicListFunctionInfo<T>>& listFunctions,
+        const std::unordered_map<std::string, BasicListQueryFunctionInfo<T>>& queryFunctions,
+        const std::unordered_map<std::string, BasicListSummaryFunctionInfo<T>>& summaryFunctions,
+        const std::unordered_map<std::string, BasicSequenceFunctionInfo<T>>& sequenceFunctions,
+        const std::unordered_map<std::string, T>& constants) {
+    std::vector<BasicSymbolFunctions<T>> functions(SYMBOLS.size());
+    for (size_t i = 0; i < SYMBOLS.size(); ++i) {
+        const std::string& name = SYMBOLS[i].name;
+        if (SYMBOLS[i].listResult && SYMBOLS[i].type != TokenType::ListFunction) {
+            functions[i].sequence = &sequenceFunctions.at(name).func;
+            continue;
+        }
+        switch (SYMBOLS[i].type) {
+            case TokenType::Operator:       functions[i].binary = &operators.at(name).func; break;
+            case TokenType::BinaryFunction: functions[i].binary = &binaryFunctions.at(name).func; break;
+            case TokenType::UnaryFunction:  functions[i].unary = &unaryFunctions.at(name).func; break;
+            case TokenType::TernaryFunction: functions[i].ternary = &ternaryFunctions.at(name).func; break;
+            case TokenType::ListFunction:
+                if (SYMBOLS[i].arity == 2) {
+                    const BasicListQueryFunctionInfo<T>& info = queryFunctions.at(name);
+                    functions[i].query = &info.func;
+                    if (info.cached) functions[i].cachedQuery = &info.cached;
+                    if (info.stream) functions[i].streamQuery = &info.stream;
+                } else if (SYMBOLS[i].listResult) {
+                    functions[i].summary = &summaryFunctions.at(name).func;
+                } else {
+                    const BasicListFunctionInfo<T>& info = listFunctions.at(name);
+                    functions[i].list = &info.func;
+                    if (info.stream) functions[i].stream = &info.stream;
+                    if (info.cached) functions[i].cached = &info.cached;
+                }
+                break;
+            case TokenType::Constant:       functions[i].constant = constants.at(name); break;
+            default: break;
+        }
+    }
+    return functions;
+}
+
+static const std::vector<SymbolFunctions> SYMBOL_FUNCTIONS =
+    buildSymbolFunctions(OPERATORS, UNARY_FUNCTIONS, BINARY_FUNCTIONS, TERNARY_FUNCTIONS, LIST_FUNCTIONS,
+                         LIST_QUERY_FUNCTIONS, LIST_SUMMARY_FUNCTIONS, SEQUENCE_FUNCTIONS, CONSTANTS);
+
+// 型 T 用の表（double 以外は初回使用時に T 版のテーブルから構築）
+template <typename T>
+static const std::vector<BasicSymbolFunctions<T>>& symbolFunctions() {
+    static const auto operators = makeOperators<T>();
+    static const auto unaryFunctions = makeUnaryFunctions<T>();
+    static const auto binaryFunctions = makeBinaryFunctions<T>();
+    static const auto ternaryFunctions = makeTernaryFunctions<T>();
+    static const auto listFunctions = makeListFunctions<T>();
+    static const auto queryFunctions = makeListQueryFunctions<T>();
+    static const auto summaryFunctions = makeListSummaryFunctions<T>();
+    static const auto sequenceFunctions = makeSequenceFunctions<T>();
+    static const auto constants = makeConstants<T>();
+    static const auto functions = buildSymbolFunctions(operators, unaryFunctions, binaryFunctions,
+                                                       ternaryFunctions, listFunctions, queryFunctions,
+                                                       summaryFunctions, sequenceFunctions, constants);
+    return functions;
+}
+
+template <>
+const std::vector<SymbolFunctions>& symbolFunctions<double>() {
+    return SYMBOL_FUNCTIONS;
+}
+
 //==============================================================================
 // UTF-8 ユーティリティ関数
 //==============================================================================
@@ -220,6 +842,10 @@ bool isMultibyte(const std::string& ch) {
 // 判定関数
 //==============================================================================
 
+SymbolId findSymbol(const std::string& name) {
+    return SYMBOL_TRIE.find(name.data(), name.size());
+}
+
 int getPrecedence(const std::string& op) {
     auto it = OPERATORS.find(op);
     return (it != OPERATORS.end()) ? it->second.precedence : 0;
@@ -234,7 +860,15 @@ bool isUnaryFunction(const std::string& s) {
 }
 
 bool isBinaryFunction(const std::string& s) {
-    return BINARY_FUNCTIONS.find(s) != BINARY_FUNCTIONS.end();
+    if (BINARY_FUNCTIONS.find(s) != BINARY_FUNCTIONS.end()) return true;
+    auto it = SEQUENCE_FUNCTIONS.find(s);
+    return it != SEQUENCE_FUNCTIONS.end() && it->second.arity == 2;
+}
+
+bool isTernaryFunction(const std::string& s) {
+    if (TERNARY_FUNCTIONS.find(s) != TERNARY_FUNCTIONS.end()) return true;
+    auto it = SEQUENCE_FUNCTIONS.find(s);
+    return it != SEQUENCE_FUNCTIONS.end() && it->second.arity == 3;
 }
 
 bool isConstant(const std::string& s) {
@@ -242,7 +876,9 @@ bool isConstant(const std::string& s) {
 }
 
 bool isListFunction(const std::string& s) {
-    return LIST_FUNCTIONS.find(s) != LIST_FUNCTIONS.end();
+    return LIST_FUNCTIONS.find(s) != LIST_FUNCTIONS.end() ||
+           LIST_QUERY_FUNCTIONS.find(s) != LIST_QUERY_FUNCTIONS.end() ||
+           LIST_SUMMARY_FUNCTIONS.find(s) != LIST_SUMMARY_FUNCTIONS.end();
 }
 
 bool isRightAssociative(const std::string& op) {
@@ -250,183 +886,306 @@ bool isRightAssociative(const std::string& op) {
     return (it != OPERATORS.end()) && it->second.rightAssociative;
 }
 
-// リストマーカー用の特殊値（NaNを使用）
-static const double LIST_MARKER = std::nan("");
-
+// リストマーカー（NaN）かどうか（評価器はリストの開始位置を別に管理するため、互換のために残している）
 bool isListMarker(double v) {
     return std::isnan(v);
 }
 
 //==============================================================================
-// トークナイザー（UTF-8対応）
+// バイト分類（字句解析の前処理）
 //==============================================================================
+//
+// 入力を64バイトごとのブロックに分け、各バイトの種類をビットマスクにする
+// （ビット i がブロックの i バイト目）。字句解析と RPN の語の分割は、このマスクから
+// 同じ種類のバイトが続く範囲をビット演算で求める。UTF-8 の後続バイト（0x80〜0xBF）は
+// どの種類にも入らないため、マルチバイト文字の途中で区切られることはない。
+// 字句解析はトークンの先頭のバイトの種類で分岐し、演算子は ASCII 演算子の続く範囲、
+// 英字で始まる名前は識別子の続く範囲だけをシンボルの表と照合する
+// （英字で始まるシンボル名は英字・数字・'_' だけ、ASCII 演算子は演算子のバイトだけからなる）。
+
+// 64バイト分のバイトの種類
+struct ByteMasks {
+    uint64_t space;      // ASCII空白（' ' \t \n \v \f \r）
+    uint64_t notSpace;   // 空白以外（入力の終わりより後は含まない）
+    uint64_t number;     // 数字と '.'
+    uint64_t word;       // 英字・数字・'_'（識別子）
+    uint64_t op;         // ASCII演算子（! % & * + - / < = > ^ |）
+    uint64_t bracket;    // 括弧と区切り（( ) { } , ? :）
+    uint64_t lead;       // UTF-8 のマルチバイト文字の先頭バイト（0xC0 以上）
+};
 
-std::vector<Token> tokenize(const std::string& expression) {
-    std::vector<Token> tokens;
-    size_t i = 0;
+constexpr size_t SCAN_BLOCK = 64;
+
+#if defined(__SSE2__)
+
+// 16バイトずつ SSE2 で比較し、movemask でビットマスクにする
+static ByteMasks classifyBlock(const unsigned char* p) {
+    ByteMasks masks = {};
+    for (size_t k = 0; k < SCAN_BLOCK; k += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + k));
+        // lo ≤ v ≤ hi（符号なし）を min(v - lo, hi - lo) == v - lo で判定
+        auto inRange = [](__m128i x, char lo, char hi) {
+            __m128i d = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+            return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(static_cast<char>(hi - lo))), d);
+        };
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), inRange(v, '\t', '\r'));
+        __m128i digit = inRange(v, '0', '9');
+        __m128i alpha = inRange(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z');
+        __m128i number = _mm_or_si128(digit, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+        __m128i word = _mm_or_si128(_mm_or_si128(digit, alpha), _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+        auto is = [&](char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); };
+        // ! % & * + - / は 0x21〜0x2F、< = > は 0x3C〜0x3E
+        __m128i op = _mm_or_si128(_mm_or_si128(_mm_or_si128(is('!'), inRange(v, '%', '&')),
+                                               _mm_or_si128(inRange(v, '*', '+'), is('-'))),
+                                  _mm_or_si128(_mm_or_si128(is('/'), inRange(v, '<', '>')),
+                                               _mm_or_si128(is('^'), is('|'))));
+        __m128i bracket = _mm_or_si128(_mm_or_si128(inRange(v, '(', ')'), is(',')),
+                                       _mm_or_si128(_mm_or_si128(is('{'), is('}')),
+                                                    _mm_or_si128(is('?'), is(':'))));
+        __m128i lead = inRange(v, static_cast<char>(0xC0), static_cast<char>(0xFF));
+        auto bits = [](__m128i x) { return static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(x))); };
+        masks.space |= bits(space) << k;
+        masks.number |= bits(number) << k;
+        masks.word |= bits(word) << k;
+        masks.op |= bits(op) << k;
+        masks.bracket |= bits(bracket) << k;
+        masks.lead |= bits(lead) << k;
+    }
+    masks.notSpace = ~masks.space;
+    return masks;
+}
 
-    while (i < expression.length()) {
-        std::string ch = utf8ExtractChar(expression, i);
-        size_t charLen = ch.length();
+#else
+
+// SSE2 がない環境では1バイトずつ分類する
+static ByteMasks classifyBlock(const unsigned char* p) {
+    ByteMasks masks = {};
+    for (size_t k = 0; k < SCAN_BLOCK; ++k) {
+        unsigned char c = p[k];
+        bool digit = c >= '0' && c <= '9';
+        bool alpha = (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+        uint64_t bit = uint64_t(1) << k;
+        if (c == ' ' || (c >= '\t' && c <= '\r')) masks.space |= bit;
+        if (digit || c == '.') masks.number |= bit;
+        if (digit || alpha || c == '_') masks.word |= bit;
+        if (c != 0 && std::strchr("!%&*+-/<=>^|", c)) masks.op |= bit;
+        if (c != 0 && std::strchr("(){},?:", c)) masks.bracket |= bit;
+        if (c >= 0xC0) masks.lead |= bit;
+    }
+    masks.notSpace = ~masks.space;
+    return masks;
+}
 
-        // 空白はスキップ
-        if (isAsciiSpace(ch)) {
-            i += charLen;
-            continue;
-        }
+#endif
 
-        // 数字または小数点の場合
-        if (isAsciiDigit(ch) || ch == ".") {
-            std::string number;
-            while (i < expression.length()) {
-                std::string c = utf8ExtractChar(expression, i);
-                if (isAsciiDigit(c) || c == ".") {
-                    number += c;
-                    i += c.length();
-                } else {
-                    break;
-                }
-            }
-            tokens.push_back({TokenType::Number, number});
-            continue;
-        }
+// 入力全体を分類する（最後のブロックは0で埋めて分類する）
+static void classifyBytes(const char* text, size_t size, std::vector<ByteMasks>& masks) {
+    masks.resize((size + SCAN_BLOCK - 1) / SCAN_BLOCK);
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(text);
+    size_t full = size / SCAN_BLOCK;
+    for (size_t b = 0; b < full; ++b) {
+        masks[b] = classifyBlock(data + b * SCAN_BLOCK);
+    }
+    size_t rest = size - full * SCAN_BLOCK;
+    if (rest > 0) {
+        unsigned char tail[SCAN_BLOCK] = {};
+        std::copy_n(data + full * SCAN_BLOCK, rest, tail);
+        masks[full] = classifyBlock(tail);
+        masks[full].notSpace &= (uint64_t(1) << rest) - 1;
+    }
+}
 
-        // 左括弧
-        if (ch == "(") {
-            tokens.push_back({TokenType::LeftParen, "("});
-            i += charLen;
-            continue;
+static void classifyBytes(const std::string& text, std::vector<ByteMasks>& masks) {
+    classifyBytes(text.data(), text.size(), masks);
+}
+
+// pos のバイトが kind の種類か
+static inline bool hasClass(const std::vector<ByteMasks>& masks, uint64_t ByteMasks::*kind, size_t pos) {
+    return (masks[pos / SCAN_BLOCK].*kind >> (pos % SCAN_BLOCK)) & 1;
+}
+
+// pos から kind の種類のバイトが続く範囲の終わり（size を超えない）
+static size_t classRunEnd(const std::vector<ByteMasks>& masks, uint64_t ByteMasks::*kind,
+                          size_t pos, size_t size) {
+    while (pos < size) {
+        size_t offset = pos % SCAN_BLOCK;
+        // 種類外のバイトのビット（ブロックの終わりより先は0になる）
+        uint64_t outside = ~(masks[pos / SCAN_BLOCK].*kind) >> offset;
+        if (outside != 0) {
+            return std::min(pos + static_cast<size_t>(__builtin_ctzll(outside)), size);
         }
+        pos += SCAN_BLOCK - offset;
+    }
+    return size;
+}
+
+// 字句解析・変換の作業領域（Evaluator が保持して呼び出しをまたいで再利用する）
+struct ParseBuffers {
+    std::vector<ByteMasks> masks;           // バイト分類
+    std::vector<Token> tokens;              // 字句解析の結果
+    std::vector<const Token*> order;        // RPN順に並べたトークン
+    std::vector<const Token*> opStack;      // 演算子スタック
+    std::string word;                       // RPN式の1語
+    std::vector<std::string> parts;         // 中置記法に戻すときの部分式
+    std::string output;
+};
+
+//==============================================================================
+// トークナイザー（UTF-8対応）
+//==============================================================================
+
+const std::string& Token::value() const {
+    static const std::string PUNCTUATION[] = {"(", ")", ",", "{", "}", "?", ":"};
+    switch (type) {
+        case TokenType::Operator:
+        case TokenType::UnaryFunction:
+        case TokenType::BinaryFunction:
+        case TokenType::TernaryFunction:
+        case TokenType::ListFunction:
+        case TokenType::Constant:
+            return id != NO_SYMBOL ? SYMBOLS[id].name : text;
+        case TokenType::LeftParen:  return PUNCTUATION[0];
+        case TokenType::RightParen: return PUNCTUATION[1];
+        case TokenType::Comma:      return PUNCTUATION[2];
+        case TokenType::ListStart:  return PUNCTUATION[3];
+        case TokenType::ListEnd:    return PUNCTUATION[4];
+        case TokenType::Question:   return PUNCTUATION[5];
+        case TokenType::Colon:      return PUNCTUATION[6];
+        default:                    return text;
+    }
+}
+
+// シンボルIDからトークンを作る
+static Token symbolToken(SymbolId id) {
+    const SymbolInfo& info = SYMBOLS[id];
+    return {info.type, {}, id, info.value};
+}
+
+// 数値リテラルからトークンを作る（値はここで1回だけ解析する）
+static Token numberToken(const std::string& number) {
+    return {TokenType::Number, number, NO_SYMBOL, std::strtod(number.c_str(), nullptr)};
+}
+
+// tokens の内容を置き換える（masks はバイト分類の作業領域）
+static void tokenize(const std::string& expression, std::vector<ByteMasks>& masks, std::vector<Token>& tokens) {
+    tokens.clear();
+    const size_t size = expression.size();
+    classifyBytes(expression, masks);
+    size_t i = 0;
+
+    while (i < size) {
+        unsigned char c = static_cast<unsigned char>(expression[i]);
 
-        // 右括弧
-        if (ch == ")") {
-            tokens.push_back({TokenType::RightParen, ")"});
-            i += charLen;
+        // 空白はまとめてスキップ
+        if (hasClass(masks, &ByteMasks::space, i)) {
+            i = classRunEnd(masks, &ByteMasks::space, i, size);
             continue;
         }
 
-        // カンマ（関数の引数区切り）
-        if (ch == ",") {
-            tokens.push_back({TokenType::Comma, ","});
-            i += charLen;
+        // 数字または小数点の場合（連続する数字・小数点を1つの数値にする）
+        if (hasClass(masks, &ByteMasks::number, i)) {
+            size_t end = classRunEnd(masks, &ByteMasks::number, i, size);
+            tokens.push_back(numberToken(expression.substr(i, end - i)));
+            i = end;
             continue;
         }
 
-        // リスト開始（HP方式）
-        if (ch == "{") {
-            tokens.push_back({TokenType::ListStart, "{"});
-            i += charLen;
+        // 括弧と区切り（1バイトで1トークン）
+        if (hasClass(masks, &ByteMasks::bracket, i)) {
+            switch (c) {
+                // 左括弧・右括弧
+                case '(': tokens.push_back({TokenType::LeftParen}); break;
+                case ')': tokens.push_back({TokenType::RightParen}); break;
+                // カンマ（関数の引数区切り）
+                case ',': tokens.push_back({TokenType::Comma}); break;
+                // リスト開始・終了（HP方式）
+                case '{': tokens.push_back({TokenType::ListStart}); break;
+                case '}': tokens.push_back({TokenType::ListEnd}); break;
+                // 条件演算子（c ? a : b）
+                case '?': tokens.push_back({TokenType::Question}); break;
+                default:  tokens.push_back({TokenType::Colon}); break;
+            }
+            ++i;
             continue;
         }
 
-        // リスト終了（HP方式）
-        if (ch == "}") {
-            tokens.push_back({TokenType::ListEnd, "}"});
-            i += charLen;
+        // 登録済みのリスト（@name）。名前は空白か , ( ) { } の手前まで
+        if (c == '@') {
+            size_t end = expression.find_first_of(" \t\n\v\f\r,(){}", i + 1);
+            if (end == std::string::npos) end = size;
+            tokens.push_back({TokenType::ListSource, expression.substr(i, end - i)});
+            i = end;
             continue;
         }
 
-        // 単項マイナス（負の数）の判定
-        // 前のトークンが演算子、左括弧、カンマ、リスト開始、または先頭の場合、- は負の数の符号
-        if (ch == "-") {
-            bool isUnaryMinus = tokens.empty() ||
-                                tokens.back().type == TokenType::Operator ||
-                                tokens.back().type == TokenType::LeftParen ||
-                                tokens.back().type == TokenType::Comma ||
-                                tokens.back().type == TokenType::ListStart;
+        // ASCII演算子（"<=" "&&" などは演算子のバイトが続く範囲で最長一致）
+        if (hasClass(masks, &ByteMasks::op, i)) {
+            // 単項マイナス（負の数）の判定
+            // 前のトークンが演算子、左括弧、カンマ、リスト開始、条件演算子、または先頭の場合、- は負の数の符号
+            if (c == '-') {
+                bool isUnaryMinus = tokens.empty() ||
+                                    tokens.back().type == TokenType::Operator ||
+                                    tokens.back().type == TokenType::LeftParen ||
+                                    tokens.back().type == TokenType::Comma ||
+                                    tokens.back().type == TokenType::ListStart ||
+                                    tokens.back().type == TokenType::Question ||
+                                    tokens.back().type == TokenType::Colon;
 
-            if (isUnaryMinus) {
                 // 次の文字が数字か小数点なら負の数として処理
-                size_t nextPos = i + charLen;
-                if (nextPos < expression.length()) {
-                    std::string nextCh = utf8ExtractChar(expression, nextPos);
-                    if (isAsciiDigit(nextCh) || nextCh == ".") {
-                        std::string number = "-";
-                        i = nextPos;
-                        while (i < expression.length()) {
-                            std::string c = utf8ExtractChar(expression, i);
-                            if (isAsciiDigit(c) || c == ".") {
-                                number += c;
-                                i += c.length();
-                            } else {
-                                break;
-                            }
-                        }
-                        tokens.push_back({TokenType::Number, number});
-                        continue;
-                    }
+                if (isUnaryMinus && i + 1 < size && hasClass(masks, &ByteMasks::number, i + 1)) {
+                    size_t end = classRunEnd(masks, &ByteMasks::number, i + 1, size);
+                    tokens.push_back(numberToken(expression.substr(i, end - i)));
+                    i = end;
+                    continue;
                 }
             }
-        }
-
-        // ASCII演算子（単一文字）
-        if (charLen == 1 && ASCII_OPERATOR_CHARS.count(ch[0])) {
-            tokens.push_back({TokenType::Operator, ch});
-            i += charLen;
+            size_t end = classRunEnd(masks, &ByteMasks::op, i, size);
+            size_t length = 0;
+            SymbolId id = SYMBOL_TRIE.longestMatch(expression.data() + i, end - i, length);
+            if (id != NO_SYMBOL) {
+                tokens.push_back(symbolToken(id));
+                i += length;
+            } else {
+                ++i;    // 未知の演算子（単独の = & | など）はスキップ
+            }
             continue;
         }
 
-        // マルチバイト文字の処理（Unicode演算子・関数・定数）
-        if (isMultibyte(ch)) {
-            // 演算子として登録されているか確認
-            if (isOperator(ch)) {
-                tokens.push_back({TokenType::Operator, ch});
-                i += charLen;
-                continue;
-            }
-            // 関数として登録されているか確認（√など）
-            if (isUnaryFunction(ch)) {
-                tokens.push_back({TokenType::UnaryFunction, ch});
-                i += charLen;
-                continue;
-            }
-            // 定数として登録されているか確認（π, τなど）
-            if (isConstant(ch)) {
-                tokens.push_back({TokenType::Constant, ch});
-                i += charLen;
-                continue;
+        // 英字で始まる名前（識別子の範囲全体が関数・定数の名前と一致しなければ変数）
+        if (hasClass(masks, &ByteMasks::word, i)) {
+            size_t end = classRunEnd(masks, &ByteMasks::word, i, size);
+            SymbolId id = SYMBOL_TRIE.find(expression.data() + i, end - i);
+            if (id != NO_SYMBOL) {
+                tokens.push_back(symbolToken(id));
+            } else {
+                tokens.push_back({TokenType::Variable, expression.substr(i, end - i)});
             }
-            // 未知のマルチバイト文字はスキップ
-            i += charLen;
+            i = end;
             continue;
         }
 
-        // ASCIIアルファベット（関数名・定数名）
-        if (isAsciiAlpha(ch)) {
-            std::string name;
-            while (i < expression.length()) {
-                std::string c = utf8ExtractChar(expression, i);
-                // アルファベットまたは数字（関数名にlog10などを許容）
-                if (isAsciiAlpha(c) || isAsciiDigit(c)) {
-                    name += c;
-                    i += c.length();
-                } else {
-                    break;
-                }
-            }
-            // 定数として登録されているか確認
-            if (isConstant(name)) {
-                tokens.push_back({TokenType::Constant, name});
-            }
-            // 単項関数として登録されているか確認
-            else if (isUnaryFunction(name)) {
-                tokens.push_back({TokenType::UnaryFunction, name});
-            }
-            // 二項関数として登録されているか確認
-            else if (isBinaryFunction(name)) {
-                tokens.push_back({TokenType::BinaryFunction, name});
-            }
-            // リスト関数として登録されているか確認
-            else if (isListFunction(name)) {
-                tokens.push_back({TokenType::ListFunction, name});
+        // Unicode の演算子・関数・定数（× π ΣLIST など。トライで最長一致）
+        if (hasClass(masks, &ByteMasks::lead, i)) {
+            size_t length = 0;
+            SymbolId id = SYMBOL_TRIE.longestMatch(expression.data() + i, size - i, length);
+            if (id != NO_SYMBOL) {
+                tokens.push_back(symbolToken(id));
+                i += length;
+                continue;
             }
-            continue;
         }
 
-        // 未知の文字はスキップ
-        i += charLen;
+        // 未知の文字はスキップ。マルチバイト文字は1文字分
+        i += std::min(utf8CharLength(c), size - i);
     }
 
+}
+
+std::vector<Token> tokenize(const std::string& expression) {
+    LIBRPN_PROFILE_CALL(Tokenize);
+    std::vector<ByteMasks> masks;
+    std::vector<Token> tokens;
+    tokenize(expression, masks, tokens);
     return tokens;
 }
 
@@ -434,267 +1193,1955 @@ std::vector<Token> tokenize(const std::string& expression) {
 // 中置記法 → RPN変換（Shunting-yard アルゴリズム）
 //==============================================================================
 
-std::string infixToRPN(const std::string& expression) {
-    std::vector<Token> tokens = tokenize(expression);
-    std::string output;
-    std::stack<Token> opStack;
+// トークンの優先順位（シンボル表をIDで引く。演算子以外は0）
+static inline int precedenceOf(const Token& token) {
+    return (token.id != NO_SYMBOL) ? SYMBOLS[token.id].precedence : 0;
+}
+
+// トークンが右結合演算子かどうか
+static inline bool rightAssociativeOf(const Token& token) {
+    return token.id != NO_SYMBOL && SYMBOLS[token.id].rightAssociative;
+}
+
+// トークン列をRPN順に並べ替える（output には tokens の要素へのポインタを追加）
+// opStack は演算子スタック（トークンをコピーせず tokens へのポインタを積む）の作業領域
+static void toRPNOrder(const std::vector<Token>& tokens, std::vector<const Token*>& output,
+                       std::vector<const Token*>& opStack) {
+    opStack.clear();
+    opStack.reserve(tokens.size());
 
+    auto popToOutput = [&]() {
+        if (opStack.back()->type == TokenType::Question) {
+            throw std::runtime_error("librpn: '?' without matching ':'");
+        }
+        output.push_back(opStack.back());
+        opStack.pop_back();
+    };
+
+    // 演算子スタックの先頭が、優先順位 precedence の演算子より先に出力すべきものか
+    // （条件演算子の ? と : は括弧と同じく区切りになる）
+    auto bindsTighter = [&](int precedence, bool rightAssociative) {
+        const Token& top = *opStack.back();
+        if (top.type == TokenType::UnaryFunction) return true;
+        if (top.type != TokenType::Operator) return false;
+        return precedenceOf(top) > precedence || (precedenceOf(top) == precedence && !rightAssociative);
+    };
+
+    const Token* previous = nullptr;
     for (const auto& token : tokens) {
         switch (token.type) {
             case TokenType::Number:
             case TokenType::Constant:
-                if (!output.empty()) output += ' ';
-                output += token.value;
+            case TokenType::Variable:
+            case TokenType::ListSource:
+                output.push_back(&token);
                 break;
 
             case TokenType::UnaryFunction:
-                opStack.push(token);
+                opStack.push_back(&token);
                 break;
 
-            case TokenType::Operator:
+            case TokenType::Operator: {
+                int precedence = precedenceOf(token);
+                bool rightAssociative = rightAssociativeOf(token);
+                while (!opStack.empty() && bindsTighter(precedence, rightAssociative)) {
+                    popToOutput();
+                }
+                opStack.push_back(&token);
+                break;
+            }
+
+            case TokenType::Question:
+                // 条件演算子は最も低い優先順位の右結合演算子（条件の式を全部出力してから積む）
+                while (!opStack.empty() && bindsTighter(std::numeric_limits<int>::min(), true)) {
+                    popToOutput();
+                }
+                opStack.push_back(&token);
+                break;
+
+            case TokenType::Colon:
+                // 対応する ? までを出力し、? を : に置き換える（: は出力時に if になる）
                 while (!opStack.empty() &&
-                       opStack.top().type != TokenType::LeftParen &&
-                       opStack.top().type != TokenType::ListStart &&
-                       (opStack.top().type == TokenType::UnaryFunction ||
-                        getPrecedence(opStack.top().value) > getPrecedence(token.value) ||
-                        (getPrecedence(opStack.top().value) == getPrecedence(token.value) &&
-                         !isRightAssociative(token.value)))) {
-                    output += ' ';
-                    output += opStack.top().value;
-                    opStack.pop();
+                       opStack.back()->type != TokenType::Question &&
+                       opStack.back()->type != TokenType::LeftParen &&
+                       opStack.back()->type != TokenType::ListStart) {
+                    popToOutput();
+                }
+                if (opStack.empty() || opStack.back()->type != TokenType::Question) {
+                    throw std::runtime_error("librpn: ':' without matching '?'");
                 }
-                opStack.push(token);
+                opStack.back() = &token;
                 break;
 
             case TokenType::LeftParen:
-                opStack.push(token);
+                opStack.push_back(&token);
                 break;
 
             case TokenType::BinaryFunction:
-                opStack.push(token);
+            case TokenType::TernaryFunction:
+                opStack.push_back(&token);
                 break;
 
             case TokenType::ListFunction:
-                // リスト関数は後置で出力するためスタックにプッシュ
-                opStack.push(token);
+                // 後置（{...} mean）ならすぐ出力、前置（mean{...}）ならリストを閉じるまでスタックに置く
+                if (previous && previous->type == TokenType::ListEnd) {
+                    output.push_back(&token);
+                } else {
+                    opStack.push_back(&token);
+                }
                 break;
 
             case TokenType::ListStart:
                 // リスト開始は出力に追加し、スタックにもマーカーとしてプッシュ
-                if (!output.empty()) output += ' ';
-                output += "{";
-                opStack.push(token);
+                output.push_back(&token);
+                opStack.push_back(&token);
                 break;
 
             case TokenType::ListEnd:
                 // リスト終了：ListStartまでの演算子をポップ
-                while (!opStack.empty() && opStack.top().type != TokenType::ListStart) {
-                    output += ' ';
-                    output += opStack.top().value;
-                    opStack.pop();
+                while (!opStack.empty() && opStack.back()->type != TokenType::ListStart) {
+                    popToOutput();
                 }
                 if (!opStack.empty()) {
-                    opStack.pop(); // '{' を削除
+                    opStack.pop_back(); // '{' を削除
+                }
+                output.push_back(&token);
+                // 前置のリスト関数があればポップ
+                if (!opStack.empty() && opStack.back()->type == TokenType::ListFunction) {
+                    popToOutput();
                 }
-                output += " }";
                 break;
 
             case TokenType::Comma:
                 // カンマは左括弧またはリスト開始までの演算子をポップ
                 while (!opStack.empty() &&
-                       opStack.top().type != TokenType::LeftParen &&
-                       opStack.top().type != TokenType::ListStart) {
-                    output += ' ';
-                    output += opStack.top().value;
-                    opStack.pop();
+                       opStack.back()->type != TokenType::LeftParen &&
+                       opStack.back()->type != TokenType::ListStart) {
+                    popToOutput();
                 }
                 break;
 
             case TokenType::RightParen:
-                while (!opStack.empty() && opStack.top().type != TokenType::LeftParen) {
-                    output += ' ';
-                    output += opStack.top().value;
-                    opStack.pop();
+                while (!opStack.empty() && opStack.back()->type != TokenType::LeftParen) {
+                    popToOutput();
                 }
                 if (!opStack.empty()) {
-                    opStack.pop(); // '(' を削除
+                    opStack.pop_back(); // '(' を削除
                 }
-                // 関数（単項または二項）があればポップ
+                // 関数（単項・二項・3引数・リスト）があればポップ
                 if (!opStack.empty() &&
-                    (opStack.top().type == TokenType::UnaryFunction ||
-                     opStack.top().type == TokenType::BinaryFunction)) {
-                    output += ' ';
-                    output += opStack.top().value;
-                    opStack.pop();
+                    (opStack.back()->type == TokenType::UnaryFunction ||
+                     opStack.back()->type == TokenType::BinaryFunction ||
+                     opStack.back()->type == TokenType::TernaryFunction ||
+                     opStack.back()->type == TokenType::ListFunction)) {
+                    popToOutput();
                 }
                 break;
         }
+        previous = &token;
     }
 
     // 残りの演算子を出力
     while (!opStack.empty()) {
-        output += ' ';
-        output += opStack.top().value;
-        opStack.pop();
+        popToOutput();
+    }
+}
+
+// buffers.tokens（字句解析済み）をRPN順にして output に移す
+static void tokensToRPN(std::vector<Token>& output, ParseBuffers& buffers) {
+    std::vector<Token>& tokens = buffers.tokens;
+    buffers.order.clear();
+    buffers.order.reserve(tokens.size());
+    toRPNOrder(tokens, buffers.order, buffers.opStack);
+
+    // 各トークンは RPN 順に高々1回しか現れないので、コピーせずに移す
+    // （条件演算子の : は if にする）
+    static const SymbolId conditional = findSymbol("if");
+    output.clear();
+    output.reserve(buffers.order.size());
+    for (const Token* token : buffers.order) {
+        if (token->type == TokenType::Colon) {
+            output.push_back(symbolToken(conditional));
+        } else {
+            output.push_back(std::move(tokens[token - tokens.data()]));
+        }
     }
+}
+
+static void infixToRPN(const std::string& expression, std::vector<Token>& output, ParseBuffers& buffers) {
+    tokenize(expression, buffers.masks, buffers.tokens);
+    tokensToRPN(output, buffers);
+}
+
+void infixToRPN(const std::string& expression, std::vector<Token>& output) {
+    LIBRPN_PROFILE_CALL(InfixToRPN);
+    ParseBuffers buffers;
+    infixToRPN(expression, output, buffers);
+}
+
+void infixToRPN(std::vector<Token> tokens, std::vector<Token>& output) {
+    ParseBuffers buffers;
+    buffers.tokens = std::move(tokens);
+    tokensToRPN(output, buffers);
+}
 
+std::string formatRPN(const std::vector<Token>& code) {
+    size_t length = 0;
+    for (const auto& token : code) length += token.value().size() + 1;
+    std::string output;
+    output.reserve(length);
+    for (const auto& token : code) {
+        if (!output.empty()) output += ' ';
+        output += token.value();
+    }
     return output;
 }
 
+std::string infixToRPN(const std::string& expression) {
+    LIBRPN_PROFILE_CALL(InfixToRPN);
+    std::vector<Token> code;
+    ParseBuffers buffers;
+    infixToRPN(expression, code, buffers);
+    return formatRPN(code);
+}
+
 //==============================================================================
-// RPN計算
+// 列単位の演算（リスト値の要素ごとの演算・バッチ評価で共用）
 //==============================================================================
 
-double calculateRPN(const std::string& expression) {
-    std::stack<double> s;
+// 列単位でまとめて計算できる演算（それ以外は要素ごとにテーブルの関数を呼ぶ）
+enum class BatchKernel {
+    Generic, Add, Sub, Mul, Div, Pow, Sqrt, Exp, Log, Log10, Sin, Cos, Tan,
+    Less, LessEqual, Greater, GreaterEqual, Equal, NotEqual, And, Or, Not
+};
 
-    // UTF-8対応のトークン分割（空白区切り）
-    std::vector<std::string> tokens;
-    std::string current;
-    size_t i = 0;
-    while (i < expression.length()) {
-        std::string ch = utf8ExtractChar(expression, i);
-        if (isAsciiSpace(ch)) {
-            if (!current.empty()) {
-                tokens.push_back(current);
-                current.clear();
-            }
-        } else {
-            current += ch;
-        }
-        i += ch.length();
-    }
-    if (!current.empty()) {
-        tokens.push_back(current);
+static std::vector<BatchKernel> buildBatchKernels() {
+    static const std::unordered_map<std::string, BatchKernel> kernels = {
+        {"+", BatchKernel::Add},
+        {"-", BatchKernel::Sub},
+        {"*", BatchKernel::Mul},
+        {"×", BatchKernel::Mul},
+        {"·", BatchKernel::Mul},
+        {"/", BatchKernel::Div},
+        {"÷", BatchKernel::Div},
+        {"^", BatchKernel::Pow},
+        {"pow", BatchKernel::Pow},
+        {"sqrt", BatchKernel::Sqrt},
+        {"√", BatchKernel::Sqrt},
+        {"exp", BatchKernel::Exp},
+        {"log", BatchKernel::Log},
+        {"ln", BatchKernel::Log},
+        {"log10", BatchKernel::Log10},
+        {"sin", BatchKernel::Sin},
+        {"cos", BatchKernel::Cos},
+        {"tan", BatchKernel::Tan},
+        {"<", BatchKernel::Less},
+        {"<=", BatchKernel::LessEqual},
+        {"≤", BatchKernel::LessEqual},
+        {">", BatchKernel::Greater},
+        {">=", BatchKernel::GreaterEqual},
+        {"≥", BatchKernel::GreaterEqual},
+        {"==", BatchKernel::Equal},
+        {"!=", BatchKernel::NotEqual},
+        {"≠", BatchKernel::NotEqual},
+        {"and", BatchKernel::And},
+        {"&&", BatchKernel::And},
+        {"∧", BatchKernel::And},
+        {"or", BatchKernel::Or},
+        {"||", BatchKernel::Or},
+        {"∨", BatchKernel::Or},
+        {"not", BatchKernel::Not},
+        {"!", BatchKernel::Not},
+        {"¬", BatchKernel::Not},
+    };
+    std::vector<BatchKernel> result(SYMBOLS.size(), BatchKernel::Generic);
+    for (size_t i = 0; i < SYMBOLS.size(); ++i) {
+        auto it = kernels.find(SYMBOLS[i].name);
+        if (it != kernels.end()) result[i] = it->second;
     }
+    return result;
+}
 
-    for (const auto& token : tokens) {
-        // リスト開始（HP方式）
-        if (token == "{") {
-            s.push(LIST_MARKER);
-            continue;
-        }
+// バッチ評価の作業領域
+// スタックの各段は BATCH_BLOCK 行の列。演算結果は scratch に書いて入れ替える
+// （SIMDカーネルは入力と出力が別の配列である必要がある）
+struct BatchBuffers {
+    std::vector<std::vector<double>> stack;
+    std::vector<double> scratch;
+    std::vector<size_t> markers;     // リスト開始時のスタックの深さ
+    std::vector<double> values;      // リスト関数に渡す1行分の要素
+    std::vector<double> params;      // パラメータ付きリスト関数のパラメータ（1行分）
+    std::vector<double> results;
+};
 
-        // リスト終了（HP方式）- 何もしない（リスト関数で処理）
-        if (token == "}") {
-            continue;
-        }
+static void evaluateColumns(const Program& program, const std::vector<const double*>& columns,
+                            size_t rows, double* out, BatchBuffers& buffers);
 
-        // 演算子
-        auto opIt = OPERATORS.find(token);
-        if (opIt != OPERATORS.end()) {
-            double b = s.top(); s.pop();
-            double a = s.top(); s.pop();
-            s.push(opIt->second.func(a, b));
-            continue;
-        }
+// シンボルID → バッチ演算の種類（SYMBOLSと同じ添字）
+static const std::vector<BatchKernel> BATCH_KERNELS = buildBatchKernels();
 
-        // 単項関数
-        auto funcIt = UNARY_FUNCTIONS.find(token);
-        if (funcIt != UNARY_FUNCTIONS.end()) {
-            double a = s.top(); s.pop();
-            s.push(funcIt->second.func(a));
-            continue;
+// 単項関数を列に適用（結果は out。Fast モードでは数学関数をSIMDカーネルで計算）
+static void applyUnaryColumn(const Token& token, MathMode mode, const double* x, double* out, size_t n) {
+    BatchKernel kernel = BATCH_KERNELS[token.id];
+    if (kernel == BatchKernel::Sqrt) {
+        // 平方根はどちらのモードでも正しく丸められる（libm と同一）
+        simd::sqrt(x, out, n);
+        return;
+    }
+    if (kernel == BatchKernel::Not) {
+        simd::logicalNot(x, out, n);
+        return;
+    }
+    if (mode == MathMode::Fast) {
+        switch (kernel) {
+            case BatchKernel::Exp:   simd::exp(x, out, n); return;
+            case BatchKernel::Log:   simd::log(x, out, n); return;
+            case BatchKernel::Log10: simd::log10(x, out, n); return;
+            case BatchKernel::Sin:   simd::sin(x, out, n); return;
+            case BatchKernel::Cos:   simd::cos(x, out, n); return;
+            case BatchKernel::Tan:   simd::tan(x, out, n); return;
+            default: break;
         }
+    }
+    const auto& func = *SYMBOL_FUNCTIONS[token.id].unary;
+    for (size_t i = 0; i < n; ++i) out[i] = func(x[i]);
+}
 
-        // 二項関数
-        auto binFuncIt = BINARY_FUNCTIONS.find(token);
-        if (binFuncIt != BINARY_FUNCTIONS.end()) {
-            double b = s.top(); s.pop();
-            double a = s.top(); s.pop();
-            s.push(binFuncIt->second.func(a, b));
-            continue;
+// 演算子・二項関数を列に適用（結果は out）
+static void applyBinaryColumn(const Token& token, MathMode mode, const double* a, const double* b,
+                              double* out, size_t n) {
+    switch (BATCH_KERNELS[token.id]) {
+        case BatchKernel::Add: for (size_t i = 0; i < n; ++i) out[i] = a[i] + b[i]; return;
+        case BatchKernel::Sub: for (size_t i = 0; i < n; ++i) out[i] = a[i] - b[i]; return;
+        case BatchKernel::Mul: for (size_t i = 0; i < n; ++i) out[i] = a[i] * b[i]; return;
+        case BatchKernel::Div: for (size_t i = 0; i < n; ++i) out[i] = a[i] / b[i]; return;
+        // 比較・論理演算は分岐のないマスク演算にする
+        case BatchKernel::Less:         simd::compare(simd::Comparison::Less, a, b, out, n); return;
+        case BatchKernel::LessEqual:    simd::compare(simd::Comparison::LessEqual, a, b, out, n); return;
+        case BatchKernel::Greater:      simd::compare(simd::Comparison::Greater, a, b, out, n); return;
+        case BatchKernel::GreaterEqual: simd::compare(simd::Comparison::GreaterEqual, a, b, out, n); return;
+        case BatchKernel::Equal:        simd::compare(simd::Comparison::Equal, a, b, out, n); return;
+        case BatchKernel::NotEqual:     simd::compare(simd::Comparison::NotEqual, a, b, out, n); return;
+        case BatchKernel::And:          simd::logicalAnd(a, b, out, n); return;
+        case BatchKernel::Or:           simd::logicalOr(a, b, out, n); return;
+        case BatchKernel::Pow:
+            if (mode == MathMode::Fast) {
+                simd::pow(a, b, out, n);
+                return;
+            }
+            break;
+        default:
+            break;
+    }
+    const auto& func = *SYMBOL_FUNCTIONS[token.id].binary;
+    for (size_t i = 0; i < n; ++i) out[i] = func(a[i], b[i]);
+}
+
+//==============================================================================
+// RPN計算
+//==============================================================================
+
+// UTF-8対応のトークン分割（空白区切り）
+template <typename F>
+static void forEachRPNWord(const std::string& expression, ParseBuffers& buffers, F f) {
+    const size_t size = expression.size();
+    classifyBytes(expression, buffers.masks);
+    size_t i = 0;
+    while (i < size) {
+        size_t end = classRunEnd(buffers.masks, &ByteMasks::space, i, size);    // 空白の終わり
+        if (end >= size) break;
+        i = classRunEnd(buffers.masks, &ByteMasks::notSpace, end, size);       // 語の終わり
+        buffers.word.assign(expression, end, i - end);
+        f(buffers.word);
+    }
+}
+
+// RPNの1語を token にする（登録済みシンボル以外は数値として解析。token の文字列のバッファは再利用する）
+static void assignRPNToken(const std::string& word, Token& token) {
+    token.text.clear();
+    token.id = NO_SYMBOL;
+    token.number = 0.0;
+    if (word == "{") {
+        token.type = TokenType::ListStart;
+    } else if (word == "}") {
+        token.type = TokenType::ListEnd;
+    } else if (word.size() > 1 && word[0] == '@') {
+        token.type = TokenType::ListSource;
+        token.text.assign(word);
+    } else if ((token.id = SYMBOL_TRIE.find(word.data(), word.size())) != NO_SYMBOL) {
+        token.type = SYMBOLS[token.id].type;
+        token.number = SYMBOLS[token.id].value;
+    } else {
+        token.type = TokenType::Number;
+        token.text.assign(word);
+        token.number = std::stod(word);
+    }
+}
+
+// RPNの1語をトークンにする
+static Token rpnToken(const std::string& word) {
+    Token token;
+    assignRPNToken(word, token);
+    return token;
+}
+
+// スタックに必要な数の値があるか確認
+template <typename T>
+static inline void requireOperands(const std::vector<T>& s, size_t count, const Token& token) {
+    if (s.size() < count) {
+        throw std::runtime_error("librpn: stack underflow at '" + token.value() + "'");
+    }
+}
+
+// 数値リテラルを T で解析
+template <typename T> static T parseNumber(const std::string& str);
+template <> float parseNumber<float>(const std::string& str) { return std::stof(str); }
+template <> double parseNumber<double>(const std::string& str) { return std::stod(str); }
+template <> long double parseNumber<long double>(const std::string& str) { return std::stold(str); }
+
+// トークン列の数値・定数を T の値にする（code と同じ添字。それ以外のトークンは0）
+template <typename T>
+static void makeLiterals(const std::vector<Token>& code, std::vector<T>& literals) {
+    const auto& functions = symbolFunctions<T>();
+    literals.assign(code.size(), T(0));
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (code[i].type == TokenType::Constant) {
+            literals[i] = functions[code[i].id].constant;
+        } else if (code[i].type == TokenType::Number) {
+            // double は字句解析時に解析済み
+            literals[i] = std::is_same<T, double>::value ? static_cast<T>(code[i].number)
+                                                         : parseNumber<T>(code[i].text);
+        }
+    }
+}
+
+template <typename T>
+static std::vector<T> makeLiterals(const std::vector<Token>& code) {
+    std::vector<T> literals;
+    makeLiterals(code, literals);
+    return literals;
+}
+
+// 評価スタックの値（スカラーまたはリスト）
+constexpr uint32_t NO_LIST = 0xFFFFFFFF;
+
+template <typename T>
+struct StackValue {
+    T scalar;
+    uint32_t list;      // リスト値なら ListPool の添字、スカラーなら NO_LIST
+
+    bool isList() const { return list != NO_LIST; }
+};
+
+//==============================================================================
+// 遅延リスト（seq・linspace）
+//==============================================================================
+
+// 要素を使うときに作るリスト（数列と、それへの要素ごとの演算をまとめたもの）
+// 変数スロット k に数列 sequences[k] を入れた式で、要素は LAZY_BLOCK 個ずつ
+// バッチ評価（列単位の演算・SIMDカーネル）で計算する。全要素を確保しないため、
+// 集約するだけならメモリは要素数によらない。
+struct LazyList {
+    Program program;                    // 要素ごとの式（数値は Token::number を使う）
+    std::vector<Sequence> sequences;    // すべて同じ要素数
+    size_t size = 0;
+
+    bool active() const { return !program.code.empty(); }
+};
+
+constexpr size_t LAZY_BLOCK = 4096;
+
+// 遅延リストの作業領域（数列の列と計算結果）
+struct LazyBuffers {
+    std::vector<std::vector<double>> columns;
+    std::vector<const double*> pointers;
+    std::vector<double> block;
+    BatchBuffers batch;
+};
+
+// 遅延リストの要素 [offset, offset + n) を out に計算する
+static void evaluateLazy(const LazyList& lazy, size_t offset, size_t n, LazyBuffers& buffers, double* out) {
+    buffers.columns.resize(lazy.sequences.size());
+    buffers.pointers.clear();
+    for (size_t k = 0; k < lazy.sequences.size(); ++k) {
+        const Sequence& sequence = lazy.sequences[k];
+        std::vector<double>& column = buffers.columns[k];
+        column.resize(n);
+        for (size_t i = 0; i < n; ++i) column[i] = sequence.first + sequence.step * static_cast<double>(offset + i);
+        if (offset + n == lazy.size) column[n - 1] = sequence.last;
+        buffers.pointers.push_back(column.data());
+    }
+    evaluateColumns(lazy.program, buffers.pointers, n, out, buffers.batch);
+}
+
+// リスト関数に渡す遅延リスト（ブロックを作るたびに同じバッファを使う）
+class LazyListStream : public ListStream {
+public:
+    LazyListStream(const LazyList& lazy, LazyBuffers& buffers) : lazy_(lazy), buffers_(buffers) {}
+
+    size_t size() const override { return lazy_.size; }
+
+    void forEachBlock(const std::function<void(ListView)>& f) const override {
+        buffers_.block.resize(std::min(LAZY_BLOCK, lazy_.size));
+        for (size_t offset = 0; offset < lazy_.size; offset += LAZY_BLOCK) {
+            size_t n = std::min(LAZY_BLOCK, lazy_.size - offset);
+            evaluateLazy(lazy_, offset, n, buffers_, buffers_.block.data());
+            f(ListView(buffers_.block.data(), n));
+        }
+    }
+
+private:
+    const LazyList& lazy_;
+    LazyBuffers& buffers_;
+};
+
+// リスト値の置き場（使い終わったリストのバッファは次のリストに再利用する）
+// 外部のデータを参照するリスト（acquireView）と遅延リスト（acquireLazy、double のみ）は、
+// 要素が必要になったとき（view・materialize）に初めて lists_ に作る。
+template <typename T>
+class ListPool {
+public:
+    uint32_t acquire() {
+        if (!free_.empty()) {
+            uint32_t index = free_.back();
+            free_.pop_back();
+            lists_[index].clear();
+            views_[index] = {};
+            sources_[index] = nullptr;
+            lazies_[index].program.code.clear();
+            lazies_[index].sequences.clear();
+            return index;
+        }
+        lists_.emplace_back();
+        views_.emplace_back();
+        sources_.emplace_back();
+        lazies_.emplace_back();
+        return static_cast<uint32_t>(lists_.size() - 1);
+    }
+
+    // 外部のデータを参照するリスト（コピーしない）
+    uint32_t acquireView(BasicListView<T> view, const ListData* source = nullptr) {
+        uint32_t index = acquire();
+        views_[index] = view;
+        sources_[index] = source;
+        return index;
+    }
+
+    // 登録済みのリストをそのまま参照しているなら、そのデータ（書き換えたあとなどは nullptr）
+    const ListData* source(uint32_t index) const {
+        return views_[index].data() ? sources_[index] : nullptr;
+    }
+
+    // 数列1つの遅延リスト
+    uint32_t acquireLazy(const Sequence& sequence, MathMode mode) {
+        uint32_t index = acquire();
+        LazyList& lazy = lazies_[index];
+        lazy.program.code.push_back(Token{TokenType::Variable, "", 0, 0.0});
+        lazy.program.mathMode = mode;
+        lazy.sequences.push_back(sequence);
+        lazy.size = sequence.count;
+        return index;
+    }
+
+    bool isLazy(uint32_t index) const { return lazies_[index].active(); }
+
+    // 要素数（遅延リストの要素は作らない）
+    size_t size(uint32_t index) const {
+        if (lazies_[index].active()) return lazies_[index].size;
+        return views_[index].data() ? views_[index].size() : lists_[index].size();
+    }
+
+    // 遅延リストの式（要素ごとの演算を後ろに追加する）
+    LazyList& lazy(uint32_t index) { return lazies_[index]; }
+
+    // 遅延リストを要素を作らずに集約するための参照
+    LazyListStream stream(uint32_t index) { return LazyListStream(lazies_[index], lazyBuffers_); }
+
+    // 読み取り用の参照（外部のデータならそれ自体、遅延リストならここで要素を作る）
+    BasicListView<T> view(uint32_t index) {
+        if (lazies_[index].active()) generate(index);
+        return views_[index].data() ? views_[index] : BasicListView<T>(lists_[index]);
+    }
+
+    // 書き換えてよい要素（外部のデータならここで初めてコピーする）
+    std::vector<T>& materialize(uint32_t index) {
+        if (lazies_[index].active()) generate(index);
+        if (views_[index].data()) {
+            lists_[index].assign(views_[index].begin(), views_[index].end());
+            views_[index] = {};
+        }
+        return lists_[index];
+    }
+
+    void release(uint32_t index) { free_.push_back(index); }
+
+    // 全リストを未使用に戻す（バッファは残す）
+    void reset() {
+        free_.clear();
+        for (size_t i = lists_.size(); i > 0; --i) free_.push_back(static_cast<uint32_t>(i - 1));
+    }
+
+    // 結果を書き込むリスト（acquire() したもの）
+    std::vector<T>& operator[](uint32_t index) { return lists_[index]; }
+
+private:
+    // 遅延リストの全要素を作り、通常のリストにする
+    void generate(uint32_t index) {
+        LazyList& lazy = lazies_[index];
+        if constexpr (std::is_same<T, double>::value) {
+            lists_[index].resize(lazy.size);
+            for (size_t offset = 0; offset < lazy.size; offset += LAZY_BLOCK) {
+                evaluateLazy(lazy, offset, std::min(LAZY_BLOCK, lazy.size - offset), lazyBuffers_,
+                             lists_[index].data() + offset);
+            }
+        }
+        lazy.program.code.clear();
+        lazy.sequences.clear();
+    }
+
+    std::vector<std::vector<T>> lists_;
+    std::vector<BasicListView<T>> views_;   // 外部のデータを参照するリスト（それ以外は空）
+    std::vector<const ListData*> sources_;  // views_ が登録済みのリスト全体なら、そのデータ
+    std::vector<LazyList> lazies_;          // 遅延リスト（それ以外は式が空）
+    LazyBuffers lazyBuffers_;
+    std::vector<uint32_t> free_;
+};
+
+// Evaluator のリストのレジスタ（キーは "@name"）
+using ListRegisters = std::unordered_map<std::string, std::shared_ptr<const ListData>>;
+
+// 上限を指定した評価の残りの作業量と取り消し
+struct EvaluationBudget {
+    uint64_t remaining;
+    const CancellationToken* cancel;
+    uint64_t untilCheck = CANCELLATION_CHECK_INTERVAL;     // 次に取り消しを確かめるまでの作業量
+
+    explicit EvaluationBudget(const EvaluationLimits& limits)
+        : remaining(limits.budget > 0 ? limits.budget : std::numeric_limits<uint64_t>::max()),
+          cancel(limits.cancel) {
+        poll();     // 取り消し済みなら、作業量によらず評価を始めない
+    }
+
+    // work の作業を始める前に差し引く
+    void charge(uint64_t work) {
+        if (work > remaining) throw EvaluationAborted(AbortReason::BudgetExceeded);
+        remaining -= work;
+        if (work < untilCheck) {
+            untilCheck -= work;
+            return;
+        }
+        untilCheck = CANCELLATION_CHECK_INTERVAL;
+        poll();
+    }
+
+    // 取り消されていれば打ち切る（差し引き済みの長い演算の途中で呼ぶ）
+    void poll() const {
+        if (cancel && cancel->cancelled()) throw EvaluationAborted(AbortReason::Cancelled);
+    }
+};
+
+// 評価の作業領域（Evaluator が保持して呼び出しをまたいで再利用する）
+template <typename T>
+struct EvalBuffers {
+    std::vector<StackValue<T>> stack;
+    std::vector<size_t> markers;    // リスト開始時のスタックの深さ
+    std::vector<T> values;          // リスト関数に渡す要素
+    std::vector<T> broadcast;       // スカラーを要素数分に広げたもの
+    ListPool<T> pool;
+    std::vector<std::shared_ptr<const ListData>> sources;   // 評価中に参照する @name のデータ
+    const ListRegisters* registers = nullptr;               // 登録表より先に引くレジスタ（Evaluator）
+    EvaluationBudget* budget = nullptr;                     // 上限を指定した評価のみ
+};
+
+// 上限を指定した評価なら、リスト値の演算の作業量（要素数）を差し引く
+template <typename T>
+static inline void chargeElements(EvalBuffers<T>& buffers, size_t n) {
+    if (buffers.budget) buffers.budget->charge(n);
+}
+
+// 要素 [0, n) の演算を f(offset, count) で行う。上限を指定した評価では
+// CANCELLATION_CHECK_INTERVAL 個ずつに分け、その間で取り消しを確かめる
+template <typename T, typename F>
+static inline void forEachChunk(const EvalBuffers<T>& buffers, size_t n, F&& f) {
+    if (!buffers.budget || n <= CANCELLATION_CHECK_INTERVAL) {
+        f(size_t(0), n);
+        return;
+    }
+    for (size_t offset = 0; offset < n; offset += CANCELLATION_CHECK_INTERVAL) {
+        buffers.budget->poll();
+        f(offset, std::min<size_t>(CANCELLATION_CHECK_INTERVAL, n - offset));
+    }
+}
+
+// 集約の途中で取り消しを確かめるためのリスト（ブロックを渡す前に確かめる。budget が nullptr なら確かめない）
+// stream があればそのブロック、なければ view を CANCELLATION_CHECK_INTERVAL 個ずつに分ける
+template <typename T>
+class PolledListStream : public BasicListStream<T> {
+public:
+    PolledListStream(const BasicListStream<T>* stream, BasicListView<T> view, const EvaluationBudget* budget)
+        : stream_(stream), view_(view), budget_(budget) {}
+
+    size_t size() const override { return stream_ ? stream_->size() : view_.size(); }
+
+    void forEachBlock(const std::function<void(BasicListView<T>)>& f) const override {
+        if (stream_) {
+            stream_->forEachBlock([&](BasicListView<T> block) {
+                if (budget_) budget_->poll();
+                f(block);
+            });
+            return;
+        }
+        for (size_t offset = 0; offset < view_.size(); offset += CANCELLATION_CHECK_INTERVAL) {
+            if (budget_) budget_->poll();
+            f(BasicListView<T>(view_.data() + offset,
+                               std::min<size_t>(CANCELLATION_CHECK_INTERVAL, view_.size() - offset)));
+        }
+    }
+
+private:
+    const BasicListStream<T>* stream_;
+    BasicListView<T> view_;
+    const EvaluationBudget* budget_;
+};
+
+// リストの要素ごとに単項関数を適用（double は列単位の演算・SIMDカーネルを使う）
+template <typename T>
+static void unaryElements(const Token& token, MathMode mode, const T* x, T* out, size_t n) {
+    if constexpr (std::is_same<T, double>::value) {
+        applyUnaryColumn(token, mode, x, out, n);
+    } else {
+        const auto& func = *symbolFunctions<T>()[token.id].unary;
+        for (size_t i = 0; i < n; ++i) out[i] = func(x[i]);
+    }
+}
+
+// リストの要素ごとに演算子・二項関数を適用
+template <typename T>
+static void binaryElements(const Token& token, MathMode mode, const T* a, const T* b, T* out, size_t n) {
+    if constexpr (std::is_same<T, double>::value) {
+        applyBinaryColumn(token, mode, a, b, out, n);
+    } else {
+        const auto& func = *symbolFunctions<T>()[token.id].binary;
+        for (size_t i = 0; i < n; ++i) out[i] = func(a[i], b[i]);
+    }
+}
+
+// スタックの start 以降の値を out にまとめて取り除く（リスト値は展開する）
+template <typename T>
+static void gatherValues(EvalBuffers<T>& buffers, size_t start, std::vector<T>& out) {
+    auto& s = buffers.stack;
+    out.clear();
+    if (buffers.budget) {
+        size_t n = 0;
+        for (size_t k = start; k < s.size(); ++k) n += s[k].isList() ? buffers.pool.size(s[k].list) : 1;
+        buffers.budget->charge(n);
+    }
+    for (size_t k = start; k < s.size(); ++k) {
+        if (s[k].isList()) {
+            BasicListView<T> list = buffers.pool.view(s[k].list);
+            out.insert(out.end(), list.begin(), list.end());
+            buffers.pool.release(s[k].list);
+        } else {
+            out.push_back(s[k].scalar);
+        }
+    }
+    s.resize(start);
+}
+
+// 開いているリストの開始位置（なければスタックの底）
+template <typename T>
+static size_t openListStart(EvalBuffers<T>& buffers) {
+    size_t start = 0;
+    if (!buffers.markers.empty()) {
+        start = std::min(buffers.markers.back(), buffers.stack.size());
+        buffers.markers.pop_back();
+    }
+    return start;
+}
+
+// 評価を始める前に作業領域を空にする
+template <typename T>
+static void beginEvaluation(EvalBuffers<T>& buffers) {
+    buffers.stack.clear();
+    buffers.markers.clear();
+    buffers.pool.reset();
+    buffers.sources.clear();
+}
+
+// 評価の結果（スタックの一番上）
+template <typename T>
+static StackValue<T> evaluationResult(const EvalBuffers<T>& buffers) {
+    if (buffers.stack.empty()) {
+        throw std::runtime_error("librpn: empty expression");
+    }
+    return buffers.stack.back();
+}
+
+// 数列を作る関数（seq・linspace）の結果を積む（引数はスタックの上の arity 個の数値）
+// double では遅延リストにし、要素は使うときに作る
+template <typename T>
+static void pushSequence(const Token& token, size_t arity, MathMode mode, EvalBuffers<T>& buffers) {
+    auto& s = buffers.stack;
+    requireOperands(s, arity, token);
+    T args[3];
+    for (size_t i = 0; i < arity; ++i) {
+        const StackValue<T>& v = s[s.size() - arity + i];
+        if (v.isList()) {
+            throw std::invalid_argument("librpn: '" + token.value() + "' requires numbers");
+        }
+        args[i] = v.scalar;
+    }
+    BasicSequence<T> sequence = (*symbolFunctions<T>()[token.id].sequence)(args);
+    s.resize(s.size() - arity);
+    uint32_t list;
+    if constexpr (std::is_same<T, double>::value) {
+        list = sequence.count > 0 ? buffers.pool.acquireLazy(sequence, mode) : buffers.pool.acquire();
+    } else {
+        list = buffers.pool.acquire();
+        buffers.pool[list].resize(sequence.count);
+        for (size_t i = 0; i < sequence.count; ++i) buffers.pool[list][i] = sequence[i];
+    }
+    s.push_back({T(0), list});
+}
+
+// 遅延リストとスカラー・遅延リストどうしの演算を、遅延リストの式に追加する（結果は a）
+// 通常のリストとの演算なら false（遅延リストの要素を作って通常どおり計算する）
+static bool fuseBinary(const Token& token, StackValue<double>& a, const StackValue<double>& b,
+                       ListPool<double>& pool) {
+    bool lazyA = a.isList() && pool.isLazy(a.list);
+    bool lazyB = b.isList() && pool.isLazy(b.list);
+    if ((a.isList() && !lazyA) || (b.isList() && !lazyB)) return false;
+    auto number = [](double value) { return Token{TokenType::Number, "", NO_SYMBOL, value}; };
+    if (lazyA && lazyB) {
+        LazyList& x = pool.lazy(a.list);
+        const LazyList& y = pool.lazy(b.list);
+        if (x.size != y.size) {
+            throw std::invalid_argument("librpn: list length mismatch at '" + token.value() + "'");
+        }
+        // y の変数スロットを x の数列の後ろに付け替える
+        SymbolId shift = static_cast<SymbolId>(x.sequences.size());
+        for (Token t : y.program.code) {
+            if (t.type == TokenType::Variable) t.id += shift;
+            x.program.code.push_back(std::move(t));
+        }
+        x.sequences.insert(x.sequences.end(), y.sequences.begin(), y.sequences.end());
+        x.program.code.push_back(token);
+        pool.release(b.list);
+    } else if (lazyA) {
+        LazyList& x = pool.lazy(a.list);
+        x.program.code.push_back(number(b.scalar));
+        x.program.code.push_back(token);
+    } else {
+        LazyList& y = pool.lazy(b.list);
+        y.program.code.insert(y.program.code.begin(), number(a.scalar));
+        y.program.code.push_back(token);
+        a = {0.0, b.list};
+    }
+    return true;
+}
+
+// 上限を指定した評価での集約（sum・mean などは途中で取り消しを確かめる）
+template <typename T>
+static T reducePolled(const Token& token, const BasicListStream<T>* stream, BasicListView<T> view,
+                      const EvaluationBudget& budget) {
+    const auto& functions = symbolFunctions<T>()[token.id];
+    if (functions.stream) return (*functions.stream)(PolledListStream<T>(stream, view, &budget));
+    budget.poll();
+    return (*functions.list)(view);
+}
+
+template <typename T>
+static T reduceWithBudget(const Token& token, uint32_t list, EvalBuffers<T>& buffers) {
+    const auto& functions = symbolFunctions<T>()[token.id];
+    auto& pool = buffers.pool;
+    buffers.budget->charge(pool.size(list));
+    if constexpr (std::is_same<T, double>::value) {
+        if (functions.cached && pool.source(list)) return (*functions.cached)(*pool.source(list));
+        if (functions.stream && pool.isLazy(list)) {
+            LazyListStream lazy = pool.stream(list);
+            return reducePolled<T>(token, &lazy, {}, *buffers.budget);
+        }
+    }
+    return reducePolled<T>(token, nullptr, pool.view(list), *buffers.budget);
+}
+
+// 要素を読むだけのパラメータ付きリスト関数（approxpercentile）を適用する
+// 遅延リストはブロックごとに作り、外部のデータ（@name など）は複製せずにブロックに分けて渡す
+template <typename T>
+static void queryStream(const Token& token, uint32_t list, const std::vector<T>& params,
+                        std::vector<T>& out, EvalBuffers<T>& buffers) {
+    const auto& query = *symbolFunctions<T>()[token.id].streamQuery;
+    auto& pool = buffers.pool;
+    if constexpr (std::is_same<T, double>::value) {
+        if (pool.isLazy(list)) {
+            LazyListStream lazy = pool.stream(list);
+            query(PolledListStream<T>(&lazy, {}, buffers.budget), params, out);
+            return;
+        }
+    }
+    query(PolledListStream<T>(nullptr, pool.view(list), buffers.budget), params, out);
+}
+
+// RPNのトークンを1つ評価する（literal は数値・定数の値）
+//   { ... } はリスト値になり、演算子・関数はリストに要素ごとに適用される
+//   （リストとスカラーの演算はスカラーを全要素に適用）。リスト関数はリスト値を集約する。
+template <typename T>
+__attribute__((always_inline)) static inline void
+evaluateToken(const Token& token, T literal, const T* variables, size_t variableCount,
+              MathMode mode, EvalBuffers<T>& buffers) {
+    const auto& functions = symbolFunctions<T>();
+    auto& s = buffers.stack;
+    auto& markers = buffers.markers;
+    auto& values = buffers.values;
+    auto& broadcast = buffers.broadcast;
+    auto& pool = buffers.pool;
+
+    switch (token.type) {
+        // 数値・定数（解析済みの値を積む）
+        case TokenType::Number:
+        case TokenType::Constant:
+            s.push_back({literal, NO_LIST});
+            break;
+
+        // 変数（スロット番号で値を引く）
+        case TokenType::Variable:
+            if (token.id >= variableCount) {
+                throw std::out_of_range("librpn: no value for variable '" + token.text + "'");
+            }
+            s.push_back({variables[token.id], NO_LIST});
+            break;
+
+        // 登録済みのリスト（@name）- データを参照するリスト値を積む
+        case TokenType::ListSource: {
+            // Evaluator のレジスタを先に引く
+            std::shared_ptr<const ListData> data;
+            if (buffers.registers) {
+                auto it = buffers.registers->find(token.text);
+                if (it != buffers.registers->end()) data = it->second;
+            }
+            buffers.sources.push_back(data ? std::move(data) : resolveListSource(token.text));
+            const ListData* source = buffers.sources.back().get();
+            ListView view = source->view;
+            if constexpr (std::is_same<T, double>::value) {
+                s.push_back({T(0), pool.acquireView(view, source)});
+            } else {
+                uint32_t list = pool.acquire();
+                pool[list].assign(view.begin(), view.end());
+                s.push_back({T(0), list});
+            }
+            break;
+        }
+
+        // リスト開始（HP方式）- 深さを記録する
+        case TokenType::ListStart:
+            markers.push_back(s.size());
+            break;
+
+        // リスト終了（HP方式）- 開始以降の値をリスト値にまとめる
+        case TokenType::ListEnd: {
+            size_t start = openListStart(buffers);
+            // { @name } のように中身がリスト1つならそのまま使う（コピーしない）
+            if (start + 1 == s.size() && s.back().isList()) break;
+            uint32_t list = pool.acquire();
+            gatherValues(buffers, start, pool[list]);
+            s.push_back({T(0), list});
+            break;
+        }
+
+        // 演算子・二項関数
+        case TokenType::Operator:
+        case TokenType::BinaryFunction: {
+            if (functions[token.id].sequence) {
+                pushSequence(token, 2, mode, buffers);
+                break;
+            }
+            requireOperands(s, 2, token);
+            StackValue<T> b = s.back(); s.pop_back();
+            StackValue<T>& a = s.back();
+            if (!a.isList() && !b.isList()) {
+                a.scalar = (*functions[token.id].binary)(a.scalar, b.scalar);
+                break;
+            }
+            chargeElements(buffers, pool.size(a.isList() ? a.list : b.list));
+            if constexpr (std::is_same<T, double>::value) {
+                if (fuseBinary(token, a, b, pool)) break;
+            }
+            size_t n = a.isList() ? pool.view(a.list).size() : pool.view(b.list).size();
+            if (a.isList() && b.isList() && pool.view(b.list).size() != n) {
+                throw std::invalid_argument("librpn: list length mismatch at '" + token.value() + "'");
+            }
+            uint32_t result = pool.acquire();
+            pool[result].resize(n);
+            if (!a.isList() || !b.isList()) broadcast.assign(n, a.isList() ? b.scalar : a.scalar);
+            const T* x = a.isList() ? pool.view(a.list).data() : broadcast.data();
+            const T* y = b.isList() ? pool.view(b.list).data() : broadcast.data();
+            T* out = pool[result].data();
+            forEachChunk(buffers, n, [&](size_t offset, size_t count) {
+                binaryElements(token, mode, x + offset, y + offset, out + offset, count);
+            });
+            if (a.isList()) pool.release(a.list);
+            if (b.isList()) pool.release(b.list);
+            a = {T(0), result};
+            break;
+        }
+
+        // 3引数の関数（if）
+        case TokenType::TernaryFunction: {
+            if (functions[token.id].sequence) {
+                pushSequence(token, 3, mode, buffers);
+                break;
+            }
+            requireOperands(s, 3, token);
+            StackValue<T> b = s.back(); s.pop_back();
+            StackValue<T> a = s.back(); s.pop_back();
+            StackValue<T>& c = s.back();
+            const auto& func = *functions[token.id].ternary;
+            if (!c.isList() && !a.isList() && !b.isList()) {
+                c.scalar = func(c.scalar, a.scalar, b.scalar);
+                break;
+            }
+            // 要素ごとに選ぶ（スカラーは全要素に使う）
+            const StackValue<T>* args[3] = {&c, &a, &b};
+            size_t n = 0;
+            bool sized = false;
+            for (const StackValue<T>* v : args) {
+                if (!v->isList()) continue;
+                if (sized && pool.view(v->list).size() != n) {
+                    throw std::invalid_argument("librpn: list length mismatch at '" + token.value() + "'");
+                }
+                n = pool.view(v->list).size();
+                sized = true;
+            }
+            chargeElements(buffers, n);
+            auto at = [&](const StackValue<T>& v, size_t i) { return v.isList() ? pool.view(v.list)[i] : v.scalar; };
+            uint32_t result = pool.acquire();
+            pool[result].resize(n);
+            forEachChunk(buffers, n, [&](size_t offset, size_t count) {
+                for (size_t i = offset; i < offset + count; ++i) pool[result][i] = func(at(c, i), at(a, i), at(b, i));
+            });
+            for (const StackValue<T>* v : args) {
+                if (v->isList()) pool.release(v->list);
+            }
+            c = {T(0), result};
+            break;
+        }
+
+        // 単項関数
+        case TokenType::UnaryFunction: {
+            requireOperands(s, 1, token);
+            StackValue<T>& a = s.back();
+            if (!a.isList()) {
+                a.scalar = (*functions[token.id].unary)(a.scalar);
+                break;
+            }
+            chargeElements(buffers, pool.size(a.list));
+            if constexpr (std::is_same<T, double>::value) {
+                if (pool.isLazy(a.list)) {
+                    pool.lazy(a.list).program.code.push_back(token);
+                    break;
+                }
+            }
+            uint32_t result = pool.acquire();
+            BasicListView<T> x = pool.view(a.list);
+            pool[result].resize(x.size());
+            T* out = pool[result].data();
+            forEachChunk(buffers, x.size(), [&](size_t offset, size_t count) {
+                unaryElements(token, mode, x.data() + offset, out + offset, count);
+            });
+            pool.release(a.list);
+            a.list = result;
+            break;
         }
 
         // リスト関数（統計関数など）
-        auto listFuncIt = LIST_FUNCTIONS.find(token);
-        if (listFuncIt != LIST_FUNCTIONS.end()) {
-            // リストマーカーまでの要素を収集
-            std::vector<double> values;
-            while (!s.empty() && !isListMarker(s.top())) {
-                values.push_back(s.top());
-                s.pop();
-            }
-            if (!s.empty()) {
-                s.pop(); // リストマーカーを削除
-            }
-            // 順序を反転（スタックから取り出したため逆順になっている）
-            std::reverse(values.begin(), values.end());
-            // リスト関数を適用
-            s.push(listFuncIt->second.func(values));
-            continue;
+        case TokenType::ListFunction: {
+            // パラメータ付きリスト関数（{ リスト } パラメータ percentile）
+            if (functions[token.id].query) {
+                requireOperands(s, 2, token);
+                StackValue<T> param = s.back(); s.pop_back();
+                StackValue<T>& list = s.back();
+                if (!list.isList()) {
+                    throw std::invalid_argument("librpn: '" + token.value() + "' requires a list");
+                }
+                if (param.isList() && SYMBOLS[token.id].listResult) {
+                    throw std::invalid_argument("librpn: '" + token.value() + "' requires a number");
+                }
+                chargeElements(buffers, pool.size(list.list) + (param.isList() ? pool.size(param.list) : 1));
+                if (!param.isList()) broadcast.assign(1, param.scalar);
+                uint32_t result = pool.acquire();
+                const std::vector<T>& params = param.isList() ? pool.materialize(param.list) : broadcast;
+                const ListData* source = pool.source(list.list);
+                if (functions[token.id].cachedQuery && source) {
+                    (*functions[token.id].cachedQuery)(*source, params, pool[result]);
+                } else if (functions[token.id].streamQuery) {
+                    queryStream(token, list.list, params, pool[result], buffers);
+                } else {
+                    (*functions[token.id].query)(pool.materialize(list.list), params, pool[result]);
+                }
+                pool.release(list.list);
+                if (param.isList()) pool.release(param.list);
+                if (param.isList() || SYMBOLS[token.id].listResult) {
+                    list.list = result;
+                } else {
+                    // スカラーのパラメータには結果もスカラー
+                    list = {pool[result][0], NO_LIST};
+                    pool.release(result);
+                }
+                break;
+            }
+
+            // 複数の結果を返すリスト関数（{ リスト } stats）- 結果はリスト
+            if (functions[token.id].summary) {
+                uint32_t result = pool.acquire();
+                if (!s.empty() && s.back().isList()) {
+                    uint32_t list = s.back().list;
+                    chargeElements(buffers, pool.size(list));
+                    (*functions[token.id].summary)(pool.view(list), pool[result]);
+                    pool.release(list);
+                    s.back() = {T(0), result};
+                } else {
+                    gatherValues(buffers, openListStart(buffers), values);
+                    chargeElements(buffers, values.size());
+                    (*functions[token.id].summary)(values, pool[result]);
+                    s.push_back({T(0), result});
+                }
+                break;
+            }
+
+            const auto& func = *functions[token.id].list;
+            if (!s.empty() && s.back().isList()) {
+                // リスト値を集約
+                uint32_t list = s.back().list;
+                T result;
+                if (buffers.budget) {
+                    result = reduceWithBudget(token, list, buffers);
+                } else if constexpr (std::is_same<T, double>::value) {
+                    // 登録済みのリストは保持している累積和・並べ替えた複製を使い、
+                    // 遅延リストは要素をブロックごとに作りながら集約する
+                    if (functions[token.id].cached && pool.source(list)) {
+                        result = (*functions[token.id].cached)(*pool.source(list));
+                    } else if (functions[token.id].stream && pool.isLazy(list)) {
+                        result = (*functions[token.id].stream)(pool.stream(list));
+                    } else {
+                        result = func(pool.view(list));
+                    }
+                } else {
+                    result = func(pool.view(list));
+                }
+                s.back() = {result, NO_LIST};
+                pool.release(list);
+            } else {
+                // 閉じていないリスト（{ 1 2 3 mean）、なければスタック全体を集約
+                gatherValues(buffers, openListStart(buffers), values);
+                if (buffers.budget) {
+                    chargeElements(buffers, values.size());
+                    s.push_back({reducePolled<T>(token, nullptr, values, *buffers.budget), NO_LIST});
+                } else {
+                    s.push_back({func(values), NO_LIST});
+                }
+            }
+            break;
         }
 
-        // 定数
-        auto constIt = CONSTANTS.find(token);
-        if (constIt != CONSTANTS.end()) {
-            s.push(constIt->second);
-            continue;
+        default:
+            break;
+    }
+}
+
+// RPN順のトークン列を評価する（calculateRPN と evaluate の共通部分）
+template <typename T>
+static StackValue<T> evaluateValues(const std::vector<Token>& code, const T* literals,
+                                    const T* variables, size_t variableCount,
+                                    MathMode mode, EvalBuffers<T>& buffers) {
+    beginEvaluation(buffers);
+    buffers.stack.reserve(code.size());
+    if (buffers.budget) {
+        // トークンごとに作業量1を差し引く（上限を指定しない評価のループは分けておく）
+        for (size_t pc = 0; pc < code.size(); ++pc) {
+            buffers.budget->charge(1);
+            evaluateToken(code[pc], literals[pc], variables, variableCount, mode, buffers);
         }
+        return evaluationResult(buffers);
+    }
+    for (size_t pc = 0; pc < code.size(); ++pc) {
+        evaluateToken(code[pc], literals[pc], variables, variableCount, mode, buffers);
+    }
+    return evaluationResult(buffers);
+}
 
-        // 数字
-        s.push(std::stod(token));
+// 結果がスカラーになるトークン列を評価する
+template <typename T>
+static T evaluateTokens(const std::vector<Token>& code, const T* literals,
+                        const T* variables, size_t variableCount, MathMode mode,
+                        EvalBuffers<T>& buffers) {
+    StackValue<T> result = evaluateValues<T>(code, literals, variables, variableCount, mode, buffers);
+    if (result.isList()) {
+        throw std::runtime_error("librpn: result is a list (use calculateRPNList / evaluateList)");
     }
+    return result.scalar;
+}
+
+template <typename T>
+static T evaluateTokens(const std::vector<Token>& code, const T* literals,
+                        const T* variables, size_t variableCount, MathMode mode) {
+    EvalBuffers<T> buffers;
+    return evaluateTokens<T>(code, literals, variables, variableCount, mode, buffers);
+}
+
+// トークン列を評価し、結果をリストとして返す（スカラーなら要素1個）
+template <typename T>
+static std::vector<T> evaluateTokensToList(const std::vector<Token>& code, const T* literals,
+                                           const T* variables, size_t variableCount, MathMode mode) {
+    EvalBuffers<T> buffers;
+    StackValue<T> result = evaluateValues<T>(code, literals, variables, variableCount, mode, buffers);
+    if (!result.isList()) return {result.scalar};
+    return std::move(buffers.pool.materialize(result.list));
+}
+
+// RPN式をトークン列にする
+static void rpnCode(const std::string& expression, std::vector<Token>& code, ParseBuffers& buffers) {
+    code.clear();
+    forEachRPNWord(expression, buffers, [&](const std::string& word) {
+        code.push_back(rpnToken(word));
+    });
+}
 
-    return s.top();
+static std::vector<Token> rpnCode(const std::string& expression) {
+    ParseBuffers buffers;
+    std::vector<Token> code;
+    rpnCode(expression, code, buffers);
+    return code;
+}
+
+template <typename T>
+T calculateRPNAs(const std::string& expression) {
+    std::vector<Token> code = rpnCode(expression);
+    std::vector<T> literals = makeLiterals<T>(code);
+    return evaluateTokens<T>(code, literals.data(), nullptr, 0, MathMode::Strict);
+}
+
+double calculateRPN(const std::string& expression) {
+    LIBRPN_PROFILE_CALL(CalculateRPN);
+    return calculateRPNAs<double>(expression);
+}
+
+double calculateRPN(const std::vector<Token>& code) {
+    LIBRPN_PROFILE_CALL(CalculateRPN);
+    std::vector<double> literals = makeLiterals<double>(code);
+    return evaluateTokens<double>(code, literals.data(), nullptr, 0, MathMode::Strict);
+}
+
+std::vector<double> calculateRPNList(const std::string& expression) {
+    std::vector<Token> code = rpnCode(expression);
+    std::vector<double> literals = makeLiterals<double>(code);
+    return evaluateTokensToList<double>(code, literals.data(), nullptr, 0, MathMode::Strict);
+}
+
+bool usesListArithmetic(const std::vector<Token>& code) {
+    // スタックの各段がリスト値かどうかだけを追跡する
+    std::vector<bool> s;
+    std::vector<size_t> markers;
+    auto openListStart = [&]() {
+        size_t start = 0;
+        if (!markers.empty()) {
+            start = std::min(markers.back(), s.size());
+            markers.pop_back();
+        }
+        return start;
+    };
+    for (const Token& token : code) {
+        switch (token.type) {
+            case TokenType::Number:
+            case TokenType::Constant:
+            case TokenType::Variable:
+                s.push_back(false);
+                break;
+            case TokenType::ListSource:
+                return true;    // 外部のデータはバッチ評価・自動微分では扱わない
+            case TokenType::ListStart:
+                markers.push_back(s.size());
+                break;
+            case TokenType::ListEnd:
+                s.resize(openListStart());
+                s.push_back(true);
+                break;
+            case TokenType::Operator:
+            case TokenType::BinaryFunction:
+                if (SYMBOLS[token.id].listResult) return true;      // seq
+                if (s.size() < 2) return false;     // スタック不足は評価時に検出する
+                if (s[s.size() - 1] || s[s.size() - 2]) return true;
+                s.pop_back();
+                break;
+            case TokenType::UnaryFunction:
+                if (s.empty()) return false;
+                if (s.back()) return true;
+                break;
+            case TokenType::TernaryFunction:
+                if (SYMBOLS[token.id].listResult) return true;      // linspace
+                if (s.size() < 3) return false;
+                if (s[s.size() - 1] || s[s.size() - 2] || s[s.size() - 3]) return true;
+                s.resize(s.size() - 2);
+                break;
+            case TokenType::ListFunction:
+                if (SYMBOLS[token.id].arity == 2) {
+                    // 結果がリストになるパラメータ付きリスト関数（窓関数・複数のパーセンタイル）
+                    if (s.size() < 2) return false;
+                    if (s.back() || SYMBOLS[token.id].listResult) return true;
+                    s.pop_back();
+                    s.back() = false;
+                } else if (SYMBOLS[token.id].listResult) {
+                    return true;    // stats
+                } else if (!s.empty() && s.back()) {
+                    s.back() = false;
+                } else {
+                    s.resize(openListStart());
+                    s.push_back(false);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return !s.empty() && s.back();
 }
 
 //==============================================================================
-// RPN → 中置記法変換
+// コンパイル・評価
 //==============================================================================
 
-std::string rpnToInfix(const std::string& expression) {
-    std::stack<std::string> s;
+// RPN順のトークン列からプログラムを作る（変数にスロット番号を割り当てる）
+template <typename T>
+static BasicProgram<T> programFromCode(std::vector<Token> code) {
+    BasicProgram<T> program;
+    program.code = std::move(code);
+
+    std::unordered_map<std::string, SymbolId> slots;
+    for (Token& t : program.code) {
+        if (t.type == TokenType::Variable) {
+            // 同じ名前には同じスロットを割り当てる
+            auto it = slots.find(t.text);
+            if (it == slots.end()) {
+                if (program.variables.size() >= NO_SYMBOL) {
+                    throw std::length_error("librpn: too many variables");
+                }
+                it = slots.emplace(t.text, static_cast<SymbolId>(program.variables.size())).first;
+                program.variables.push_back(t.text);
+            }
+            t.id = it->second;
+        }
+    }
+    program.literals = makeLiterals<T>(program.code);
+    return program;
+}
 
-    // UTF-8対応のトークン分割（空白区切り）
-    std::vector<std::string> tokens;
-    std::string current;
-    size_t i = 0;
-    while (i < expression.length()) {
-        std::string ch = utf8ExtractChar(expression, i);
-        if (isAsciiSpace(ch)) {
-            if (!current.empty()) {
-                tokens.push_back(current);
-                current.clear();
+template <typename T>
+BasicProgram<T> compileAs(const std::string& expression) {
+    std::vector<Token> code;
+    infixToRPN(expression, code);
+    return programFromCode<T>(std::move(code));
+}
+
+template <typename T>
+T evaluateAs(const BasicProgram<T>& program, const std::vector<T>& variables) {
+    return evaluateTokens<T>(program.code, program.literals.data(), variables.data(), variables.size(),
+                             program.mathMode);
+}
+
+Program compile(const std::string& expression) {
+    return compileAs<double>(expression);
+}
+
+Program compile(std::vector<Token> code) {
+    return programFromCode<double>(std::move(code));
+}
+
+Program compileRPN(const std::string& expression) {
+    Program program;
+    program.code = rpnCode(expression);
+    program.literals = makeLiterals<double>(program.code);
+    return program;
+}
+
+double evaluate(const Program& program, const std::vector<double>& variables) {
+    return evaluateAs<double>(program, variables);
+}
+
+double evaluate(const Program& program, const std::vector<double>& variables,
+                const std::vector<double>& literals) {
+    if (literals.size() != program.code.size()) {
+        throw std::invalid_argument("librpn: literals must have one value per token");
+    }
+    return evaluateTokens<double>(program.code, literals.data(), variables.data(), variables.size(),
+                                  program.mathMode);
+}
+
+std::vector<double> evaluateList(const Program& program, const std::vector<double>& variables) {
+    return evaluateTokensToList<double>(program.code, program.literals.data(), variables.data(),
+                                        variables.size(), program.mathMode);
+}
+
+//==============================================================================
+// 評価の予算と取り消し
+//==============================================================================
+
+static const char* abortMessage(AbortReason reason) {
+    switch (reason) {
+        case AbortReason::BudgetExceeded: return "librpn: evaluation budget exceeded";
+        case AbortReason::Cancelled: return "librpn: evaluation cancelled";
+    }
+    return "librpn: evaluation aborted";
+}
+
+EvaluationAborted::EvaluationAborted(AbortReason reason)
+    : std::runtime_error(abortMessage(reason)), reason_(reason) {}
+
+double evaluate(const Program& program, const std::vector<double>& variables, const EvaluationLimits& limits) {
+    EvaluationBudget budget(limits);
+    EvalBuffers<double> buffers;
+    buffers.budget = &budget;
+    return evaluateTokens<double>(program.code, program.literals.data(), variables.data(), variables.size(),
+                                  program.mathMode, buffers);
+}
+
+std::vector<double> evaluateList(const Program& program, const std::vector<double>& variables,
+                                 const EvaluationLimits& limits) {
+    EvaluationBudget budget(limits);
+    EvalBuffers<double> buffers;
+    buffers.budget = &budget;
+    StackValue<double> result = evaluateValues<double>(program.code, program.literals.data(), variables.data(),
+                                                       variables.size(), program.mathMode, buffers);
+    if (!result.isList()) return {result.scalar};
+    chargeElements(buffers, buffers.pool.size(result.list));   // 遅延リストはここで要素を作る
+    return std::move(buffers.pool.materialize(result.list));
+}
+
+double calculateRPN(const std::string& expression, const EvaluationLimits& limits) {
+    LIBRPN_PROFILE_CALL(CalculateRPN);
+    return evaluate(compileRPN(expression), {}, limits);
+}
+
+std::vector<double> calculateRPNList(const std::string& expression, const EvaluationLimits& limits) {
+    return evaluateList(compileRPN(expression), {}, limits);
+}
+
+// 明示的インスタンス化
+template float calculateRPNAs<float>(const std::string&);
+template double calculateRPNAs<double>(const std::string&);
+template long double calculateRPNAs<long double>(const std::string&);
+template BasicProgram<float> compileAs<float>(const std::string&);
+template BasicProgram<double> compileAs<double>(const std::string&);
+template BasicProgram<long double> compileAs<long double>(const std::string&);
+template float evaluateAs<float>(const BasicProgram<float>&, const std::vector<float>&);
+template double evaluateAs<double>(const BasicProgram<double>&, const std::vector<double>&);
+template long double evaluateAs<long double>(const BasicProgram<long double>&, const std::vector<long double>&);
+
+//==============================================================================
+// バッチ評価（列単位）
+//==============================================================================
+
+// 1回に処理する行数（スタックの列がL1キャッシュに収まる程度）
+static constexpr size_t BATCH_BLOCK = 256;
+
+// スタックに必要な数の列があるか確認
+static inline void requireColumns(size_t depth, size_t count, const Token& token) {
+    if (depth < count) {
+        throw std::runtime_error("librpn: stack underflow at '" + token.value() + "'");
+    }
+}
+
+// リスト値を扱わない式を列単位で評価する（作業領域は buffers を再利用する）
+static void evaluateColumns(const Program& program, const std::vector<const double*>& columns,
+                            size_t rows, double* out, BatchBuffers& buffers) {
+    auto& stack = buffers.stack;
+    auto& scratch = buffers.scratch;
+    auto& markers = buffers.markers;
+    auto& values = buffers.values;
+    auto& params = buffers.params;
+    auto& results = buffers.results;
+    scratch.resize(BATCH_BLOCK);
+
+    for (size_t offset = 0; offset < rows; offset += BATCH_BLOCK) {
+        size_t n = std::min(BATCH_BLOCK, rows - offset);
+        size_t depth = 0;
+        markers.clear();
+
+        // 新しい段を確保して返す
+        auto push = [&]() -> double* {
+            if (depth == stack.size()) stack.emplace_back(BATCH_BLOCK);
+            return stack[depth++].data();
+        };
+
+        for (const Token& token : program.code) {
+            switch (token.type) {
+                // 数値・定数
+                case TokenType::Number:
+                case TokenType::Constant:
+                    std::fill_n(push(), n, token.number);
+                    break;
+
+                // 変数（スロット番号の列から値を取る）
+                case TokenType::Variable:
+                    if (token.id >= columns.size()) {
+                        throw std::out_of_range("librpn: no value for variable '" + token.text + "'");
+                    }
+                    std::copy_n(columns[token.id] + offset, n, push());
+                    break;
+
+                // リスト開始（HP方式）- 深さを記録する
+                case TokenType::ListStart:
+                    markers.push_back(depth);
+                    break;
+
+                // 演算子・二項関数
+                case TokenType::Operator:
+                case TokenType::BinaryFunction:
+                    requireColumns(depth, 2, token);
+                    applyBinaryColumn(token, program.mathMode, stack[depth - 2].data(),
+                                      stack[depth - 1].data(), scratch.data(), n);
+                    std::swap(stack[depth - 2], scratch);
+                    --depth;
+                    break;
+
+                // 3引数の関数（if）- 条件の列で2つの列から選ぶ（分岐なし）
+                case TokenType::TernaryFunction:
+                    requireColumns(depth, 3, token);
+                    simd::select(stack[depth - 3].data(), stack[depth - 2].data(), stack[depth - 1].data(),
+                                 scratch.data(), n);
+                    std::swap(stack[depth - 3], scratch);
+                    depth -= 2;
+                    break;
+
+                // 単項関数
+                case TokenType::UnaryFunction:
+                    requireColumns(depth, 1, token);
+                    applyUnaryColumn(token, program.mathMode, stack[depth - 1].data(), scratch.data(), n);
+                    std::swap(stack[depth - 1], scratch);
+                    break;
+
+                // リスト関数（行ごとにリストを組み立てて適用）
+                case TokenType::ListFunction: {
+                    size_t start = 0;
+                    while (!markers.empty()) {
+                        start = markers.back();
+                        markers.pop_back();
+                        if (start <= depth) break;
+                        start = 0;
+                    }
+                    const auto& functions = SYMBOL_FUNCTIONS[token.id];
+                    if (functions.query) {
+                        // パラメータ付き（{ リスト } パラメータ percentile）- 最後の列がパラメータ
+                        requireColumns(depth - start, 2, token);
+                        const double* param = stack[depth - 1].data();
+                        values.resize(depth - 1 - start);
+                        params.resize(1);
+                        for (size_t r = 0; r < n; ++r) {
+                            for (size_t k = start; k + 1 < depth; ++k) values[k - start] = stack[k][r];
+                            params[0] = param[r];
+                            (*functions.query)(values, params, results);
+                            scratch[r] = results[0];
+                        }
+                    } else {
+                        values.resize(depth - start);
+                        for (size_t r = 0; r < n; ++r) {
+                            for (size_t k = start; k < depth; ++k) values[k - start] = stack[k][r];
+                            scratch[r] = (*functions.list)(values);
+                        }
+                    }
+                    depth = start;
+                    push();
+                    std::swap(stack[depth - 1], scratch);
+                    break;
+                }
+
+                // リスト終了（HP方式）- 何もしない（リスト関数で処理）
+                default:
+                    break;
             }
-        } else {
-            current += ch;
         }
-        i += ch.length();
+
+        if (depth == 0) {
+            throw std::runtime_error("librpn: empty expression");
+        }
+        std::copy_n(stack[depth - 1].data(), n, out + offset);
     }
-    if (!current.empty()) {
-        tokens.push_back(current);
+}
+
+void evaluateBatch(const Program& program, const std::vector<const double*>& columns,
+                   size_t rows, double* out) {
+    if (usesListArithmetic(program.code)) {
+        throw std::invalid_argument("librpn: list values are not supported in batch evaluation");
     }
+    BatchBuffers buffers;
+    evaluateColumns(program, columns, rows, out, buffers);
+}
 
-    for (const auto& token : tokens) {
+void evaluateBatch(const Program& program, const std::vector<const double*>& columns,
+                   size_t rows, double* out, const EvaluationLimits& limits) {
+    if (usesListArithmetic(program.code)) {
+        throw std::invalid_argument("librpn: list values are not supported in batch evaluation");
+    }
+    EvaluationBudget budget(limits);
+    // 1行の作業量はトークン数。取り消しを確かめる間隔ほどの行（BATCH_BLOCK の倍数）ずつ差し引く
+    size_t perRow = std::max<size_t>(program.code.size(), 1);
+    size_t chunk = std::max(BATCH_BLOCK, CANCELLATION_CHECK_INTERVAL / perRow / BATCH_BLOCK * BATCH_BLOCK);
+    BatchBuffers buffers;
+    std::vector<const double*> shifted(columns.size());
+    for (size_t offset = 0; offset < rows; offset += chunk) {
+        size_t n = std::min(chunk, rows - offset);
+        budget.charge(static_cast<uint64_t>(n) * perRow);
+        for (size_t i = 0; i < columns.size(); ++i) {
+            shifted[i] = columns[i] ? columns[i] + offset : nullptr;
+        }
+        evaluateColumns(program, shifted, n, out + offset, buffers);
+    }
+}
+
+//==============================================================================
+// RPN → 中置記法変換
+//==============================================================================
+
+// 部分式の文字列は buffers.parts を深さごとに使い回す（各段の文字列をその場で組み立てる）
+static const std::string& rpnToInfix(const std::string& expression, ParseBuffers& buffers) {
+    std::vector<std::string>& parts = buffers.parts;
+    size_t depth = 0;
+
+    auto require = [&](size_t count, const std::string& token) {
+        if (depth < count) {
+            throw std::runtime_error("librpn: stack underflow at '" + token + "'");
+        }
+    };
+
+    forEachRPNWord(expression, buffers, [&](const std::string& token) {
         // 演算子
         if (isOperator(token)) {
-            std::string b = s.top(); s.pop();
-            std::string a = s.top(); s.pop();
-            s.push("(" + a + " " + token + " " + b + ")");
-            continue;
+            require(2, token);
+            std::string& a = parts[depth - 2];
+            a.insert(0, 1, '(');
+            a += ' ';
+            a += token;
+            a += ' ';
+            a += parts[depth - 1];
+            a += ')';
+            --depth;
+            return;
         }
 
         // 単項関数
         if (isUnaryFunction(token)) {
-            std::string a = s.top(); s.pop();
-            s.push(token + "(" + a + ")");
-            continue;
+            require(1, token);
+            std::string& a = parts[depth - 1];
+            a.insert(0, token);
+            a.insert(token.size(), 1, '(');
+            a += ')';
+            return;
         }
 
         // 二項関数
         if (isBinaryFunction(token)) {
-            std::string b = s.top(); s.pop();
-            std::string a = s.top(); s.pop();
-            s.push(token + "(" + a + ", " + b + ")");
-            continue;
+            require(2, token);
+            std::string& a = parts[depth - 2];
+            a.insert(0, token);
+            a.insert(token.size(), 1, '(');
+            a += ", ";
+            a += parts[depth - 1];
+            a += ')';
+            --depth;
+            return;
+        }
+
+        // 3引数の関数
+        if (isTernaryFunction(token)) {
+            require(3, token);
+            std::string& a = parts[depth - 3];
+            a.insert(0, token);
+            a.insert(token.size(), 1, '(');
+            a += ", ";
+            a += parts[depth - 2];
+            a += ", ";
+            a += parts[depth - 1];
+            a += ')';
+            depth -= 2;
+            return;
         }
 
         // 数値または定数
-        s.push(token);
+        if (depth == parts.size()) parts.emplace_back();
+        parts[depth++].assign(token);
+    });
+
+    if (depth == 0) {
+        throw std::runtime_error("librpn: empty expression");
+    }
+    buffers.output.assign(parts[depth - 1]);
+    return buffers.output;
+}
+
+std::string rpnToInfix(const std::string& expression) {
+    LIBRPN_PROFILE_CALL(RPNToInfix);
+    ParseBuffers buffers;
+    return rpnToInfix(expression, buffers);
+}
+
+//==============================================================================
+// 評価コンテキスト
+//==============================================================================
+
+struct Evaluator::Buffers {
+    ParseBuffers parse;
+    std::vector<Token> code;
+    std::vector<double> literals;
+    EvalBuffers<double> eval;
+    ListRegisters registers;
+
+    Buffers() { eval.registers = &registers; }
+
+    double run() {
+        makeLiterals<double>(code, literals);
+        return evaluateTokens<double>(code, literals.data(), nullptr, 0, MathMode::Strict, eval);
     }
+};
+
+Evaluator::Evaluator() : buffers_(new Buffers) {}
+Evaluator::~Evaluator() = default;
+Evaluator::Evaluator(Evaluator&&) noexcept = default;
+Evaluator& Evaluator::operator=(Evaluator&&) noexcept = default;
+
+double Evaluator::calculateRPN(const std::string& expression) {
+    rpnCode(expression, buffers_->code, buffers_->parse);
+    return buffers_->run();
+}
+
+double Evaluator::calculate(const std::string& expression) {
+    librpn::infixToRPN(expression, buffers_->code, buffers_->parse);
+    return buffers_->run();
+}
+
+const std::vector<Token>& Evaluator::infixToRPN(const std::string& expression) {
+    librpn::infixToRPN(expression, buffers_->code, buffers_->parse);
+    return buffers_->code;
+}
+
+const std::string& Evaluator::rpnToInfix(const std::string& expression) {
+    return librpn::rpnToInfix(expression, buffers_->parse);
+}
+
+double Evaluator::evaluate(const Program& program, const std::vector<double>& variables) {
+    return evaluateTokens<double>(program.code, program.literals.data(), variables.data(), variables.size(),
+                                  program.mathMode, buffers_->eval);
+}
 
-    return s.top();
+double Evaluator::evaluate(const Program& program, const std::vector<double>& variables,
+                           const EvaluationLimits& limits) {
+    // 作業領域は次の呼び出しでも使うため、打ち切られても予算を外す
+    struct Attach {
+        EvalBuffers<double>& eval;
+        ~Attach() { eval.budget = nullptr; }
+    } attach{buffers_->eval};
+    EvaluationBudget budget(limits);
+    attach.eval.budget = &budget;
+    return evaluateTokens<double>(program.code, program.literals.data(), variables.data(), variables.size(),
+                                  program.mathMode, attach.eval);
+}
+
+void Evaluator::shrink() {
+    ListRegisters registers = std::move(buffers_->registers);
+    buffers_.reset(new Buffers);
+    buffers_->registers = std::move(registers);
+}
+
+std::shared_ptr<const ListData> Evaluator::storeList(const std::string& name, const std::string& expression) {
+    std::string reference = listReference(name);
+    rpnCode(expression, buffers_->code, buffers_->parse);
+    makeLiterals<double>(buffers_->code, buffers_->literals);
+    EvalBuffers<double>& eval = buffers_->eval;
+    StackValue<double> result = evaluateValues<double>(buffers_->code, buffers_->literals.data(), nullptr, 0,
+                                                       MathMode::Strict, eval);
+    std::shared_ptr<const ListData> data;
+    if (!result.isList()) {
+        data = makeListData({result.scalar});
+    } else if (const ListData* source = eval.pool.source(result.list)) {
+        // 登録済みのリストそのもの（@a だけの式）なら同じデータを共有する
+        for (const auto& held : eval.sources) {
+            if (held.get() == source) data = held;
+        }
+    } else {
+        data = makeListData(std::move(eval.pool.materialize(result.list)));
+    }
+    buffers_->registers[reference] = data;
+    return data;
+}
+
+void Evaluator::storeList(const std::string& name, std::shared_ptr<const ListData> data) {
+    if (!data) {
+        throw std::invalid_argument("librpn: no list data to store as '" + name + "'");
+    }
+    buffers_->registers[listReference(name)] = std::move(data);
+}
+
+std::shared_ptr<const ListData> Evaluator::recallList(const std::string& name) const {
+    auto it = buffers_->registers.find(listReference(name));
+    return it != buffers_->registers.end() ? it->second : nullptr;
+}
+
+bool Evaluator::purgeList(const std::string& name) {
+    return buffers_->registers.erase(listReference(name)) > 0;
+}
+
+//==============================================================================
+// ストリーム評価
+//==============================================================================
+
+struct StreamEvaluator::State {
+    std::vector<ByteMasks> masks;
+    std::string word;           // 読みかけの語（feed() の境界をまたぐ）
+    Token token;                // 評価する語のトークン（文字列のバッファを再利用する）
+    EvalBuffers<double> eval;
+    EvaluationLimits limits;
+    bool limited = false;                           // 上限を指定したかどうか
+    std::unique_ptr<EvaluationBudget> budget;       // 評価中の式の予算（式ごとに作り直す）
+
+    State() { beginEvaluation(eval); }
+
+    // 上限を指定していれば、式の最初の入力で予算を作る（取り消し済みならここで打ち切る）
+    void start() {
+        if (!limited || eval.budget) return;
+        budget.reset(new EvaluationBudget(limits));
+        eval.budget = budget.get();
+    }
+
+    void evaluateWord() {
+        assignRPNToken(word, token);
+        if (eval.budget) eval.budget->charge(1);
+        double literal = 0.0;
+        if (token.type == TokenType::Number) {
+            literal = token.number;
+        } else if (token.type == TokenType::Constant) {
+            literal = symbolFunctions<double>()[token.id].constant;
+        }
+        evaluateToken(token, literal, static_cast<const double*>(nullptr), 0, MathMode::Strict, eval);
+        word.clear();
+    }
+
+    // data を空白で語に分けて評価する（末尾の語は次の入力に続きうるので残す）
+    void scan(const char* data, size_t size) {
+        start();
+        classifyBytes(data, size, masks);
+        size_t i = 0;
+        while (i < size) {
+            if (word.empty()) {
+                i = classRunEnd(masks, &ByteMasks::space, i, size);
+                if (i >= size) break;
+            }
+            size_t end = classRunEnd(masks, &ByteMasks::notSpace, i, size);
+            if (word.size() + (end - i) > MAX_STREAM_WORD) {
+                throw std::runtime_error("librpn: token too long in stream");
+            }
+            word.append(data + i, end - i);
+            i = end;
+            if (i < size) evaluateWord();
+        }
+    }
+
+    StackValue<double> finish() {
+        start();
+        if (!word.empty()) evaluateWord();
+        return evaluationResult(eval);
+    }
+
+    void clear() {
+        word.clear();
+        beginEvaluation(eval);
+        eval.budget = nullptr;      // 次の式で作り直す（ここでは例外を投げない）
+    }
+};
+
+StreamEvaluator::StreamEvaluator() : state_(new State) {}
+
+StreamEvaluator::StreamEvaluator(const EvaluationLimits& limits) : state_(new State) {
+    state_->limits = limits;
+    state_->limited = true;
+}
+StreamEvaluator::~StreamEvaluator() = default;
+StreamEvaluator::StreamEvaluator(StreamEvaluator&&) noexcept = default;
+StreamEvaluator& StreamEvaluator::operator=(StreamEvaluator&&) noexcept = default;
+
+void StreamEvaluator::feed(const char* data, size_t size) {
+    try {
+        // バイト分類の作業領域が入力の大きさに比例しないよう STREAM_CHUNK ずつ走査する
+        for (size_t offset = 0; offset < size; offset += STREAM_CHUNK) {
+            state_->scan(data + offset, std::min(STREAM_CHUNK, size - offset));
+        }
+    } catch (...) {
+        state_->clear();
+        throw;
+    }
+}
+
+double StreamEvaluator::finish() {
+    try {
+        StackValue<double> result = state_->finish();
+        if (result.isList()) {
+            throw std::runtime_error("librpn: result is a list (use calculateRPNList / evaluateList)");
+        }
+        state_->clear();
+        return result.scalar;
+    } catch (...) {
+        state_->clear();
+        throw;
+    }
+}
+
+std::vector<double> StreamEvaluator::finishList() {
+    try {
+        StackValue<double> result = state_->finish();
+        std::vector<double> values;
+        if (result.isList()) {
+            chargeElements(state_->eval, state_->eval.pool.size(result.list));
+            values = state_->eval.pool.materialize(result.list);
+        } else {
+            values.push_back(result.scalar);
+        }
+        state_->clear();
+        return values;
+    } catch (...) {
+        state_->clear();
+        throw;
+    }
+}
+
+size_t StreamEvaluator::depth() const {
+    return state_->eval.stack.size();
+}
+
+void StreamEvaluator::reset() {
+    state_->clear();
+}
+
+double calculateRPNStream(std::istream& in, size_t chunkSize) {
+    StreamEvaluator stream;
+    std::vector<char> buffer(std::max<size_t>(chunkSize, 1));
+    while (in.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || in.gcount() > 0) {
+        stream.feed(buffer.data(), static_cast<size_t>(in.gcount()));
+    }
+    if (in.bad()) {
+        throw std::runtime_error("librpn: failed to read the expression stream");
+    }
+    return stream.finish();
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+double calculateRPNStream(int fd, size_t chunkSize) {
+    StreamEvaluator stream;
+    std::vector<char> buffer(std::max<size_t>(chunkSize, 1));
+    for (;;) {
+        ssize_t n = ::read(fd, buffer.data(), buffer.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throw std::system_error(errno, std::generic_category(), "librpn: read");
+        if (n == 0) break;
+        stream.feed(buffer.data(), static_cast<size_t>(n));
+    }
+    return stream.finish();
 }
+#endif
 
 } // namespace librpn
@@ -1,12 +1,19 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <functional>
+#include <iosfwd>
+#include <memory>
 #include <unordered_map>
 
 namespace librpn {
 
+struct ListData;    // 登録済みのリスト（librpn_source.hpp）
+
 //==============================================================================
 // トークン定義
 //==============================================================================
@@ -17,45 +24,192 @@ enum class TokenType {
     Operator,
     UnaryFunction,
     BinaryFunction,
-    ListFunction,    // リストを引数に取る関数（統計関数など）
+    TernaryFunction, // 3引数の関数（if）
+    ListFunction,    // リストを引数に取る関数（統計関数など。パラメータ付きのものを含む）
     Constant,
+    Variable,        // 変数（未登録の識別子。値は評価時に与える）
     LeftParen,
     RightParen,
     Comma,
     ListStart,       // { - HP方式のリスト開始
-    ListEnd          // } - HP方式のリスト終了
+    ListEnd,         // } - HP方式のリスト終了
+    Question,        // ? - 条件演算子（中置記法のみ。RPNでは if になる）
+    Colon,           // : - 条件演算子の区切り
+    ListSource       // @name - 登録済みのリスト・ファイルのデータ（librpn_source.hpp）
 };
 
+// シンボルID（SYMBOLSテーブルのインデックス）
+using SymbolId = std::uint16_t;
+
+// シンボルIDなし（数値・括弧・カンマなど）
+constexpr SymbolId NO_SYMBOL = 0xFFFF;
+
 // トークン構造体
+// 演算子・関数・定数は id でシンボル情報を引けるため、変換・計算時に文字列の
+// ハッシュ計算が不要。数値は字句解析時に解析済みの値を number に保持する。
+// 文字列を持つのは変数名・数値の綴り・@name だけで、演算子・関数・定数・括弧などの
+// トークンは文字列を持たない（コピーしても文字列をコピーしない。名前は value() で引く）。
 struct Token {
     TokenType type;
-    std::string value;
+    std::string text;           // 変数名・数値の綴り・@name（それ以外は空）
+    SymbolId id = NO_SYMBOL;    // 演算子・関数・定数のシンボルID（変数の場合はスロット番号）
+    double number = 0.0;        // 数値・定数の値（解析済み）
+
+    // トークンの文字列（演算子・関数・定数は SYMBOLS[id].name、括弧などは記号そのもの）
+    const std::string& value() const;
+};
+
+// 数学関数の計算方式（バッチ評価とリスト値の要素ごとの演算で使用）
+enum class MathMode {
+    Strict,          // libm を要素ごとに呼ぶ（evaluate() とビット単位で同一の結果）
+    Fast             // SIMDカーネルを使う（誤差上限は librpn_simd.hpp を参照）
+};
+
+// コンパイル済みプログラム（RPN順のトークン列と変数スロット）
+// T は評価に使う値の型（float / double / long double）
+template <typename T>
+struct BasicProgram {
+    std::vector<Token> code;             // RPN順のトークン列
+    std::vector<std::string> variables;  // 変数名（添字が変数スロット番号）
+    std::vector<T> literals;             // 数値・定数を T で解析した値（code と同じ添字）
+    MathMode mathMode = MathMode::Strict; // バッチ評価・リスト値の演算での数学関数の計算方式
+};
+
+using Program = BasicProgram<double>;
+
+// 連続した要素への読み取り専用の参照（リスト関数の引数。std::vector から暗黙に作れる）
+// 外部のデータ（@name のリスト）もコピーせずにこの形でリスト関数に渡す
+template <typename T>
+class BasicListView {
+public:
+    BasicListView() = default;
+    BasicListView(const T* data, size_t size) : data_(data), size_(size) {}
+    BasicListView(const std::vector<T>& values) : data_(values.data()), size_(values.size()) {}
+
+    const T* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size_; }
+    const T& operator[](size_t i) const { return data_[i]; }
+
+private:
+    const T* data_ = nullptr;
+    size_t size_ = 0;
 };
 
+using ListView = BasicListView<double>;
+
+// 要素を先頭から順に生成するリスト（seq・linspace の遅延リスト。全体を確保しない）
+// forEachBlock は全要素を先頭から連続したブロックに分けて f に渡す（何度呼んでもよい）
+template <typename T>
+class BasicListStream {
+public:
+    virtual ~BasicListStream() = default;
+    virtual size_t size() const = 0;
+    virtual void forEachBlock(const std::function<void(BasicListView<T>)>& f) const = 0;
+    bool empty() const { return size() == 0; }
+};
+
+using ListStream = BasicListStream<double>;
+
 //==============================================================================
 // 演算子・関数・定数の情報構造体
 //==============================================================================
 
 // 演算子の定義
-struct OperatorInfo {
+template <typename T>
+struct BasicOperatorInfo {
     int precedence;
     bool rightAssociative;
-    std::function<double(double, double)> func;
+    std::function<T(T, T)> func;
 };
 
 // 単項関数の定義
-struct UnaryFunctionInfo {
-    std::function<double(double)> func;
+template <typename T>
+struct BasicUnaryFunctionInfo {
+    std::function<T(T)> func;
 };
 
 // 二項関数の定義
-struct BinaryFunctionInfo {
-    std::function<double(double, double)> func;
+template <typename T>
+struct BasicBinaryFunctionInfo {
+    std::function<T(T, T)> func;
+};
+
+// 3引数の関数の定義（if）
+template <typename T>
+struct BasicTernaryFunctionInfo {
+    std::function<T(T, T, T)> func;
 };
 
 // リスト関数の定義（統計関数など）
-struct ListFunctionInfo {
-    std::function<double(const std::vector<double>&)> func;
+template <typename T>
+struct BasicListFunctionInfo {
+    std::function<T(BasicListView<T>)> func;
+    std::function<T(const BasicListStream<T>&)> stream;    // 遅延リストを全体を作らずに集約する版
+                                                           // （省略時は要素を作ってから func を呼ぶ）
+    std::function<T(const ListData&)> cached;              // 登録済みのリスト（@name）をそのまま渡したとき、
+                                                           // 並べ替えた複製・累積和から求める版（double のみ）
+};
+
+// パラメータ付きリスト関数の定義（パーセンタイルなど）
+// params の各値について1つずつ結果を out に書く。values は関数の中で並べ替えてよい。
+template <typename T>
+struct BasicListQueryFunctionInfo {
+    std::function<void(std::vector<T>& values, const std::vector<T>& params, std::vector<T>& out)> func;
+    bool listResult = false;    // 結果が常にリスト（窓関数。params は窓幅1個）
+    std::function<void(const ListData& data, const std::vector<T>& params, std::vector<T>& out)> cached;
+                                // 登録済みのリストの並べ替えた複製から求める版（double のみ）
+    std::function<void(const BasicListStream<T>& values, const std::vector<T>& params, std::vector<T>& out)> stream;
+                                // 要素を読むだけの版（遅延リストはブロックごとに作り、外部のデータは
+                                // 複製せずに読む。省略時は要素を複製してから func を呼ぶ）
+};
+
+// 複数の結果をリストで返すリスト関数の定義（stats）
+template <typename T>
+struct BasicListSummaryFunctionInfo {
+    std::function<void(BasicListView<T> values, std::vector<T>& out)> func;
+};
+
+// 等差数列（i 番目の要素は first + step × i、最後の要素だけは last そのもの）
+template <typename T>
+struct BasicSequence {
+    T first;
+    T step;
+    T last;
+    size_t count;
+
+    T operator[](size_t i) const { return i + 1 == count ? last : first + step * static_cast<T>(i); }
+};
+
+// 数列を作る関数の定義（seq・linspace。結果は遅延リスト）
+// 引数が不正なら std::invalid_argument
+template <typename T>
+struct BasicSequenceFunctionInfo {
+    int arity;
+    std::function<BasicSequence<T>(const T* args)> func;
+};
+
+using OperatorInfo = BasicOperatorInfo<double>;
+using UnaryFunctionInfo = BasicUnaryFunctionInfo<double>;
+using BinaryFunctionInfo = BasicBinaryFunctionInfo<double>;
+using TernaryFunctionInfo = BasicTernaryFunctionInfo<double>;
+using ListFunctionInfo = BasicListFunctionInfo<double>;
+using ListQueryFunctionInfo = BasicListQueryFunctionInfo<double>;
+using ListSummaryFunctionInfo = BasicListSummaryFunctionInfo<double>;
+using Sequence = BasicSequence<double>;
+using SequenceFunctionInfo = BasicSequenceFunctionInfo<double>;
+
+// シンボル情報（演算子・関数・定数の属性をIDで引くための表の要素）
+struct SymbolInfo {
+    std::string name;
+    TokenType type;
+    int precedence;          // 演算子の優先順位（算術は1〜3、比較・論理は負。演算子以外は0）
+    bool rightAssociative;   // 右結合演算子かどうか
+    int arity;               // 引数の数（定数は0、if は3、リスト関数は-1、パラメータ付きリスト関数は2）
+    double value;            // 定数の値（定数以外は0）
+    bool listResult = false; // 結果が常にリストの関数（移動平均などの窓関数、stats、seq・linspace）
 };
 
 //==============================================================================
@@ -65,9 +219,16 @@ struct ListFunctionInfo {
 extern const std::unordered_map<std::string, OperatorInfo> OPERATORS;
 extern const std::unordered_map<std::string, UnaryFunctionInfo> UNARY_FUNCTIONS;
 extern const std::unordered_map<std::string, BinaryFunctionInfo> BINARY_FUNCTIONS;
+extern const std::unordered_map<std::string, TernaryFunctionInfo> TERNARY_FUNCTIONS;
 extern const std::unordered_map<std::string, ListFunctionInfo> LIST_FUNCTIONS;
+extern const std::unordered_map<std::string, ListQueryFunctionInfo> LIST_QUERY_FUNCTIONS;
+extern const std::unordered_map<std::string, ListSummaryFunctionInfo> LIST_SUMMARY_FUNCTIONS;
+extern const std::unordered_map<std::string, SequenceFunctionInfo> SEQUENCE_FUNCTIONS;
 extern const std::unordered_map<std::string, double> CONSTANTS;
 
+// 全シンボルの一覧（上記テーブルから構築、SymbolIdで添字アクセス）
+extern const std::vector<SymbolInfo> SYMBOLS;
+
 //==============================================================================
 // UTF-8 ユーティリティ関数
 //==============================================================================
@@ -94,6 +255,9 @@ bool isMultibyte(const std::string& ch);
 // 判定関数
 //==============================================================================
 
+// シンボル名からIDを引く（未登録なら NO_SYMBOL）
+SymbolId findSymbol(const std::string& name);
+
 // 演算子の優先順位を返す
 int getPrecedence(const std::string& op);
 
@@ -103,13 +267,16 @@ bool isOperator(const std::string& s);
 // 単項関数かどうかを判定
 bool isUnaryFunction(const std::string& s);
 
-// 二項関数かどうかを判定
+// 二項関数（seq を含む）かどうかを判定
 bool isBinaryFunction(const std::string& s);
 
+// 3引数の関数（if・linspace）かどうかを判定
+bool isTernaryFunction(const std::string& s);
+
 // 定数かどうかを判定
 bool isConstant(const std::string& s);
 
-// リスト関数かどうかを判定
+// リスト関数（パラメータ付きを含む）かどうかを判定
 bool isListFunction(const std::string& s);
 
 // 右結合演算子かどうか
@@ -118,6 +285,10 @@ bool isRightAssociative(const std::string& op);
 // リストマーカーかどうかを判定
 bool isListMarker(double v);
 
+// RPN順のトークン列がリスト値を扱う演算（要素ごとの演算・リストを返す関数）を含むか
+// （結果がリストの場合と、登録済みのリスト @name を参照する場合も true）
+bool usesListArithmetic(const std::vector<Token>& code);
+
 //==============================================================================
 // 主要な変換・計算関数
 //==============================================================================
@@ -128,10 +299,276 @@ std::vector<Token> tokenize(const std::string& expression);
 // 中置記法をRPNに変換
 std::string infixToRPN(const std::string& expression);
 
+// 中置記法をRPN順のトークン列に変換（output の内容は置き換え、確保済みの容量は再利用する）
+//   std::vector<Token> code;
+//   infixToRPN("(1 + 2) * 3", code);
+//   calculateRPN(code);      // 9（RPN文字列を経由しない）
+//   formatRPN(code);         // "1 2 + 3 *"
+void infixToRPN(const std::string& expression, std::vector<Token>& output);
+
+// 字句解析済みのトークン列（tokenize の結果）をRPN順に並べ替える（output の内容は置き換える）
+// 呼び出し側でトークンを差し替えてから変換する場合に使う
+void infixToRPN(std::vector<Token> tokens, std::vector<Token>& output);
+
+// RPN順のトークン列を空白区切りのRPN文字列にする
+std::string formatRPN(const std::vector<Token>& code);
+
 // RPNを中置記法に変換
 std::string rpnToInfix(const std::string& expression);
 
-// RPN式を計算
+// RPN式を計算（結果がリスト値の場合は std::runtime_error）
 double calculateRPN(const std::string& expression);
 
+// RPN式を計算し、結果をリストとして返す（結果がスカラーなら要素1個）
+//   calculateRPNList("{ 1 2 3 } { 4 5 6 } +")  // {5, 7, 9}
+std::vector<double> calculateRPNList(const std::string& expression);
+
+// RPN順のトークン列を計算（変数を含む場合は std::out_of_range。変数は compile() / evaluate() を使う）
+double calculateRPN(const std::vector<Token>& code);
+
+// 中置記法をコンパイル（変数は出現順にスロット番号を割り当てる）
+Program compile(const std::string& expression);
+
+// RPN順のトークン列をコンパイル（変数は出現順にスロット番号を割り当てる）
+Program compile(std::vector<Token> code);
+
+// RPN式をコンパイル（変数は使えない。RPNの語は演算子・関数・定数・数値のいずれか）
+Program compileRPN(const std::string& expression);
+
+// コンパイル済みプログラムを評価（variables[i] がスロット i の値）
+double evaluate(const Program& program, const std::vector<double>& variables = {});
+
+// program.literals の代わりに literals（code と同じ添字）を使って評価する
+// （部分式の結果を数値として埋め込んだプログラムの評価用。大きさが違えば std::invalid_argument）
+double evaluate(const Program& program, const std::vector<double>& variables,
+                const std::vector<double>& literals);
+
+// コンパイル済みプログラムを評価し、結果をリストとして返す
+std::vector<double> evaluateList(const Program& program, const std::vector<double>& variables = {});
+
+// コンパイル済みプログラムを列単位でまとめて評価する
+// columns[i] がスロット i の変数の列（rows 個の値）、out に rows 個の結果を書き込む
+// sin・exp などの数学関数は program.mathMode に従って計算する
+// リスト値に対する要素ごとの演算を含む場合は std::invalid_argument
+void evaluateBatch(const Program& program, const std::vector<const double*>& columns,
+                   size_t rows, double* out);
+
+//==============================================================================
+// 評価の予算と取り消し
+//==============================================================================
+
+// 共有のワーカーで利用者の式を評価する場合に、1つの式が評価を占有しないよう打ち切る
+//
+//   librpn::CancellationToken cancel;              // 別のスレッドから cancel.cancel()
+//   librpn::EvaluationLimits limits{1000000, &cancel};
+//   try {
+//       double v = librpn::evaluate(program, variables, limits);
+//   } catch (const librpn::EvaluationAborted& e) {
+//       e.reason();                                // BudgetExceeded / Cancelled
+//   }
+//
+// 作業量はトークン1つで1、リスト値の要素ごとの演算・集約はリストの要素1個で1と数え、
+// 演算を始める前に差し引く（予算を超える演算は始めない）。取り消しは評価を始めるとき、
+// 作業量 CANCELLATION_CHECK_INTERVAL ごと、長いリストの要素ごとの演算・sum や mean などの
+// 集約の途中（同じ要素数ごと）に確かめる。median・percentile・窓関数は始める前にだけ確かめる。
+// 上限を指定しない評価（evaluate(program, variables) など）の速さは変わらない。
+
+// 取り消しを確かめる間隔（作業量）
+constexpr uint64_t CANCELLATION_CHECK_INTERVAL = 16384;
+
+// 評価の取り消し（別のスレッドから cancel() してよい）
+class CancellationToken {
+public:
+    void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+    void reset() { cancelled_.store(false, std::memory_order_relaxed); }
+    bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<bool> cancelled_{false};
+};
+
+// 評価の上限
+struct EvaluationLimits {
+    uint64_t budget = 0;                        // 作業量の上限（0なら制限なし）
+    const CancellationToken* cancel = nullptr;  // 取り消し（nullptr なら確かめない）
+};
+
+// 評価を打ち切った理由
+enum class AbortReason {
+    BudgetExceeded,
+    Cancelled
+};
+
+// 予算の超過・取り消しで評価を打ち切ったときの例外
+// （式の誤りの std::invalid_argument・std::runtime_error とは型で区別できる）
+class EvaluationAborted : public std::runtime_error {
+public:
+    explicit EvaluationAborted(AbortReason reason);
+    AbortReason reason() const { return reason_; }
+
+private:
+    AbortReason reason_;
+};
+
+// 上限を指定してコンパイル済みプログラムを評価する（超えたら EvaluationAborted）
+double evaluate(const Program& program, const std::vector<double>& variables, const EvaluationLimits& limits);
+
+// 上限を指定して評価し、結果をリストとして返す
+std::vector<double> evaluateList(const Program& program, const std::vector<double>& variables,
+                                 const EvaluationLimits& limits);
+
+// 上限を指定してRPN式を計算する（字句解析は作業量に数えない）
+double calculateRPN(const std::string& expression, const EvaluationLimits& limits);
+std::vector<double> calculateRPNList(const std::string& expression, const EvaluationLimits& limits);
+
+// 上限を指定してバッチ評価する（作業量は1行につきトークン数）
+// 打ち切った場合、out はそれまでに評価した先頭の行だけが書き込まれている
+void evaluateBatch(const Program& program, const std::vector<const double*>& columns,
+                   size_t rows, double* out, const EvaluationLimits& limits);
+
+//==============================================================================
+// 評価コンテキスト
+//==============================================================================
+
+// 字句解析・変換・評価の作業領域を保持し、呼び出しをまたいで再利用する
+//
+//   librpn::Evaluator ev;          // スレッドごとに1つ
+//   for (const auto& line : lines) {
+//       double v = ev.calculate(line);
+//   }
+//
+// 作業領域は必要に応じて伸びるだけで縮まないため、同程度の大きさの式を繰り返し
+// 計算する定常状態では、式1つあたりのヒープ確保はない（数値・名前が短く文字列の
+// 内部バッファに収まる場合。percentile など一部のリスト関数は内部で確保する）。
+// 大きな式のあとで作業領域を手放すには shrink() を呼ぶ。
+// スレッドセーフではない。複数スレッドではスレッドごとに Evaluator を持つこと。
+class Evaluator {
+public:
+    Evaluator();
+    ~Evaluator();
+    Evaluator(Evaluator&&) noexcept;
+    Evaluator& operator=(Evaluator&&) noexcept;
+
+    // RPN式を計算（calculateRPN と同じ）
+    double calculateRPN(const std::string& expression);
+
+    // 中置記法の式を計算（変数を含む場合は std::out_of_range）
+    double calculate(const std::string& expression);
+
+    // 中置記法をRPN順のトークン列に変換（次の呼び出しまで有効）
+    const std::vector<Token>& infixToRPN(const std::string& expression);
+
+    // RPNを中置記法に変換（次の呼び出しまで有効）
+    const std::string& rpnToInfix(const std::string& expression);
+
+    // コンパイル済みプログラムを評価（evaluate と同じ）
+    double evaluate(const Program& program, const std::vector<double>& variables = {});
+
+    // 上限を指定して評価（超えたら EvaluationAborted）
+    double evaluate(const Program& program, const std::vector<double>& variables, const EvaluationLimits& limits);
+
+    // 作業領域を解放する（リストのレジスタは残す）
+    void shrink();
+
+    // RPN式の結果のリストを名前 name のレジスタに保存する（HP電卓の STO）
+    // 以後この Evaluator の式では @name で参照でき、同じ名前の登録済みリストより優先する。
+    // 結果は1回だけ計算して保持し（スカラーなら要素1個のリスト）、参照するたびに
+    // 式を解析・計算し直すことはない。保存したデータは変更されないため、返り値を
+    // 他の Evaluator の storeList や registerList に渡して複数スレッドで共有してよい。
+    std::shared_ptr<const ListData> storeList(const std::string& name, const std::string& expression);
+
+    // 作成済みのデータをレジスタに保存する（コピーしない）
+    void storeList(const std::string& name, std::shared_ptr<const ListData> data);
+
+    // レジスタのデータ（HP電卓の RCL。なければ nullptr）
+    std::shared_ptr<const ListData> recallList(const std::string& name) const;
+
+    // レジスタを消す（なければ false）
+    bool purgeList(const std::string& name);
+
+private:
+    struct Buffers;
+    std::unique_ptr<Buffers> buffers_;
+};
+
+//==============================================================================
+// ストリーム評価
+//==============================================================================
+
+// ストリームから1回に読むバイト数の既定値
+constexpr size_t STREAM_CHUNK = 64 * 1024;
+
+// ストリーム評価で許す1語の最大バイト数（空白のない巨大な入力でメモリを使い切らないため）
+constexpr size_t MAX_STREAM_WORD = 4096;
+
+// RPN式を少しずつ受け取りながら評価する
+//
+//   librpn::StreamEvaluator stream;
+//   while (size_t n = readSome(buffer, sizeof(buffer))) stream.feed(buffer, n);
+//   double v = stream.finish();
+//
+// 語は受け取った時点で評価し、入力そのものは保持しない。メモリは入力の長さによらず、
+// スタックの深さと { } の中の要素数に比例する。語（UTF-8の文字を含む）は feed() の
+// 境界で切れていてよい。結果は calculateRPN() と同じ。
+// 1語が MAX_STREAM_WORD バイトを超えると std::runtime_error。例外を投げたときと
+// finish() のあとは状態が空に戻り、次の式を受け取れる。
+// 上限を指定した場合は式ごとに予算を数え、超えたら feed()・finish() が EvaluationAborted。
+class StreamEvaluator {
+public:
+    StreamEvaluator();
+    explicit StreamEvaluator(const EvaluationLimits& limits);   // limits.cancel は評価中有効であること
+    ~StreamEvaluator();
+    StreamEvaluator(StreamEvaluator&&) noexcept;
+    StreamEvaluator& operator=(StreamEvaluator&&) noexcept;
+
+    // 入力の続きを渡す
+    void feed(const char* data, size_t size);
+    void feed(const std::string& data) { feed(data.data(), data.size()); }
+
+    // 入力の終わり。結果を返す
+    double finish();
+
+    // 入力の終わり。結果をリストとして返す（calculateRPNList と同じ）
+    std::vector<double> finishList();
+
+    // 現在のスタックの深さ
+    size_t depth() const;
+
+    // 途中の状態を捨てる
+    void reset();
+
+private:
+    struct State;
+    std::unique_ptr<State> state_;
+};
+
+// std::istream から chunkSize バイトずつ読みながらRPN式を計算する
+double calculateRPNStream(std::istream& in, size_t chunkSize = STREAM_CHUNK);
+
+#if defined(__unix__) || defined(__APPLE__)
+// ファイル記述子から chunkSize バイトずつ読みながらRPN式を計算する
+// （EINTR は読み直す。読み込みエラーは std::system_error）
+double calculateRPNStream(int fd, size_t chunkSize = STREAM_CHUNK);
+#endif
+
+//==============================================================================
+// 値の型を選べる版（T = float / double / long double で明示的インスタンス化済み）
+//==============================================================================
+//
+// 上の double 版の関数はこれらの T = double の薄いラッパー。
+// 数値リテラルと定数は T の精度で解析する（long double では pi なども long double 精度）。
+// バッチ評価と SIMD カーネルは double のみ対応。
+
+// RPN式を T で計算
+template <typename T>
+T calculateRPNAs(const std::string& expression);
+
+// 中置記法を T で評価するプログラムにコンパイル
+template <typename T>
+BasicProgram<T> compileAs(const std::string& expression);
+
+// コンパイル済みプログラムを T で評価
+template <typename T>
+T evaluateAs(const BasicProgram<T>& program, const std::vector<T>& variables = {});
+
 } // namespace librpn
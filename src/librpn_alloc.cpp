@@ -0,0 +1,248 @@
+#include "librpn_alloc.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+
+namespace librpn {
+
+//==============================================================================
+// API 呼び出しごとの集計
+//==============================================================================
+
+struct ProfileSlot {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<int64_t> peakLiveBytes{0};
+};
+
+static ProfileSlot profileSlots[PROFILED_CALL_COUNT];
+static std::atomic<bool> profilingEnabled{false};
+
+void setAllocationProfiling(bool enabled) {
+    profilingEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+CallProfile allocationProfile(ProfiledCall call) {
+    const ProfileSlot& slot = profileSlots[static_cast<size_t>(call)];
+    CallProfile profile;
+    profile.calls = slot.calls.load(std::memory_order_relaxed);
+    profile.allocations = slot.allocations.load(std::memory_order_relaxed);
+    profile.bytes = slot.bytes.load(std::memory_order_relaxed);
+    profile.peakLiveBytes = slot.peakLiveBytes.load(std::memory_order_relaxed);
+    return profile;
+}
+
+void resetAllocationProfile() {
+    for (ProfileSlot& slot : profileSlots) {
+        slot.calls.store(0, std::memory_order_relaxed);
+        slot.allocations.store(0, std::memory_order_relaxed);
+        slot.bytes.store(0, std::memory_order_relaxed);
+        slot.peakLiveBytes.store(0, std::memory_order_relaxed);
+    }
+}
+
+ProfiledCallScope::ProfiledCallScope(ProfiledCall call) : call_(call) {
+    if (allocationHooksEnabled() && profilingEnabled.load(std::memory_order_relaxed)) scope_.emplace();
+}
+
+ProfiledCallScope::~ProfiledCallScope() {
+    if (!scope_) return;
+    AllocationStats stats = scope_->stats();
+    scope_.reset();
+    ProfileSlot& slot = profileSlots[static_cast<size_t>(call_)];
+    slot.calls.fetch_add(1, std::memory_order_relaxed);
+    slot.allocations.fetch_add(stats.allocations, std::memory_order_relaxed);
+    slot.bytes.fetch_add(stats.bytes, std::memory_order_relaxed);
+    int64_t peak = slot.peakLiveBytes.load(std::memory_order_relaxed);
+    while (stats.peakLiveBytes > peak &&
+           !slot.peakLiveBytes.compare_exchange_weak(peak, stats.peakLiveBytes, std::memory_order_relaxed)) {
+    }
+}
+
+#if defined(LIBRPN_ALLOC_HOOKS)
+
+//==============================================================================
+// operator new / delete の置き換え
+//==============================================================================
+//
+// 各ブロックの直前に、確保したリソース（malloc なら nullptr）と要求された大きさを置く。
+// 解放はこの情報だけで行うため、どのスレッドで解放してもよい。
+// operator new から参照するため、スレッドごとの状態は動的な初期化のない型だけにする。
+
+struct BlockHeader {
+    std::pmr::memory_resource* resource;
+    size_t size;
+};
+
+constexpr size_t BLOCK_HEADER = 16;     // 既定のアラインメント（__STDCPP_DEFAULT_NEW_ALIGNMENT__）
+static_assert(sizeof(BlockHeader) <= BLOCK_HEADER, "block header must fit in the default alignment");
+
+static thread_local AllocationScope* currentScope = nullptr;
+static thread_local AllocationStats threadStats;
+static thread_local bool insideResource = false;    // リソースの中の確保（上流からの確保）は数えない
+
+static void addAllocation(AllocationStats& stats, size_t size) {
+    ++stats.allocations;
+    stats.bytes += size;
+    stats.liveBytes += static_cast<int64_t>(size);
+    stats.peakLiveBytes = std::max(stats.peakLiveBytes, stats.liveBytes);
+}
+
+static void addDeallocation(AllocationStats& stats, size_t size) {
+    ++stats.deallocations;
+    stats.liveBytes -= static_cast<int64_t>(size);
+}
+
+struct AllocationTracker {
+    static void allocated(size_t size) {
+        addAllocation(threadStats, size);
+        for (AllocationScope* scope = currentScope; scope; scope = scope->outer_) addAllocation(scope->stats_, size);
+    }
+
+    static void deallocated(size_t size) {
+        addDeallocation(threadStats, size);
+        for (AllocationScope* scope = currentScope; scope; scope = scope->outer_) addDeallocation(scope->stats_, size);
+    }
+
+    static std::pmr::memory_resource* resource() {
+        return currentScope && !insideResource ? currentScope->resource_ : nullptr;
+    }
+};
+
+static void* hookedAllocate(size_t size, size_t alignment) {
+    size_t offset = std::max(BLOCK_HEADER, alignment);
+    size_t total = size + offset;
+    std::pmr::memory_resource* resource = AllocationTracker::resource();
+    void* base;
+    if (resource) {
+        insideResource = true;
+        try {
+            base = resource->allocate(total, offset);
+        } catch (...) {
+            insideResource = false;
+            throw;
+        }
+        insideResource = false;
+    } else if (alignment <= BLOCK_HEADER) {
+        base = std::malloc(total);
+    } else {
+        base = std::aligned_alloc(alignment, (total + alignment - 1) / alignment * alignment);
+    }
+    if (!base) throw std::bad_alloc();
+
+    char* block = static_cast<char*>(base) + offset;
+    *reinterpret_cast<BlockHeader*>(block - BLOCK_HEADER) = {resource, size};
+    if (!insideResource) AllocationTracker::allocated(size);
+    return block;
+}
+
+static void hookedDeallocate(void* block, size_t alignment) noexcept {
+    if (!block) return;
+    size_t offset = std::max(BLOCK_HEADER, alignment);
+    BlockHeader header = *reinterpret_cast<BlockHeader*>(static_cast<char*>(block) - BLOCK_HEADER);
+    void* base = static_cast<char*>(block) - offset;
+    if (!insideResource) AllocationTracker::deallocated(header.size);
+    if (header.resource) {
+        bool outer = insideResource;
+        insideResource = true;
+        header.resource->deallocate(base, header.size + offset, offset);
+        insideResource = outer;
+    } else {
+        std::free(base);
+    }
+}
+
+bool allocationHooksEnabled() {
+    return true;
+}
+
+AllocationStats threadAllocations() {
+    return threadStats;
+}
+
+AllocationScope::AllocationScope(std::pmr::memory_resource* resource)
+    : outer_(currentScope), resource_(resource ? resource : currentScope ? currentScope->resource_ : nullptr) {
+    currentScope = this;
+}
+
+AllocationScope::~AllocationScope() {
+    currentScope = outer_;
+}
+
+} // namespace librpn
+
+void* operator new(std::size_t size) { return librpn::hookedAllocate(size, 0); }
+void* operator new[](std::size_t size) { return librpn::hookedAllocate(size, 0); }
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return librpn::hookedAllocate(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return librpn::hookedAllocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try { return librpn::hookedAllocate(size, 0); } catch (...) { return nullptr; }
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    try { return librpn::hookedAllocate(size, 0); } catch (...) { return nullptr; }
+}
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    try { return librpn::hookedAllocate(size, static_cast<std::size_t>(alignment)); } catch (...) { return nullptr; }
+}
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    try { return librpn::hookedAllocate(size, static_cast<std::size_t>(alignment)); } catch (...) { return nullptr; }
+}
+
+void operator delete(void* p) noexcept { librpn::hookedDeallocate(p, 0); }
+void operator delete[](void* p) noexcept { librpn::hookedDeallocate(p, 0); }
+void operator delete(void* p, std::size_t) noexcept { librpn::hookedDeallocate(p, 0); }
+void operator delete[](void* p, std::size_t) noexcept { librpn::hookedDeallocate(p, 0); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { librpn::hookedDeallocate(p, 0); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { librpn::hookedDeallocate(p, 0); }
+void operator delete(void* p, std::align_val_t alignment) noexcept {
+    librpn::hookedDeallocate(p, static_cast<std::size_t>(alignment));
+}
+void operator delete[](void* p, std::align_val_t alignment) noexcept {
+    librpn::hookedDeallocate(p, static_cast<std::size_t>(alignment));
+}
+void operator delete(void* p, std::size_t, std::align_val_t alignment) noexcept {
+    librpn::hookedDeallocate(p, static_cast<std::size_t>(alignment));
+}
+void operator delete[](void* p, std::size_t, std::align_val_t alignment) noexcept {
+    librpn::hookedDeallocate(p, static_cast<std::size_t>(alignment));
+}
+void operator delete(void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    librpn::hookedDeallocate(p, static_cast<std::size_t>(alignment));
+}
+void operator delete[](void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    librpn::hookedDeallocate(p, static_cast<std::size_t>(alignment));
+}
+
+#else
+
+//==============================================================================
+// 計測なしのビルド
+//==============================================================================
+
+bool allocationHooksEnabled() {
+    return false;
+}
+
+AllocationStats threadAllocations() {
+    return {};
+}
+
+AllocationScope::AllocationScope(std::pmr::memory_resource* resource) {
+    if (resource) {
+        throw std::logic_error("librpn: AllocationScope needs a build with LIBRPN_ALLOC_HOOKS to use a resource");
+    }
+}
+
+AllocationScope::~AllocationScope() = default;
+
+} // namespace librpn
+
+#endif
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+
+namespace librpn {
+
+//==============================================================================
+// ヒープ確保の計測とメモリリソースの差し替え（LIBRPN_ALLOC_HOOKS）
+//==============================================================================
+
+// LIBRPN_ALLOC_HOOKS を定義してビルドすると（CMake では -DALLOC_HOOKS=true）、
+// librpn_alloc.cpp がグローバルな operator new / delete を置き換え、スレッドごとに
+// 確保を数える。Token の文字列なども含め、ライブラリの中の確保はすべてここを通る。
+//
+//   librpn::AllocationScope scope;                 // このスレッドの確保を数える
+//   librpn::infixToRPN("sqrt(16) + 2");
+//   librpn::AllocationStats s = scope.stats();     // 回数・バイト数・生存バイト数の最大
+//
+//   std::pmr::unsynchronized_pool_resource pool;
+//   librpn::AllocationScope arena(&pool);          // このスレッドの確保を pool から行う
+//
+// 置き換えは実行ファイル全体に及ぶため、operator new を独自に置き換えているプログラムでは
+// 定義しないこと。定義しない場合、以下は何もしない（統計は0、リソースの指定は std::logic_error）。
+
+// 確保の統計
+struct AllocationStats {
+    uint64_t allocations = 0;       // 確保の回数
+    uint64_t deallocations = 0;     // 解放の回数
+    uint64_t bytes = 0;             // 確保したバイト数の合計
+    int64_t liveBytes = 0;          // 確保 − 解放のバイト数（範囲の前に確保したものの解放で負になりうる）
+    int64_t peakLiveBytes = 0;      // liveBytes の最大
+};
+
+// 計測を有効にしてビルドしたか
+bool allocationHooksEnabled();
+
+// 呼び出しスレッドの起動からの確保の統計
+AllocationStats threadAllocations();
+
+// 生存期間の間、呼び出しスレッドの確保を数える（入れ子にでき、外側の範囲にも数える）
+// resource を指定すると、その間の確保を resource から行う（nullptr なら外側の指定を引き継ぐ）。
+// 確保したブロックは、どのスレッド・どの時点で解放しても確保したリソースに返る。
+// resource はそこから確保したブロックがすべて解放されるまで有効に保つこと。
+// 同じスレッドで、作った順と逆の順に破棄すること。
+class AllocationScope {
+public:
+    explicit AllocationScope(std::pmr::memory_resource* resource = nullptr);
+    ~AllocationScope();
+
+    AllocationScope(const AllocationScope&) = delete;
+    AllocationScope& operator=(const AllocationScope&) = delete;
+
+    AllocationStats stats() const { return stats_; }
+
+private:
+    friend struct AllocationTracker;
+    AllocationScope* outer_ = nullptr;
+    std::pmr::memory_resource* resource_ = nullptr;   // 外側から引き継いだものを含む
+    AllocationStats stats_;
+};
+
+//==============================================================================
+// API 呼び出しごとの集計
+//==============================================================================
+
+// 集計する関数
+enum class ProfiledCall {
+    Tokenize,       // tokenize()
+    InfixToRPN,     // infixToRPN()
+    CalculateRPN,   // calculateRPN()
+    RPNToInfix,     // rpnToInfix()
+};
+
+constexpr size_t PROFILED_CALL_COUNT = 4;
+
+// 1つの関数の集計（全スレッドの合計）
+struct CallProfile {
+    uint64_t calls = 0;
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+    int64_t peakLiveBytes = 0;      // 1回の呼び出しの中での生存バイト数の最大（全呼び出しの最大）
+};
+
+// 集計の開始・停止（既定は停止。LIBRPN_ALLOC_HOOKS なしでは何も集計しない）
+void setAllocationProfiling(bool enabled);
+
+// 集計結果の取得・消去
+CallProfile allocationProfile(ProfiledCall call);
+void resetAllocationProfile();
+
+// 集計が有効なら、生存期間の間の確保を call の1回の呼び出しとして集計する（ライブラリ内部用）
+class ProfiledCallScope {
+public:
+    explicit ProfiledCallScope(ProfiledCall call);
+    ~ProfiledCallScope();
+
+    ProfiledCallScope(const ProfiledCallScope&) = delete;
+    ProfiledCallScope& operator=(const ProfiledCallScope&) = delete;
+
+private:
+    ProfiledCall call_;
+    std::optional<AllocationScope> scope_;
+};
+
+#if defined(LIBRPN_ALLOC_HOOKS)
+#define LIBRPN_PROFILE_CALL(call) ::librpn::ProfiledCallScope librpnProfiledCall_(::librpn::ProfiledCall::call)
+#else
+#define LIBRPN_PROFILE_CALL(call) ((void)0)
+#endif
+
+} // namespace librpn
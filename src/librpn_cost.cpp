@@ -0,0 +1,392 @@
+#include "librpn_cost.hpp"
+#include "librpn_source.hpp"
+#include "librpn_stats.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+namespace librpn {
+
+//==============================================================================
+// 見積もり（スタックの抽象的なたどり）
+//==============================================================================
+
+// スタックの値の代わりに積むもの
+struct AbstractValue {
+    bool list = false;
+    size_t size = 0;        // リストの要素数（決まらなければ0）
+    bool sized = true;      // リストの要素数が静的に決まるか
+    bool known = false;     // スカラーの値が数値だけから決まるか
+    double value = 0;
+};
+
+// シンボルごとの見積もりの情報（SYMBOLS と同じ添字。評価器と同じくトークンの id で引き、名前は引かない）
+struct SymbolCost {
+    bool transcendental = false;    // 超越関数（libm の呼び出しが四則演算・sqrt より桁違いに重いもの）
+    bool ordered = false;           // 順位統計量（要素を選択・並べ替える関数）
+    bool summary = false;           // 複数の結果を返すリスト関数（stats）
+    const ListQueryFunctionInfo* query = nullptr;                           // パラメータ付きリスト関数
+    const std::function<Sequence(const double*)>* sequence = nullptr;      // seq・linspace
+    const std::function<double(double)>* unary = nullptr;                   // 数値だけの引数の畳み込み用
+    const std::function<double(double, double)>* binary = nullptr;
+    const std::function<double(double, double, double)>* ternary = nullptr;
+};
+
+static std::vector<SymbolCost> buildSymbolCosts() {
+    static const char* const TRANSCENDENTALS[] = {
+        "sin", "cos", "tan", "log", "ln", "log10", "exp", "pow", "^", "atan2",
+    };
+    static const char* const ORDER_STATISTICS[] = {
+        "median", "iqr", "percentile", "approxpercentile",
+    };
+    std::vector<SymbolCost> result(SYMBOLS.size());
+    for (size_t i = 0; i < SYMBOLS.size(); ++i) {
+        const std::string& name = SYMBOLS[i].name;
+        SymbolCost& c = result[i];
+        c.transcendental = std::find(std::begin(TRANSCENDENTALS), std::end(TRANSCENDENTALS), name) !=
+                           std::end(TRANSCENDENTALS);
+        c.ordered = std::find(std::begin(ORDER_STATISTICS), std::end(ORDER_STATISTICS), name) !=
+                    std::end(ORDER_STATISTICS);
+        if (SYMBOLS[i].listResult && SYMBOLS[i].type != TokenType::ListFunction) {
+            c.sequence = &SEQUENCE_FUNCTIONS.at(name).func;
+            continue;
+        }
+        switch (SYMBOLS[i].type) {
+            case TokenType::Operator:        c.binary = &OPERATORS.at(name).func; break;
+            case TokenType::BinaryFunction:  c.binary = &BINARY_FUNCTIONS.at(name).func; break;
+            case TokenType::UnaryFunction:   c.unary = &UNARY_FUNCTIONS.at(name).func; break;
+            case TokenType::TernaryFunction: c.ternary = &TERNARY_FUNCTIONS.at(name).func; break;
+            case TokenType::ListFunction:
+                if (SYMBOLS[i].arity == 2) {
+                    c.query = &LIST_QUERY_FUNCTIONS.at(name);
+                } else {
+                    c.summary = SYMBOLS[i].listResult;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return result;
+}
+
+// SYMBOLS などは別の翻訳単位で初期化されるため、初回使用時に構築する
+static const SymbolCost& symbolCost(const Token& token) {
+    static const std::vector<SymbolCost> table = buildSymbolCosts();
+    static const SymbolCost none;
+    return token.id < table.size() ? table[token.id] : none;
+}
+
+class CostEstimator {
+public:
+    explicit CostEstimator(CostEstimate& cost) : cost_(cost) {}
+
+    void token(const Token& token) {
+        switch (token.type) {
+            case TokenType::Number:
+            case TokenType::Constant:
+                push(scalar(token.number));
+                break;
+
+            case TokenType::Variable:
+                push(AbstractValue{});
+                break;
+
+            // 登録済みならその要素数。未登録の名前（まだ開いていないファイルを含む）は評価時に決まる
+            case TokenType::ListSource: {
+                std::shared_ptr<const ListData> data = findListSource(token.text);
+                push(data ? list(data->view.size(), true) : list(0, false));
+                break;
+            }
+
+            case TokenType::ListStart:
+                markers_.push_back(stack_.size());
+                break;
+
+            case TokenType::ListEnd: {
+                size_t start = openListStart();
+                if (start + 1 == stack_.size() && stack_.back().list) break;
+                push(gather(start));
+                break;
+            }
+
+            case TokenType::Operator:
+            case TokenType::BinaryFunction:
+            case TokenType::TernaryFunction:
+                function(token);
+                break;
+
+            case TokenType::UnaryFunction: {
+                const SymbolCost& c = symbolCost(token);
+                AbstractValue a = pop();
+                if (a.list) {
+                    elementwise(c, a.size);
+                    push(a);
+                    break;
+                }
+                if (c.transcendental) ++cost_.transcendentals;
+                push(a.known && c.unary ? scalar((*c.unary)(a.value)) : AbstractValue{});
+                break;
+            }
+
+            case TokenType::ListFunction:
+                listFunction(token);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+private:
+    static AbstractValue scalar(double value) {
+        AbstractValue v;
+        v.known = true;
+        v.value = value;
+        return v;
+    }
+
+    AbstractValue list(size_t size, bool sized) {
+        AbstractValue v;
+        v.list = true;
+        v.size = size;
+        v.sized = sized;
+        if (!sized) cost_.unboundedLists = true;
+        cost_.maxListSize = std::max(cost_.maxListSize, size);
+        return v;
+    }
+
+    void push(const AbstractValue& v) {
+        stack_.push_back(v);
+        cost_.maxStackDepth = std::max(cost_.maxStackDepth, stack_.size());
+    }
+
+    // 足りなければ値の分からないスカラー（評価時にはスタック不足の例外になる）
+    AbstractValue pop() {
+        if (stack_.empty()) return AbstractValue{};
+        AbstractValue v = stack_.back();
+        stack_.pop_back();
+        return v;
+    }
+
+    size_t openListStart() {
+        size_t start = 0;
+        if (!markers_.empty()) {
+            start = std::min(markers_.back(), stack_.size());
+            markers_.pop_back();
+        }
+        return start;
+    }
+
+    // start 以降の値を1つのリストにまとめる（要素はコピーされる）
+    AbstractValue gather(size_t start) {
+        size_t size = 0;
+        bool sized = true;
+        for (size_t k = start; k < stack_.size(); ++k) {
+            size += stack_[k].list ? stack_[k].size : 1;
+            sized = sized && (!stack_[k].list || stack_[k].sized);
+        }
+        stack_.resize(start);
+        ++cost_.listOps;
+        cost_.elementOps += size;
+        return list(size, sized);
+    }
+
+    void elementwise(const SymbolCost& c, size_t n) {
+        ++cost_.listOps;
+        cost_.elementOps += n;
+        if (c.transcendental) cost_.transcendentals += n;
+    }
+
+    // 演算子・二項関数・3引数の関数（seq・linspace を含む）
+    void function(const Token& token) {
+        const SymbolCost& c = symbolCost(token);
+        size_t arity = token.type == TokenType::TernaryFunction ? 3 : 2;
+        AbstractValue args[3];
+        for (size_t k = arity; k-- > 0;) args[k] = pop();
+
+        if (c.sequence) {
+            bool known = true;
+            double values[3];
+            for (size_t k = 0; k < arity; ++k) {
+                known = known && !args[k].list && args[k].known;
+                values[k] = args[k].value;
+            }
+            if (!known) {
+                push(list(0, false));
+                return;
+            }
+            size_t count = 0;
+            try {
+                count = (*c.sequence)(values).count;
+            } catch (const std::exception&) {
+            }
+            ++cost_.listOps;
+            cost_.elementOps += count;
+            push(list(count, true));
+            return;
+        }
+
+        // リストがあれば要素ごと（長さは評価時に揃っている必要がある）
+        size_t n = 0;
+        bool anyList = false, sized = true, known = true;
+        for (size_t k = 0; k < arity; ++k) {
+            if (args[k].list) {
+                anyList = true;
+                n = std::max(n, args[k].size);
+                sized = sized && args[k].sized;
+            }
+            known = known && args[k].known;
+        }
+        if (anyList) {
+            elementwise(c, n);
+            push(list(n, sized));
+            return;
+        }
+
+        if (c.transcendental) ++cost_.transcendentals;
+        if (!known) {
+            push(AbstractValue{});
+        } else if (arity == 3) {
+            push(c.ternary ? scalar((*c.ternary)(args[0].value, args[1].value, args[2].value)) : AbstractValue{});
+        } else {
+            push(c.binary ? scalar((*c.binary)(args[0].value, args[1].value)) : AbstractValue{});
+        }
+    }
+
+    // リスト関数（集約・パラメータ付き・stats）
+    void listFunction(const Token& token) {
+        const SymbolCost& c = symbolCost(token);
+        bool ordered = c.ordered;
+
+        if (c.query) {
+            AbstractValue param = pop();
+            AbstractValue values = pop();
+            ++cost_.listOps;
+            cost_.elementOps += values.size;       // 作業用の複製
+            if (ordered) cost_.orderedElements += values.size;
+            if (c.query->listResult) {
+                cost_.elementOps += values.size;   // 窓をずらしながらの計算
+                push(list(values.size, values.sized));
+            } else if (param.list) {
+                push(list(param.size, param.sized));
+            } else {
+                push(AbstractValue{});
+            }
+            return;
+        }
+
+        AbstractValue values = !stack_.empty() && stack_.back().list ? pop() : gather(openListStart());
+        ++cost_.listOps;
+        cost_.elementOps += values.size;
+        if (ordered) cost_.orderedElements += values.size;
+        if (c.summary) {
+            cost_.orderedElements += values.size;  // stats は中央値を含む
+            push(list(std::size(STATS_RESULTS), true));
+        } else {
+            push(AbstractValue{});
+        }
+    }
+
+    CostEstimate& cost_;
+    std::vector<AbstractValue> stack_;
+    std::vector<size_t> markers_;
+};
+
+CostEstimate estimateCost(const std::vector<Token>& code, const CostModel& model) {
+    CostEstimate cost;
+    cost.tokens = code.size();
+    CostEstimator estimator(cost);
+    for (const Token& token : code) estimator.token(token);
+    cost.nanoseconds = model.evaluationNs + model.tokenNs * static_cast<double>(cost.tokens) +
+                       model.listNs * static_cast<double>(cost.listOps) +
+                       model.elementNs * static_cast<double>(cost.elementOps) +
+                       model.transcendentalNs * static_cast<double>(cost.transcendentals) +
+                       model.orderedNs * static_cast<double>(cost.orderedElements);
+    return cost;
+}
+
+CostEstimate estimateCost(const Program& program, const CostModel& model) {
+    return estimateCost(program.code, model);
+}
+
+//==============================================================================
+// 係数の較正
+//==============================================================================
+
+// program を繰り返し評価した1回あたりの時間（ナノ秒。数回測って最小値）
+static double measure(const Program& program) {
+    using Clock = std::chrono::steady_clock;
+    volatile double sink = 0;
+    double best = std::numeric_limits<double>::infinity();
+    for (int round = 0; round < 3; ++round) {
+        size_t repetitions = 0;
+        size_t batch = 1;
+        auto start = Clock::now();
+        double elapsed = 0;
+        do {
+            for (size_t i = 0; i < batch; ++i) sink = sink + evaluate(program);
+            repetitions += batch;
+            batch = std::min<size_t>(batch * 2, 256);
+            elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        } while (elapsed < 1e6);
+        best = std::min(best, elapsed / static_cast<double>(repetitions));
+    }
+    return best;
+}
+
+// 長さ n のスカラーの演算の連なり（1 0.25 + 1.5 * …）
+static Program scalarChain(size_t n) {
+    std::string rpn = "1";
+    for (size_t i = 0; i < n; ++i) rpn += i % 2 ? " 1.5 *" : " 0.25 +";
+    return compileRPN(rpn);
+}
+
+// 既知の係数で説明できない残りの時間を count で割る（負にはしない）
+static double fit(const Program& program, const CostModel& model, size_t CostEstimate::*count) {
+    CostEstimate cost = estimateCost(program, model);
+    double rest = measure(program) - cost.nanoseconds;
+    return std::max(0.0, rest / static_cast<double>(std::max<size_t>(cost.*count, 1)));
+}
+
+CostModel calibrateCostModel() {
+    CostModel model;
+    model.evaluationNs = model.tokenNs = model.listNs = model.elementNs = model.transcendentalNs = model.orderedNs = 0;
+
+    // 評価1回の固定分とトークンあたりの時間（短い連なりと長い連なりの差）
+    Program shortChain = scalarChain(4);
+    Program longChain = scalarChain(256);
+    double shortNs = measure(shortChain);
+    double longNs = measure(longChain);
+    model.tokenNs = std::max(0.0, (longNs - shortNs) / static_cast<double>(longChain.code.size() - shortChain.code.size()));
+    model.evaluationNs = std::max(0.0, shortNs - model.tokenNs * static_cast<double>(shortChain.code.size()));
+
+    // リスト値の演算1回の固定分（短いリスト）
+    model.listNs = fit(compileRPN("{ 1 2 3 4 } 2 * 1 + sum"), model, &CostEstimate::listOps);
+
+    // 要素ごとの四則演算と集約、超越関数、順位統計量（要素の値が並んでいないよう sin を通す）
+    const std::string list = "0 1000 65536 linspace";
+    model.elementNs = fit(compileRPN(list + " 2 * 1 + sum"), model, &CostEstimate::elementOps);
+    model.transcendentalNs = fit(compileRPN(list + " sin sum"), model, &CostEstimate::transcendentals);
+    model.orderedNs = fit(compileRPN(list + " sin median"), model, &CostEstimate::orderedElements);
+    return model;
+}
+
+//==============================================================================
+// 受け入れ判定
+//==============================================================================
+
+Admission admit(const CostEstimate& cost, const AdmissionLimits& limits) {
+    if (cost.tokens > limits.maxTokens || cost.maxStackDepth > limits.maxStackDepth ||
+        cost.maxListSize > limits.maxListSize || cost.nanoseconds > limits.maxNanoseconds) {
+        return Admission::Reject;
+    }
+    if (cost.unboundedLists) return limits.rejectUnboundedLists ? Admission::Reject : Admission::Isolate;
+    return cost.nanoseconds > limits.isolateNanoseconds ? Admission::Isolate : Admission::Accept;
+}
+
+} // namespace librpn
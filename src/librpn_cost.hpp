@@ -0,0 +1,84 @@
+#pragma once
+
+#include "librpn.hpp"
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace librpn {
+
+//==============================================================================
+// 静的なコスト見積もりと受け入れ判定
+//==============================================================================
+
+// 利用者が送ってくる式を評価する前に、RPN順のトークン列だけから評価のコストを見積もる
+//
+//   librpn::Program p = librpn::compile(expression);
+//   librpn::CostEstimate cost = librpn::estimateCost(p);
+//   if (librpn::admit(cost, limits) == librpn::Admission::Reject) ...
+//
+// 評価と同じ順にスタックをたどり、値の代わりに「スカラーかリストか・リストの要素数・
+// 数値だけから決まるスカラーの値」を積む。{ } の要素数、登録済みのリスト（@name）の
+// 要素数、引数が数値だけの seq・linspace の要素数はそのまま数え、要素ごとの演算・
+// リスト関数はその要素数の分だけ数える。評価はしないため、見積もりの時間は式の長さに比例する。
+// 要素数が変数や未登録のリストで決まる場合は unboundedLists を立てる（その部分は0個として数える）。
+// @name は登録表を引くだけで、setListFileRoot() の下のファイルを開いたり登録したりはしない。
+// 見積もりは目安で、遅延リストの融合・登録済みのリストの累積和などによる短縮は数えない。
+
+// 見積もりの結果
+struct CostEstimate {
+    size_t tokens = 0;              // トークン数
+    size_t maxStackDepth = 0;       // スタックに同時に積まれる値の数の最大
+    size_t maxListSize = 0;         // 途中に現れるリストの要素数の最大
+    size_t listOps = 0;             // リスト値を作る・集約する演算の回数
+    size_t elementOps = 0;          // リストの要素ごとの演算・集約の回数
+    size_t transcendentals = 0;     // 超越関数（sin・exp・log・pow など）の呼び出し回数（要素ごとを含む）
+    size_t orderedElements = 0;     // 順位統計量（median・percentile など）で選択する要素数
+    bool unboundedLists = false;    // 要素数が静的に決まらないリストがある（seq(1, x) など）
+    double nanoseconds = 0;         // 評価時間の見積もり（CostModel による）
+};
+
+// 見積もりの係数（ナノ秒）
+// 既定値は x86-64 の -O2 ビルドで calibrateCostModel() を実行して求めたもの
+struct CostModel {
+    double evaluationNs = 40.0;     // 評価1回の固定分
+    double tokenNs = 10.0;          // トークン1つ（スカラーの演算を含む）
+    double listNs = 150.0;          // リスト値の演算1回の固定分（作業領域の確保など）
+    double elementNs = 1.3;         // 要素ごとの演算・集約1回
+    double transcendentalNs = 13.0; // 超越関数1回（elementNs に上乗せ）
+    double orderedNs = 9.0;         // 順位統計量の要素1個（選択）
+};
+
+// RPN順のトークン列のコストを見積もる（構文の誤りは検査しない。評価時に例外になる）
+CostEstimate estimateCost(const std::vector<Token>& code, const CostModel& model = CostModel());
+
+// コンパイル済みプログラムのコストを見積もる
+CostEstimate estimateCost(const Program& program, const CostModel& model = CostModel());
+
+// この環境で小さな式を評価して係数を求める（数十ミリ秒かかる。起動時に1回呼ぶ想定）
+CostModel calibrateCostModel();
+
+// 受け入れ判定の結果
+enum class Admission {
+    Accept,     // そのまま評価する
+    Isolate,    // 重い式として別のワーカー（プール）で評価する
+    Reject      // 評価しない
+};
+
+// 受け入れの上限（いずれかを超えたら Reject。時間が isolateNanoseconds を超えたら Isolate）
+struct AdmissionLimits {
+    size_t maxTokens = 4096;
+    size_t maxStackDepth = 1024;
+    size_t maxListSize = size_t(1) << 24;
+    double maxNanoseconds = 100e6;          // 100ms
+    double isolateNanoseconds = 1e6;        // 1ms
+    bool rejectUnboundedLists = true;       // false なら要素数が決まらない式は Isolate
+};
+
+// 見積もりを上限と比べる
+Admission admit(const CostEstimate& cost, const AdmissionLimits& limits);
+
+// 受け入れ判定のフック（サーバーなど、呼び出し側で判定を差し替える場合）
+using AdmissionPolicy = std::function<Admission(const CostEstimate&)>;
+
+} // namespace librpn
@@ -0,0 +1,287 @@
+#include "librpn_csv.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace librpn {
+
+//==============================================================================
+// フィールドの解析・結果の書式化
+//==============================================================================
+
+// 前後の空白（行末の \r を含む）と、フィールドを囲む引用符を除いた範囲
+static void trimField(const char*& begin, const char*& end) {
+    while (begin < end && (*begin == ' ' || *begin == '\t')) ++begin;
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) --end;
+    if (end - begin >= 2 && *begin == '"' && end[-1] == '"') {
+        ++begin;
+        --end;
+    }
+}
+
+// フィールド全体が1つの数値なら value に入れて true
+static bool parseField(const char* begin, const char* end, double& value) {
+    trimField(begin, end);
+    if (end - begin >= 2 && *begin == '+' && begin[1] != '-') ++begin;    // from_chars は '+' を受け付けない
+    if (begin == end) return false;
+#if defined(__cpp_lib_to_chars)
+    auto result = std::from_chars(begin, end, value);
+    return result.ec == std::errc() && result.ptr == end;
+#else
+    char buffer[64];
+    size_t n = static_cast<size_t>(end - begin);
+    if (n >= sizeof(buffer)) return false;
+    std::memcpy(buffer, begin, n);
+    buffer[n] = '\0';
+    char* parsed = nullptr;
+    value = std::strtod(buffer, &parsed);
+    return parsed == buffer + n;
+#endif
+}
+
+// 値を往復可能な最短の表記で追加する
+static void appendValue(std::string& text, double value) {
+    char buffer[32];
+#if defined(__cpp_lib_to_chars)
+    char* end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+#else
+    char* end = buffer + std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+#endif
+    text.append(buffer, end);
+    text.push_back('\n');
+}
+
+static const char* findByte(const char* begin, const char* end, char c) {
+    const void* found = std::memchr(begin, c, static_cast<size_t>(end - begin));
+    return found ? static_cast<const char*>(found) : end;
+}
+
+static bool isBlankLine(const char* begin, const char* end) {
+    for (; begin < end; ++begin) {
+        if (*begin != ' ' && *begin != '\t' && *begin != '\r') return false;
+    }
+    return true;
+}
+
+//==============================================================================
+// チャンクの評価
+//==============================================================================
+
+// 改行で区切った入力の範囲と、その評価結果（作業領域はチャンクをまたいで再利用する）
+struct CsvChunk {
+    const char* begin = nullptr;
+    const char* end = nullptr;
+    size_t rows = 0;                            // データ行の数
+    size_t lines = 0;                           // 空行を含む行の数
+    size_t errorLine = 0;                       // 解析に失敗した行（チャンク内で1から。0 なら成功）
+    std::string error;
+    std::string text;                           // 書き出す結果
+    std::vector<std::vector<double>> columns;   // 変数スロットごとの列
+    std::vector<double> results;
+};
+
+// 列の割り当て（slotOfColumn[列] = 変数スロット、使わない列は NO_SLOT）
+struct CsvLayout {
+    static constexpr size_t NO_SLOT = static_cast<size_t>(-1);
+    std::vector<std::string> header;
+    std::vector<size_t> slotOfColumn;
+    size_t slots = 0;
+};
+
+static void evaluateChunk(const Program& program, const CsvLayout& layout, char delimiter, CsvChunk& chunk) {
+    chunk.columns.resize(layout.slots);
+    for (auto& column : chunk.columns) column.clear();
+
+    const char* p = chunk.begin;
+    while (p < chunk.end) {
+        const char* lineEnd = findByte(p, chunk.end, '\n');
+        ++chunk.lines;
+        if (!isBlankLine(p, lineEnd)) {
+            size_t column = 0;
+            size_t found = 0;
+            const char* field = p;
+            while (true) {
+                const char* fieldEnd = findByte(field, lineEnd, delimiter);
+                size_t slot = column < layout.slotOfColumn.size() ? layout.slotOfColumn[column] : CsvLayout::NO_SLOT;
+                if (slot != CsvLayout::NO_SLOT) {
+                    double value;
+                    if (!parseField(field, fieldEnd, value)) {
+                        chunk.errorLine = chunk.lines;
+                        chunk.error = "'" + std::string(field, fieldEnd) + "' is not a number (column '" +
+                                      layout.header[column] + "')";
+                        return;
+                    }
+                    chunk.columns[slot].push_back(value);
+                    ++found;
+                }
+                ++column;
+                if (fieldEnd == lineEnd) break;
+                field = fieldEnd + 1;
+            }
+            if (found != layout.slots) {
+                chunk.errorLine = chunk.lines;
+                chunk.error = "expected " + std::to_string(layout.header.size()) + " fields, found " +
+                              std::to_string(column);
+                return;
+            }
+            ++chunk.rows;
+        }
+        p = lineEnd + 1;
+    }
+
+    std::vector<const double*> columns;
+    columns.reserve(layout.slots);
+    for (const auto& column : chunk.columns) columns.push_back(column.data());
+    chunk.results.resize(chunk.rows);
+    evaluateBatch(program, columns, chunk.rows, chunk.results.data());
+    for (double value : chunk.results) appendValue(chunk.text, value);
+}
+
+//==============================================================================
+// 入力全体の処理
+//==============================================================================
+
+static CsvLayout parseHeader(const Program& program, const char* begin, const char* end, char delimiter) {
+    CsvLayout layout;
+    const char* field = begin;
+    while (true) {
+        const char* fieldEnd = findByte(field, end, delimiter);
+        const char* nameBegin = field;
+        const char* nameEnd = fieldEnd;
+        trimField(nameBegin, nameEnd);
+        layout.header.emplace_back(nameBegin, nameEnd);
+        if (fieldEnd == end) break;
+        field = fieldEnd + 1;
+    }
+
+    layout.slots = program.variables.size();
+    layout.slotOfColumn.assign(layout.header.size(), CsvLayout::NO_SLOT);
+    for (size_t slot = 0; slot < program.variables.size(); ++slot) {
+        auto it = std::find(layout.header.begin(), layout.header.end(), program.variables[slot]);
+        if (it == layout.header.end()) {
+            throw std::invalid_argument("librpn: no column '" + program.variables[slot] + "' in the CSV header");
+        }
+        layout.slotOfColumn[static_cast<size_t>(it - layout.header.begin())] = slot;
+    }
+    return layout;
+}
+
+// release(n) は先頭から n バイトを処理し終えたときに呼ばれる（ページの解放用）
+static size_t processCsv(const Program& program, const char* data, size_t size, TaskPool& pool,
+                         std::ostream& out, const CsvOptions& options,
+                         const std::function<void(size_t)>& release) {
+    const char* end = data + size;
+    const char* p = data;
+    if (size >= 3 && std::memcmp(p, "\xEF\xBB\xBF", 3) == 0) p += 3;     // UTF-8 の BOM
+    const char* headerEnd = findByte(p, end, '\n');
+    CsvLayout layout = parseHeader(program, p, headerEnd, options.delimiter);
+    p = headerEnd < end ? headerEnd + 1 : end;
+
+    size_t chunkBytes = std::max<size_t>(options.chunkBytes, 1);
+    std::vector<CsvChunk> chunks(pool.size() * 2);
+    size_t rows = 0;
+    size_t line = 1;    // ここまでに読んだ行の数（ヘッダを含む）
+    while (p < end) {
+        // 次の chunkBytes バイト目を含む行の末尾で区切る
+        size_t count = 0;
+        for (; count < chunks.size() && p < end; ++count) {
+            CsvChunk& chunk = chunks[count];
+            chunk.begin = p;
+            chunk.end = static_cast<size_t>(end - p) > chunkBytes ? findByte(p + chunkBytes - 1, end, '\n') : end;
+            if (chunk.end < end) ++chunk.end;
+            chunk.rows = chunk.lines = chunk.errorLine = 0;
+            chunk.error.clear();
+            chunk.text.clear();
+            p = chunk.end;
+        }
+
+        pool.run(count, [&](size_t i) { evaluateChunk(program, layout, options.delimiter, chunks[i]); });
+
+        for (size_t i = 0; i < count; ++i) {
+            const CsvChunk& chunk = chunks[i];
+            out.write(chunk.text.data(), static_cast<std::streamsize>(chunk.text.size()));
+            if (chunk.errorLine != 0) {
+                throw std::runtime_error("librpn: line " + std::to_string(line + chunk.errorLine) + ": " +
+                                         chunk.error);
+            }
+            rows += chunk.rows;
+            line += chunk.lines;
+        }
+        release(static_cast<size_t>(p - data));
+    }
+    return rows;
+}
+
+size_t evaluateCsv(const Program& program, const char* data, size_t size, TaskPool& pool,
+                   std::ostream& out, const CsvOptions& options) {
+    return processCsv(program, data, size, pool, out, options, [](size_t) {});
+}
+
+size_t evaluateCsvFile(const Program& program, const std::string& path, TaskPool& pool,
+                       std::ostream& out, const CsvOptions& options) {
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("librpn: cannot open CSV file '" + path + "'");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        throw std::runtime_error("librpn: '" + path + "' is not a regular file");
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size == 0) {
+        ::close(fd);
+        return evaluateCsv(program, "", 0, pool, out, options);
+    }
+    void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) {
+        throw std::runtime_error("librpn: cannot map CSV file '" + path + "'");
+    }
+    // 例外でも解除する
+    struct Mapping {
+        void* address;
+        size_t size;
+        ~Mapping() { munmap(address, size); }
+    } mapping{address, size};
+    madvise(address, size, MADV_SEQUENTIAL);
+
+    // 処理済みのページを捨て、メモリより大きなファイルでも常駐するページを抑える
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t released = 0;
+    auto release = [&](size_t done) {
+        size_t upTo = done / page * page;
+        if (upTo > released) {
+            madvise(static_cast<char*>(address) + released, upTo - released, MADV_DONTNEED);
+            released = upTo;
+        }
+    };
+    return processCsv(program, static_cast<const char*>(address), size, pool, out, options, release);
+#else
+    // mmap のない環境では全体を読み込む
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("librpn: cannot open CSV file '" + path + "'");
+    }
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return evaluateCsv(program, text.data(), text.size(), pool, out, options);
+#endif
+}
+
+} // namespace librpn
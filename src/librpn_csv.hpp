@@ -0,0 +1,43 @@
+#pragma once
+
+#include "librpn.hpp"
+#include "librpn_parallel.hpp"
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+
+namespace librpn {
+
+//==============================================================================
+// CSVの各行への数式の適用
+//==============================================================================
+
+// 1行目（ヘッダ）の列名を変数名として、各行に数式を適用し、結果を1行に1つ書き出す。
+//
+//   librpn::TaskPool pool;
+//   librpn::evaluateCsvFile(librpn::compile("sqrt(x^2 + y^2)"), "data.csv", pool, std::cout);
+//
+// 入力はチャンク（改行で区切った chunkBytes 程度の範囲）に分け、各チャンクの数値の
+// 解析と評価（evaluateBatch）を pool で並列に行う。結果は入力の行の順に書き出す。
+// 一度に扱うのはスレッド数 × 2 個のチャンクだけなので、メモリは入力の大きさによらない。
+//
+// - 区切り文字の前後の空白と、"…" で囲んだフィールドの引用符は無視する
+//   （引用符の中の区切り文字・改行は扱わない）。改行は LF または CRLF。空行は読み飛ばす
+// - 数式で使う列のフィールドが数値でなければ std::runtime_error（ファイルの行番号付き）
+// - ヘッダにない変数があれば std::invalid_argument
+// - リスト値を扱う式は使えない（evaluateBatch と同じ）
+struct CsvOptions {
+    char delimiter = ',';
+    size_t chunkBytes = size_t(1) << 20;    // 1タスクで扱うバイト数の目安
+};
+
+// data[0 … size-1] のCSVを評価して結果を out に書き出し、データ行の数を返す
+size_t evaluateCsv(const Program& program, const char* data, size_t size, TaskPool& pool,
+                   std::ostream& out, const CsvOptions& options = {});
+
+// ファイルのCSVを評価する（POSIX では mmap し、処理済みの範囲はページを解放する）
+// 開けなければ std::runtime_error
+size_t evaluateCsvFile(const Program& program, const std::string& path, TaskPool& pool,
+                       std::ostream& out, const CsvOptions& options = {});
+
+} // namespace librpn
@@ -0,0 +1,334 @@
+#include "librpn_function.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace librpn {
+
+//==============================================================================
+// 本体・引数のRPN（穴あき）
+//==============================================================================
+
+// RPN順のトークン列。仮引数の参照と関数呼び出しは「穴」の Variable トークン
+// （id が holes の添字）になっていて、展開時に引数・本体のRPNで埋める。
+// 呼び出しは1つの値を積む項として変換するため、穴の位置は引数によらず決まる。
+struct FunctionLibrary::Template {
+    struct Hole {
+        static constexpr size_t NO_PARAMETER = static_cast<size_t>(-1);
+        size_t parameter = NO_PARAMETER;        // 仮引数の番号
+        std::string function;                   // 呼び出す関数（parameter が NO_PARAMETER のとき）
+        std::vector<Template> arguments;        // 呼び出しの引数
+    };
+
+    std::vector<Token> code;
+    std::vector<Hole> holes;
+};
+
+struct FunctionLibrary::Definition {
+    std::vector<std::string> parameters;
+    Template body;
+    std::vector<std::string> calls;     // 本体が呼び出す関数（再帰の検出用）
+};
+
+// tokens[begin] の '(' に対応する ')' の位置（リストの { } の中の括弧も数える）
+static size_t closingParen(const std::vector<Token>& tokens, size_t begin, size_t end) {
+    size_t depth = 0;
+    for (size_t i = begin; i < end; ++i) {
+        if (tokens[i].type == TokenType::LeftParen) ++depth;
+        if (tokens[i].type == TokenType::RightParen && --depth == 0) return i;
+    }
+    throw std::invalid_argument("librpn: missing ')' in call to '" + tokens[begin - 1].value() + "'");
+}
+
+// tokens[begin … end) を変換する。parameters にない識別子は、allowVariables なら変数、
+// そうでなければ std::invalid_argument（関数の本体）。呼び出す関数の名前を calls に追加する。
+FunctionLibrary::Template FunctionLibrary::parse(const std::vector<Token>& tokens, size_t begin, size_t end,
+                                                 const std::vector<std::string>& parameters,
+                                                 bool allowVariables, std::vector<std::string>& calls) {
+    Template result;
+    std::vector<Token> infix;
+    infix.reserve(end - begin);
+    auto addHole = [&](Template::Hole hole, const std::string& name) {
+        if (result.holes.size() >= NO_SYMBOL) {
+            throw std::length_error("librpn: too many calls and parameters in one expression");
+        }
+        infix.push_back({TokenType::Variable, name, static_cast<SymbolId>(result.holes.size()), 0.0});
+        result.holes.push_back(std::move(hole));
+    };
+
+    for (size_t i = begin; i < end; ++i) {
+        const Token& token = tokens[i];
+        if (token.type != TokenType::Variable) {
+            infix.push_back(token);
+            continue;
+        }
+
+        // 関数呼び出し（引数は最も外側のカンマで区切る）
+        if (i + 1 < end && tokens[i + 1].type == TokenType::LeftParen) {
+            size_t close = closingParen(tokens, i + 1, end);
+            Template::Hole hole;
+            hole.function = token.text;
+            if (close > i + 2) {
+                size_t start = i + 2;
+                size_t depth = 0;
+                for (size_t j = start; j <= close; ++j) {
+                    TokenType type = tokens[j].type;
+                    if (j == close || (type == TokenType::Comma && depth == 0)) {
+                        if (j == start) {
+                            throw std::invalid_argument("librpn: empty argument in call to '" + token.value() + "'");
+                        }
+                        hole.arguments.push_back(parse(tokens, start, j, parameters, allowVariables, calls));
+                        start = j + 1;
+                    } else if (type == TokenType::LeftParen || type == TokenType::ListStart) {
+                        ++depth;
+                    } else if (type == TokenType::RightParen || type == TokenType::ListEnd) {
+                        --depth;
+                    }
+                }
+            }
+            calls.push_back(token.text);
+            addHole(std::move(hole), token.text);
+            i = close;
+            continue;
+        }
+
+        // 仮引数
+        auto it = std::find(parameters.begin(), parameters.end(), token.text);
+        if (it != parameters.end()) {
+            Template::Hole hole;
+            hole.parameter = static_cast<size_t>(it - parameters.begin());
+            addHole(std::move(hole), token.text);
+        } else if (allowVariables) {
+            infix.push_back(token);
+        } else {
+            throw std::invalid_argument("librpn: unknown name '" + token.value() + "' in function body");
+        }
+    }
+    if (infix.size() == 1) {
+        result.code = std::move(infix);     // 1語だけの引数（変数・数値）は並べ替えない
+    } else {
+        librpn::infixToRPN(std::move(infix), result.code);
+    }
+    return result;
+}
+
+//==============================================================================
+// 定数の畳み込み
+//==============================================================================
+
+// 数値を往復可能な最短の表記にする
+static std::string formatNumber(double value) {
+    char buffer[32];
+#if defined(__cpp_lib_to_chars)
+    char* end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+#else
+    char* end = buffer + std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+#endif
+    return std::string(buffer, end);
+}
+
+// 数値・定数だけを引数とする演算子・関数を、計算した値の数値トークンに置き換える
+// リストを扱う式は対象外。計算で例外・非有限の値になる部分式はそのまま残す（評価時と同じ結果にする）。
+static void foldConstants(std::vector<Token>& code) {
+    if (usesListArithmetic(code)) return;
+    for (const Token& token : code) {
+        if (token.type == TokenType::ListStart || token.type == TokenType::ListEnd ||
+            token.type == TokenType::ListFunction) {
+            return;
+        }
+    }
+
+    // 出力（code の先頭から詰め直す）の各項の先頭の位置と、数値だけからなるか
+    struct Operand {
+        size_t start;
+        bool constant;
+    };
+    std::vector<Operand> stack;
+    size_t size = 0;
+    for (size_t i = 0; i < code.size(); ++i) {
+        size_t arity = 0;
+        switch (code[i].type) {
+            case TokenType::Operator:
+            case TokenType::BinaryFunction:  arity = 2; break;
+            case TokenType::UnaryFunction:   arity = 1; break;
+            case TokenType::TernaryFunction: arity = 3; break;
+            default: break;
+        }
+        if (arity == 0) {
+            bool constant = code[i].type == TokenType::Number || code[i].type == TokenType::Constant;
+            stack.push_back({size, constant});
+            if (size != i) code[size] = std::move(code[i]);
+            ++size;
+            continue;
+        }
+        if (stack.size() < arity) {
+            // 評価時のエラーに任せ、残りはそのまま詰める
+            for (; i < code.size(); ++i, ++size) {
+                if (size != i) code[size] = std::move(code[i]);
+            }
+            break;
+        }
+
+        size_t start = stack[stack.size() - arity].start;
+        bool constant = true;
+        for (size_t j = stack.size() - arity; j < stack.size(); ++j) constant = constant && stack[j].constant;
+        stack.resize(stack.size() - arity);
+        if (size != i) code[size] = std::move(code[i]);
+        ++size;
+        if (constant) {
+            constant = false;
+            try {
+                double value = calculateRPN(std::vector<Token>(code.begin() + start, code.begin() + size));
+                if (std::isfinite(value)) {
+                    code[start] = {TokenType::Number, formatNumber(value), NO_SYMBOL, value};
+                    size = start + 1;
+                    constant = true;
+                }
+            } catch (const std::exception&) {
+            }
+        }
+        stack.push_back({start, constant});
+    }
+    code.resize(size);
+}
+
+//==============================================================================
+// 定義・展開
+//==============================================================================
+
+FunctionLibrary::FunctionLibrary() = default;
+FunctionLibrary::~FunctionLibrary() = default;
+FunctionLibrary::FunctionLibrary(FunctionLibrary&&) noexcept = default;
+FunctionLibrary& FunctionLibrary::operator=(FunctionLibrary&&) noexcept = default;
+
+// 名前が組み込みのシンボルでない1つの識別子か
+static void requireIdentifier(const std::string& name, const char* what) {
+    std::vector<Token> tokens = tokenize(name);
+    if (tokens.size() != 1 || tokens[0].type != TokenType::Variable || tokens[0].text != name) {
+        throw std::invalid_argument(std::string("librpn: invalid ") + what + " name '" + name + "'");
+    }
+}
+
+void FunctionLibrary::define(const std::string& definition) {
+    // 最初の単独の '='（"==" "<=" ">=" "!=" の一部でないもの）で頭部と本体に分ける
+    size_t equals = 0;
+    while ((equals = definition.find('=', equals)) != std::string::npos) {
+        bool partOfOperator = (equals + 1 < definition.size() && definition[equals + 1] == '=') ||
+                              (equals > 0 && std::string("<>!=").find(definition[equals - 1]) != std::string::npos);
+        if (!partOfOperator) break;
+        equals += 2;
+    }
+    if (equals == std::string::npos) {
+        throw std::invalid_argument("librpn: expected 'name(parameters) = body' in '" + definition + "'");
+    }
+
+    // 頭部は name ( p1 , p2 , ... )
+    std::vector<Token> head = tokenize(definition.substr(0, equals));
+    bool valid = head.size() >= 3 && head[0].type == TokenType::Variable &&
+                 head[1].type == TokenType::LeftParen && head.back().type == TokenType::RightParen;
+    std::vector<std::string> parameters;
+    for (size_t i = 2; valid && i + 1 < head.size(); i += 2) {
+        valid = head[i].type == TokenType::Variable &&
+                (i + 2 == head.size() || head[i + 1].type == TokenType::Comma);
+        if (valid) parameters.push_back(head[i].text);
+    }
+    valid = valid && (head.size() == 3 || head[head.size() - 2].type == TokenType::Variable);
+    if (!valid) {
+        throw std::invalid_argument("librpn: expected 'name(parameters) = body' in '" + definition + "'");
+    }
+    define(head[0].text, parameters, definition.substr(equals + 1));
+}
+
+void FunctionLibrary::define(const std::string& name, const std::vector<std::string>& parameters,
+                             const std::string& body) {
+    requireIdentifier(name, "function");
+    for (size_t i = 0; i < parameters.size(); ++i) {
+        requireIdentifier(parameters[i], "parameter");
+        if (std::find(parameters.begin(), parameters.begin() + i, parameters[i]) != parameters.begin() + i) {
+            throw std::invalid_argument("librpn: duplicate parameter '" + parameters[i] + "' in '" + name + "'");
+        }
+    }
+
+    Definition definition;
+    definition.parameters = parameters;
+    std::vector<Token> tokens = tokenize(body);
+    if (tokens.empty()) {
+        throw std::invalid_argument("librpn: empty body for function '" + name + "'");
+    }
+    definition.body = parse(tokens, 0, tokens.size(), parameters, false, definition.calls);
+
+    // 呼び出しをたどって自分に戻るなら再帰（未定義の関数の先はたどらない）
+    std::vector<std::string> pending = definition.calls;
+    std::unordered_set<std::string> visited;
+    while (!pending.empty()) {
+        std::string callee = std::move(pending.back());
+        pending.pop_back();
+        if (callee == name) {
+            throw std::invalid_argument("librpn: function '" + name + "' is recursive");
+        }
+        if (!visited.insert(callee).second) continue;
+        auto it = functions_.find(callee);
+        if (it != functions_.end()) pending.insert(pending.end(), it->second.calls.begin(), it->second.calls.end());
+    }
+    functions_[name] = std::move(definition);
+}
+
+bool FunctionLibrary::remove(const std::string& name) {
+    return functions_.erase(name) > 0;
+}
+
+bool FunctionLibrary::contains(const std::string& name) const {
+    return functions_.find(name) != functions_.end();
+}
+
+size_t FunctionLibrary::size() const {
+    return functions_.size();
+}
+
+void FunctionLibrary::expand(const Template& code, const std::vector<std::vector<Token>>& arguments,
+                             std::vector<Token>& output) const {
+    for (const Token& token : code.code) {
+        if (token.type != TokenType::Variable || token.id == NO_SYMBOL) {
+            output.push_back(token);
+            continue;
+        }
+        const Template::Hole& hole = code.holes[token.id];
+        if (hole.parameter != Template::Hole::NO_PARAMETER) {
+            output.insert(output.end(), arguments[hole.parameter].begin(), arguments[hole.parameter].end());
+            continue;
+        }
+
+        auto it = functions_.find(hole.function);
+        if (it == functions_.end()) {
+            throw std::invalid_argument("librpn: unknown function '" + hole.function + "'");
+        }
+        const Definition& callee = it->second;
+        if (hole.arguments.size() != callee.parameters.size()) {
+            throw std::invalid_argument("librpn: '" + hole.function + "' takes " +
+                                        std::to_string(callee.parameters.size()) + " argument(s), got " +
+                                        std::to_string(hole.arguments.size()));
+        }
+        std::vector<std::vector<Token>> values(hole.arguments.size());
+        for (size_t i = 0; i < values.size(); ++i) expand(hole.arguments[i], arguments, values[i]);
+        expand(callee.body, values, output);
+    }
+}
+
+Program FunctionLibrary::compile(const std::string& expression) const {
+    std::vector<Token> tokens = tokenize(expression);
+    std::vector<std::string> calls;
+    Template code = parse(tokens, 0, tokens.size(), {}, true, calls);
+    std::vector<Token> expanded;
+    expand(code, {}, expanded);
+    foldConstants(expanded);
+    return librpn::compile(std::move(expanded));
+}
+
+std::string FunctionLibrary::infixToRPN(const std::string& expression) const {
+    return formatRPN(compile(expression).code);
+}
+
+} // namespace librpn
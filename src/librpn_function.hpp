@@ -0,0 +1,73 @@
+#pragma once
+
+#include "librpn.hpp"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace librpn {
+
+//==============================================================================
+// ユーザー定義関数（コンパイル時のインライン展開）
+//==============================================================================
+
+// 引数を取る補助の数式を関数として定義し、式の中から呼び出す
+//
+//   FunctionLibrary f;
+//   f.define("hyp(a, b) = sqrt(a^2 + b^2)");
+//   f.define("norm3(x, y, z) = hyp(hyp(x, y), z)");
+//   Program p = f.compile("norm3(u, v, 2) / 2");
+//   evaluate(p, {1.0, 2.0});
+//
+// 本体は定義時に1回だけ字句解析・RPN変換し、呼び出しは compile() のときに本体の
+// RPNで置き換える（引数の式を仮引数の位置に埋め込む）。結果は関数呼び出しを含まない
+// 通常の Program で、evaluate・evaluateBatch・自動微分などにそのまま使える。
+// 展開後、数値と定数だけからなる部分式は1つの数値にまとめる（hyp(3, 4) → 5）。
+//
+// 本体で使える名前は仮引数と関数呼び出しだけ（それ以外の識別子は std::invalid_argument）。
+// 呼び出す関数はあとから定義してよい。直接・間接の再帰は定義時に std::invalid_argument。
+// const のメンバ関数は複数スレッドから同時に呼んでよい（定義の変更とは同時に呼ばないこと）。
+class FunctionLibrary {
+public:
+    FunctionLibrary();
+    ~FunctionLibrary();
+    FunctionLibrary(FunctionLibrary&&) noexcept;
+    FunctionLibrary& operator=(FunctionLibrary&&) noexcept;
+
+    // "name(p1, p2, ...) = 本体（中置記法）" の形の定義を追加する。既存の名前なら置き換える
+    void define(const std::string& definition);
+
+    // 名前・仮引数・本体を分けて定義する
+    void define(const std::string& name, const std::vector<std::string>& parameters, const std::string& body);
+
+    // 定義を削除する（なければ false）
+    bool remove(const std::string& name);
+
+    // 定義済みの名前かどうか
+    bool contains(const std::string& name) const;
+
+    // 定義の数
+    size_t size() const;
+
+    // 中置記法をコンパイルし、ユーザー定義関数の呼び出しを展開する
+    // 未定義の関数の呼び出し・引数の数の誤りは std::invalid_argument
+    Program compile(const std::string& expression) const;
+
+    // 展開したRPN文字列（compile の結果を formatRPN したもの）
+    std::string infixToRPN(const std::string& expression) const;
+
+private:
+    struct Template;
+    struct Definition;
+
+    static Template parse(const std::vector<Token>& tokens, size_t begin, size_t end,
+                          const std::vector<std::string>& parameters, bool allowVariables,
+                          std::vector<std::string>& calls);
+    void expand(const Template& code, const std::vector<std::vector<Token>>& arguments,
+                std::vector<Token>& output) const;
+
+    std::unordered_map<std::string, Definition> functions_;
+};
+
+} // namespace librpn
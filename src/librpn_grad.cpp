@@ -0,0 +1,404 @@
+#include "librpn_grad.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+namespace librpn {
+
+//==============================================================================
+// 導関数テーブル
+//==============================================================================
+
+// 演算子・二項関数: a, b と結果 r から ∂r/∂a, ∂r/∂b を求める
+using BinaryDerivative = void (*)(double a, double b, double r, double& da, double& db);
+
+// 単項関数: a と結果 r から dr/da を求める
+using UnaryDerivative = double (*)(double a, double r);
+
+// 3引数の関数: c, a, b から ∂r/∂c, ∂r/∂a, ∂r/∂b を求める
+using TernaryDerivative = void (*)(double c, double a, double b, double& dc, double& da, double& db);
+
+// リスト関数: 要素 v と結果 r から ∂r/∂v[i] を dv[i] に書き込む
+using ListDerivative = void (*)(const std::vector<double>& v, double r, double* dv);
+
+static void powDerivative(double a, double b, double r, double& da, double& db) {
+    da = b * std::pow(a, b - 1);
+    db = a > 0 ? r * std::log(a) : 0.0;
+}
+
+// fmod(a, b) = a - trunc(a / b) * b
+static void fmodDerivative(double a, double b, double, double& da, double& db) {
+    da = 1.0;
+    db = -std::trunc(a / b);
+}
+
+// 比較・論理演算（結果は階段関数なので、値が変わる点を除いて偏微分は0）
+static void stepDerivative(double, double, double, double& da, double& db) {
+    da = 0.0;
+    db = 0.0;
+}
+
+// 演算子・二項関数の導関数テーブル（OPERATORS / BINARY_FUNCTIONS と同じ名前）
+static const std::unordered_map<std::string, BinaryDerivative> BINARY_DERIVATIVES = {
+    // 演算子
+    {"+", [](double, double, double, double& da, double& db) { da = 1.0; db = 1.0; }},
+    {"-", [](double, double, double, double& da, double& db) { da = 1.0; db = -1.0; }},
+    {"*", [](double a, double b, double, double& da, double& db) { da = b; db = a; }},
+    {"/", [](double, double b, double r, double& da, double& db) { da = 1.0 / b; db = -r / b; }},
+    {"%", fmodDerivative},
+    {"^", powDerivative},
+    {"×", [](double a, double b, double, double& da, double& db) { da = b; db = a; }},
+    {"÷", [](double, double b, double r, double& da, double& db) { da = 1.0 / b; db = -r / b; }},
+    {"·", [](double a, double b, double, double& da, double& db) { da = b; db = a; }},
+    {"<", stepDerivative},
+    {"<=", stepDerivative},
+    {">", stepDerivative},
+    {">=", stepDerivative},
+    {"≤", stepDerivative},
+    {"≥", stepDerivative},
+    {"==", stepDerivative},
+    {"!=", stepDerivative},
+    {"≠", stepDerivative},
+    {"and", stepDerivative},
+    {"&&", stepDerivative},
+    {"∧", stepDerivative},
+    {"or", stepDerivative},
+    {"||", stepDerivative},
+    {"∨", stepDerivative},
+    // 二項関数
+    {"pow", powDerivative},
+    {"max", [](double a, double b, double, double& da, double& db) {
+        da = a >= b ? 1.0 : 0.0;
+        db = 1.0 - da;
+    }},
+    {"min", [](double a, double b, double, double& da, double& db) {
+        da = a <= b ? 1.0 : 0.0;
+        db = 1.0 - da;
+    }},
+    {"atan2", [](double a, double b, double, double& da, double& db) {
+        double d = a * a + b * b;
+        da = b / d;
+        db = -a / d;
+    }},
+    {"mod", fmodDerivative},
+};
+
+// 単項関数の導関数テーブル（UNARY_FUNCTIONS と同じ名前）
+static const std::unordered_map<std::string, UnaryDerivative> UNARY_DERIVATIVES = {
+    {"sqrt",  [](double, double r) { return 0.5 / r; }},
+    {"sin",   [](double a, double) { return std::cos(a); }},
+    {"cos",   [](double a, double) { return -std::sin(a); }},
+    {"tan",   [](double, double r) { return 1.0 + r * r; }},
+    {"log",   [](double a, double) { return 1.0 / a; }},
+    {"ln",    [](double a, double) { return 1.0 / a; }},
+    {"log10", [](double a, double) { return 1.0 / (a * M_LN10); }},
+    {"abs",   [](double a, double) { return a > 0 ? 1.0 : (a < 0 ? -1.0 : 0.0); }},
+    {"exp",   [](double, double r) { return r; }},
+    {"floor", [](double, double) { return 0.0; }},
+    {"ceil",  [](double, double) { return 0.0; }},
+    {"not",   [](double, double) { return 0.0; }},
+    {"!",     [](double, double) { return 0.0; }},
+    {"¬",     [](double, double) { return 0.0; }},
+    {"√",     [](double, double r) { return 0.5 / r; }},
+};
+
+// 3引数の関数の導関数テーブル（TERNARY_FUNCTIONS と同じ名前）
+static const std::unordered_map<std::string, TernaryDerivative> TERNARY_DERIVATIVES = {
+    // 選ばれた側の引数にだけ勾配が流れる
+    {"if", [](double c, double, double, double& dc, double& da, double& db) {
+        dc = 0.0;
+        da = c != 0 ? 1.0 : 0.0;
+        db = 1.0 - da;
+    }},
+};
+
+static void sumDerivative(const std::vector<double>& v, double, double* dv) {
+    for (size_t i = 0; i < v.size(); ++i) dv[i] = 1.0;
+}
+
+// 積: 自分以外の要素の積（0を含む場合も正しく求めるため前後の累積積を使う）
+static void productDerivative(const std::vector<double>& v, double, double* dv) {
+    double prefix = 1.0;
+    for (size_t i = 0; i < v.size(); ++i) {
+        dv[i] = prefix;
+        prefix *= v[i];
+    }
+    double suffix = 1.0;
+    for (size_t i = v.size(); i-- > 0;) {
+        dv[i] *= suffix;
+        suffix *= v[i];
+    }
+}
+
+// 分散: ∂/∂x_i Σ(x_j - m)^2 / d = 2(x_i - m) / d（平均を通じた寄与は打ち消し合う）
+static void varianceDerivative(const std::vector<double>& v, double divisor, double scale, double* dv) {
+    double mean = 0;
+    for (double x : v) mean += x;
+    mean /= v.size();
+    for (size_t i = 0; i < v.size(); ++i) dv[i] = scale * 2.0 * (v[i] - mean) / divisor;
+}
+
+// リスト関数の導関数テーブル（微分できるものだけ）
+static const std::unordered_map<std::string, ListDerivative> LIST_DERIVATIVES = {
+    {"sum", sumDerivative},
+    {"ΣLIST", sumDerivative},
+    {"product", productDerivative},
+    {"ΠLIST", productDerivative},
+    {"mean", [](const std::vector<double>& v, double, double* dv) {
+        for (size_t i = 0; i < v.size(); ++i) dv[i] = 1.0 / v.size();
+    }},
+    {"var", [](const std::vector<double>& v, double, double* dv) {
+        if (!v.empty()) varianceDerivative(v, v.size(), 1.0, dv);
+    }},
+    {"svar", [](const std::vector<double>& v, double, double* dv) {
+        if (v.size() < 2) { for (size_t i = 0; i < v.size(); ++i) dv[i] = 0.0; return; }
+        varianceDerivative(v, v.size() - 1, 1.0, dv);
+    }},
+    // 標準偏差: d√V = dV / (2√V)
+    {"stddev", [](const std::vector<double>& v, double r, double* dv) {
+        if (!v.empty()) varianceDerivative(v, v.size(), r > 0 ? 0.5 / r : 0.0, dv);
+    }},
+    {"sstddev", [](const std::vector<double>& v, double r, double* dv) {
+        if (v.size() < 2) { for (size_t i = 0; i < v.size(); ++i) dv[i] = 0.0; return; }
+        varianceDerivative(v, v.size() - 1, r > 0 ? 0.5 / r : 0.0, dv);
+    }},
+    {"count", [](const std::vector<double>& v, double, double* dv) {
+        for (size_t i = 0; i < v.size(); ++i) dv[i] = 0.0;
+    }},
+};
+
+// シンボルIDから計算関数と導関数を引くための表（SYMBOLSと同じ添字）
+struct SymbolDerivatives {
+    const std::function<double(double, double)>* binary = nullptr;
+    const std::function<double(double)>* unary = nullptr;
+    const std::function<double(double, double, double)>* ternary = nullptr;
+    const std::function<double(ListView)>* list = nullptr;
+    BinaryDerivative binaryDerivative = nullptr;
+    UnaryDerivative unaryDerivative = nullptr;
+    TernaryDerivative ternaryDerivative = nullptr;
+    ListDerivative listDerivative = nullptr;
+};
+
+template <typename Table>
+static typename Table::mapped_type findDerivative(const Table& table, const std::string& name) {
+    auto it = table.find(name);
+    return it != table.end() ? it->second : nullptr;
+}
+
+static std::vector<SymbolDerivatives> buildSymbolDerivatives() {
+    std::vector<SymbolDerivatives> result(SYMBOLS.size());
+    for (size_t i = 0; i < SYMBOLS.size(); ++i) {
+        const std::string& name = SYMBOLS[i].name;
+        SymbolDerivatives& d = result[i];
+        if (SYMBOLS[i].listResult) continue;    // 結果がリストの関数（窓関数・seq など）は微分できない
+        switch (SYMBOLS[i].type) {
+            case TokenType::Operator:
+                d.binary = &OPERATORS.at(name).func;
+                d.binaryDerivative = findDerivative(BINARY_DERIVATIVES, name);
+                break;
+            case TokenType::BinaryFunction:
+                d.binary = &BINARY_FUNCTIONS.at(name).func;
+                d.binaryDerivative = findDerivative(BINARY_DERIVATIVES, name);
+                break;
+            case TokenType::UnaryFunction:
+                d.unary = &UNARY_FUNCTIONS.at(name).func;
+                d.unaryDerivative = findDerivative(UNARY_DERIVATIVES, name);
+                break;
+            case TokenType::TernaryFunction:
+                d.ternary = &TERNARY_FUNCTIONS.at(name).func;
+                d.ternaryDerivative = findDerivative(TERNARY_DERIVATIVES, name);
+                break;
+            case TokenType::ListFunction:
+                if (SYMBOLS[i].arity == 2) break;   // パラメータ付き（percentile など）は微分できない
+                d.list = &LIST_FUNCTIONS.at(name).func;
+                d.listDerivative = findDerivative(LIST_DERIVATIVES, name);
+                break;
+            default:
+                break;
+        }
+    }
+    return result;
+}
+
+// SYMBOLS などは別の翻訳単位で初期化されるため、初回使用時に構築する
+static const std::vector<SymbolDerivatives>& symbolDerivatives() {
+    static const std::vector<SymbolDerivatives> table = buildSymbolDerivatives();
+    return table;
+}
+
+bool isDifferentiable(SymbolId id) {
+    const auto& table = symbolDerivatives();
+    if (id >= table.size()) return false;
+    const SymbolDerivatives& d = table[id];
+    return d.binaryDerivative || d.unaryDerivative || d.ternaryDerivative || d.listDerivative;
+}
+
+//==============================================================================
+// テープの記録と逆伝播
+//==============================================================================
+
+// テープの1ノード（値と、オペランドへの辺の範囲）
+struct TapeNode {
+    double value;
+    size_t edgeBegin;
+    size_t edgeEnd;
+    SymbolId variable;      // 変数ノードならスロット番号、それ以外は NO_SYMBOL
+};
+
+// オペランドのノードと局所的な偏微分
+struct TapeEdge {
+    size_t operand;
+    double partial;
+};
+
+static inline void requireNodes(const std::vector<size_t>& stack, size_t count, const Token& token) {
+    if (stack.size() < count) {
+        throw std::runtime_error("librpn: stack underflow at '" + token.value() + "'");
+    }
+}
+
+GradientResult gradient(const Program& program, const std::vector<double>& variables) {
+    if (usesListArithmetic(program.code)) {
+        throw std::invalid_argument("librpn: list values are not differentiable");
+    }
+    const auto& derivatives = symbolDerivatives();
+    std::vector<TapeNode> nodes;
+    std::vector<TapeEdge> edges;
+    std::vector<size_t> stack;       // ノード番号のスタック
+    std::vector<size_t> markers;     // リスト開始時のスタックの深さ
+    std::vector<double> values;
+    std::vector<double> partials;
+    nodes.reserve(program.code.size());
+    edges.reserve(program.code.size() * 2);
+
+    auto addNode = [&](double value, SymbolId variable) {
+        nodes.push_back({value, edges.size(), edges.size(), variable});
+        stack.push_back(nodes.size() - 1);
+    };
+
+    // 前進評価（各演算の局所的な偏微分を記録）
+    for (size_t pc = 0; pc < program.code.size(); ++pc) {
+        const Token& token = program.code[pc];
+        switch (token.type) {
+            case TokenType::Number:
+            case TokenType::Constant:
+                addNode(program.literals[pc], NO_SYMBOL);
+                break;
+
+            case TokenType::Variable:
+                if (token.id >= variables.size()) {
+                    throw std::out_of_range("librpn: no value for variable '" + token.text + "'");
+                }
+                addNode(variables[token.id], token.id);
+                break;
+
+            case TokenType::ListStart:
+                markers.push_back(stack.size());
+                break;
+
+            case TokenType::Operator:
+            case TokenType::BinaryFunction: {
+                requireNodes(stack, 2, token);
+                const SymbolDerivatives& d = derivatives[token.id];
+                size_t nb = stack.back(); stack.pop_back();
+                size_t na = stack.back(); stack.pop_back();
+                double a = nodes[na].value;
+                double b = nodes[nb].value;
+                double r = (*d.binary)(a, b);
+                double da, db;
+                d.binaryDerivative(a, b, r, da, db);
+                edges.push_back({na, da});
+                edges.push_back({nb, db});
+                nodes.push_back({r, edges.size() - 2, edges.size(), NO_SYMBOL});
+                stack.push_back(nodes.size() - 1);
+                break;
+            }
+
+            case TokenType::UnaryFunction: {
+                requireNodes(stack, 1, token);
+                const SymbolDerivatives& d = derivatives[token.id];
+                size_t na = stack.back(); stack.pop_back();
+                double a = nodes[na].value;
+                double r = (*d.unary)(a);
+                edges.push_back({na, d.unaryDerivative(a, r)});
+                nodes.push_back({r, edges.size() - 1, edges.size(), NO_SYMBOL});
+                stack.push_back(nodes.size() - 1);
+                break;
+            }
+
+            case TokenType::TernaryFunction: {
+                requireNodes(stack, 3, token);
+                const SymbolDerivatives& d = derivatives[token.id];
+                size_t nb = stack.back(); stack.pop_back();
+                size_t na = stack.back(); stack.pop_back();
+                size_t nc = stack.back(); stack.pop_back();
+                double c = nodes[nc].value;
+                double a = nodes[na].value;
+                double b = nodes[nb].value;
+                double r = (*d.ternary)(c, a, b);
+                double dc, da, db;
+                d.ternaryDerivative(c, a, b, dc, da, db);
+                edges.push_back({nc, dc});
+                edges.push_back({na, da});
+                edges.push_back({nb, db});
+                nodes.push_back({r, edges.size() - 3, edges.size(), NO_SYMBOL});
+                stack.push_back(nodes.size() - 1);
+                break;
+            }
+
+            case TokenType::ListFunction: {
+                const SymbolDerivatives& d = derivatives[token.id];
+                if (!d.listDerivative) {
+                    throw std::invalid_argument("librpn: '" + token.value() + "' is not differentiable");
+                }
+                size_t start = 0;
+                if (!markers.empty()) {
+                    start = std::min(markers.back(), stack.size());
+                    markers.pop_back();
+                }
+                size_t count = stack.size() - start;
+                values.resize(count);
+                for (size_t k = 0; k < count; ++k) values[k] = nodes[stack[start + k]].value;
+                double r = (*d.list)(values);
+                partials.resize(count);
+                d.listDerivative(values, r, partials.data());
+                size_t edgeBegin = edges.size();
+                for (size_t k = 0; k < count; ++k) edges.push_back({stack[start + k], partials[k]});
+                stack.resize(start);
+                nodes.push_back({r, edgeBegin, edges.size(), NO_SYMBOL});
+                stack.push_back(nodes.size() - 1);
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+    if (stack.empty()) {
+        throw std::runtime_error("librpn: empty expression");
+    }
+
+    // 逆伝播（ノードは記録順にトポロジカル順なので逆順にたどるだけでよい）
+    GradientResult result;
+    result.value = nodes[stack.back()].value;
+    result.gradient.assign(variables.size(), 0.0);
+    std::vector<double> adjoint(nodes.size(), 0.0);
+    adjoint[stack.back()] = 1.0;
+    for (size_t i = stack.back() + 1; i-- > 0;) {
+        double g = adjoint[i];
+        if (g == 0.0) continue;
+        const TapeNode& node = nodes[i];
+        for (size_t e = node.edgeBegin; e < node.edgeEnd; ++e) {
+            adjoint[edges[e].operand] += g * edges[e].partial;
+        }
+        if (node.variable != NO_SYMBOL) {
+            result.gradient[node.variable] += g;
+        }
+    }
+    return result;
+}
+
+} // namespace librpn
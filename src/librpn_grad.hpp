@@ -0,0 +1,36 @@
+#pragma once
+
+#include "librpn.hpp"
+
+#include <vector>
+
+namespace librpn {
+
+//==============================================================================
+// 自動微分（リバースモード）
+//==============================================================================
+
+// 値と全変数についての偏微分
+struct GradientResult {
+    double value = 0.0;
+    std::vector<double> gradient;   // gradient[i] = ∂f/∂(スロット i の変数)
+};
+
+// コンパイル済みプログラムの値と勾配を求める
+//
+//   Program p = compile("x * y + sin(x)");
+//   GradientResult g = gradient(p, {2.0, 3.0});
+//   // g.value = 6 + sin(2), g.gradient = {3 + cos(2), 2}
+//
+// 前進評価で各演算の局所的な偏微分をテープに記録し、1回の逆伝播で全変数の
+// 偏微分を求める（変数の数によらず評価1回分 + 逆伝播1回分のコスト）。
+// 演算子・単項関数・二項関数はすべて微分できる。リスト関数は sum / ΣLIST /
+// product / ΠLIST / mean / var / svar / stddev / sstddev / count のみで、
+// それ以外（median など）を含む場合は std::invalid_argument。
+// 不連続点（floor の整数値、max の引数が等しい場合など）では片側の微分を返す。
+GradientResult gradient(const Program& program, const std::vector<double>& variables = {});
+
+// シンボルが微分できるか（演算子・関数以外は false）
+bool isDifferentiable(SymbolId id);
+
+} // namespace librpn
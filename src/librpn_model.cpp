@@ -0,0 +1,203 @@
+#include "librpn_model.hpp"
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+
+namespace librpn {
+
+//==============================================================================
+// 定義・入力
+//==============================================================================
+
+size_t Model::nodeIndex(const std::string& name) {
+    auto it = index_.find(name);
+    if (it != index_.end()) return it->second;
+    index_.emplace(name, nodes_.size());
+    nodes_.push_back({});
+    nodes_.back().name = name;
+    structureChanged_ = true;
+    return nodes_.size() - 1;
+}
+
+void Model::setInput(const std::string& name, double value) {
+    size_t index = nodeIndex(name);
+    Node& node = nodes_[index];
+    if (!node.isInput) {
+        // 数式を入力に置き換える
+        node.isInput = true;
+        node.program = Program();
+        node.inputs.clear();
+        structureChanged_ = true;
+    } else if (node.value == value) {
+        return;
+    }
+    node.value = value;
+    changed_.push_back(index);
+}
+
+void Model::define(const std::string& name, const std::string& formula) {
+    Program program = compile(formula);
+    size_t index = nodeIndex(name);
+    Node& node = nodes_[index];
+    node.isInput = false;
+    node.program = std::move(program);
+    structureChanged_ = true;
+    changed_.push_back(index);
+}
+
+double Model::value(const std::string& name) const {
+    auto it = index_.find(name);
+    if (it == index_.end()) {
+        throw std::out_of_range("librpn: unknown name '" + name + "'");
+    }
+    return nodes_[it->second].value;
+}
+
+bool Model::contains(const std::string& name) const {
+    return index_.find(name) != index_.end();
+}
+
+//==============================================================================
+// 依存グラフの構築
+//==============================================================================
+
+void Model::rebuild() {
+    // 参照の解決
+    for (auto& node : nodes_) {
+        node.dependents.clear();
+    }
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+        Node& node = nodes_[i];
+        node.inputs.clear();
+        if (node.isInput) continue;
+        for (const auto& name : node.program.variables) {
+            auto it = index_.find(name);
+            if (it == index_.end()) {
+                throw std::runtime_error("librpn: undefined name '" + name + "' in '" + node.name + "'");
+            }
+            node.inputs.push_back(it->second);
+            nodes_[it->second].dependents.push_back(i);
+        }
+    }
+
+    // トポロジカルソート（Kahn法）で依存の深さを求める
+    std::vector<size_t> pending(nodes_.size());
+    std::vector<size_t> ready;
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+        pending[i] = nodes_[i].inputs.size();
+        nodes_[i].level = 0;
+        if (pending[i] == 0) ready.push_back(i);
+    }
+    size_t visited = 0;
+    while (!ready.empty()) {
+        size_t i = ready.back();
+        ready.pop_back();
+        ++visited;
+        for (size_t d : nodes_[i].dependents) {
+            nodes_[d].level = std::max(nodes_[d].level, nodes_[i].level + 1);
+            if (--pending[d] == 0) ready.push_back(d);
+        }
+    }
+    if (visited != nodes_.size()) {
+        for (size_t i = 0; i < nodes_.size(); ++i) {
+            if (pending[i] != 0) {
+                throw std::runtime_error("librpn: circular reference involving '" + nodes_[i].name + "'");
+            }
+        }
+    }
+
+    structureChanged_ = false;
+}
+
+//==============================================================================
+// 再計算
+//==============================================================================
+
+void Model::markDirty(size_t index) {
+    std::vector<size_t> stack = {index};
+    while (!stack.empty()) {
+        size_t i = stack.back();
+        stack.pop_back();
+        Node& node = nodes_[i];
+        if (node.dirty) continue;
+        node.dirty = true;
+        dirty_.push_back(i);
+        stack.insert(stack.end(), node.dependents.begin(), node.dependents.end());
+    }
+}
+
+void Model::evaluateNode(Node& node, std::vector<double>& args) {
+    args.resize(node.inputs.size());
+    for (size_t k = 0; k < node.inputs.size(); ++k) {
+        args[k] = nodes_[node.inputs[k]].value;
+    }
+    node.value = evaluate(node.program, args);
+}
+
+size_t Model::recompute(unsigned threads) {
+    if (structureChanged_) {
+        rebuild();
+    }
+
+    // 変更されたノードの下流を dirty にする
+    for (size_t i : changed_) {
+        if (nodes_[i].isInput) {
+            for (size_t d : nodes_[i].dependents) markDirty(d);
+        } else {
+            markDirty(i);
+        }
+    }
+    changed_.clear();
+
+    // 依存の深さ順に並べる（同じ段の数式は互いに独立）
+    std::sort(dirty_.begin(), dirty_.end(), [this](size_t a, size_t b) {
+        return nodes_[a].level != nodes_[b].level ? nodes_[a].level < nodes_[b].level : a < b;
+    });
+
+    std::vector<double> args;
+    size_t begin = 0;
+    while (begin < dirty_.size()) {
+        size_t level = nodes_[dirty_[begin]].level;
+        size_t end = begin;
+        while (end < dirty_.size() && nodes_[dirty_[end]].level == level) ++end;
+
+        size_t count = end - begin;
+        // 並列化は1スレッドあたりの数式が十分にある場合のみ
+        unsigned workers = static_cast<unsigned>(std::min<size_t>(threads, count / PARALLEL_GRAIN));
+        if (workers <= 1) {
+            for (size_t k = begin; k < end; ++k) {
+                evaluateNode(nodes_[dirty_[k]], args);
+            }
+        } else {
+            std::vector<std::thread> pool;
+            std::vector<std::exception_ptr> errors(workers);
+            for (unsigned w = 0; w < workers; ++w) {
+                size_t first = begin + count * w / workers;
+                size_t last = begin + count * (w + 1) / workers;
+                pool.emplace_back([this, first, last, w, &errors]() {
+                    std::vector<double> localArgs;
+                    try {
+                        for (size_t k = first; k < last; ++k) {
+                            evaluateNode(nodes_[dirty_[k]], localArgs);
+                        }
+                    } catch (...) {
+                        errors[w] = std::current_exception();
+                    }
+                });
+            }
+            for (auto& t : pool) t.join();
+            for (auto& e : errors) {
+                if (e) std::rethrow_exception(e);
+            }
+        }
+        begin = end;
+    }
+
+    size_t evaluated = dirty_.size();
+    for (size_t i : dirty_) nodes_[i].dirty = false;
+    dirty_.clear();
+    return evaluated;
+}
+
+} // namespace librpn
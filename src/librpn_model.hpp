@@ -0,0 +1,76 @@
+#pragma once
+
+#include "librpn.hpp"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace librpn {
+
+//==============================================================================
+// 名前付き数式の依存グラフ（スプレッドシート方式の増分再計算）
+//==============================================================================
+
+// 入力値と名前付き数式を保持し、変更された入力の下流だけを再計算するモデル
+//
+//   Model m;
+//   m.setInput("x", 3);
+//   m.define("y", "x * 2");
+//   m.define("z", "y + x");
+//   m.recompute();          // y, z を評価
+//   m.setInput("x", 4);
+//   m.recompute();          // x の下流（y, z）だけを評価
+//
+// 数式中の未登録の識別子は他の入力・数式への参照になる。定義の順序は自由で、
+// 参照の解決と循環の検出は recompute() 時に行う。
+class Model {
+public:
+    // 入力値を設定（未登録なら追加）。値が変わった場合のみ下流を dirty にする
+    void setInput(const std::string& name, double value);
+
+    // 名前付き数式を定義（中置記法）。既存の名前なら置き換える
+    void define(const std::string& name, const std::string& formula);
+
+    // 現在の値を返す（数式は最後の recompute() の結果）
+    double value(const std::string& name) const;
+
+    // 登録済みの名前かどうか
+    bool contains(const std::string& name) const;
+
+    // 登録されている入力・数式の数
+    size_t size() const { return nodes_.size(); }
+
+    // dirty な数式だけを依存順に再評価し、評価した数を返す
+    // threads > 1 の場合、依存関係のない同じ段の数式を並列に評価する
+    // 未定義の名前を参照している場合・循環参照がある場合は std::runtime_error
+    size_t recompute(unsigned threads = 1);
+
+private:
+    // 並列評価する場合の1スレッドあたりの最小の数式数
+    static constexpr size_t PARALLEL_GRAIN = 64;
+
+    struct Node {
+        std::string name;
+        bool isInput = true;
+        Program program;                   // 数式（入力の場合は空）
+        std::vector<size_t> inputs;        // 変数スロット → 参照先ノード
+        std::vector<size_t> dependents;    // このノードを参照するノード
+        double value = 0.0;
+        bool dirty = false;
+        size_t level = 0;                  // 依存の深さ（入力は0）
+    };
+
+    size_t nodeIndex(const std::string& name);
+    void markDirty(size_t index);
+    void rebuild();
+    void evaluateNode(Node& node, std::vector<double>& args);
+
+    std::vector<Node> nodes_;
+    std::unordered_map<std::string, size_t> index_;
+    std::vector<size_t> changed_;          // 値・定義が変わったノード（下流は未伝播）
+    std::vector<size_t> dirty_;            // dirty になった数式（未整列）
+    bool structureChanged_ = false;        // 定義の追加・変更があったか
+};
+
+} // namespace librpn
@@ -0,0 +1,436 @@
+#include "librpn_parallel.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace librpn {
+
+//==============================================================================
+// Work-stealing スレッドプール
+//==============================================================================
+
+TaskPool::TaskPool(unsigned threads) {
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < threads; ++i) queues_.push_back(std::make_unique<Queue>());
+    for (unsigned i = 0; i + 1 < threads; ++i) threads_.emplace_back(&TaskPool::workerLoop, this, i);
+}
+
+TaskPool::~TaskPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& t : threads_) t.join();
+}
+
+bool TaskPool::next(size_t self, size_t& index) {
+    {
+        Queue& own = *queues_[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            index = own.tasks.front();
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+    // 自分のキューが空なら、他のスレッドのキューの末尾（まだ当分取られない側）から盗む
+    for (size_t k = 1; k < queues_.size(); ++k) {
+        Queue& victim = *queues_[(self + k) % queues_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            index = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskPool::execute(size_t index) {
+    try {
+        (*task_)(index);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(errorMutex_);
+        if (!error_ || index < errorIndex_) {
+            error_ = std::current_exception();
+            errorIndex_ = index;
+        }
+    }
+    remaining_.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+void TaskPool::workerLoop(size_t self) {
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&]() { return stop_ || generation_ != seen; });
+            if (stop_) return;
+            seen = generation_;
+        }
+        size_t index;
+        while (next(self, index)) execute(index);
+    }
+}
+
+void TaskPool::run(size_t count, const std::function<void(size_t)>& task) {
+    if (count == 0) return;
+    task_ = &task;
+    error_ = nullptr;
+    remaining_.store(count, std::memory_order_release);
+
+    // 添字を連続した区間に分けて各スレッドのキューに配る（隣り合うタスクは同じスレッドで続けて実行）
+    size_t n = queues_.size();
+    for (size_t w = 0; w < n; ++w) {
+        std::lock_guard<std::mutex> lock(queues_[w]->mutex);
+        for (size_t i = count * w / n; i < count * (w + 1) / n; ++i) queues_[w]->tasks.push_back(i);
+    }
+    if (!threads_.empty()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++generation_;
+        }
+        wake_.notify_all();
+    }
+
+    size_t index;
+    while (remaining_.load(std::memory_order_acquire) > 0) {
+        if (next(n - 1, index)) {
+            execute(index);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    if (error_) {
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+//==============================================================================
+// 式の木の解析
+//==============================================================================
+
+// 値を1つ計算する部分木（code[start … end] がこの値を計算する）
+struct TreeNode {
+    size_t start;
+    size_t end;
+    bool list;                       // 値がリストかどうか
+    std::vector<size_t> children;    // オペランドの節（式の中の順）
+};
+
+static size_t treeCost(const TreeNode& node) {
+    return node.end - node.start + 1;
+}
+
+// code を値ごとの部分木に分ける。部分木が連続したトークン列にならない形
+// （スタック不足、リストの開始をまたぐ演算、開始のないリストの集計など）なら false
+static bool buildTree(const std::vector<Token>& code, std::vector<TreeNode>& nodes, size_t& root) {
+    struct Marker {
+        size_t depth;       // リスト開始時のスタックの深さ
+        size_t position;    // '{' のトークン位置
+    };
+    std::vector<size_t> stack;
+    std::vector<Marker> markers;
+    nodes.clear();
+    nodes.reserve(code.size());
+
+    // スタックの上 operands 個をオペランドとする節を積む
+    auto reduce = [&](size_t start, size_t end, bool list, size_t operands) {
+        TreeNode node{start, end, list, {}};
+        node.children.assign(stack.end() - static_cast<std::ptrdiff_t>(operands), stack.end());
+        stack.resize(stack.size() - operands);
+        nodes.push_back(std::move(node));
+        stack.push_back(nodes.size() - 1);
+    };
+    // オペランドがすべて直近のリスト開始より後にあるか
+    auto insideList = [&](size_t operands) {
+        return stack.size() >= operands &&
+               (markers.empty() || markers.back().depth <= stack.size() - operands);
+    };
+    // 直近の開いたリストを閉じる
+    auto closeList = [&](size_t end, bool list) {
+        if (markers.empty() || markers.back().depth > stack.size()) return false;
+        Marker marker = markers.back();
+        markers.pop_back();
+        reduce(marker.position, end, list, stack.size() - marker.depth);
+        return true;
+    };
+
+    for (size_t pc = 0; pc < code.size(); ++pc) {
+        const Token& token = code[pc];
+        size_t operands = 0;
+        switch (token.type) {
+            case TokenType::Number:
+            case TokenType::Constant:
+            case TokenType::Variable:
+                reduce(pc, pc, false, 0);
+                continue;
+            case TokenType::ListSource:
+                reduce(pc, pc, true, 0);
+                continue;
+            case TokenType::ListStart:
+                markers.push_back({stack.size(), pc});
+                continue;
+            case TokenType::ListEnd:
+                if (!closeList(pc, true)) return false;
+                continue;
+            case TokenType::Operator:
+            case TokenType::BinaryFunction:
+                operands = 2;
+                break;
+            case TokenType::UnaryFunction:
+                operands = 1;
+                break;
+            case TokenType::TernaryFunction:
+                operands = 3;
+                break;
+            case TokenType::ListFunction:
+                if (SYMBOLS[token.id].arity == 2) {
+                    // リスト パラメータ 関数
+                    if (!insideList(2)) return false;
+                    bool list = nodes[stack.back()].list || SYMBOLS[token.id].listResult;
+                    reduce(nodes[stack[stack.size() - 2]].start, pc, list, 2);
+                } else if (!stack.empty() && nodes[stack.back()].list) {
+                    if (!insideList(1)) return false;
+                    reduce(nodes[stack.back()].start, pc, SYMBOLS[token.id].listResult, 1);
+                } else if (!closeList(pc, SYMBOLS[token.id].listResult)) {
+                    return false;
+                }
+                continue;
+            default:
+                return false;
+        }
+        if (!insideList(operands)) return false;
+        bool list = SYMBOLS[token.id].listResult;     // seq・linspace は数値からリストを作る
+        for (size_t k = stack.size() - operands; k < stack.size(); ++k) list = list || nodes[stack[k]].list;
+        reduce(nodes[stack[stack.size() - operands]].start, pc, list, operands);
+    }
+    if (stack.size() != 1 || !markers.empty()) return false;
+    root = stack.front();
+    return true;
+}
+
+//==============================================================================
+// 結合の組み替え（reassociate）
+//==============================================================================
+
+static bool isAssociative(const Token& token) {
+    return token.type == TokenType::Operator &&
+           (token.value() == "+" || token.value() == "*" || token.value() == "×" || token.value() == "·");
+}
+
+// 左のオペランドが同じ演算子の節（左結合の連鎖の途中）か
+static bool continuesChain(const std::vector<Token>& code, const TreeNode& node, const Token& op) {
+    return node.children.size() == 2 && code[node.end].type == op.type && code[node.end].value() == op.value();
+}
+
+// grain を超える + と * の連鎖 ((a + b) + c) + … を、合計 grain 以下のブロックの和を
+// 左から順に足す形 (a + b + …) + (… + …) + … に組み替えたトークン列を作る
+// 深い連鎖でもスタックを使い切らないよう、出力する動作を明示的なスタックで処理する
+static void reassociate(const std::vector<Token>& code, const std::vector<double>& literals,
+                        const std::vector<TreeNode>& nodes, size_t root, size_t grain,
+                        std::vector<Token>& outCode, std::vector<double>& outLiterals) {
+    struct Action {
+        bool node;          // true: 節 a を出力、false: トークン [a, b) をそのまま出力
+        size_t a;
+        size_t b;
+    };
+    std::vector<Action> work{{true, root, 0}};
+    std::vector<Action> pending;
+    std::vector<size_t> operands;
+    outCode.clear();
+    outLiterals.clear();
+
+    while (!work.empty()) {
+        Action action = work.back();
+        work.pop_back();
+        if (!action.node) {
+            outCode.insert(outCode.end(), code.begin() + action.a, code.begin() + action.b);
+            outLiterals.insert(outLiterals.end(), literals.begin() + action.a, literals.begin() + action.b);
+            continue;
+        }
+
+        const TreeNode& node = nodes[action.a];
+        const Token& op = code[node.end];
+        pending.clear();
+        if (treeCost(node) > grain && isAssociative(op) && node.children.size() == 2 &&
+            continuesChain(code, nodes[node.children[0]], op)) {
+            // 連鎖のオペランドを左から並べる
+            operands.clear();
+            size_t n = action.a;
+            while (continuesChain(code, nodes[n], op)) {
+                operands.push_back(nodes[n].children[1]);
+                n = nodes[n].children[0];
+            }
+            operands.push_back(n);
+            std::reverse(operands.begin(), operands.end());
+
+            Action opAction{false, node.end, node.end + 1};
+            size_t blocks = 0;
+            size_t blockSize = 0;
+            size_t blockCost = 0;
+            for (size_t o : operands) {
+                size_t c = treeCost(nodes[o]) + 1;
+                if (blockSize > 0 && blockCost + c > grain) {
+                    if (blocks++ > 0) pending.push_back(opAction);
+                    blockSize = 0;
+                    blockCost = 0;
+                }
+                pending.push_back({true, o, 0});
+                if (blockSize++ > 0) pending.push_back(opAction);
+                blockCost += c;
+            }
+            if (blocks > 0) pending.push_back(opAction);
+        } else {
+            // オペランドの間のトークン（'{' など）と自身の演算子はそのまま出力する
+            size_t position = node.start;
+            for (size_t c : node.children) {
+                pending.push_back({false, position, nodes[c].start});
+                pending.push_back({true, c, 0});
+                position = nodes[c].end + 1;
+            }
+            pending.push_back({false, position, node.end + 1});
+        }
+        work.insert(work.end(), pending.rbegin(), pending.rend());
+    }
+}
+
+//==============================================================================
+// 並列評価
+//==============================================================================
+
+ParallelProgram planParallel(const Program& program, const ParallelOptions& options) {
+    ParallelProgram plan;
+    plan.program = program;
+    size_t grain = std::max<size_t>(options.grain, 1);
+    if (program.code.size() <= grain) return plan;
+
+    std::vector<TreeNode> nodes;
+    size_t root = 0;
+    if (!buildTree(program.code, nodes, root)) return plan;
+
+    if (options.reassociate) {
+        std::vector<Token> code;
+        std::vector<double> literals;
+        reassociate(program.code, program.literals, nodes, root, grain, code, literals);
+        plan.program.code = std::move(code);
+        plan.program.literals = std::move(literals);
+        if (!buildTree(plan.program.code, nodes, root)) return plan;
+    }
+    const std::vector<Token>& code = plan.program.code;
+    const std::vector<double>& literals = plan.program.literals;
+
+    // grain を超える節の子のうち、grain 以下でスカラー値の部分木を式の中の順に集める
+    // （1トークンの葉はタスクにしても得がないので spine に残す）
+    std::vector<size_t> pieces;
+    std::vector<std::pair<bool, size_t>> work{{false, root}};    // (部分木として採るか, 節)
+    while (!work.empty()) {
+        auto [piece, n] = work.back();
+        work.pop_back();
+        if (piece) {
+            pieces.push_back(n);
+            continue;
+        }
+        const auto& children = nodes[n].children;
+        for (auto it = children.rbegin(); it != children.rend(); ++it) {
+            const TreeNode& child = nodes[*it];
+            if (treeCost(child) > grain) {
+                work.push_back({false, *it});
+            } else if (!child.list && treeCost(child) > 1) {
+                work.push_back({true, *it});
+            }
+        }
+    }
+
+    // 隣り合う部分木を合計 grain 以上になるまで1つのタスクにまとめる
+    std::vector<size_t> offsets{0};
+    size_t taskCost = 0;
+    for (size_t j = 0; j < pieces.size(); ++j) {
+        taskCost += treeCost(nodes[pieces[j]]);
+        if (taskCost >= grain || j + 1 == pieces.size()) {
+            offsets.push_back(j + 1);
+            taskCost = 0;
+        }
+    }
+    // タスクが1つ以下なら逐次に評価する
+    if (offsets.size() < 3) return plan;
+
+    auto append = [&](Program& target, size_t first, size_t last) {
+        target.code.insert(target.code.end(), code.begin() + first, code.begin() + last);
+        target.literals.insert(target.literals.end(), literals.begin() + first, literals.begin() + last);
+    };
+    auto appendToken = [](Program& target, Token token) {
+        target.code.push_back(std::move(token));
+        target.literals.push_back(0.0);
+    };
+
+    for (size_t t = 0; t + 1 < offsets.size(); ++t) {
+        Program task;
+        task.mathMode = program.mathMode;
+        appendToken(task, {TokenType::ListStart});
+        for (size_t j = offsets[t]; j < offsets[t + 1]; ++j) {
+            append(task, nodes[pieces[j]].start, nodes[pieces[j]].end + 1);
+        }
+        appendToken(task, {TokenType::ListEnd});
+        plan.tasks.push_back(std::move(task));
+    }
+    plan.taskOffsets = std::move(offsets);
+
+    // spine: 部分木を結果の数値（評価時に埋める）に置き換えた残り
+    plan.spine.variables = program.variables;
+    plan.spine.mathMode = program.mathMode;
+    size_t position = 0;
+    for (size_t j = 0; j < pieces.size(); ++j) {
+        append(plan.spine, position, nodes[pieces[j]].start);
+        plan.holes.push_back(plan.spine.code.size());
+        appendToken(plan.spine, {TokenType::Number, "#" + std::to_string(j)});
+        position = nodes[pieces[j]].end + 1;
+    }
+    append(plan.spine, position, code.size());
+    return plan;
+}
+
+// タスクを pool で並列に評価し、各部分木の値を spine の literals に入れる
+template <typename EvaluateTask>
+static std::vector<double> runTasks(const ParallelProgram& plan, TaskPool& pool, EvaluateTask evaluateTask) {
+    std::vector<double> literals = plan.spine.literals;
+    pool.run(plan.tasks.size(), [&](size_t t) {
+        std::vector<double> values = evaluateTask(plan.tasks[t]);
+        size_t first = plan.taskOffsets[t];
+        if (values.size() != plan.taskOffsets[t + 1] - first) {
+            throw std::logic_error("librpn: parallel task returned a wrong number of values");
+        }
+        // タスクごとに書く位置が重ならないので排他は不要
+        for (size_t k = 0; k < values.size(); ++k) literals[plan.holes[first + k]] = values[k];
+    });
+    return literals;
+}
+
+double evaluateParallel(const ParallelProgram& plan, TaskPool& pool, const std::vector<double>& variables) {
+    if (!plan.parallel()) return evaluate(plan.program, variables);
+
+    std::vector<double> literals = runTasks(plan, pool, [&](const Program& task) {
+        return evaluateList(task, variables);
+    });
+    return evaluate(plan.spine, variables, literals);
+}
+
+double evaluateParallel(const ParallelProgram& plan, TaskPool& pool, const std::vector<double>& variables,
+                        const EvaluationLimits& limits) {
+    if (!plan.parallel()) return evaluate(plan.program, variables, limits);
+
+    Program spine = plan.spine;
+    spine.literals = runTasks(plan, pool, [&](const Program& task) {
+        return evaluateList(task, variables, limits);
+    });
+    return evaluate(spine, variables, limits);
+}
+
+double calculateRPNParallel(const std::string& expression, TaskPool& pool, const ParallelOptions& options) {
+    return evaluateParallel(planParallel(compileRPN(expression), options), pool);
+}
+
+} // namespace librpn
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "librpn.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace librpn {
+
+//==============================================================================
+// Work-stealing スレッドプール
+//==============================================================================
+
+// 各スレッドは自分のキューの先頭からタスクを取り、空になったら他のスレッドの
+// キューの末尾から盗む。
+//
+//   TaskPool pool(4);
+//   pool.run(n, [&](size_t i) { ... });   // i = 0 … n-1 を並列に実行して待つ
+//
+// run() の呼び出しスレッドも実行に加わる。run() を同時に呼べるのは1スレッドだけ。
+class TaskPool {
+public:
+    // threads は呼び出しスレッドを含む並列度（0 ならハードウェアのスレッド数）
+    explicit TaskPool(unsigned threads = 0);
+    ~TaskPool();
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+    // 呼び出しスレッドを含む並列度
+    unsigned size() const { return static_cast<unsigned>(queues_.size()); }
+
+    // task(0) … task(count - 1) を実行し、すべて終わるまで待つ
+    // 例外を投げたタスクがあれば、添字が最小のタスクの例外を投げ直す
+    void run(size_t count, const std::function<void(size_t)>& task);
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    bool next(size_t self, size_t& index);
+    void execute(size_t index);
+    void workerLoop(size_t self);
+
+    std::vector<std::unique_ptr<Queue>> queues_;    // 末尾が run() の呼び出しスレッド用
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    uint64_t generation_ = 0;                       // run() のたびに増える
+    bool stop_ = false;
+    const std::function<void(size_t)>* task_ = nullptr;
+    std::atomic<size_t> remaining_{0};
+    std::mutex errorMutex_;
+    size_t errorIndex_ = 0;
+    std::exception_ptr error_;
+};
+
+//==============================================================================
+// 大きな式の部分木の並列評価
+//==============================================================================
+
+struct ParallelOptions {
+    // 1タスクの目安のトークン数。これ以下の部分木は分割せず、小さい部分木は
+    // 合計がこの程度になるまで1つのタスクにまとめる
+    size_t grain = 4096;
+
+    // + と * の長い左結合の連鎖を grain ごとのブロックに分け、ブロックの和（積）を
+    // 順に結合する形に組み替える。連鎖の加算も並列になるが、丸め誤差は逐次評価と
+    // 変わりうる（結果はスレッド数によらず grain で決まる）
+    bool reassociate = false;
+};
+
+// 並列評価の計画
+//
+// 互いに独立な部分木（grain 以下でスカラー値のもの）を切り出してタスクにまとめ、
+// 残りの式（spine）では各部分木をその結果の数値に置き換える。各部分木は元と同じ
+// トークン列を同じ順で評価し、spine も元の順で結合するため、reassociate しなければ
+// 結果は evaluate() とビット単位で同じで、スレッド数やスケジューリングにもよらない。
+struct ParallelProgram {
+    Program program;                    // 元のプログラム（reassociate なら組み替え後）
+    std::vector<Program> tasks;         // 各タスク: { 部分木 … } の形で部分木の値をまとめて返す
+    std::vector<size_t> taskOffsets;    // tasks[i] の部分木の通し番号の先頭（末尾に総数）
+    Program spine;                      // 部分木を数値に置き換えた残りの式
+    std::vector<size_t> holes;          // 部分木 j の結果を入れる spine のトークン位置
+
+    // 分割したかどうか（小さい式、解析できない式は分割せず逐次に評価する）
+    bool parallel() const { return !tasks.empty(); }
+};
+
+// プログラムを解析して並列評価の計画を作る
+// リストを閉じずに集計する古い書き方（"1 2 3 sum"）を含む式などは分割しない
+ParallelProgram planParallel(const Program& program, const ParallelOptions& options = {});
+
+// 計画に従ってタスクを pool で並列に評価し、spine で結合する
+// タスクで例外が出た場合は、式の中で最初に現れる部分木のものを投げる
+double evaluateParallel(const ParallelProgram& plan, TaskPool& pool,
+                        const std::vector<double>& variables = {});
+
+// 上限を指定して並列に評価する（超えたら EvaluationAborted）
+// 予算は各タスクと spine にそれぞれ適用する（合計の作業量はタスク数 + 1 倍まで）。
+// 取り消しはすべてのタスクで確かめる。
+double evaluateParallel(const ParallelProgram& plan, TaskPool& pool, const std::vector<double>& variables,
+                        const EvaluationLimits& limits);
+
+// RPN式を並列に評価（計画を作って evaluateParallel() する）
+double calculateRPNParallel(const std::string& expression, TaskPool& pool,
+                            const ParallelOptions& options = {});
+
+} // namespace librpn
@@ -0,0 +1,209 @@
+#include "librpn_quantile.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+namespace librpn {
+
+//==============================================================================
+// パーセンタイル（厳密な選択）
+//==============================================================================
+
+// ranks（昇順・重複なし）の各順位の値を values[first, last) の該当位置に置く
+// 中央の順位を選んでから、その左右の区間で残りの順位を選ぶ
+template <typename T>
+static void selectRanks(std::vector<T>& values, size_t first, size_t last,
+                        const size_t* ranks, size_t count) {
+    while (count > 0 && first < last) {
+        size_t mid = count / 2;
+        size_t k = ranks[mid];
+        std::nth_element(values.begin() + first, values.begin() + k, values.begin() + last);
+        selectRanks(values, first, k, ranks, mid);
+        // 右側はループで続ける
+        first = k + 1;
+        ranks += mid + 1;
+        count -= mid + 1;
+    }
+}
+
+// 順位 h = p / 100 × (n - 1) の値（下側と上側の順位の値が values の同じ位置にあること）
+template <typename T>
+static T interpolateRank(const T* values, size_t n, T p) {
+    T h = p / 100 * static_cast<T>(n - 1);
+    size_t lower = static_cast<size_t>(h);
+    T fraction = h - static_cast<T>(lower);
+    T value = values[lower];
+    if (lower + 1 < n && fraction > 0) {
+        value += fraction * (values[lower + 1] - values[lower]);
+    }
+    return value;
+}
+
+template <typename T>
+void percentilesInPlace(std::vector<T>& values, const std::vector<T>& ps, std::vector<T>& out) {
+    for (T p : ps) {
+        if (!(p >= 0 && p <= 100)) {
+            throw std::invalid_argument("librpn: percentile must be between 0 and 100");
+        }
+    }
+    out.assign(ps.size(), T(0));
+    size_t n = values.size();
+    if (n == 0) return;
+
+    // 補間に使う順位（下側と上側）を集めて1回で選ぶ
+    std::vector<size_t> ranks;
+    ranks.reserve(ps.size() * 2);
+    for (T p : ps) {
+        T h = p / 100 * static_cast<T>(n - 1);
+        size_t lower = static_cast<size_t>(h);
+        ranks.push_back(lower);
+        if (lower + 1 < n && h > static_cast<T>(lower)) ranks.push_back(lower + 1);
+    }
+    std::sort(ranks.begin(), ranks.end());
+    ranks.erase(std::unique(ranks.begin(), ranks.end()), ranks.end());
+    selectRanks(values, 0, n, ranks.data(), ranks.size());
+
+    for (size_t i = 0; i < ps.size(); ++i) out[i] = interpolateRank(values.data(), n, ps[i]);
+}
+
+template <typename T>
+void selectRanksInPlace(std::vector<T>& values, const std::vector<size_t>& ranks) {
+    selectRanks(values, 0, values.size(), ranks.data(), ranks.size());
+}
+
+template <typename T>
+T sortedPercentile(const T* sorted, size_t n, T p) {
+    if (!(p >= 0 && p <= 100)) {
+        throw std::invalid_argument("librpn: percentile must be between 0 and 100");
+    }
+    return n == 0 ? T(0) : interpolateRank(sorted, n, p);
+}
+
+template void percentilesInPlace<float>(std::vector<float>&, const std::vector<float>&, std::vector<float>&);
+template void percentilesInPlace<double>(std::vector<double>&, const std::vector<double>&, std::vector<double>&);
+template void percentilesInPlace<long double>(std::vector<long double>&, const std::vector<long double>&,
+                                              std::vector<long double>&);
+template void selectRanksInPlace<float>(std::vector<float>&, const std::vector<size_t>&);
+template void selectRanksInPlace<double>(std::vector<double>&, const std::vector<size_t>&);
+template void selectRanksInPlace<long double>(std::vector<long double>&, const std::vector<size_t>&);
+template float sortedPercentile<float>(const float*, size_t, float);
+template double sortedPercentile<double>(const double*, size_t, double);
+template long double sortedPercentile<long double>(const long double*, size_t, long double);
+
+//==============================================================================
+// t-digest
+//==============================================================================
+
+static constexpr double PI = 3.14159265358979323846;
+
+// スケール関数 k1: k(q) = δ / 2π · asin(2q - 1)
+// 1つの重心が覆う q の幅を k が1増える範囲に制限する（両端ほど狭い）
+static double scaleK(double q, double compression) {
+    return compression / (2 * PI) * std::asin(2 * q - 1);
+}
+
+static double scaleKInverse(double k, double compression) {
+    double angle = std::min(k * 2 * PI / compression, PI / 2);
+    return (std::sin(angle) + 1) / 2;
+}
+
+TDigest::TDigest(double compression)
+    : compression_(std::max(compression, 10.0)),
+      bufferCapacity_(static_cast<size_t>(compression_ * 5)),
+      min_(std::numeric_limits<double>::infinity()),
+      max_(-std::numeric_limits<double>::infinity()) {
+    pending_.reserve(bufferCapacity_);
+}
+
+void TDigest::add(double x, double weight) {
+    if (std::isnan(x) || !(weight > 0)) return;
+    min_ = std::min(min_, x);
+    max_ = std::max(max_, x);
+    pending_.push_back({x, weight});
+    pendingWeight_ += weight;
+    if (pending_.size() >= bufferCapacity_) compress();
+}
+
+void TDigest::merge(const TDigest& other) {
+    for (const Centroid& c : other.centroids_) add(c.mean, c.weight);
+    for (const Centroid& c : other.pending_) add(c.mean, c.weight);
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+}
+
+void TDigest::compress() {
+    if (pending_.empty()) return;
+
+    // 既存の重心と未反映の値を平均の順に並べ、左から貪欲にまとめる
+    pending_.insert(pending_.end(), centroids_.begin(), centroids_.end());
+    std::sort(pending_.begin(), pending_.end(),
+              [](const Centroid& a, const Centroid& b) { return a.mean < b.mean; });
+    double total = total_ + pendingWeight_;
+
+    std::vector<Centroid> merged;
+    merged.reserve(centroids_.size() + 16);
+    Centroid current = pending_.front();
+    double before = 0.0;    // current より左の重みの合計
+    double limit = total * scaleKInverse(scaleK(0.0, compression_) + 1, compression_);
+    for (size_t i = 1; i < pending_.size(); ++i) {
+        const Centroid& next = pending_[i];
+        if (before + current.weight + next.weight <= limit) {
+            current.weight += next.weight;
+            current.mean += (next.mean - current.mean) * next.weight / current.weight;
+        } else {
+            merged.push_back(current);
+            before += current.weight;
+            limit = total * scaleKInverse(scaleK(before / total, compression_) + 1, compression_);
+            current = next;
+        }
+    }
+    merged.push_back(current);
+
+    centroids_.swap(merged);
+    pending_.clear();
+    total_ = total;
+    pendingWeight_ = 0.0;
+}
+
+size_t TDigest::centroidCount() {
+    compress();
+    return centroids_.size();
+}
+
+double TDigest::quantile(double q) {
+    if (!(q >= 0 && q <= 1)) {
+        throw std::invalid_argument("librpn: quantile must be between 0 and 1");
+    }
+    compress();
+    if (centroids_.empty()) return 0.0;
+    if (centroids_.size() == 1) return centroids_.front().mean;
+
+    // 重心の中心（左端からの重み）の間を線形補間する。両端は最小値（重み 0 の位置）・
+    // 最大値（重みの合計の位置）と補間する。位置は重みの比だけで決まるため、重みは整数でなくてよい
+    double index = q * total_;
+    const Centroid& first = centroids_.front();
+    const Centroid& last = centroids_.back();
+    if (index <= first.weight / 2) {
+        return min_ + index / (first.weight / 2) * (first.mean - min_);
+    }
+    if (total_ - index <= last.weight / 2) {
+        return max_ - (total_ - index) / (last.weight / 2) * (max_ - last.mean);
+    }
+
+    double center = first.weight / 2;
+    for (size_t i = 0; i + 1 < centroids_.size(); ++i) {
+        const Centroid& a = centroids_[i];
+        const Centroid& b = centroids_[i + 1];
+        double gap = (a.weight + b.weight) / 2;
+        if (center + gap > index) {
+            double z1 = index - center;
+            double z2 = center + gap - index;
+            return (a.mean * z2 + b.mean * z1) / gap;
+        }
+        center += gap;
+    }
+    return last.mean;
+}
+
+} // namespace librpn
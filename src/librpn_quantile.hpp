@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace librpn {
+
+//==============================================================================
+// パーセンタイル（厳密な選択）
+//==============================================================================
+
+// values の p パーセンタイル（0 ≤ p ≤ 100、順位の線形補間）を ps の各値について out に求める
+//
+//   std::vector<double> v = ...;
+//   std::vector<double> out;
+//   percentilesInPlace(v, {50.0, 99.0}, out);   // out = {p50, p99}
+//
+// 全体を並べ替えず、必要な順位だけを nth_element で選ぶ。複数の順位は選んだ位置で
+// 区間を分けながらまとめて選ぶため、全体で O(n log |ps|)。values は並べ替えられる。
+// values が空なら結果は 0、p が範囲外（NaN を含む）なら std::invalid_argument。
+// T = float / double / long double で明示的にインスタンス化済み。
+template <typename T>
+void percentilesInPlace(std::vector<T>& values, const std::vector<T>& ps, std::vector<T>& out);
+
+// 順位 ranks（昇順・重複なし）の値を、values を並べ替えたときと同じ位置に置く
+// （percentilesInPlace の選択の部分。中央値と四分位数をまとめて選ぶ場合など）
+template <typename T>
+void selectRanksInPlace(std::vector<T>& values, const std::vector<size_t>& ranks);
+
+// 昇順に並べ替え済みの sorted[0 … n-1] の p パーセンタイル（percentilesInPlace と同じ補間・検査）
+template <typename T>
+T sortedPercentile(const T* sorted, size_t n, T p);
+
+//==============================================================================
+// パーセンタイル（t-digest による近似）
+//==============================================================================
+
+// merging t-digest（Dunning）
+//
+//   TDigest digest;
+//   for (double x : samples) digest.add(x);
+//   double p99 = digest.percentile(99.0);
+//
+// 値を重み付きの重心（平均・重み）にまとめて保持する。分布の両端ほど重心を小さく
+// 保つため、p99 / p99.9 のような裾のパーセンタイルほど相対的に精度が高い。
+// 保持する重心の数は compression 程度で、追加した値の数によらずメモリは一定。
+// 別の TDigest を merge() でまとめられる（シャードごとに集計して合算する場合など）。
+class TDigest {
+public:
+    explicit TDigest(double compression = 100.0);
+
+    // 値を追加（重みは正の任意の値。NaN と重みが正でないものは無視する）
+    void add(double x, double weight = 1.0);
+
+    // 別の TDigest の内容を取り込む
+    void merge(const TDigest& other);
+
+    // q 分位点（0 ≤ q ≤ 1）。空なら 0、q が範囲外なら std::invalid_argument
+    // 重心の中心の間を重みで線形補間する（q = 0 は最小値、q = 1 は最大値）
+    double quantile(double q);
+
+    // p パーセンタイル（0 ≤ p ≤ 100）
+    double percentile(double p) { return quantile(p / 100.0); }
+
+    // 追加した値の重みの合計
+    double count() const { return total_ + pendingWeight_; }
+
+    // 保持している重心の数（未反映の値をまとめてから数える）
+    size_t centroidCount();
+
+    // 未反映の値を重心にまとめる
+    void compress();
+
+private:
+    struct Centroid {
+        double mean;
+        double weight;
+    };
+
+    double compression_;
+    size_t bufferCapacity_;
+    std::vector<Centroid> centroids_;   // 平均の昇順
+    std::vector<Centroid> pending_;     // まだ重心にまとめていない値
+    double total_ = 0.0;                // centroids_ の重みの合計
+    double pendingWeight_ = 0.0;        // pending_ の重みの合計
+    double min_;
+    double max_;
+};
+
+} // namespace librpn
@@ -0,0 +1,400 @@
+#include "librpn_simd.hpp"
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// x86-64 Linux の GCC では関数マルチバージョニングで命令セット別の版を生成する
+// （このファイルは -O3 -fno-math-errno でコンパイルし、ループを自動ベクトル化させる）
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__) && !defined(__clang__)
+#define LIBRPN_SIMD_CLONES __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#else
+#define LIBRPN_SIMD_CLONES
+#endif
+
+#define LIBRPN_INLINE static inline __attribute__((always_inline))
+
+namespace librpn {
+namespace simd {
+
+//==============================================================================
+// 定数（多くは fdlibm に由来）
+//==============================================================================
+
+// 最近接整数への丸めに使う定数（1.5 × 2^52）
+static constexpr double ROUND_SHIFT = 6755399441055744.0;
+
+static constexpr double INV_LN2 = 1.44269504088896338700e+00;
+static constexpr double LN2_HI  = 6.93147180369123816490e-01;
+static constexpr double LN2_LO  = 1.90821492927058770002e-10;
+
+static constexpr double LOG10_2_HI = 3.01029995663611771306e-01;
+static constexpr double LOG10_2_LO = 3.69423907715893078616e-13;
+static constexpr double INV_LN10   = 4.34294481903251816668e-01;
+
+static constexpr double LG1 = 6.666666666666735130e-01;
+static constexpr double LG2 = 3.999999999940941908e-01;
+static constexpr double LG3 = 2.857142874366239149e-01;
+static constexpr double LG4 = 2.222219843214978396e-01;
+static constexpr double LG5 = 1.818357216161805012e-01;
+static constexpr double LG6 = 1.531383769920937332e-01;
+static constexpr double LG7 = 1.479819860511658591e-01;
+
+static constexpr double TWO_OVER_PI = 6.36619772367581382433e-01;
+static constexpr double PIO2_1  = 1.57079632673412561417e+00;
+static constexpr double PIO2_2  = 6.07710050630396597660e-11;
+static constexpr double PIO2_3  = 2.02226624871116645580e-21;
+static constexpr double PIO2_3T = 8.47842766036889956997e-32;
+
+static constexpr double S1 = -1.66666666666666324348e-01;
+static constexpr double S2 =  8.33333333332248946124e-03;
+static constexpr double S3 = -1.98412698298579493134e-04;
+static constexpr double S4 =  2.75573137070700676789e-06;
+static constexpr double S5 = -2.50507602534068634195e-08;
+static constexpr double S6 =  1.58969099521155010221e-10;
+
+static constexpr double C1 =  4.16666666666666019037e-02;
+static constexpr double C2 = -1.38888888888741095749e-03;
+static constexpr double C3 =  2.48015872894767294178e-05;
+static constexpr double C4 = -2.75573143513906633035e-07;
+static constexpr double C5 =  2.08757232129817482790e-09;
+static constexpr double C6 = -1.13596475577881948265e-11;
+
+// 高速パスを使う引数の範囲
+static constexpr double EXP_LIMIT = 708.0;
+static constexpr double TRIG_LIMIT = 524288.0;          // 2^19（π/2 の倍数の引き算が厳密な範囲）
+static constexpr double TRIG_TINY = 3.7252902984e-09;   // 2^-28
+static constexpr double TAN_HUGE = 268435456.0;         // 2^28
+static constexpr double POW_INT_LIMIT = 32.0;
+static constexpr double POW_MIN = 3.4e-308;             // exp(-708) より少し大きい値
+static constexpr double POW_MAX = 3.0e307;              // exp(708) より少し小さい値
+
+//==============================================================================
+// ビット操作（memcpy はベクトル化の妨げにならない）
+//==============================================================================
+
+LIBRPN_INLINE uint64_t asU64(double x) {
+    uint64_t u;
+    std::memcpy(&u, &x, sizeof u);
+    return u;
+}
+
+LIBRPN_INLINE double asF64(uint64_t u) {
+    double x;
+    std::memcpy(&x, &u, sizeof x);
+    return x;
+}
+
+//==============================================================================
+// 要素ごとの計算（分岐なし）
+//==============================================================================
+
+// exp: x = k·ln2 + r（|r| ≤ ln2/2）に分解し、exp(r) を13次のテイラー多項式で近似
+// （依存の連鎖を短くするため Estrin 法で評価する）
+LIBRPN_INLINE double expCore(double x) {
+    double kd = x * INV_LN2 + ROUND_SHIFT;
+    uint64_t ki = asU64(kd);
+    kd -= ROUND_SHIFT;
+    double r = (x - kd * LN2_HI) - kd * LN2_LO;
+    double r2 = r * r;
+    double r4 = r2 * r2;
+    double r8 = r4 * r4;
+    double p01 = 1.0 + r;
+    double p23 = 1.0 / 2.0 + r * (1.0 / 6.0);
+    double p45 = 1.0 / 24.0 + r * (1.0 / 120.0);
+    double p67 = 1.0 / 720.0 + r * (1.0 / 5040.0);
+    double p89 = 1.0 / 40320.0 + r * (1.0 / 362880.0);
+    double pab = 1.0 / 3628800.0 + r * (1.0 / 39916800.0);
+    double pcd = 1.0 / 479001600.0 + r * (1.0 / 6227020800.0);
+    double p03 = p01 + r2 * p23;
+    double p47 = p45 + r2 * p67;
+    double p8b = p89 + r2 * pab;
+    double p07 = p03 + r4 * p47;
+    double p8d = p8b + r4 * pcd;
+    double p = p07 + r8 * p8d;
+    // 2^k（ki の下位ビットが k の2の補数表現になっている）
+    double scale = asF64((ki << 52) + (uint64_t(1023) << 52));
+    return p * scale;
+}
+
+// log の前処理: x = 2^k · m（√2/2 ≤ m < √2）に分解し、k を double で返す
+LIBRPN_INLINE double logReduce(double x, double& f) {
+    uint64_t bits = asU64(x);
+    uint64_t hx = bits >> 32;
+    uint64_t e = hx >> 20;
+    hx &= 0xfffff;
+    uint64_t i = (hx + 0x95f64) & 0x100000;
+    double m = asF64(((hx | (i ^ 0x3ff00000)) << 32) | (bits & 0xffffffffULL));
+    f = m - 1.0;
+    // k = e - 1023 + (i >> 20) を整数→浮動小数点変換なしで求める
+    return asF64(0x4330000000000000ULL | (e + (i >> 20))) - (4503599627370496.0 + 1023.0);
+}
+
+// log(1 + f) - f の補正項（fdlibm の有理近似）
+LIBRPN_INLINE double log1pCorrection(double f, double& hfsq) {
+    hfsq = 0.5 * f * f;
+    double s = f / (2.0 + f);
+    double z = s * s;
+    double w = z * z;
+    double t1 = w * (LG2 + w * (LG4 + w * LG6));
+    double t2 = z * (LG1 + w * (LG3 + w * (LG5 + w * LG7)));
+    return s * (hfsq + t2 + t1);
+}
+
+LIBRPN_INLINE double logCore(double x) {
+    double f, hfsq;
+    double dk = logReduce(x, f);
+    double c = log1pCorrection(f, hfsq);
+    return dk * LN2_HI - ((hfsq - (c + dk * LN2_LO)) - f);
+}
+
+LIBRPN_INLINE double log10Core(double x) {
+    double f, hfsq;
+    double dk = logReduce(x, f);
+    double c = log1pCorrection(f, hfsq);
+    double logm = f - (hfsq - c);
+    return dk * LOG10_2_HI + (dk * LOG10_2_LO + logm * INV_LN10);
+}
+
+// 三角関数: x = q·π/2 + r（|r| ≤ π/4）に分解し、sin(r) と cos(r) を多項式で近似
+LIBRPN_INLINE void sinCosCore(double x, uint64_t& q, double& s, double& c) {
+    double qd = x * TWO_OVER_PI + ROUND_SHIFT;
+    q = asU64(qd);
+    qd -= ROUND_SHIFT;
+    double r = (((x - qd * PIO2_1) - qd * PIO2_2) - qd * PIO2_3) - qd * PIO2_3T;
+    double z = r * r;
+    s = r + r * z * (S1 + z * (S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)))));
+    double hz = 0.5 * z;
+    double w = 1.0 - hz;
+    c = w + (((1.0 - w) - hz) + z * z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6))))));
+}
+
+// 象限 q に応じて sin(x) を選ぶ（cos(x) は q + 1 で同じ式になる）
+LIBRPN_INLINE double selectQuadrant(uint64_t q, double s, double c) {
+    double v = (q & 1) ? c : s;
+    return (q & 2) ? -v : v;
+}
+
+//==============================================================================
+// カーネル
+//==============================================================================
+//
+// 各カーネルは分岐のない高速パスで全要素を計算した後、高速パスの範囲外の要素
+// だけを libm で計算し直す（特殊値は稀なので2回目のループは安い）。
+
+LIBRPN_SIMD_CLONES
+void sqrt(const double* x, double* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) out[i] = std::sqrt(x[i]);
+}
+
+LIBRPN_SIMD_CLONES
+void exp(const double* x, double* out, size_t n) {
+    size_t special = 0;
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = expCore(x[i]);
+        special += (!(std::fabs(x[i]) <= EXP_LIMIT)) ? 1 : 0;
+    }
+    if (special == 0) return;
+    for (size_t i = 0; i < n; ++i) {
+        if (!(std::fabs(x[i]) <= EXP_LIMIT)) out[i] = std::exp(x[i]);
+    }
+}
+
+// log の高速パスが使える（正の正規化数）か
+LIBRPN_INLINE bool isNormalPositive(double x) {
+    return (x >= DBL_MIN) & (x <= DBL_MAX);
+}
+
+LIBRPN_SIMD_CLONES
+void log(const double* x, double* out, size_t n) {
+    size_t special = 0;
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = logCore(x[i]);
+        special += isNormalPositive(x[i]) ? 0 : 1;
+    }
+    if (special == 0) return;
+    for (size_t i = 0; i < n; ++i) {
+        if (!isNormalPositive(x[i])) out[i] = std::log(x[i]);
+    }
+}
+
+LIBRPN_SIMD_CLONES
+void log10(const double* x, double* out, size_t n) {
+    size_t special = 0;
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = log10Core(x[i]);
+        special += isNormalPositive(x[i]) ? 0 : 1;
+    }
+    if (special == 0) return;
+    for (size_t i = 0; i < n; ++i) {
+        if (!isNormalPositive(x[i])) out[i] = std::log10(x[i]);
+    }
+}
+
+// 三角関数の高速パスの結果を使えない要素か（ビット演算で分岐を避ける）
+LIBRPN_INLINE bool trigSpecial(double x, double result) {
+    double ax = std::fabs(x);
+    return (!(ax <= TRIG_LIMIT)) | ((ax > 0.5) & (std::fabs(result) < TRIG_TINY));
+}
+
+LIBRPN_INLINE bool cosSpecial(double x, double result) {
+    return !(std::fabs(x) <= TRIG_LIMIT) | (std::fabs(result) < TRIG_TINY);
+}
+
+LIBRPN_INLINE bool tanSpecial(double x, double result) {
+    return trigSpecial(x, result) | !(std::fabs(result) <= TAN_HUGE);
+}
+
+LIBRPN_SIMD_CLONES
+void sin(const double* x, double* out, size_t n) {
+    size_t special = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t q;
+        double s, c;
+        sinCosCore(x[i], q, s, c);
+        out[i] = selectQuadrant(q, s, c);
+        special += (trigSpecial(x[i], out[i])) ? 1 : 0;
+    }
+    if (special == 0) return;
+    for (size_t i = 0; i < n; ++i) {
+        if (trigSpecial(x[i], out[i])) out[i] = std::sin(x[i]);
+    }
+}
+
+LIBRPN_SIMD_CLONES
+void cos(const double* x, double* out, size_t n) {
+    size_t special = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t q;
+        double s, c;
+        sinCosCore(x[i], q, s, c);
+        out[i] = selectQuadrant(q + 1, s, c);
+        special += cosSpecial(x[i], out[i]) ? 1 : 0;
+    }
+    if (special == 0) return;
+    for (size_t i = 0; i < n; ++i) {
+        if (cosSpecial(x[i], out[i])) out[i] = std::cos(x[i]);
+    }
+}
+
+LIBRPN_SIMD_CLONES
+void tan(const double* x, double* out, size_t n) {
+    size_t special = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t q;
+        double s, c;
+        sinCosCore(x[i], q, s, c);
+        out[i] = (q & 1) ? -c / s : s / c;
+        special += tanSpecial(x[i], out[i]) ? 1 : 0;
+    }
+    if (special == 0) return;
+    for (size_t i = 0; i < n; ++i) {
+        if (tanSpecial(x[i], out[i])) out[i] = std::tan(x[i]);
+    }
+}
+
+// pow の高速パスの結果を使えない要素か
+//   整数指数: オーバーフロー・アンダーフローした場合（x が 0・inf・NaN なら結果は正しい）
+//   それ以外: x が正の正規化数でない場合、exp の引数が範囲外だった場合
+LIBRPN_INLINE bool powSpecial(double x, bool isInt, double result) {
+    double ar = std::fabs(result);
+    bool intSpecial = !((ar >= DBL_MIN) & (ar <= DBL_MAX)) & (x != 0.0) & (std::fabs(x) <= DBL_MAX);
+    bool expSpecial = !isNormalPositive(x) | !((ar >= POW_MIN) & (ar <= POW_MAX));
+    return (isInt & intSpecial) | (!isInt & expSpecial);
+}
+
+// 整数指数として二進べき乗で計算する要素か
+LIBRPN_INLINE bool isSmallInteger(double y) {
+    // std::floor は -fno-trapping-math なしではベクトル化されないため、丸めシフトで判定する
+    double ay = std::fabs(y);
+    return (ay <= POW_INT_LIMIT) & ((ay + ROUND_SHIFT) - ROUND_SHIFT == ay);
+}
+
+LIBRPN_SIMD_CLONES
+void pow(const double* x, const double* y, double* out, size_t n) {
+    size_t special = 0;
+    for (size_t i = 0; i < n; ++i) {
+        double xi = x[i];
+        double yi = y[i];
+        // 小さな整数指数は二進べき乗（|y| ≤ 32 なので6ビットで足りる）
+        // （std::fmin/fmax は NaN の扱いのためベクトル化されないので三項演算子で挟む）
+        double ay = std::fabs(yi);
+        uint64_t e = asU64((ay < POW_INT_LIMIT ? ay : POW_INT_LIMIT) + ROUND_SHIFT);
+        double b1 = xi * xi;
+        double b2 = b1 * b1;
+        double b3 = b2 * b2;
+        double b4 = b3 * b3;
+        double b5 = b4 * b4;
+        double r = ((e & 1) ? xi : 1.0) * ((e & 2) ? b1 : 1.0);
+        r *= ((e & 4) ? b2 : 1.0) * ((e & 8) ? b3 : 1.0);
+        r *= ((e & 16) ? b4 : 1.0) * ((e & 32) ? b5 : 1.0);
+        double inv = 1.0 / r;
+        r = (yi < 0) ? inv : r;
+        // それ以外は exp(y·log x)（範囲外は結果が POW_MIN..POW_MAX を外れるよう丸めておく）
+        double t = yi * logCore(xi);
+        t = t < -EXP_LIMIT - 1.0 ? -EXP_LIMIT - 1.0 : t;
+        t = t > EXP_LIMIT + 1.0 ? EXP_LIMIT + 1.0 : t;
+        double g = expCore(t);
+        bool isInt = isSmallInteger(yi);
+        double o = isInt ? r : g;
+        out[i] = o;
+        special += powSpecial(xi, isInt, o) ? 1 : 0;
+    }
+    if (special == 0) return;
+    for (size_t i = 0; i < n; ++i) {
+        if (powSpecial(x[i], isSmallInteger(y[i]), out[i])) out[i] = std::pow(x[i], y[i]);
+    }
+}
+
+//==============================================================================
+// 比較・論理演算と選択
+//==============================================================================
+
+template <typename F>
+LIBRPN_INLINE void compareLoop(const double* a, const double* b, double* out, size_t n, F test) {
+    for (size_t i = 0; i < n; ++i) out[i] = test(a[i], b[i]) ? 1.0 : 0.0;
+}
+
+LIBRPN_SIMD_CLONES
+void compare(Comparison op, const double* a, const double* b, double* out, size_t n) {
+    switch (op) {
+        case Comparison::Less:         compareLoop(a, b, out, n, [](double x, double y) { return x < y; }); return;
+        case Comparison::LessEqual:    compareLoop(a, b, out, n, [](double x, double y) { return x <= y; }); return;
+        case Comparison::Greater:      compareLoop(a, b, out, n, [](double x, double y) { return x > y; }); return;
+        case Comparison::GreaterEqual: compareLoop(a, b, out, n, [](double x, double y) { return x >= y; }); return;
+        case Comparison::Equal:        compareLoop(a, b, out, n, [](double x, double y) { return x == y; }); return;
+        case Comparison::NotEqual:     compareLoop(a, b, out, n, [](double x, double y) { return x != y; }); return;
+    }
+}
+
+LIBRPN_SIMD_CLONES
+void logicalAnd(const double* a, const double* b, double* out, size_t n) {
+    compareLoop(a, b, out, n, [](double x, double y) { return (x != 0.0) & (y != 0.0); });
+}
+
+LIBRPN_SIMD_CLONES
+void logicalOr(const double* a, const double* b, double* out, size_t n) {
+    compareLoop(a, b, out, n, [](double x, double y) { return (x != 0.0) | (y != 0.0); });
+}
+
+LIBRPN_SIMD_CLONES
+void logicalNot(const double* x, double* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) out[i] = x[i] == 0.0 ? 1.0 : 0.0;
+}
+
+LIBRPN_SIMD_CLONES
+void select(const double* condition, const double* a, const double* b, double* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) out[i] = condition[i] != 0.0 ? a[i] : b[i];
+}
+
+const char* activeISA() {
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__) && !defined(__clang__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return "avx512";
+    if (__builtin_cpu_supports("avx2")) return "avx2";
+#endif
+    return "baseline";
+}
+
+} // namespace simd
+} // namespace librpn
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+
+namespace librpn {
+namespace simd {
+
+//==============================================================================
+// SIMD数学カーネル（バッチ評価の Fast モード用）
+//==============================================================================
+//
+// 配列の各要素に関数を適用する。x86-64 (Linux, GCC) では AVX-512 / AVX2 / ベースライン
+// の各版をコンパイルし、実行時にCPUに合った版が選ばれる。それ以外の環境では
+// コンパイラの自動ベクトル化に任せたスカラー版になる。
+//
+// 誤差上限（glibc の libm の結果との差、ULP単位）：
+//   sqrt   : 0   （ハードウェア命令。libm と同一）
+//   exp    : 2   （|x| ≤ 708。範囲外は libm に委譲）
+//   log    : 1   （正規化数。0・負数・非正規化数・inf・NaN は libm に委譲）
+//   log10  : 2   （同上）
+//   sin/cos: 2   （|x| ≤ 2^19。範囲外、および結果が 2^-28 未満になる π/2 の倍数付近は libm に委譲）
+//   tan    : 4   （同上。結果の絶対値が 2^28 を超える場合も libm に委譲）
+//   pow    : 整数指数 |y| ≤ 32 は (|y| + 1) ULP（小さな整数べきは厳密）
+//            それ以外は x > 0 で (4 + 3·|y·ln x|) ULP（x ≤ 0・オーバーフロー等は libm に委譲）
+//
+// 上限はテスト（SimdKernelTest）で乱数入力に対して確認している。
+// libm と完全に同じ結果が必要な場合は MathMode::Strict を使うこと。
+
+void sqrt(const double* x, double* out, size_t n);
+void exp(const double* x, double* out, size_t n);
+void log(const double* x, double* out, size_t n);
+void log10(const double* x, double* out, size_t n);
+void sin(const double* x, double* out, size_t n);
+void cos(const double* x, double* out, size_t n);
+void tan(const double* x, double* out, size_t n);
+void pow(const double* x, const double* y, double* out, size_t n);
+
+//==============================================================================
+// 比較・論理演算と選択（分岐なし。結果は libm を使わないので両モードで同一）
+//==============================================================================
+//
+// 真偽は 1 / 0 で表し、0 以外（NaN を含む）を真とする。NaN との比較は != 以外偽。
+// 要素ごとの分岐を比較結果のマスクと blend にするため、データに依存する分岐がない。
+
+enum class Comparison { Less, LessEqual, Greater, GreaterEqual, Equal, NotEqual };
+
+void compare(Comparison op, const double* a, const double* b, double* out, size_t n);
+void logicalAnd(const double* a, const double* b, double* out, size_t n);
+void logicalOr(const double* a, const double* b, double* out, size_t n);
+void logicalNot(const double* x, double* out, size_t n);
+
+// out[i] = condition[i] が真なら a[i]、偽なら b[i]
+void select(const double* condition, const double* a, const double* b, double* out, size_t n);
+
+// 実行時に選ばれる命令セット（"avx512", "avx2", "baseline"）
+const char* activeISA();
+
+} // namespace simd
+} // namespace librpn
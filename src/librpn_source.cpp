@@ -0,0 +1,351 @@
+#include "librpn_source.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace librpn {
+
+//==============================================================================
+// データの保持者
+//==============================================================================
+
+ListView ListData::sorted() const {
+    std::call_once(sortedOnce_, [this] {
+        sorted_.assign(view.begin(), view.end());
+        std::sort(sorted_.begin(), sorted_.end(), [](double a, double b) {
+            return a < b || (!std::isnan(a) && std::isnan(b));
+        });
+    });
+    return ListView(sorted_);
+}
+
+ListView ListData::prefixSums() const {
+    std::call_once(prefixOnce_, [this] {
+        prefix_.resize(view.size() + 1);
+        double total = 0;
+        prefix_[0] = total;
+        for (size_t i = 0; i < view.size(); ++i) {
+            total += view[i];
+            prefix_[i + 1] = total;
+        }
+    });
+    return ListView(prefix_);
+}
+
+// 外部のポインタ（登録した側が寿命を管理する）
+struct BorrowedListData : ListData {
+    BorrowedListData(const double* data, size_t count) { view = ListView(data, count); }
+};
+
+// ライブラリが所有する配列
+struct OwnedListData : ListData {
+    std::vector<double> values;
+
+    explicit OwnedListData(std::vector<double> v) : values(std::move(v)) { view = ListView(values); }
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+// マップしたファイル（解除は最後の参照がなくなったとき）
+struct MappedListData : ListData {
+    void* address = nullptr;
+    size_t length = 0;
+
+    ~MappedListData() override {
+        if (address) munmap(address, length);
+    }
+};
+#endif
+
+//==============================================================================
+// ファイルの読み込み
+//==============================================================================
+
+constexpr char HEADER_MAGIC[4] = {'R', 'P', 'N', 'V'};
+constexpr size_t HEADER_SIZE = 16;
+
+static uint64_t loadLittleEndian(const unsigned char* p, size_t bytes) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < bytes; ++i) v |= static_cast<uint64_t>(p[i]) << (8 * i);
+    return v;
+}
+
+static bool hostIsLittleEndian() {
+    const uint16_t probe = 1;
+    unsigned char first;
+    std::memcpy(&first, &probe, 1);
+    return first == 1;
+}
+
+static bool endsWith(const std::string& s, const char* suffix) {
+    size_t n = std::strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// ファイルの中の要素の配置（bytes の先頭から offset バイト目に width バイトの要素が count 個）
+struct ListLayout {
+    size_t offset;
+    size_t width;
+    size_t count;
+};
+
+static ListLayout parseLayout(const std::string& path, const unsigned char* bytes, size_t size) {
+    if (size >= 4 && std::memcmp(bytes, HEADER_MAGIC, 4) == 0) {
+        if (size < HEADER_SIZE) {
+            throw std::runtime_error("librpn: truncated list header in '" + path + "'");
+        }
+        size_t width = static_cast<size_t>(loadLittleEndian(bytes + 4, 4));
+        uint64_t count = loadLittleEndian(bytes + 8, 8);
+        if (width != 4 && width != 8) {
+            throw std::runtime_error("librpn: unsupported element size in '" + path + "'");
+        }
+        if (count > (size - HEADER_SIZE) / width) {
+            throw std::runtime_error("librpn: list file '" + path + "' is shorter than its header says");
+        }
+        return {HEADER_SIZE, width, static_cast<size_t>(count)};
+    }
+    size_t width = endsWith(path, ".f32") ? 4 : endsWith(path, ".f64") ? 8 : 0;
+    if (width == 0) {
+        throw std::runtime_error("librpn: list file '" + path + "' needs an RPNV header or a .f64 / .f32 name");
+    }
+    if (size % width != 0) {
+        throw std::runtime_error("librpn: list file '" + path + "' is not a whole number of elements");
+    }
+    return {0, width, size / width};
+}
+
+// 要素を double の配列にする（f32、またはビッグエンディアンのホスト）
+static std::vector<double> widenElements(const unsigned char* p, const ListLayout& layout) {
+    std::vector<double> values(layout.count);
+    for (size_t i = 0; i < layout.count; ++i) {
+        uint64_t bits = loadLittleEndian(p + layout.offset + i * layout.width, layout.width);
+        if (layout.width == 4) {
+            uint32_t narrow = static_cast<uint32_t>(bits);
+            float f;
+            std::memcpy(&f, &narrow, sizeof(f));
+            values[i] = f;
+        } else {
+            std::memcpy(&values[i], &bits, sizeof(double));
+        }
+    }
+    return values;
+}
+
+static std::shared_ptr<const ListData> openListFile(const std::string& path) {
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("librpn: cannot open list file '" + path + "'");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        throw std::runtime_error("librpn: '" + path + "' is not a regular file");
+    }
+    auto mapped = std::make_shared<MappedListData>();
+    mapped->length = static_cast<size_t>(st.st_size);
+    if (mapped->length > 0) {
+        void* address = mmap(nullptr, mapped->length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("librpn: cannot map list file '" + path + "'");
+        }
+        mapped->address = address;
+    }
+    ::close(fd);
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(mapped->address);
+    ListLayout layout = parseLayout(path, bytes, mapped->length);
+    if (layout.count == 0) return std::make_shared<OwnedListData>(std::vector<double>());
+    if (layout.width == 8 && hostIsLittleEndian()) {
+        // マップしたページをそのまま参照する（ヘッダは16バイトなので境界は8バイトに揃う）
+        mapped->view = ListView(reinterpret_cast<const double*>(bytes + layout.offset), layout.count);
+        madvise(mapped->address, mapped->length, MADV_SEQUENTIAL);
+        return mapped;
+    }
+    return std::make_shared<OwnedListData>(widenElements(bytes, layout));
+#else
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("librpn: cannot open list file '" + path + "'");
+    }
+    std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    ListLayout layout = parseLayout(path, bytes.data(), bytes.size());
+    return std::make_shared<OwnedListData>(widenElements(bytes.data(), layout));
+#endif
+}
+
+//==============================================================================
+// 登録表
+//==============================================================================
+
+// 基準ディレクトリの下から開いたファイルのマップを保持しておく数（古いものから捨てる）
+constexpr size_t FILE_CACHE_CAPACITY = 32;
+
+// キーは式に現れる形の "@name"（評価時にトークンの文字列でそのまま引くため）
+// @path で開いたファイルは登録せず、正規化したパスをキーに files に最大 FILE_CACHE_CAPACITY 個保持する
+struct ListRegistry {
+    std::shared_mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<const ListData>> lists;
+    std::string fileRoot;
+    std::unordered_map<std::string, std::shared_ptr<const ListData>> files;
+    std::deque<std::string> fileOrder;      // files に加えた順
+};
+
+static ListRegistry& listRegistry() {
+    static ListRegistry registry;
+    return registry;
+}
+
+std::string listReference(const std::string& name) {
+    if (name.empty() || name.find_first_of(" \t\n\v\f\r,(){}") != std::string::npos) {
+        throw std::invalid_argument("librpn: invalid list name '" + name + "'");
+    }
+    return "@" + name;
+}
+
+static void storeList(const std::string& name, std::shared_ptr<const ListData> data) {
+    std::string reference = listReference(name);
+    ListRegistry& registry = listRegistry();
+    std::unique_lock<std::shared_mutex> lock(registry.mutex);
+    registry.lists[reference] = std::move(data);
+}
+
+void registerList(const std::string& name, const double* data, size_t count) {
+    storeList(name, std::make_shared<BorrowedListData>(data, count));
+}
+
+void registerList(const std::string& name, std::vector<double> values) {
+    storeList(name, std::make_shared<OwnedListData>(std::move(values)));
+}
+
+void registerList(const std::string& name, std::shared_ptr<const ListData> data) {
+    if (!data) {
+        throw std::invalid_argument("librpn: no list data to register as '" + name + "'");
+    }
+    storeList(name, std::move(data));
+}
+
+std::shared_ptr<const ListData> makeListData(std::vector<double> values) {
+    return std::make_shared<OwnedListData>(std::move(values));
+}
+
+void registerListFile(const std::string& name, const std::string& path) {
+    listReference(name);      // ファイルを開く前に名前を検査する
+    storeList(name, openListFile(path));
+}
+
+bool unregisterList(const std::string& name) {
+    ListRegistry& registry = listRegistry();
+    std::unique_lock<std::shared_mutex> lock(registry.mutex);
+    return registry.lists.erase(listReference(name)) > 0;
+}
+
+void setListFileRoot(const std::string& directory) {
+    ListRegistry& registry = listRegistry();
+    std::unique_lock<std::shared_mutex> lock(registry.mutex);
+    registry.fileRoot = directory;
+    registry.files.clear();
+    registry.fileOrder.clear();
+}
+
+// @path の基準ディレクトリからの相対パスを、区切りを '/' にそろえて正規化する
+// 絶対パスと、空・"."・".." の要素を含むパスは拒否する（空文字列を返す）。
+// 同じファイルを別の綴り（./x.f64 や a//x.f64）で何度も開かせないため、綴りは1通りに限る。
+static std::string normalizeListPath(const std::string& path) {
+    if (path.empty() || path[0] == '/' || path[0] == '\\') return std::string();
+    std::string normalized;
+    normalized.reserve(path.size());
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find_first_of("/\\", start);
+        if (end == std::string::npos) end = path.size();
+        size_t length = end - start;
+        if (length == 0 || path.compare(start, length, ".") == 0 || path.compare(start, length, "..") == 0) {
+            return std::string();
+        }
+        if (!normalized.empty()) normalized += '/';
+        normalized.append(path, start, length);
+        start = end + 1;
+    }
+    return normalized;
+}
+
+// 基準ディレクトリの下のファイルの実際のパス（シンボリックリンクをたどった先も基準ディレクトリの下に限る）
+static std::string fileUnderRoot(const std::string& root, const std::string& path, const std::string& reference) {
+    namespace fs = std::filesystem;
+    std::error_code error;
+    fs::path base = fs::canonical(root, error);
+    fs::path file;
+    if (!error) file = fs::canonical(fs::path(root) / path, error);
+    if (error) {
+        throw std::runtime_error("librpn: cannot open list file '" + root + "/" + path + "'");
+    }
+    auto mismatch = std::mismatch(base.begin(), base.end(), file.begin(), file.end());
+    if (mismatch.first != base.end() || mismatch.second == file.end()) {
+        throw std::out_of_range("librpn: unknown list '" + reference + "'");
+    }
+    return file.string();
+}
+
+std::shared_ptr<const ListData> findListSource(const std::string& reference) {
+    ListRegistry& registry = listRegistry();
+    std::shared_lock<std::shared_mutex> lock(registry.mutex);
+    auto it = registry.lists.find(reference);
+    if (it != registry.lists.end()) return it->second;
+    if (registry.files.empty()) return nullptr;
+    auto file = registry.files.find(normalizeListPath(reference.substr(1)));
+    return file != registry.files.end() ? file->second : nullptr;
+}
+
+std::shared_ptr<const ListData> resolveListSource(const std::string& reference) {
+    ListRegistry& registry = listRegistry();
+    std::string root;
+    {
+        std::shared_lock<std::shared_mutex> lock(registry.mutex);
+        auto it = registry.lists.find(reference);
+        if (it != registry.lists.end()) return it->second;
+        root = registry.fileRoot;
+    }
+
+    std::string path = normalizeListPath(reference.substr(1));
+    if (root.empty() || path.empty()) {
+        throw std::out_of_range("librpn: unknown list '" + reference + "'");
+    }
+    {
+        std::shared_lock<std::shared_mutex> lock(registry.mutex);
+        auto it = registry.files.find(path);
+        if (it != registry.files.end()) return it->second;
+    }
+    std::shared_ptr<const ListData> data = openListFile(fileUnderRoot(root, path, reference));
+
+    // 同時に開いたスレッドがあれば先に保持されたほうを使う。基準ディレクトリが変わっていれば保持しない
+    std::unique_lock<std::shared_mutex> lock(registry.mutex);
+    if (registry.fileRoot != root) return data;
+    auto inserted = registry.files.emplace(path, std::move(data));
+    if (inserted.second) {
+        registry.fileOrder.push_back(path);
+        if (registry.fileOrder.size() > FILE_CACHE_CAPACITY) {
+            // 捨てたマップは、評価中の式が参照していれば評価が終わるまで残る
+            registry.files.erase(registry.fileOrder.front());
+            registry.fileOrder.pop_front();
+        }
+    }
+    return inserted.first->second;
+}
+
+} // namespace librpn
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "librpn.hpp"
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace librpn {
+
+//==============================================================================
+// 外部データのリスト（@name）
+//==============================================================================
+
+// 式の中の @name は、名前で登録したリストの値になる（{ } の中に1つだけ置いてもよい）。
+//
+//   std::vector<double> prices = ...;
+//   librpn::registerList("prices", prices.data(), prices.size());   // コピーしない
+//   librpn::calculateRPN("{ @prices } mean");
+//   librpn::registerListFile("ticks", "/data/ticks.f64");            // mmap する
+//   librpn::calculateRPN(librpn::infixToRPN("{ @ticks } range * 2"));
+//
+// 数値を文字列にして解析し直すことはなく、リスト関数はデータを直接集約する。
+// 登録・参照はスレッドセーフ。評価中に登録を解除・置き換えても、評価中のデータは
+// 評価が終わるまで有効。バッチ評価と自動微分では使えない。
+//
+// ファイルの形式（リトルエンディアン）
+//   *.f64 / *.f32       : 要素を並べただけのファイル
+//   ヘッダ付き（形式を問わず先頭が "RPNV" なら）:
+//     "RPNV" | u32 要素のバイト数（4 = f32、8 = f64）| u64 要素数 | 要素 …
+// f64 はマップしたデータをそのまま使う。f32 は読み込み時に1回だけ double に広げる。
+
+// 登録したデータの保持者（ファイルのマップ・所有する配列・外部のポインタ）
+// 同じデータに何度も median・percentile・sum を求める場合のため、並べ替えた複製と
+// 累積和を最初に必要になったときに1回だけ作って保持する（複数スレッドから呼んでよい）。
+// 外部のポインタで登録したデータを書き換えた場合は、登録し直して複製を捨てること。
+struct ListData {
+    ListView view;
+    virtual ~ListData() = default;
+
+    // 昇順に並べた複製（NaN は末尾）
+    ListView sorted() const;
+
+    // 累積和（要素数 + 1 個。[i] は先頭 i 個を順に足した値で、最後は sum と一致する）
+    ListView prefixSums() const;
+
+private:
+    mutable std::once_flag sortedOnce_;
+    mutable std::once_flag prefixOnce_;
+    mutable std::vector<double> sorted_;
+    mutable std::vector<double> prefix_;
+};
+
+// data[0 … count-1] を name で登録する（コピーしない。登録を解除するまで data を有効に保つこと）
+// name が空か空白・',' '(' ')' '{' '}' を含む場合は std::invalid_argument
+void registerList(const std::string& name, const double* data, size_t count);
+
+// values を name で登録する（ライブラリが所有する）
+void registerList(const std::string& name, std::vector<double> values);
+
+// 作成済みのデータを name で登録する（Evaluator::recallList の結果など。コピーしない）
+void registerList(const std::string& name, std::shared_ptr<const ListData> data);
+
+// values を所有するデータを作る（登録はしない）
+std::shared_ptr<const ListData> makeListData(std::vector<double> values);
+
+// ファイルをマップして name で登録する（開けない・形式が不正なら std::runtime_error）
+void registerListFile(const std::string& name, const std::string& path);
+
+// 登録を解除する（登録されていなければ false）
+bool unregisterList(const std::string& name);
+
+// @path/to/data.f64 のように、登録していない名前をファイルとして開くときの基準ディレクトリ
+// 空（既定）ならファイルとしては開かない。絶対パスと、空・"."・".." の要素を含むパス、
+// シンボリックリンクをたどると基準ディレクトリの外に出るパスは常に拒否する。
+// 開いたファイルは登録せず、最近開いた32個までマップを再利用する（基準ディレクトリを変えると捨てる）。
+void setListFileRoot(const std::string& directory);
+
+// 名前を式の中の参照 "@name" にする（名前が不正なら std::invalid_argument）
+std::string listReference(const std::string& name);
+
+// 参照 "@name" のデータを引く（評価器から使う）。見つからなければ std::out_of_range
+std::shared_ptr<const ListData> resolveListSource(const std::string& reference);
+
+// 登録済みの "@name"（と、すでに開いて保持している @path）のデータだけを引く（ファイルは開かない。なければ nullptr）
+std::shared_ptr<const ListData> findListSource(const std::string& reference);
+
+} // namespace librpn
@@ -0,0 +1,137 @@
+#include "librpn_stats.hpp"
+#include "librpn_quantile.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace librpn {
+
+//==============================================================================
+// 複数の統計量の一括計算
+//==============================================================================
+
+template <typename T>
+BasicListStatistics<T> computeStatistics(BasicListView<T> v, StatisticSet which) {
+    auto wants = [which](std::initializer_list<Statistic> statistics) {
+        for (Statistic s : statistics) {
+            if (which & statisticBit(s)) return true;
+        }
+        return false;
+    };
+    BasicListStatistics<T> result;
+    auto set = [&](Statistic s, T value) {
+        if (which & statisticBit(s)) result.values[static_cast<size_t>(s)] = value;
+    };
+
+    size_t n = v.size();
+    bool order = n > 0 && wants({Statistic::Median, Statistic::Iqr});
+
+    // 合計・積・最小・最大（順位統計量が必要なら作業用の複製も作る）
+    // 最小・最大は先頭の要素から順に比べ、より小さい・大きいときだけ置き換える（lmin・lmax と同じ）
+    T sum = 0;
+    T product = 1;
+    T lo = n > 0 ? v[0] : 0;
+    T hi = lo;
+    std::vector<T> work;
+    if (order) work.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        T x = v[i];
+        sum += x;
+        product *= x;
+        lo = x < lo ? x : lo;
+        hi = hi < x ? x : hi;
+        if (order) work[i] = x;
+    }
+
+    set(Statistic::Count, static_cast<T>(n));
+    set(Statistic::Sum, sum);
+    set(Statistic::Product, product);
+    if (n > 0) {
+        set(Statistic::Mean, sum / n);
+        set(Statistic::Min, lo);
+        set(Statistic::Max, hi);
+        set(Statistic::Range, hi - lo);
+    }
+
+    // 偏差平方和（分散・標準偏差を求めるときだけ）
+    if (n > 0 && wants({Statistic::Var, Statistic::SVar, Statistic::Stddev, Statistic::SStddev})) {
+        T mean = sum / n;
+        T deviations = 0;
+        for (T x : v) deviations += (x - mean) * (x - mean);
+        set(Statistic::Var, deviations / n);
+        set(Statistic::Stddev, std::sqrt(deviations / n));
+        if (n >= 2) {
+            set(Statistic::SVar, deviations / (n - 1));
+            set(Statistic::SStddev, std::sqrt(deviations / (n - 1)));
+        }
+    }
+
+    // 中央値・四分位数に必要な順位をまとめて選ぶ
+    if (order) {
+        const T quartiles[2] = {25, 75};
+        bool iqr = wants({Statistic::Iqr});
+        std::vector<size_t> ranks = {n / 2};
+        for (T p : quartiles) {
+            if (!iqr) break;
+            T h = p / 100 * static_cast<T>(n - 1);
+            size_t lower = static_cast<size_t>(h);
+            ranks.push_back(lower);
+            if (lower + 1 < n && h > static_cast<T>(lower)) ranks.push_back(lower + 1);
+        }
+        std::sort(ranks.begin(), ranks.end());
+        ranks.erase(std::unique(ranks.begin(), ranks.end()), ranks.end());
+        selectRanksInPlace(work, ranks);
+
+        // 要素数が偶数なら、中央の下側は左半分の最大値（median と同じ）
+        if (n % 2 == 0) {
+            set(Statistic::Median, (*std::max_element(work.begin(), work.begin() + n / 2) + work[n / 2]) / 2);
+        } else {
+            set(Statistic::Median, work[n / 2]);
+        }
+        // percentilesInPlace と同じ補間
+        if (!iqr) return result;
+        T values[2];
+        for (size_t i = 0; i < 2; ++i) {
+            T h = quartiles[i] / 100 * static_cast<T>(n - 1);
+            size_t lower = static_cast<size_t>(h);
+            T fraction = h - static_cast<T>(lower);
+            values[i] = work[lower];
+            if (lower + 1 < n && fraction > 0) values[i] += fraction * (work[lower + 1] - work[lower]);
+        }
+        set(Statistic::Iqr, values[1] - values[0]);
+    }
+    return result;
+}
+
+template BasicListStatistics<float> computeStatistics<float>(BasicListView<float>, StatisticSet);
+template BasicListStatistics<double> computeStatistics<double>(BasicListView<double>, StatisticSet);
+template BasicListStatistics<long double> computeStatistics<long double>(BasicListView<long double>, StatisticSet);
+
+Statistic statisticFromName(const std::string& name) {
+    static const std::unordered_map<std::string, Statistic> statistics = {
+        {"count", Statistic::Count},
+        {"sum", Statistic::Sum},
+        {"ΣLIST", Statistic::Sum},
+        {"product", Statistic::Product},
+        {"ΠLIST", Statistic::Product},
+        {"mean", Statistic::Mean},
+        {"var", Statistic::Var},
+        {"svar", Statistic::SVar},
+        {"stddev", Statistic::Stddev},
+        {"sstddev", Statistic::SStddev},
+        {"lmin", Statistic::Min},
+        {"lmax", Statistic::Max},
+        {"range", Statistic::Range},
+        {"median", Statistic::Median},
+        {"iqr", Statistic::Iqr},
+    };
+    auto it = statistics.find(name);
+    if (it == statistics.end()) {
+        throw std::invalid_argument("librpn: '" + name + "' is not a list statistic");
+    }
+    return it->second;
+}
+
+} // namespace librpn
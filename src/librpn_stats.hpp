@@ -0,0 +1,80 @@
+#pragma once
+
+#include "librpn.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace librpn {
+
+//==============================================================================
+// 複数の統計量の一括計算
+//==============================================================================
+
+// 同じリストに count・mean・stddev・median などを1つずつ適用する代わりに、
+// 必要な統計量をまとめて求める（RPN では { リスト } stats）。
+//
+//   librpn::StatisticSet which = librpn::statisticBit(librpn::Statistic::Mean) |
+//                                librpn::statisticBit(librpn::Statistic::Median);
+//   librpn::ListStatistics s = librpn::computeStatistics(values, which);
+//   s[librpn::Statistic::Median];
+//
+// 合計・積・最小・最大は1回の走査でまとめて求め、中央値・四分位範囲が必要ならその走査で
+// 作業用の複製も作る。分散・標準偏差を求めるときだけ、平均からの偏差をもう1回読む。
+// 中央値と四分位範囲に必要な順位は1回の選択でまとめて選ぶ。
+// 各値は同じ名前のリスト関数の結果とビット単位で一致する（空のリストでは0など）。
+
+// 統計量（括弧内は同じ結果のリスト関数）
+enum class Statistic {
+    Count,      // count
+    Sum,        // sum / ΣLIST
+    Product,    // product / ΠLIST
+    Mean,       // mean
+    Var,        // var
+    SVar,       // svar
+    Stddev,     // stddev
+    SStddev,    // sstddev
+    Min,        // lmin
+    Max,        // lmax
+    Range,      // range
+    Median,     // median
+    Iqr,        // iqr
+};
+
+constexpr size_t STATISTIC_COUNT = 13;
+
+// 求める統計量の集合（statisticBit の論理和）
+using StatisticSet = uint32_t;
+
+constexpr StatisticSet statisticBit(Statistic s) {
+    return StatisticSet(1) << static_cast<unsigned>(s);
+}
+
+constexpr StatisticSet ALL_STATISTICS = (StatisticSet(1) << STATISTIC_COUNT) - 1;
+
+// stats が返す統計量（この順のリストになる）
+constexpr Statistic STATS_RESULTS[] = {
+    Statistic::Count, Statistic::Mean, Statistic::Stddev, Statistic::Min, Statistic::Max, Statistic::Median,
+};
+
+// 計算結果（求めなかった統計量は0）
+template <typename T>
+struct BasicListStatistics {
+    std::array<T, STATISTIC_COUNT> values{};
+
+    T operator[](Statistic s) const { return values[static_cast<size_t>(s)]; }
+};
+
+using ListStatistics = BasicListStatistics<double>;
+
+// which の統計量をまとめて求める
+// T = float / double / long double で明示的にインスタンス化済み。
+template <typename T>
+BasicListStatistics<T> computeStatistics(BasicListView<T> values, StatisticSet which = ALL_STATISTICS);
+
+// リスト関数の名前（"mean"、"lmax"、"ΣLIST" など）に対応する統計量
+// 対応するものがなければ std::invalid_argument
+Statistic statisticFromName(const std::string& name);
+
+} // namespace librpn
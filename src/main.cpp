@@ -1,7 +1,72 @@
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <string>
 #include "librpn.hpp"
+#include "librpn_csv.hpp"
 
-int main() {
+//==============================================================================
+// CSVモード
+//==============================================================================
+
+static void printUsage(const char* program) {
+    std::cerr << "usage: " << program << "    （デモを実行する）\n"
+              << "       " << program << " --csv FILE --expr EXPR [--threads N] [--delimiter C] [--fast]\n"
+              << "           CSVの各行に中置記法の数式 EXPR を適用し、結果を1行に1つ出力する\n"
+              << "           （変数名は1行目の列名）\n";
+}
+
+static int runCsv(int argc, char** argv) {
+    std::string path;
+    std::string expression;
+    unsigned threads = 0;
+    librpn::CsvOptions options;
+    bool fast = false;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (std::strcmp(arg, "--csv") == 0 && hasValue) {
+            path = argv[++i];
+        } else if (std::strcmp(arg, "--expr") == 0 && hasValue) {
+            expression = argv[++i];
+        } else if (std::strcmp(arg, "--threads") == 0 && hasValue) {
+            threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (std::strcmp(arg, "--delimiter") == 0 && hasValue) {
+            options.delimiter = std::strcmp(argv[i + 1], "\\t") == 0 ? '\t' : argv[i + 1][0];
+            ++i;
+        } else if (std::strcmp(arg, "--fast") == 0) {
+            fast = true;
+        } else {
+            printUsage(argv[0]);
+            return 2;
+        }
+    }
+    if (path.empty() || expression.empty()) {
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    try {
+        librpn::Program program = librpn::compile(expression);
+        if (fast) program.mathMode = librpn::MathMode::Fast;
+        librpn::TaskPool pool(threads);
+        std::ios::sync_with_stdio(false);
+        librpn::evaluateCsvFile(program, path, pool, std::cout, options);
+        std::cout.flush();
+    } catch (const std::exception& e) {
+        std::cout.flush();
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+//==============================================================================
+// デモ
+//==============================================================================
+
+static int runDemo() {
     std::cout << "=== 通常の数式からRPNへの変換 ===" << std::endl;
 
     // 基本的な四則演算
@@ -227,3 +292,8 @@ int main() {
 
     return 0;
 }
+
+int main(int argc, char** argv) {
+    if (argc > 1) return runCsv(argc, argv);
+    return runDemo();
+}
@@ -1,6 +1,51 @@
 #include <gtest/gtest.h>
 #include "../src/librpn.hpp"
+#include "../src/librpn_alloc.hpp"
+#include "../src/librpn_model.hpp"
+#include "../src/librpn_grad.hpp"
+#include "../src/librpn_quantile.hpp"
+#include "../src/librpn_parallel.hpp"
+#include "../src/librpn_source.hpp"
+#include "../src/librpn_csv.hpp"
+#include "../src/librpn_simd.hpp"
+#include "../src/librpn_stats.hpp"
+#include "../src/librpn_function.hpp"
+#include "../src/librpn_cost.hpp"
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <new>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <cstdio>
+
+// ヒープ確保の回数・バイト数を数える（Evaluator の定常状態で確保がないことの確認用）
+#if !defined(LIBRPN_ALLOC_HOOKS)
+static std::atomic<size_t> allocationCount{0};
+static std::atomic<size_t> allocationBytes{0};
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    ++allocationCount;
+    allocationBytes += size;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+// インライン展開されると GCC が new/free の組み合わせを誤って警告するため noinline にする
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+static size_t heapAllocations() { return allocationCount.load(); }
+static size_t heapBytes() { return allocationBytes.load(); }
+#else
+// operator new はライブラリの計測（librpn_alloc.cpp）が置き換えている
+static size_t heapAllocations() { return librpn::threadAllocations().allocations; }
+static size_t heapBytes() { return librpn::threadAllocations().bytes; }
+#endif
 
 //==============================================================================
 // infixToRPN テスト
@@ -66,6 +111,25 @@ TEST_F(InfixToRPNTest, ListFunctions) {
     EXPECT_EQ(librpn::infixToRPN("{ 2, 4, 6 } mean"), "{ 2 4 6 } mean");
 }
 
+TEST_F(InfixToRPNTest, TokenOutput) {
+    std::vector<librpn::Token> code;
+    librpn::infixToRPN("(1 + 2) * sqrt(16)", code);
+    ASSERT_EQ(code.size(), 6u);
+    EXPECT_EQ(code[2].type, librpn::TokenType::Operator);
+    EXPECT_EQ(librpn::formatRPN(code), "1 2 + 16 sqrt *");
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN(code), 12.0);
+
+    // 出力は置き換えられ、確保済みの容量は再利用される
+    const librpn::Token* storage = code.data();
+    librpn::infixToRPN("2 ^ 3", code);
+    EXPECT_EQ(code.data(), storage);
+    EXPECT_EQ(librpn::formatRPN(code), "2 3 ^");
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN(code), 8.0);
+
+    librpn::infixToRPN("x + 1", code);
+    EXPECT_THROW(librpn::calculateRPN(code), std::out_of_range);
+}
+
 //==============================================================================
 // calculateRPN テスト
 //==============================================================================
@@ -246,56 +310,56 @@ TEST_F(TokenizeTest, Numbers) {
     auto tokens = librpn::tokenize("123");
     ASSERT_EQ(tokens.size(), 1);
     EXPECT_EQ(tokens[0].type, librpn::TokenType::Number);
-    EXPECT_EQ(tokens[0].value, "123");
+    EXPECT_EQ(tokens[0].value(), "123");
 }
 
 TEST_F(TokenizeTest, DecimalNumbers) {
     auto tokens = librpn::tokenize("3.14");
     ASSERT_EQ(tokens.size(), 1);
     EXPECT_EQ(tokens[0].type, librpn::TokenType::Number);
-    EXPECT_EQ(tokens[0].value, "3.14");
+    EXPECT_EQ(tokens[0].value(), "3.14");
 }
 
 TEST_F(TokenizeTest, NegativeNumbers) {
     auto tokens = librpn::tokenize("-5");
     ASSERT_EQ(tokens.size(), 1);
     EXPECT_EQ(tokens[0].type, librpn::TokenType::Number);
-    EXPECT_EQ(tokens[0].value, "-5");
+    EXPECT_EQ(tokens[0].value(), "-5");
 }
 
 TEST_F(TokenizeTest, Operators) {
     auto tokens = librpn::tokenize("1 + 2");
     ASSERT_EQ(tokens.size(), 3);
     EXPECT_EQ(tokens[1].type, librpn::TokenType::Operator);
-    EXPECT_EQ(tokens[1].value, "+");
+    EXPECT_EQ(tokens[1].value(), "+");
 }
 
 TEST_F(TokenizeTest, UnaryFunctions) {
     auto tokens = librpn::tokenize("sqrt(16)");
     ASSERT_GE(tokens.size(), 1);
     EXPECT_EQ(tokens[0].type, librpn::TokenType::UnaryFunction);
-    EXPECT_EQ(tokens[0].value, "sqrt");
+    EXPECT_EQ(tokens[0].value(), "sqrt");
 }
 
 TEST_F(TokenizeTest, BinaryFunctions) {
     auto tokens = librpn::tokenize("pow(2, 10)");
     ASSERT_GE(tokens.size(), 1);
     EXPECT_EQ(tokens[0].type, librpn::TokenType::BinaryFunction);
-    EXPECT_EQ(tokens[0].value, "pow");
+    EXPECT_EQ(tokens[0].value(), "pow");
 }
 
 TEST_F(TokenizeTest, Constants) {
     auto tokens = librpn::tokenize("pi");
     ASSERT_EQ(tokens.size(), 1);
     EXPECT_EQ(tokens[0].type, librpn::TokenType::Constant);
-    EXPECT_EQ(tokens[0].value, "pi");
+    EXPECT_EQ(tokens[0].value(), "pi");
 }
 
 TEST_F(TokenizeTest, UnicodeSymbols) {
     auto tokens = librpn::tokenize("π");
     ASSERT_EQ(tokens.size(), 1);
     EXPECT_EQ(tokens[0].type, librpn::TokenType::Constant);
-    EXPECT_EQ(tokens[0].value, "π");
+    EXPECT_EQ(tokens[0].value(), "π");
 }
 
 TEST_F(TokenizeTest, ListBrackets) {
@@ -305,6 +369,70 @@ TEST_F(TokenizeTest, ListBrackets) {
     EXPECT_EQ(tokens[4].type, librpn::TokenType::ListEnd);
 }
 
+TEST_F(TokenizeTest, SymbolIdsAndParsedNumbers) {
+    auto tokens = librpn::tokenize("-2.5 × π");
+    ASSERT_EQ(tokens.size(), 3);
+    EXPECT_EQ(tokens[0].id, librpn::NO_SYMBOL);
+    EXPECT_DOUBLE_EQ(tokens[0].number, -2.5);
+    ASSERT_NE(tokens[1].id, librpn::NO_SYMBOL);
+    EXPECT_EQ(librpn::SYMBOLS[tokens[1].id].name, "×");
+    EXPECT_EQ(librpn::SYMBOLS[tokens[1].id].precedence, 2);
+    EXPECT_EQ(librpn::SYMBOLS[tokens[1].id].arity, 2);
+    EXPECT_NEAR(tokens[2].number, M_PI, 1e-10);
+}
+
+TEST_F(TokenizeTest, LongestMatchOfMultiCharacterSymbols) {
+    // 複数の文字からなる Unicode の名前も1つのトークンになる
+    auto tokens = librpn::tokenize("{ 1, 2, 3 } ΣLIST + { 2, 3 } ΠLIST");
+    ASSERT_EQ(tokens.size(), 15u);
+    EXPECT_EQ(tokens[7].type, librpn::TokenType::ListFunction);
+    EXPECT_EQ(tokens[7].value(), "ΣLIST");
+    EXPECT_EQ(tokens[14].value(), "ΠLIST");
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN(librpn::infixToRPN("{ 1, 2, 3 } ΣLIST + { 2, 3 } ΠLIST")), 12.0);
+
+    // 演算子は長いほうを優先する
+    auto ops = librpn::tokenize("a<=b<c&&!d");
+    ASSERT_EQ(ops.size(), 8u);
+    EXPECT_EQ(ops[1].value(), "<=");
+    EXPECT_EQ(ops[3].value(), "<");
+    EXPECT_EQ(ops[5].value(), "&&");
+    EXPECT_EQ(ops[6].value(), "!");
+
+    // 名前の途中では一致しない（識別子の続きなら変数）
+    auto names = librpn::tokenize("log10(pix) + sinx + 2πr + ΣLISTS");
+    ASSERT_EQ(names.size(), 12u);
+    EXPECT_EQ(names[0].value(), "log10");
+    EXPECT_EQ(names[2].type, librpn::TokenType::Variable);
+    EXPECT_EQ(names[2].value(), "pix");
+    EXPECT_EQ(names[5].type, librpn::TokenType::Variable);
+    EXPECT_EQ(names[5].value(), "sinx");
+    EXPECT_EQ(names[8].value(), "π");
+    EXPECT_EQ(names[9].value(), "r");
+    EXPECT_EQ(names[11].type, librpn::TokenType::Variable);     // 未知の Σ は読み飛ばす
+    EXPECT_EQ(names[11].value(), "LISTS");
+}
+
+TEST_F(TokenizeTest, SymbolTokensCarryNoText) {
+    // 文字列を持つのは変数名・数値の綴り・@name だけ（名前は SYMBOLS から引く）
+    auto tokens = librpn::tokenize("sin(x) + 1.50 * π + sum{@prices}");
+    ASSERT_EQ(tokens.size(), 13u);
+    for (const auto& token : tokens) {
+        bool named = token.type == librpn::TokenType::Variable || token.type == librpn::TokenType::Number ||
+                     token.type == librpn::TokenType::ListSource;
+        EXPECT_EQ(token.text.empty(), !named) << token.value();
+    }
+    EXPECT_EQ(tokens[0].value(), "sin");
+    EXPECT_EQ(tokens[1].value(), "(");
+    EXPECT_EQ(tokens[2].text, "x");
+    EXPECT_EQ(tokens[5].text, "1.50");
+    EXPECT_EQ(tokens[9].value(), "sum");
+    EXPECT_EQ(tokens[10].value(), "{");
+    EXPECT_EQ(tokens[11].value(), "@prices");
+    std::vector<librpn::Token> code;
+    librpn::infixToRPN("sin(x) + 1.50 * π", code);
+    EXPECT_EQ(librpn::formatRPN(code), "x sin 1.50 π * +");
+}
+
 //==============================================================================
 // 判定関数テスト
 //==============================================================================
@@ -374,6 +502,15 @@ TEST_F(HelperFunctionTest, IsRightAssociative) {
     EXPECT_FALSE(librpn::isRightAssociative("/"));
 }
 
+TEST_F(HelperFunctionTest, FindSymbol) {
+    librpn::SymbolId id = librpn::findSymbol("^");
+    ASSERT_NE(id, librpn::NO_SYMBOL);
+    EXPECT_EQ(librpn::SYMBOLS[id].type, librpn::TokenType::Operator);
+    EXPECT_TRUE(librpn::SYMBOLS[id].rightAssociative);
+    EXPECT_EQ(librpn::SYMBOLS[librpn::findSymbol("median")].type, librpn::TokenType::ListFunction);
+    EXPECT_EQ(librpn::findSymbol("unknown"), librpn::NO_SYMBOL);
+}
+
 TEST_F(HelperFunctionTest, GetPrecedence) {
     EXPECT_EQ(librpn::getPrecedence("+"), 1);
     EXPECT_EQ(librpn::getPrecedence("-"), 1);
@@ -425,3 +562,1709 @@ TEST_F(IntegrationTest, UnicodeExpressions) {
 TEST_F(IntegrationTest, StatisticalFunctions) {
     EXPECT_DOUBLE_EQ(librpn::calculateRPN(librpn::infixToRPN("{ 10, 20, 30, 40, 50 } mean")), 30.0);
 }
+
+//==============================================================================
+// コンパイル・評価テスト
+//==============================================================================
+
+class CompileTest : public ::testing::Test {};
+
+TEST_F(CompileTest, VariablesGetSlotsInOrder) {
+    librpn::Program p = librpn::compile("x * x + y_1");
+    ASSERT_EQ(p.variables.size(), 2);
+    EXPECT_EQ(p.variables[0], "x");
+    EXPECT_EQ(p.variables[1], "y_1");
+    EXPECT_DOUBLE_EQ(librpn::evaluate(p, {3.0, 1.0}), 10.0);
+    EXPECT_EQ(librpn::infixToRPN("x * x + y_1"), "x x * y_1 +");
+}
+
+TEST_F(CompileTest, MatchesCalculateRPN) {
+    const char* expressions[] = {"max(pow(2, 3), min(10, 5))", "√(16) + π", "{ 2, 4, 6, 8 } stddev"};
+    for (const char* e : expressions) {
+        EXPECT_DOUBLE_EQ(librpn::evaluate(librpn::compile(e)), librpn::calculateRPN(librpn::infixToRPN(e))) << e;
+    }
+}
+
+TEST_F(CompileTest, MissingVariableThrows) {
+    EXPECT_THROW(librpn::evaluate(librpn::compile("x + 1")), std::out_of_range);
+}
+
+//==============================================================================
+// 値の型を選べる版（calculateRPNAs / compileAs / evaluateAs）テスト
+//==============================================================================
+
+class TemplateEngineTest : public ::testing::Test {};
+
+TEST_F(TemplateEngineTest, DoubleMatchesWrapper) {
+    const char* expr = "3 4 + 2 * sin { 1 2 3 } mean +";
+    EXPECT_EQ(librpn::calculateRPNAs<double>(expr), librpn::calculateRPN(expr));
+    librpn::Program p = librpn::compile("x ^ 2 + stddev{x, 1, 2}");
+    EXPECT_EQ(librpn::evaluateAs(p, {1.5}), librpn::evaluate(p, {1.5}));
+}
+
+TEST_F(TemplateEngineTest, FloatAndLongDoublePrecision) {
+    // 各型の精度で計算される
+    EXPECT_EQ(librpn::calculateRPNAs<float>("0.1 0.2 +"), 0.1f + 0.2f);
+    EXPECT_EQ(librpn::calculateRPNAs<long double>("0.1 0.2 +"), 0.1L + 0.2L);
+    EXPECT_EQ(librpn::calculateRPNAs<long double>("pi"), 3.141592653589793238462643383279502884L);
+    EXPECT_NE(librpn::calculateRPNAs<long double>("pi"), static_cast<long double>(M_PI));
+
+    librpn::BasicProgram<float> pf = librpn::compileAs<float>("sqrt(x) * median{ 3, x, 1 }");
+    EXPECT_FLOAT_EQ(librpn::evaluateAs(pf, {4.0f}), 6.0f);
+    librpn::BasicProgram<long double> pl = librpn::compileAs<long double>("x / 3");
+    EXPECT_EQ(librpn::evaluateAs(pl, {1.0L}), 1.0L / 3.0L);
+    EXPECT_THROW(librpn::evaluateAs(pl), std::out_of_range);
+}
+
+//==============================================================================
+// 依存グラフ（Model）テスト
+//==============================================================================
+
+class ModelTest : public ::testing::Test {};
+
+TEST_F(ModelTest, RecomputesOnlyDownstream) {
+    librpn::Model m;
+    m.define("total", "price * qty");   // 前方参照
+    m.setInput("price", 2.0);
+    m.setInput("qty", 5.0);
+    m.setInput("rate", 0.5);
+    m.define("tax", "total * rate");
+    m.define("other", "rate + 1");
+    EXPECT_EQ(m.recompute(), 3);
+    EXPECT_DOUBLE_EQ(m.value("tax"), 5.0);
+
+    m.setInput("qty", 6.0);
+    EXPECT_EQ(m.recompute(), 2);        // total, tax のみ
+    EXPECT_DOUBLE_EQ(m.value("total"), 12.0);
+    EXPECT_DOUBLE_EQ(m.value("tax"), 6.0);
+    EXPECT_DOUBLE_EQ(m.value("other"), 1.5);
+
+    m.setInput("qty", 6.0);             // 値が同じなら再計算しない
+    EXPECT_EQ(m.recompute(), 0);
+}
+
+TEST_F(ModelTest, ParallelMatchesSequential) {
+    librpn::Model seq, par;
+    for (librpn::Model* m : {&seq, &par}) {
+        m->setInput("x", 1.5);
+        for (int i = 0; i < 500; ++i) {
+            std::string n = std::to_string(i);
+            m->define("a" + n, "sin(x * " + n + ") + " + n);
+            m->define("b" + n, "a" + n + " * a" + n + " - x");
+        }
+    }
+    seq.recompute(1);
+    par.recompute(4);
+    for (int i = 0; i < 500; i += 37) {
+        EXPECT_DOUBLE_EQ(seq.value("b" + std::to_string(i)), par.value("b" + std::to_string(i)));
+    }
+}
+
+TEST_F(ModelTest, DetectsErrors) {
+    librpn::Model cyclic;
+    cyclic.define("a", "b + 1");
+    cyclic.define("b", "a * 2");
+    EXPECT_THROW(cyclic.recompute(), std::runtime_error);
+
+    librpn::Model undefined;
+    undefined.define("a", "missing + 1");
+    EXPECT_THROW(undefined.recompute(), std::runtime_error);
+}
+
+//==============================================================================
+// SIMDカーネル・バッチ評価テスト
+//==============================================================================
+
+class SimdKernelTest : public ::testing::Test {
+protected:
+    // 2つの値の差（ULP単位）
+    static double ulpDiff(double a, double b) {
+        if (a == b) return 0.0;
+        int64_t ia, ib;
+        std::memcpy(&ia, &a, sizeof(a));
+        std::memcpy(&ib, &b, sizeof(b));
+        if (ia < 0) ia = INT64_MIN - ia;
+        if (ib < 0) ib = INT64_MIN - ib;
+        return static_cast<double>(ia > ib ? ia - ib : ib - ia);
+    }
+
+    static std::vector<double> uniform(double lo, double hi, size_t n, unsigned seed) {
+        std::mt19937_64 rng(seed);
+        std::uniform_real_distribution<double> dist(lo, hi);
+        std::vector<double> v(n);
+        for (auto& x : v) x = dist(rng);
+        return v;
+    }
+
+    // カーネルの結果が libm との差 maxUlp 以内か
+    template <typename Kernel, typename Reference>
+    static void expectWithin(Kernel kernel, Reference reference, const std::vector<double>& x, double maxUlp) {
+        std::vector<double> out(x.size());
+        kernel(x.data(), out.data(), x.size());
+        for (size_t i = 0; i < x.size(); ++i) {
+            ASSERT_LE(ulpDiff(out[i], reference(x[i])), maxUlp) << "x = " << x[i];
+        }
+    }
+};
+
+TEST_F(SimdKernelTest, UnaryKernelsWithinUlpBounds) {
+    const size_t n = 20000;
+    expectWithin(librpn::simd::sqrt, [](double x) { return std::sqrt(x); }, uniform(0, 1e10, n, 1), 0);
+    expectWithin(librpn::simd::exp, [](double x) { return std::exp(x); }, uniform(-708, 708, n, 2), 2);
+    expectWithin(librpn::simd::log, [](double x) { return std::log(x); }, uniform(1e-300, 1e300, n, 3), 1);
+    expectWithin(librpn::simd::log, [](double x) { return std::log(x); }, uniform(0.5, 2, n, 4), 1);
+    expectWithin(librpn::simd::log10, [](double x) { return std::log10(x); }, uniform(0.5, 2, n, 5), 2);
+    expectWithin(librpn::simd::sin, [](double x) { return std::sin(x); }, uniform(-1e5, 1e5, n, 6), 2);
+    expectWithin(librpn::simd::cos, [](double x) { return std::cos(x); }, uniform(-1e5, 1e5, n, 7), 2);
+    expectWithin(librpn::simd::tan, [](double x) { return std::tan(x); }, uniform(-1e5, 1e5, n, 8), 4);
+}
+
+TEST_F(SimdKernelTest, PowWithinUlpBoundsAndSpecialValues) {
+    const size_t n = 20000;
+    std::vector<double> x = uniform(1e-3, 1e3, n, 9);
+    std::vector<double> y = uniform(-50, 50, n, 10);
+    // 整数指数・負の底・特殊値も混ぜる
+    for (size_t i = 0; i < n; i += 4) y[i] = std::round(y[i] * 0.6);
+    for (size_t i = 0; i < n; i += 8) x[i] = -x[i];
+    x[1] = 0.0; x[3] = INFINITY; x[5] = NAN; y[7] = NAN;
+    std::vector<double> out(n);
+    librpn::simd::pow(x.data(), y.data(), out.data(), n);
+    for (size_t i = 0; i < n; ++i) {
+        double expected = std::pow(x[i], y[i]);
+        if (std::isnan(expected)) {
+            EXPECT_TRUE(std::isnan(out[i]));
+            continue;
+        }
+        bool isInt = std::fabs(y[i]) <= 32 && std::floor(y[i]) == y[i];
+        double bound = isInt ? std::fabs(y[i]) + 1 : 4 + 3 * std::fabs(y[i] * std::log(std::fabs(x[i])));
+        ASSERT_LE(ulpDiff(out[i], expected), bound) << "x = " << x[i] << ", y = " << y[i];
+    }
+}
+
+TEST_F(SimdKernelTest, StrictBatchMatchesEvaluate) {
+    librpn::Program p = librpn::compile("sin(x) * exp(y / 10) + x ^ y - sqrt(x) / ln(x + 2) + mean{ x, y, 1 }");
+    const size_t rows = 1000;   // ブロック境界をまたぐ行数
+    std::vector<double> x = uniform(0.1, 5, rows, 11);
+    std::vector<double> y = uniform(-3, 3, rows, 12);
+    std::vector<double> out(rows);
+    librpn::evaluateBatch(p, {x.data(), y.data()}, rows, out.data());
+    for (size_t i = 0; i < rows; ++i) {
+        ASSERT_EQ(out[i], librpn::evaluate(p, {x[i], y[i]}));
+    }
+}
+
+TEST_F(SimdKernelTest, FastBatchIsCloseToStrict) {
+    librpn::Program strict = librpn::compile("sin(x) * cos(y) + exp(0 - x) * log10(y + 11) + tan(x / 4) ^ 2");
+    librpn::Program fast = strict;
+    fast.mathMode = librpn::MathMode::Fast;
+    const size_t rows = 777;
+    std::vector<double> x = uniform(-3, 3, rows, 13);
+    std::vector<double> y = uniform(-10, 10, rows, 14);
+    std::vector<double> a(rows), b(rows);
+    librpn::evaluateBatch(strict, {x.data(), y.data()}, rows, a.data());
+    librpn::evaluateBatch(fast, {x.data(), y.data()}, rows, b.data());
+    for (size_t i = 0; i < rows; ++i) {
+        EXPECT_NEAR(a[i], b[i], 1e-12 * (1 + std::fabs(a[i])));
+    }
+    EXPECT_THROW(librpn::evaluateBatch(strict, {x.data()}, rows, a.data()), std::out_of_range);
+}
+
+//==============================================================================
+// 自動微分テスト
+//==============================================================================
+
+class GradientTest : public ::testing::Test {
+protected:
+    // 中心差分による偏微分
+    static double numericPartial(const librpn::Program& p, std::vector<double> vars, size_t slot) {
+        const double h = 1e-6;
+        vars[slot] += h;
+        double plus = librpn::evaluate(p, vars);
+        vars[slot] -= 2 * h;
+        double minus = librpn::evaluate(p, vars);
+        return (plus - minus) / (2 * h);
+    }
+
+    static void expectMatchesNumeric(const std::string& expr, const std::vector<double>& vars) {
+        librpn::Program p = librpn::compile(expr);
+        ASSERT_EQ(p.variables.size(), vars.size()) << expr;
+        librpn::GradientResult g = librpn::gradient(p, vars);
+        EXPECT_EQ(g.value, librpn::evaluate(p, vars)) << expr;
+        for (size_t i = 0; i < vars.size(); ++i) {
+            EXPECT_NEAR(g.gradient[i], numericPartial(p, vars, i), 1e-6 * (1 + std::fabs(g.gradient[i])))
+                << expr << " d/d" << p.variables[i];
+        }
+    }
+};
+
+TEST_F(GradientTest, Analytic) {
+    librpn::Program p = librpn::compile("x * y + sin(x)");
+    librpn::GradientResult g = librpn::gradient(p, {2.0, 3.0});
+    EXPECT_DOUBLE_EQ(g.value, 6.0 + std::sin(2.0));
+    ASSERT_EQ(g.gradient.size(), 2u);
+    EXPECT_DOUBLE_EQ(g.gradient[0], 3.0 + std::cos(2.0));
+    EXPECT_DOUBLE_EQ(g.gradient[1], 2.0);
+
+    // 同じ変数が複数回現れる場合は寄与を合計する
+    g = librpn::gradient(librpn::compile("x * x * x"), {2.0});
+    EXPECT_DOUBLE_EQ(g.gradient[0], 12.0);
+}
+
+TEST_F(GradientTest, EveryBuiltinMatchesFiniteDifferences) {
+    for (const auto& entry : librpn::OPERATORS) {
+        expectMatchesNumeric("x " + entry.first + " y", {1.7, 0.6});
+    }
+    for (const auto& entry : librpn::UNARY_FUNCTIONS) {
+        expectMatchesNumeric(entry.first + "(x)", {0.7});
+    }
+    for (const auto& entry : librpn::BINARY_FUNCTIONS) {
+        expectMatchesNumeric(entry.first + "(x, y)", {1.7, 0.6});
+    }
+}
+
+TEST_F(GradientTest, ListFunctions) {
+    // ΣLIST / ΠLIST は中置記法で書けないため sum / product で代表する（導関数は共通）
+    for (const char* name : {"sum", "product", "mean", "var", "svar", "stddev", "sstddev"}) {
+        expectMatchesNumeric(std::string(name) + "{x, y * 2, 3, z}", {0.5, 1.5, -2.0});
+    }
+    // 0 を含む積
+    librpn::GradientResult g = librpn::gradient(librpn::compile("product{x, y, 4}"), {0.0, 3.0});
+    EXPECT_DOUBLE_EQ(g.gradient[0], 12.0);
+    EXPECT_DOUBLE_EQ(g.gradient[1], 0.0);
+
+    EXPECT_THROW(librpn::gradient(librpn::compile("median{x, 1, 2}"), {1.0}), std::invalid_argument);
+    EXPECT_THROW(librpn::gradient(librpn::compile("x + y"), {1.0}), std::out_of_range);
+}
+
+//==============================================================================
+// リスト値の要素ごとの演算
+//==============================================================================
+
+class ListValueTest : public ::testing::Test {};
+
+TEST_F(ListValueTest, ElementwiseAndBroadcast) {
+    EXPECT_EQ(librpn::calculateRPNList("{ 1 2 3 } { 4 5 6 } +"), (std::vector<double>{5, 7, 9}));
+    EXPECT_EQ(librpn::calculateRPNList("{ 1 2 3 } 2 *"), (std::vector<double>{2, 4, 6}));
+    EXPECT_EQ(librpn::calculateRPNList("10 { 1 2 4 } /"), (std::vector<double>{10, 5, 2.5}));
+    EXPECT_EQ(librpn::calculateRPNList("{ 1 4 9 } sqrt"), (std::vector<double>{1, 2, 3}));
+    EXPECT_EQ(librpn::calculateRPNList("{ 1 2 3 } 2 max"), (std::vector<double>{2, 2, 3}));
+    EXPECT_EQ(librpn::calculateRPNList("3"), (std::vector<double>{3}));
+
+    EXPECT_THROW(librpn::calculateRPNList("{ 1 2 3 } { 4 5 } +"), std::invalid_argument);
+    EXPECT_THROW(librpn::calculateRPN("{ 1 2 3 } 2 *"), std::runtime_error);
+}
+
+TEST_F(ListValueTest, ReductionsOfListValues) {
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("{ 1 2 3 } { 4 5 6 } + sum"), 21.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("{ 1 2 3 } { 4 5 6 } * sum sqrt"), std::sqrt(32.0));
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("{ 1 2 3 } mean { 4 5 6 } mean +"), 7.0);
+    // 従来の書き方（閉じていないリスト・スタック全体）
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("{ 1 2 3 mean"), 2.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("1 2 3 sum"), 6.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPNAs<float>("{ 1 2 3 } 2 * sum"), 12.0f);
+}
+
+TEST_F(ListValueTest, InfixListFunctionsAndPrograms) {
+    // 後置・前置のリスト関数はリストの直後に適用される
+    EXPECT_EQ(librpn::infixToRPN("sum{x * 2, 3} + 1"), "{ x 2 * 3 } sum 1 +");
+    EXPECT_DOUBLE_EQ(librpn::evaluate(librpn::compile("mean{1, 2} * 2"), {}), 3.0);
+
+    librpn::Program p = librpn::compile("{x, y, 3} * 2");
+    EXPECT_EQ(librpn::evaluateList(p, {1.0, 2.0}), (std::vector<double>{2, 4, 6}));
+    EXPECT_TRUE(librpn::usesListArithmetic(p.code));
+    EXPECT_FALSE(librpn::usesListArithmetic(librpn::compile("sum{x, 2} * 2").code));
+
+    std::vector<double> x = {0.5};
+    std::vector<double> out(1);
+    EXPECT_THROW(librpn::evaluateBatch(p, {x.data(), x.data()}, 1, out.data()), std::invalid_argument);
+    EXPECT_THROW(librpn::gradient(p, {1.0, 2.0}), std::invalid_argument);
+
+    // Fast では SIMDカーネルで計算する
+    librpn::Program q = librpn::compile("sin({x, y, 3}) * 2");
+    q.mathMode = librpn::MathMode::Fast;
+    std::vector<double> fast = librpn::evaluateList(q, {0.25, 1.5});
+    ASSERT_EQ(fast.size(), 3u);
+    EXPECT_NEAR(fast[0], 2 * std::sin(0.25), 1e-14);
+    EXPECT_NEAR(fast[2], 2 * std::sin(3.0), 1e-14);
+}
+
+//==============================================================================
+// パーセンタイル
+//==============================================================================
+
+class PercentileTest : public ::testing::Test {
+protected:
+    // 並べ替えによる線形補間のパーセンタイル（検証用）
+    static double sortedPercentile(std::vector<double> v, double p) {
+        std::sort(v.begin(), v.end());
+        double h = p / 100 * (v.size() - 1);
+        size_t lower = static_cast<size_t>(h);
+        if (lower + 1 >= v.size()) return v[lower];
+        return v[lower] + (h - lower) * (v[lower + 1] - v[lower]);
+    }
+};
+
+TEST_F(PercentileTest, ExactMatchesSorting) {
+    std::mt19937 rng(7);
+    std::lognormal_distribution<double> dist(0.0, 1.0);
+    for (size_t n : {1u, 2u, 5u, 100u, 10001u}) {
+        std::vector<double> v(n);
+        for (double& x : v) x = dist(rng);
+        std::vector<double> ps = {0, 1, 25, 50, 75, 90, 99, 99.9, 100};
+        std::vector<double> values = v;
+        std::vector<double> out;
+        librpn::percentilesInPlace(values, ps, out);
+        for (size_t i = 0; i < ps.size(); ++i) {
+            EXPECT_DOUBLE_EQ(out[i], sortedPercentile(v, ps[i])) << "n=" << n << " p=" << ps[i];
+        }
+    }
+}
+
+TEST_F(PercentileTest, Expressions) {
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("{ 5 1 4 2 3 } 50 percentile"), 3.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("{ 1 2 3 4 } 25 percentile"), 1.75);
+    EXPECT_EQ(librpn::calculateRPNList("{ 4 3 2 1 5 } { 0 50 100 } percentile"),
+              (std::vector<double>{1, 3, 5}));
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("{ 1 2 3 4 5 6 7 8 9 } iqr"), 4.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("{ 4 1 3 2 } median"), 2.5);
+
+    // 中置記法では二項関数と同じ形で書く
+    EXPECT_EQ(librpn::infixToRPN("percentile({x, y, 3}, 90)"), "{ x y 3 } 90 percentile");
+    librpn::Program p = librpn::compile("percentile({x, y, 3}, 50) + 1");
+    EXPECT_DOUBLE_EQ(librpn::evaluate(p, {10.0, 0.0}), 4.0);
+
+    std::vector<double> x = {1, 10, 20}, y = {2, 0, 30}, out(3);
+    librpn::evaluateBatch(p, {x.data(), y.data()}, 3, out.data());
+    EXPECT_EQ(out, (std::vector<double>{3, 4, 21}));
+
+    EXPECT_THROW(librpn::calculateRPN("{ 1 2 } 101 percentile"), std::invalid_argument);
+    EXPECT_THROW(librpn::calculateRPN("1 2 50 percentile"), std::invalid_argument);
+    EXPECT_THROW(librpn::gradient(p, {1.0, 2.0}), std::invalid_argument);
+}
+
+TEST_F(PercentileTest, TDigestAccuracyAndMerge) {
+    std::mt19937 rng(11);
+    std::lognormal_distribution<double> dist(0.0, 1.0);
+    std::vector<double> v(200000);
+    librpn::TDigest whole;
+    librpn::TDigest shards[4];
+    for (size_t i = 0; i < v.size(); ++i) {
+        v[i] = dist(rng);
+        whole.add(v[i]);
+        shards[i % 4].add(v[i]);
+    }
+    librpn::TDigest merged;
+    for (auto& shard : shards) merged.merge(shard);
+    EXPECT_DOUBLE_EQ(merged.count(), 200000.0);
+    EXPECT_LT(whole.centroidCount(), 200u);
+
+    std::vector<double> sorted = v;
+    std::sort(sorted.begin(), sorted.end());
+    // 近似値の順位の誤差で評価する（両端ほど厳しい）
+    for (double p : {1.0, 50.0, 90.0, 99.0, 99.9}) {
+        for (librpn::TDigest* digest : {&whole, &merged}) {
+            double estimate = digest->percentile(p);
+            double rank = std::lower_bound(sorted.begin(), sorted.end(), estimate) - sorted.begin();
+            double q = p / 100;
+            EXPECT_NEAR(rank / sorted.size(), q, 0.001 + 0.01 * std::min(q, 1 - q)) << "p=" << p;
+        }
+    }
+    EXPECT_DOUBLE_EQ(whole.percentile(0), sorted.front());
+    EXPECT_DOUBLE_EQ(whole.percentile(100), sorted.back());
+
+    EXPECT_NEAR(librpn::calculateRPN("{ 1 2 3 4 5 6 7 8 9 10 } 50 approxpercentile"), 5.5, 0.5);
+}
+
+TEST_F(PercentileTest, TDigestFractionalWeights) {
+    // 重み 0.5 の4点は、重み1の4点と同じ分位点になる
+    librpn::TDigest half;
+    librpn::TDigest unit;
+    for (double x : {1.0, 2.0, 3.0, 9.0}) {
+        half.add(x, 0.5);
+        unit.add(x);
+    }
+    EXPECT_NEAR(half.quantile(0.4), 2.0, 0.2);
+    for (double q : {0.0, 0.1, 0.4, 0.5, 0.9, 1.0}) {
+        EXPECT_DOUBLE_EQ(half.quantile(q), unit.quantile(q)) << "q=" << q;
+    }
+
+    // 重みを定数倍しても分位点は変わらない（重心にまとめたあとも）
+    std::mt19937 rng(5);
+    std::normal_distribution<double> dist(0.0, 1.0);
+    librpn::TDigest scaled;
+    librpn::TDigest plain;
+    for (int i = 0; i < 20000; ++i) {
+        double x = dist(rng);
+        scaled.add(x, 0.25);
+        plain.add(x);
+    }
+    for (double p : {0.1, 1.0, 50.0, 99.0, 99.9}) {
+        EXPECT_NEAR(scaled.percentile(p), plain.percentile(p), 1e-9) << "p=" << p;
+    }
+
+    // 重みの大きい値ほど分位点が寄る
+    librpn::TDigest skewed;
+    skewed.add(0.0, 3.0);
+    skewed.add(10.0, 1.0);
+    EXPECT_LT(skewed.quantile(0.5), 5.0);
+}
+
+TEST_F(PercentileTest, ApproxPercentileReadsWithoutCopying) {
+    // 遅延リスト（seq）と登録済みのリストは要素を複製せずに読む
+    const size_t n = 1000000;
+    std::vector<double> values(n);
+    for (size_t i = 0; i < n; ++i) values[i] = static_cast<double>(i + 1);
+    librpn::registerList("approx_test_values", values.data(), values.size());
+
+    librpn::AllocationStats lazy, registered;
+    double lazyMedian, registeredP99;
+    {
+        librpn::AllocationScope scope;
+        lazyMedian = librpn::calculateRPN("1 1000000 seq 50 approxpercentile");
+        lazy = scope.stats();
+    }
+    {
+        librpn::AllocationScope scope;
+        registeredP99 = librpn::calculateRPN("@approx_test_values 99 approxpercentile");
+        registered = scope.stats();
+    }
+    EXPECT_NEAR(lazyMedian, 500000.5, 5000);
+    EXPECT_NEAR(registeredP99, 990000.0, 1000);
+    EXPECT_EQ(librpn::calculateRPNList("1 1000 seq 2 * { 0 100 } approxpercentile"),
+              (std::vector<double>{2, 2000}));
+    librpn::unregisterList("approx_test_values");
+
+    if (!librpn::allocationHooksEnabled()) return;
+    // 要素数 × 8バイトのバッファを作らない（t-digest と遅延リストのブロックだけ）
+    EXPECT_LT(lazy.peakLiveBytes, static_cast<int64_t>(n * sizeof(double) / 8));
+    EXPECT_LT(registered.peakLiveBytes, static_cast<int64_t>(n * sizeof(double) / 8));
+}
+
+//==============================================================================
+// 窓関数（移動平均など）
+//==============================================================================
+
+class WindowFunctionTest : public ::testing::Test {
+protected:
+    // 窓ごとにリスト関数を適用した結果（検証用の O(n·k) 版）
+    static std::vector<double> naive(const std::vector<double>& v, size_t k, const std::string& name) {
+        std::vector<double> out;
+        for (size_t i = 0; i + k <= v.size(); ++i) {
+            std::vector<double> window(v.begin() + i, v.begin() + i + k);
+            out.push_back(librpn::LIST_FUNCTIONS.at(name).func(window));
+        }
+        return out;
+    }
+
+    static std::string listOf(const std::vector<double>& v) {
+        std::string s = "{";
+        for (double x : v) s += " " + std::to_string(x);
+        return s + " }";
+    }
+};
+
+TEST_F(WindowFunctionTest, MatchNaiveWindows) {
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<double> dist(-100.0, 100.0);
+    std::vector<double> v(300);
+    for (double& x : v) x = std::round(dist(rng) * 1000) / 1000;   // to_string で丸まらない値
+    const std::pair<const char*, const char*> pairs[] = {
+        {"movsum", "sum"}, {"movavg", "mean"}, {"movmin", "lmin"}, {"movmax", "lmax"}, {"movstd", "stddev"}};
+    for (size_t k : {1u, 2u, 7u, 64u, 300u}) {
+        for (const auto& pair : pairs) {
+            std::vector<double> result =
+                librpn::calculateRPNList(listOf(v) + " " + std::to_string(k) + " " + pair.first);
+            std::vector<double> expected = naive(v, k, pair.second);
+            ASSERT_EQ(result.size(), expected.size()) << pair.first << " k=" << k;
+            for (size_t i = 0; i < result.size(); ++i) {
+                EXPECT_NEAR(result[i], expected[i], 1e-9 * (1 + std::abs(expected[i])))
+                    << pair.first << " k=" << k << " i=" << i;
+            }
+        }
+    }
+}
+
+TEST_F(WindowFunctionTest, EwmaAndComposition) {
+    std::vector<double> ewma = librpn::calculateRPNList("{ 1 2 3 } 3 ewma");   // α = 0.5
+    EXPECT_EQ(ewma, (std::vector<double>{1, 1.5, 2.25}));
+
+    // 結果のリストは他のリスト関数・演算に渡せる
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("{ 1 2 3 4 5 } 2 movavg lmax"), 4.5);
+    EXPECT_EQ(librpn::calculateRPNList("{ 1 2 3 4 } 2 movsum 10 *"), (std::vector<double>{30, 50, 70}));
+    EXPECT_TRUE(librpn::calculateRPNList("{ 1 2 } 3 movsum").empty());
+    EXPECT_EQ(librpn::evaluateList(librpn::compile("movmax({x, y, 3}, 2)"), {5.0, 1.0}),
+              (std::vector<double>{5, 3}));
+
+    EXPECT_THROW(librpn::calculateRPNList("{ 1 2 3 } 0 movavg"), std::invalid_argument);
+    EXPECT_THROW(librpn::calculateRPNList("{ 1 2 3 } 1.5 movavg"), std::invalid_argument);
+    EXPECT_THROW(librpn::calculateRPNList("{ 1 2 3 } { 1 2 } movavg"), std::invalid_argument);
+
+    // リストを返す関数はバッチ評価できない
+    librpn::Program p = librpn::compile("mean(movavg({x, y, 3}, 2))");
+    EXPECT_TRUE(librpn::usesListArithmetic(p.code));
+}
+
+//==============================================================================
+// 長い式の字句解析（64バイト単位のバイト分類）
+//==============================================================================
+
+class LongExpressionTest : public ::testing::Test {};
+
+TEST_F(LongExpressionTest, TokensAcrossBlockBoundaries) {
+    // ブロック境界（64バイト）をまたぐ数値・識別子・マルチバイト文字・空白
+    for (size_t pad = 0; pad < 70; ++pad) {
+        std::string expression = std::string(pad, ' ') + "alpha_1 × 123.25 + √(x)\t-\n-4.5 ÷ π" +
+                                 std::string(pad % 3, ' ');
+        std::vector<librpn::Token> tokens = librpn::tokenize(expression);
+        std::vector<std::string> values;
+        for (const auto& token : tokens) values.push_back(token.value());
+        EXPECT_EQ(values, (std::vector<std::string>{"alpha_1", "×", "123.25", "+", "√", "(", "x", ")",
+                                                    "-", "-4.5", "÷", "π"})) << "pad=" << pad;
+    }
+
+    // ASCII演算子・括弧と区切り・Unicode の名前（演算子はバイトの続く範囲で最長一致）
+    for (size_t pad = 1; pad < 70; ++pad) {
+        std::string expression = std::string(pad, 'x') + "<=b&&!c?{1,2}:ΣLIST{d}>=-e==f=g|h^2%3";
+        std::vector<librpn::Token> tokens = librpn::tokenize(expression);
+        std::vector<std::string> values;
+        for (const auto& token : tokens) values.push_back(token.value());
+        EXPECT_EQ(values, (std::vector<std::string>{std::string(pad, 'x'), "<=", "b", "&&", "!", "c", "?",
+                                                    "{", "1", ",", "2", "}", ":", "ΣLIST", "{", "d", "}",
+                                                    ">=", "-", "e", "==", "f", "g", "h", "^", "2", "%", "3"}))
+            << "pad=" << pad;
+    }
+
+    // 大きなリスト（数千語）
+    std::string rpn = "{";
+    for (int i = 1; i <= 5000; ++i) rpn += (i % 2 ? " " : "\t ") + std::to_string(i);
+    rpn += " } sum";
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN(rpn), 5000.0 * 5001 / 2);
+}
+
+//==============================================================================
+// Evaluator（作業領域の再利用）
+//==============================================================================
+
+class EvaluatorTest : public ::testing::Test {};
+
+TEST_F(EvaluatorTest, SameResultsAsFreeFunctions) {
+    librpn::Evaluator ev;
+    EXPECT_DOUBLE_EQ(ev.calculateRPN("1 2 + 3 *"), 9.0);
+    EXPECT_DOUBLE_EQ(ev.calculate("(1 + 2) * 3"), 9.0);
+    EXPECT_DOUBLE_EQ(ev.calculate("mean{1, 2, 3} + sqrt(16)"), 6.0);
+    EXPECT_EQ(librpn::formatRPN(ev.infixToRPN("1 + 2 * 3")), "1 2 3 * +");
+    EXPECT_EQ(ev.rpnToInfix("1 2 + 3 4 + *"), "((1 + 2) * (3 + 4))");
+    EXPECT_EQ(ev.rpnToInfix("16 sqrt 2 +"), "(sqrt(16) + 2)");
+    EXPECT_DOUBLE_EQ(ev.evaluate(librpn::compile("x * y + 1"), {2.0, 3.0}), 7.0);
+
+    EXPECT_THROW(ev.calculateRPN("1 +"), std::runtime_error);
+    EXPECT_THROW(ev.rpnToInfix("1 +"), std::runtime_error);
+    EXPECT_THROW(ev.calculate("x + 1"), std::out_of_range);
+    // エラーのあとも続けて使える
+    EXPECT_DOUBLE_EQ(ev.calculateRPN("2 3 ^"), 8.0);
+
+    ev.shrink();
+    EXPECT_DOUBLE_EQ(ev.calculate("sum({1, 2} * 2 + 1)"), 8.0);
+}
+
+TEST_F(EvaluatorTest, NoAllocationsInSteadyState) {
+    librpn::Evaluator ev;
+    librpn::Program program = librpn::compile("x * y + sin(x) - mean{x, y, 3}");
+    std::vector<double> variables = {1.5, 2.5};
+    const std::string rpn = "3 4 2 * 1 5 - 2 3 ^ ^ / + { 1 2 3 } sum +";
+    const std::string infix = "sqrt(3 ^ 2 + 4 ^ 2) * (1 + 2) - max(1, 2)";
+    const std::string nested = "1 2 + 3 4 + * sqrt";
+
+    double sum = 0;
+    auto run = [&] {
+        sum += ev.calculateRPN(rpn);
+        sum += ev.calculate(infix);
+        sum += ev.evaluate(program, variables);
+        sum += static_cast<double>(ev.rpnToInfix(nested).size());
+    };
+    run();    // 作業領域を確保する
+
+    size_t before = heapAllocations();
+    for (int i = 0; i < 100; ++i) run();
+    EXPECT_EQ(heapAllocations() - before, 0u);
+    EXPECT_GT(sum, 0);
+}
+
+//==============================================================================
+// 比較・論理演算と条件式
+//==============================================================================
+
+class ConditionalTest : public ::testing::Test {};
+
+TEST_F(ConditionalTest, ComparisonAndLogicalOperators) {
+    // 比較は算術より、論理積は比較より、論理和は論理積より低い
+    EXPECT_EQ(librpn::infixToRPN("1 + 2 < 4"), "1 2 + 4 <");
+    EXPECT_EQ(librpn::infixToRPN("a < b and c >= d or e != f"), "a b < c d >= and e f != or");
+    EXPECT_EQ(librpn::infixToRPN("x <= -1 || x ≥ 1"), "x -1 <= x 1 ≥ ||");
+    EXPECT_EQ(librpn::infixToRPN("!(a == b) && ¬c"), "a b == ! c ¬ &&");
+
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("1 2 <"), 1.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("2 2 <"), 0.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("2 2 <="), 1.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("3 2 ≠"), 1.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("0 5 or 0 and"), 0.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("0 not 2 ∧"), 1.0);
+
+    librpn::Program p = librpn::compile("x > 0 && y > 0");
+    EXPECT_DOUBLE_EQ(librpn::evaluate(p, {1.0, 2.0}), 1.0);
+    EXPECT_DOUBLE_EQ(librpn::evaluate(p, {1.0, -2.0}), 0.0);
+    EXPECT_DOUBLE_EQ(librpn::evaluate(librpn::compile("x != x"), {std::nan("")}), 1.0);
+
+    EXPECT_EQ(librpn::rpnToInfix("1 2 + 4 <"), "((1 + 2) < 4)");
+}
+
+TEST_F(ConditionalTest, IfAndTernaryOperator) {
+    EXPECT_EQ(librpn::infixToRPN("if(x > 0, x, 0 - x)"), "x 0 > x 0 x - if");
+    EXPECT_EQ(librpn::infixToRPN("x > 0 ? x : -1"), "x 0 > x -1 if");
+    // 右結合（a ? b : (c ? d : e)）と入れ子
+    EXPECT_EQ(librpn::infixToRPN("a ? b : c ? d : e"), "a b c d e if if");
+    EXPECT_EQ(librpn::infixToRPN("a ? b ? c : d : e"), "a b c d if e if");
+    EXPECT_EQ(librpn::infixToRPN("max(a ? 1 : 2, 3) + 1"), "a 1 2 if 3 max 1 +");
+
+    librpn::Program sign = librpn::compile("x > 0 ? 1 : x < 0 ? -1 : 0");
+    EXPECT_DOUBLE_EQ(librpn::evaluate(sign, {5.0}), 1.0);
+    EXPECT_DOUBLE_EQ(librpn::evaluate(sign, {-5.0}), -1.0);
+    EXPECT_DOUBLE_EQ(librpn::evaluate(sign, {0.0}), 0.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("0 1 2 if"), 2.0);
+    EXPECT_EQ(librpn::rpnToInfix("x 0 > x 0 if"), "if((x > 0), x, 0)");
+
+    // リスト値には要素ごとに適用する
+    EXPECT_EQ(librpn::calculateRPNList("{ 1 -2 3 } 0 > { 1 -2 3 } 0 if"), (std::vector<double>{1, 0, 3}));
+
+    // 勾配は選ばれた側にだけ流れる
+    librpn::GradientResult g = librpn::gradient(librpn::compile("x > y ? x * y : y"), {3.0, 2.0});
+    EXPECT_DOUBLE_EQ(g.value, 6.0);
+    EXPECT_DOUBLE_EQ(g.gradient[0], 2.0);
+    EXPECT_DOUBLE_EQ(g.gradient[1], 3.0);
+
+    EXPECT_THROW(librpn::infixToRPN("a ? b"), std::runtime_error);
+    EXPECT_THROW(librpn::infixToRPN("a : b"), std::runtime_error);
+    EXPECT_THROW(librpn::calculateRPN("1 2 if"), std::runtime_error);
+}
+
+TEST_F(ConditionalTest, BatchSelectMatchesEvaluate) {
+    librpn::Program p = librpn::compile("x > y && x != 3 ? sqrt(x) : not(y <= 2) * (0 - y)");
+    const size_t rows = 1000;
+    std::vector<double> x(rows), y(rows), out(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        x[i] = static_cast<double>(i % 7);
+        y[i] = static_cast<double>(i % 5);
+    }
+    librpn::evaluateBatch(p, {x.data(), y.data()}, rows, out.data());
+    for (size_t i = 0; i < rows; ++i) {
+        EXPECT_EQ(out[i], librpn::evaluate(p, {x[i], y[i]})) << "row " << i;
+    }
+}
+
+//==============================================================================
+// 部分木の並列評価
+//==============================================================================
+
+class ParallelTest : public ::testing::Test {
+protected:
+    // 項数 terms の積和（各項にリスト関数・条件式を混ぜる）
+    static std::string sumOfProducts(size_t terms) {
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<double> dist(0.1, 3.0);
+        std::string expr;
+        for (size_t i = 0; i < terms; ++i) {
+            if (i > 0) expr += " + ";
+            std::string a = std::to_string(dist(rng));
+            std::string b = std::to_string(dist(rng));
+            switch (i % 4) {
+                case 0: expr += "x * " + a + " * sin(y + " + b + ")"; break;
+                case 1: expr += "mean{x, " + a + ", y} / " + b; break;
+                case 2: expr += "(x > " + a + " ? " + b + " : y) * " + a; break;
+                default: expr += "(" + a + " - y) * (" + b + " + x) * x"; break;
+            }
+        }
+        return expr;
+    }
+};
+
+TEST_F(ParallelTest, MatchesSequentialBitwise) {
+    librpn::Program p = librpn::compile(sumOfProducts(4000));
+    librpn::ParallelOptions options;
+    options.grain = 512;
+    librpn::ParallelProgram plan = librpn::planParallel(p, options);
+    ASSERT_TRUE(plan.parallel());
+    EXPECT_GT(plan.tasks.size(), 10u);
+
+    librpn::TaskPool pool(4);
+    for (double x : {0.5, 1.7, 2.9}) {
+        std::vector<double> vars = {x, 1.3};
+        EXPECT_EQ(librpn::evaluateParallel(plan, pool, vars), librpn::evaluate(p, vars));
+    }
+
+    // RPN式から
+    std::string rpn = librpn::infixToRPN(sumOfProducts(1000));
+    std::string constants = rpn;
+    for (size_t at; (at = constants.find('x')) != std::string::npos;) constants.replace(at, 1, "2");
+    for (size_t at; (at = constants.find('y')) != std::string::npos;) constants.replace(at, 1, "3");
+    EXPECT_EQ(librpn::calculateRPNParallel(constants, pool, options), librpn::calculateRPN(constants));
+}
+
+TEST_F(ParallelTest, ReassociateIsDeterministic) {
+    std::string expr = "1";
+    for (int i = 1; i < 20000; ++i) expr += " + " + std::to_string(1.0 / i) + " * x";
+    librpn::Program p = librpn::compile(expr);
+    librpn::ParallelOptions options;
+    options.grain = 1000;
+    options.reassociate = true;
+    librpn::ParallelProgram plan = librpn::planParallel(p, options);
+    ASSERT_TRUE(plan.parallel());
+    // 連鎖の加算もタスクに入り、spine はブロックの数程度になる
+    EXPECT_LT(plan.spine.code.size(), 200u);
+
+    double expected = librpn::evaluate(plan.program, {0.3});
+    for (unsigned threads : {1u, 2u, 4u}) {
+        librpn::TaskPool pool(threads);
+        EXPECT_EQ(librpn::evaluateParallel(plan, pool, {0.3}), expected) << threads << " threads";
+    }
+    EXPECT_NEAR(expected, librpn::evaluate(p, {0.3}), 1e-9);
+
+    // 組み替えなしでは連鎖の加算は spine に残るが、結果は逐次評価と同じ
+    options.reassociate = false;
+    librpn::ParallelProgram exact = librpn::planParallel(p, options);
+    librpn::TaskPool pool(3);
+    EXPECT_EQ(librpn::evaluateParallel(exact, pool, {0.3}), librpn::evaluate(p, {0.3}));
+}
+
+TEST_F(ParallelTest, FallbackAndErrors) {
+    librpn::TaskPool pool(2);
+
+    // 小さい式、開始のないリストの集計は分割しない
+    librpn::ParallelProgram small = librpn::planParallel(librpn::compile("x * 2 + 1"));
+    EXPECT_FALSE(small.parallel());
+    EXPECT_DOUBLE_EQ(librpn::evaluateParallel(small, pool, {4.0}), 9.0);
+
+    std::string legacy;
+    for (int i = 0; i < 3000; ++i) legacy += "1 2 + ";
+    legacy += "sum";
+    librpn::ParallelOptions options;
+    options.grain = 256;
+    librpn::ParallelProgram plan = librpn::planParallel(librpn::compileRPN(legacy), options);
+    EXPECT_FALSE(plan.parallel());
+    EXPECT_DOUBLE_EQ(librpn::evaluateParallel(plan, pool), 9000.0);
+
+    // タスク内の例外は呼び出し側に届く
+    librpn::ParallelProgram big = librpn::planParallel(librpn::compile(sumOfProducts(500)), options);
+    ASSERT_TRUE(big.parallel());
+    EXPECT_THROW(librpn::evaluateParallel(big, pool, {1.0}), std::out_of_range);
+
+    // 複数のタスクが失敗したら添字が最小のものの例外
+    try {
+        pool.run(100, [](size_t i) {
+            if (i % 10 == 3) throw std::runtime_error(std::to_string(i));
+        });
+        FAIL() << "expected an exception";
+    } catch (const std::runtime_error& e) {
+        EXPECT_STREQ(e.what(), "3");
+    }
+}
+
+//==============================================================================
+// ストリーム評価
+//==============================================================================
+
+class StreamTest : public ::testing::Test {
+protected:
+    // "1 1 + 0.5 + 0.5 + …" を必要な分だけその場で作る入力（全体を保持しない）
+    class GeneratedInput : public std::streambuf {
+    public:
+        explicit GeneratedInput(size_t terms) : remaining_(terms) {}
+
+    protected:
+        int_type underflow() override {
+            if (remaining_ == 0) return traits_type::eof();
+            chunk_.clear();
+            for (int k = 0; k < 1000 && remaining_ > 0; ++k, --remaining_) chunk_ += "0.5 + ";
+            setg(&chunk_[0], &chunk_[0], &chunk_[0] + chunk_.size());
+            return traits_type::to_int_type(chunk_[0]);
+        }
+
+    private:
+        size_t remaining_;
+        std::string chunk_;
+    };
+};
+
+TEST_F(StreamTest, MatchesCalculateRPNAcrossChunkBoundaries) {
+    const std::string expr = "3.14159265358979323 2 × √ { 1 2 3 } { 4 5 6 } + sum + π 2 ÷ sin + "
+                             "{ 10 20 30 40 } 50 percentile -";
+    double expected = librpn::calculateRPN(expr);
+    for (size_t chunk : {1, 2, 3, 7, 64, 65536}) {
+        std::istringstream in(expr);
+        EXPECT_EQ(librpn::calculateRPNStream(in, chunk), expected) << "chunk " << chunk;
+    }
+
+    // 1バイトずつ渡しても同じ（UTF-8の文字の途中で切れる）
+    librpn::StreamEvaluator stream;
+    for (char c : expr) stream.feed(&c, 1);
+    EXPECT_EQ(stream.finish(), expected);
+
+    // finish() のあとは次の式を受け取れる
+    stream.feed("{ 1 2 3 } { 4 5 ");
+    stream.feed("6 } *");
+    EXPECT_EQ(stream.finishList(), (std::vector<double>{4, 10, 18}));
+    stream.feed("\t1\n2\r\n+  ");
+    EXPECT_EQ(stream.depth(), 1u);
+    EXPECT_DOUBLE_EQ(stream.finish(), 3.0);
+}
+
+TEST_F(StreamTest, MemoryDoesNotGrowWithInput) {
+    // 100万項を評価しても、ヒープ確保の回数は入力の長さによらない
+    GeneratedInput source(1000000);
+    std::istream in(&source);
+    librpn::StreamEvaluator stream;
+    stream.feed("1 ");
+    size_t before = heapAllocations();
+    char buffer[4096];
+    while (in.read(buffer, sizeof(buffer)) || in.gcount() > 0) {
+        stream.feed(buffer, static_cast<size_t>(in.gcount()));
+        ASSERT_LE(stream.depth(), 2u);
+    }
+    EXPECT_LT(heapAllocations() - before, 100u);
+    EXPECT_DOUBLE_EQ(stream.finish(), 500001.0);
+}
+
+TEST_F(StreamTest, ErrorsAndFileDescriptors) {
+    librpn::StreamEvaluator stream;
+    EXPECT_THROW(stream.feed("1 2 abc +"), std::invalid_argument);
+    EXPECT_EQ(stream.depth(), 0u);     // 例外のあとは空に戻る
+    EXPECT_THROW(stream.feed(std::string(librpn::MAX_STREAM_WORD + 1, '1')), std::runtime_error);
+    EXPECT_THROW(stream.finish(), std::runtime_error);
+    stream.feed("1 +");
+    EXPECT_THROW(stream.finish(), std::runtime_error);
+    stream.feed("{ 1 2 }");
+    EXPECT_THROW(stream.finish(), std::runtime_error);
+
+    std::FILE* file = std::tmpfile();
+    ASSERT_NE(file, nullptr);
+    std::string expr;
+    for (int i = 0; i < 10000; ++i) expr += i == 0 ? "2 " : "2 + ";
+    std::fputs(expr.c_str(), file);
+    std::fflush(file);
+    std::rewind(file);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPNStream(fileno(file), 100), 20000.0);
+    std::fclose(file);
+}
+
+//==============================================================================
+// 外部データのリスト（@name）のテスト
+//==============================================================================
+
+class ListSourceTest : public ::testing::Test {
+protected:
+    // 一時ディレクトリにバイト列を書き込む
+    static std::string writeFile(const std::string& name, const void* data, size_t size) {
+        std::string path = directory() + "/" + name;
+        std::FILE* file = std::fopen(path.c_str(), "wb");
+        EXPECT_NE(file, nullptr);
+        if (size > 0) std::fwrite(data, 1, size, file);
+        std::fclose(file);
+        return path;
+    }
+
+    static std::string directory() {
+        static std::string dir = [] {
+            std::string d = std::filesystem::temp_directory_path() / "librpn_list_source_test";
+            std::filesystem::create_directories(d);
+            return d;
+        }();
+        return dir;
+    }
+};
+
+TEST_F(ListSourceTest, RegisteredBufferIsReducedInPlace) {
+    std::vector<double> data = {4, 8, 15, 16, 23, 42};
+    librpn::registerList("lost", data.data(), data.size());
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("{ @lost } mean"), 18.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("@lost sum"), 108.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN(librpn::infixToRPN("{ @lost } lmax - { @lost } lmin")), 38.0);
+    EXPECT_EQ(librpn::calculateRPNList("@lost 2 *"), (std::vector<double>{8, 16, 30, 32, 46, 84}));
+
+    // 元のデータを書き換えずに集計する（percentile は作業用の複製を並べ替える）
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("@lost 50 percentile"), 15.5);
+    EXPECT_EQ(data, (std::vector<double>{4, 8, 15, 16, 23, 42}));
+
+    // 所有する配列で置き換えられる
+    librpn::registerList("lost", std::vector<double>{1, 2});
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("@lost sum"), 3.0);
+    EXPECT_TRUE(librpn::unregisterList("lost"));
+    EXPECT_FALSE(librpn::unregisterList("lost"));
+}
+
+TEST_F(ListSourceTest, MapsRawAndHeaderFiles) {
+    std::vector<double> f64 = {1.5, 2.5, 3.5, 4.5};
+    std::vector<float> f32 = {0.5f, 0.25f, 0.125f};
+    writeFile("values.f64", f64.data(), f64.size() * sizeof(double));
+    writeFile("values.f32", f32.data(), f32.size() * sizeof(float));
+
+    // ヘッダ付き: 要素数より後ろのバイトは使わない
+    std::vector<unsigned char> header = {'R', 'P', 'N', 'V', 8, 0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0};
+    header.insert(header.end(), reinterpret_cast<const unsigned char*>(f64.data()),
+                  reinterpret_cast<const unsigned char*>(f64.data() + f64.size()));
+    std::string headed = writeFile("values.bin", header.data(), header.size());
+
+    librpn::registerListFile("headed", headed);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("@headed sum"), 4.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("@headed count"), 2.0);
+
+    // 基準ディレクトリを設定すると @path をファイルとして開く
+    librpn::setListFileRoot(directory());
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("{ @values.f64 } mean"), 3.0);
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN(librpn::infixToRPN("({ @values.f32 } sum) * 8")), 7.0);
+    EXPECT_NE(librpn::findListSource("@values.f64"), nullptr);              // マップは保持して再利用する
+    librpn::setListFileRoot("");
+    EXPECT_THROW(librpn::calculateRPN("@values.f64 lmax"), std::out_of_range);    // 登録はしない
+    librpn::unregisterList("headed");
+}
+
+TEST_F(ListSourceTest, Errors) {
+    EXPECT_THROW(librpn::calculateRPN("@missing sum"), std::out_of_range);
+    EXPECT_THROW(librpn::registerList("bad name", std::vector<double>{1}), std::invalid_argument);
+    EXPECT_THROW(librpn::registerList("", std::vector<double>{1}), std::invalid_argument);
+
+    std::vector<unsigned char> bad = {'R', 'P', 'N', 'V', 2, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    EXPECT_THROW(librpn::registerListFile("bad", writeFile("bad.bin", bad.data(), bad.size())),
+                 std::runtime_error);
+    std::vector<unsigned char> odd(12, 0);
+    EXPECT_THROW(librpn::registerListFile("odd", writeFile("odd.f64", odd.data(), odd.size())),
+                 std::runtime_error);
+    EXPECT_THROW(librpn::registerListFile("none", directory() + "/none.f64"), std::runtime_error);
+
+    // 基準ディレクトリの外は開かない。同じファイルの別の綴りも拒否する
+    librpn::setListFileRoot(directory());
+    EXPECT_THROW(librpn::calculateRPN("@../values.f64 sum"), std::out_of_range);
+    EXPECT_THROW(librpn::calculateRPN("@/etc/passwd.f64 sum"), std::out_of_range);
+    double values[2] = {1.5, 2.5};
+    writeFile("alias.f64", values, sizeof(values));
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("@alias.f64 sum"), 4.0);
+    for (const char* alias : {"@./alias.f64 sum", "@././alias.f64 sum", "@sub//alias.f64 sum", "@sub/ sum"}) {
+        EXPECT_THROW(librpn::calculateRPN(alias), std::out_of_range) << alias;
+    }
+
+    // シンボリックリンクをたどって外に出るパスも開かない
+    std::filesystem::path outside = std::filesystem::temp_directory_path() / "librpn_list_source_outside.f64";
+    std::filesystem::copy_file(directory() + "/alias.f64", outside,
+                               std::filesystem::copy_options::overwrite_existing);
+    std::filesystem::remove(directory() + "/link.f64");
+    std::filesystem::create_symlink(outside, directory() + "/link.f64");
+    EXPECT_THROW(librpn::calculateRPN("@link.f64 sum"), std::out_of_range);
+
+    // 開いたファイルのマップは数を限って保持する
+    for (int i = 0; i < 40; ++i) {
+        std::string name = "many" + std::to_string(i) + ".f64";
+        writeFile(name, values, sizeof(values));
+        EXPECT_DOUBLE_EQ(librpn::calculateRPN("@" + name + " sum"), 4.0);
+    }
+    EXPECT_EQ(librpn::findListSource("@many0.f64"), nullptr);
+    EXPECT_NE(librpn::findListSource("@many39.f64"), nullptr);
+    librpn::setListFileRoot("");
+    EXPECT_EQ(librpn::findListSource("@many39.f64"), nullptr);
+    std::filesystem::remove(outside);
+
+    // バッチ評価では使えない
+    librpn::registerList("batch", std::vector<double>{1, 2});
+    double x = 1.0, out = 0.0;
+    EXPECT_THROW(librpn::evaluateBatch(librpn::compileRPN("@batch sum x +"), {&x}, 1, &out),
+                 std::invalid_argument);
+    librpn::unregisterList("batch");
+}
+
+//==============================================================================
+// CSVの各行への数式の適用のテスト
+//==============================================================================
+
+class CsvTest : public ::testing::Test {
+protected:
+    // 出力を行ごとの数値に戻す
+    static std::vector<double> parseOutput(const std::string& text) {
+        std::vector<double> values;
+        std::istringstream in(text);
+        std::string line;
+        while (std::getline(in, line)) values.push_back(std::stod(line));
+        return values;
+    }
+};
+
+TEST_F(CsvTest, MatchesEvaluatePerRowForAnyChunking) {
+    std::string csv = "id, y ,\"x\",label\r\n";
+    std::vector<double> expected;
+    librpn::Program program = librpn::compile("sqrt(x^2 + y^2) + x / 3");
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<double> dist(-1e3, 1e3);
+    for (int i = 0; i < 500; ++i) {
+        double x = dist(rng), y = dist(rng);
+        char line[128];
+        std::snprintf(line, sizeof(line), "%d,%.17g, \"%.17g\" ,row%d\r\n", i, y, x, i);
+        csv += line;
+        if (i % 100 == 0) csv += "\n";     // 空行は読み飛ばす
+        expected.push_back(librpn::evaluate(program, {x, y}));
+    }
+    csv.resize(csv.size() - 2);             // 最後の行は改行なし
+
+    for (unsigned threads : {1u, 3u}) {
+        librpn::TaskPool pool(threads);
+        for (size_t chunk : {size_t(1), size_t(50), size_t(4096), size_t(1) << 20}) {
+            std::ostringstream out;
+            librpn::CsvOptions options;
+            options.chunkBytes = chunk;
+            EXPECT_EQ(librpn::evaluateCsv(program, csv.data(), csv.size(), pool, out, options), 500u);
+            EXPECT_EQ(parseOutput(out.str()), expected) << "threads " << threads << " chunk " << chunk;
+        }
+    }
+}
+
+TEST_F(CsvTest, ReadsFiles) {
+    std::string path = (std::filesystem::temp_directory_path() / "librpn_csv_test.tsv").string();
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    ASSERT_NE(file, nullptr);
+    std::fputs("\xEF\xBB\xBF" "a\tb\n1\t2\n3\t4\n+5\t-6e0\n", file);
+    std::fclose(file);
+
+    librpn::TaskPool pool(2);
+    librpn::CsvOptions options;
+    options.delimiter = '\t';
+    options.chunkBytes = 4;
+    std::ostringstream out;
+    EXPECT_EQ(librpn::evaluateCsvFile(librpn::compile("a * 10 + b"), path, pool, out, options), 3u);
+    EXPECT_EQ(out.str(), "12\n34\n44\n");
+
+    // 列を使わない式は各行で同じ値
+    std::ostringstream constant;
+    EXPECT_EQ(librpn::evaluateCsvFile(librpn::compile("2 ^ 10"), path, pool, constant, options), 3u);
+    EXPECT_EQ(constant.str(), "1024\n1024\n1024\n");
+    std::remove(path.c_str());
+    EXPECT_THROW(librpn::evaluateCsvFile(librpn::compile("a"), path, pool, out), std::runtime_error);
+}
+
+TEST_F(CsvTest, ReportsTheFailingLine) {
+    librpn::TaskPool pool(2);
+    librpn::CsvOptions options;
+    options.chunkBytes = 8;
+    std::string csv = "x,y\n1,2\n3,4\n\n5,oops\n7,8\n";
+    std::ostringstream out;
+    try {
+        librpn::evaluateCsv(librpn::compile("x + y"), csv.data(), csv.size(), pool, out, options);
+        FAIL() << "expected an exception";
+    } catch (const std::runtime_error& e) {
+        EXPECT_NE(std::string(e.what()).find("line 5"), std::string::npos) << e.what();
+        EXPECT_NE(std::string(e.what()).find("'oops'"), std::string::npos) << e.what();
+    }
+    EXPECT_EQ(out.str(), "3\n7\n");       // それより前の行の結果は書き出している
+
+    std::string shortRow = "x,y\n1\n";
+    EXPECT_THROW(librpn::evaluateCsv(librpn::compile("x + y"), shortRow.data(), shortRow.size(), pool, out),
+                 std::runtime_error);
+    EXPECT_THROW(librpn::evaluateCsv(librpn::compile("x + z"), csv.data(), csv.size(), pool, out),
+                 std::invalid_argument);
+}
+
+//==============================================================================
+// ヒープ確保の計測のテスト
+//==============================================================================
+
+class AllocationTest : public ::testing::Test {
+protected:
+    // 確保・解放の回数を数えて new_delete_resource に渡すリソース
+    struct CountingResource : std::pmr::memory_resource {
+        size_t allocations = 0;
+        size_t deallocations = 0;
+
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            ++allocations;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+            ++deallocations;
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+    };
+};
+
+TEST_F(AllocationTest, ScopesCountNestedCalls) {
+    librpn::AllocationScope outer;
+    std::string rpn;
+    librpn::AllocationStats inner;
+    {
+        librpn::AllocationScope scope;
+        rpn = librpn::infixToRPN("sqrt(16) + 2 × π × radius");
+        inner = scope.stats();
+    }
+    if (!librpn::allocationHooksEnabled()) {
+        EXPECT_EQ(inner.allocations, 0u);
+        EXPECT_EQ(outer.stats().allocations, 0u);
+        return;
+    }
+    EXPECT_GT(inner.allocations, 0u);
+    EXPECT_GE(inner.bytes, rpn.size());
+    EXPECT_GE(inner.peakLiveBytes, inner.liveBytes);
+    EXPECT_GT(inner.liveBytes, 0);                  // 返した文字列はまだ生きている
+    EXPECT_EQ(outer.stats().allocations, inner.allocations);
+    EXPECT_LE(inner.allocations, librpn::threadAllocations().allocations);
+}
+
+TEST_F(AllocationTest, ProfilesEachApiCall) {
+    librpn::resetAllocationProfile();
+    librpn::setAllocationProfiling(true);
+    for (int i = 0; i < 3; ++i) librpn::tokenize("max(3, 7) + √(16)");
+    librpn::infixToRPN("(1 + 2) * 3");
+    librpn::calculateRPN("1 2 + 3 *");
+    librpn::rpnToInfix("1 2 + 3 *");
+    librpn::setAllocationProfiling(false);
+    librpn::tokenize("1 + 2");                      // 停止後は数えない
+
+    librpn::CallProfile tokenize = librpn::allocationProfile(librpn::ProfiledCall::Tokenize);
+    if (!librpn::allocationHooksEnabled()) {
+        EXPECT_EQ(tokenize.calls, 0u);
+        return;
+    }
+    EXPECT_EQ(tokenize.calls, 3u);
+    EXPECT_EQ(tokenize.allocations % 3, 0u);        // 同じ式なら毎回同じ回数
+    EXPECT_GT(tokenize.peakLiveBytes, 0);
+    EXPECT_EQ(librpn::allocationProfile(librpn::ProfiledCall::InfixToRPN).calls, 1u);
+    EXPECT_EQ(librpn::allocationProfile(librpn::ProfiledCall::CalculateRPN).calls, 1u);
+    EXPECT_EQ(librpn::allocationProfile(librpn::ProfiledCall::RPNToInfix).calls, 1u);
+    EXPECT_GT(librpn::allocationProfile(librpn::ProfiledCall::RPNToInfix).bytes, 0u);
+    librpn::resetAllocationProfile();
+    EXPECT_EQ(librpn::allocationProfile(librpn::ProfiledCall::Tokenize).calls, 0u);
+}
+
+TEST_F(AllocationTest, AllocatesFromPluggedResource) {
+    CountingResource resource;
+    if (!librpn::allocationHooksEnabled()) {
+        EXPECT_THROW(librpn::AllocationScope scope(&resource), std::logic_error);
+        return;
+    }
+    std::vector<librpn::Token> tokens;
+    {
+        librpn::AllocationScope scope(&resource);
+        tokens = librpn::tokenize("longVariableName * anotherLongName + 1");
+        EXPECT_DOUBLE_EQ(librpn::calculateRPN("{ 1 2 3 } sum"), 6.0);
+        EXPECT_EQ(resource.allocations, scope.stats().allocations);
+    }
+    EXPECT_GT(resource.allocations, 0u);
+    EXPECT_LT(resource.deallocations, resource.allocations);
+
+    // 範囲の外で解放しても確保したリソースに返る
+    tokens = std::vector<librpn::Token>();
+    EXPECT_EQ(resource.deallocations, resource.allocations);
+}
+
+//==============================================================================
+// 数列（seq・linspace）の遅延リストのテスト
+//==============================================================================
+
+class ListSequenceTest : public ::testing::Test {};
+
+TEST_F(ListSequenceTest, GeneratesSequences) {
+    EXPECT_EQ(librpn::calculateRPNList("1 5 seq"), (std::vector<double>{1, 2, 3, 4, 5}));
+    EXPECT_EQ(librpn::calculateRPNList("{ 0.5 3 seq }"), (std::vector<double>{0.5, 1.5, 2.5}));
+    EXPECT_EQ(librpn::calculateRPNList("{ 0 1 5 linspace }"), (std::vector<double>{0, 0.25, 0.5, 0.75, 1}));
+    EXPECT_EQ(librpn::calculateRPNList("5 1 seq"), (std::vector<double>{}));
+    EXPECT_EQ(librpn::calculateRPNList("3 7 1 linspace"), (std::vector<double>{3}));
+
+    // 最後の要素は終点そのもの
+    std::vector<double> v = librpn::calculateRPNList("0.1 0.7 7 linspace");
+    ASSERT_EQ(v.size(), 7u);
+    EXPECT_EQ(v.back(), 0.7);
+
+    // 要素ごとの演算・中置記法・他の型
+    EXPECT_EQ(librpn::calculateRPNList("{ 1 3 seq } 10 * 1 +"), (std::vector<double>{11, 21, 31}));
+    EXPECT_EQ(librpn::calculateRPNList("1 3 seq { 4 5 6 } +"), (std::vector<double>{5, 7, 9}));
+    EXPECT_EQ(librpn::infixToRPN("sum{seq(1, n)^2}"), "{ 1 n seq 2 ^ } sum");
+    EXPECT_EQ(librpn::rpnToInfix("0 1 5 linspace"), "linspace(0, 1, 5)");
+    EXPECT_DOUBLE_EQ(librpn::evaluate(librpn::compile("sum{seq(1, n)}"), {100.0}), 5050.0);
+    EXPECT_FLOAT_EQ(librpn::calculateRPNAs<float>("{ 1 4 seq } 2 * sum"), 20.0f);
+    EXPECT_TRUE(librpn::usesListArithmetic(librpn::compile("seq(1, 3)").code));
+
+    EXPECT_THROW(librpn::calculateRPN("0 1 -1 linspace sum"), std::invalid_argument);
+    EXPECT_THROW(librpn::calculateRPN("0 1 2.5 linspace sum"), std::invalid_argument);
+    EXPECT_THROW(librpn::calculateRPN("{ 1 2 } 3 seq sum"), std::invalid_argument);
+    EXPECT_THROW(librpn::calculateRPN("0 1e300 seq sum"), std::invalid_argument);
+    EXPECT_THROW(librpn::calculateRPN("1 3 seq 1 4 seq + sum"), std::invalid_argument);
+}
+
+TEST_F(ListSequenceTest, FusedReductionsMatchMaterializedLists) {
+    // 同じ要素を作ってから（@name のリストとして）集約した結果とビット単位で一致する
+    const std::string expression = "1 10000 seq 0.001 * 2 ^ sin 1 10000 seq sqrt +";
+    std::vector<double> values = librpn::calculateRPNList(expression);
+    ASSERT_EQ(values.size(), 10000u);
+    EXPECT_EQ(values[9999], std::sin(std::pow(10.0, 2)) + 100.0);
+    librpn::registerList("sequence", values);
+    for (const char* reduction : {"sum", "product", "mean", "var", "sstddev", "lmax", "lmin", "range", "count",
+                                  "median"}) {
+        SCOPED_TRACE(reduction);
+        EXPECT_EQ(librpn::calculateRPN(expression + " " + reduction),
+                  librpn::calculateRPN(std::string("@sequence ") + reduction));
+    }
+    EXPECT_EQ(librpn::calculateRPN(expression + " 90 percentile"), librpn::calculateRPN("@sequence 90 percentile"));
+    librpn::unregisterList("sequence");
+}
+
+TEST_F(ListSequenceTest, ReductionsDoNotAllocatePerElement) {
+    // 確保の回数・バイト数は要素数によらない（要素はブロックごとに同じバッファに作る）
+    auto allocations = [](const std::string& count) {
+        std::string expression = "{ 1 " + count + " seq } 2 ^ { 0 1 " + count + " linspace } + stddev";
+        size_t count0 = heapAllocations();
+        size_t bytes0 = heapBytes();
+        double result = librpn::calculateRPN(expression);
+        EXPECT_TRUE(std::isfinite(result));
+        return std::make_pair(heapAllocations() - count0, heapBytes() - bytes0);
+    };
+    auto small = allocations("100000");
+    auto large = allocations("1000000");
+    EXPECT_EQ(small, large);
+    EXPECT_LT(large.second, 1000000 * sizeof(double));
+    EXPECT_DOUBLE_EQ(librpn::calculateRPN("{ 1 1000000 seq } sum"), 500000500000.0);
+
+    // 集約しない使い方では要素を作る
+    size_t before = heapBytes();
+    EXPECT_EQ(librpn::calculateRPNList("1 1000000 seq").size(), 1000000u);
+    EXPECT_GE(heapBytes() - before, 1000000 * sizeof(double));
+}
+
+//==============================================================================
+// 複数の統計量の一括計算のテスト
+//==============================================================================
+
+class StatisticsTest : public ::testing::Test {};
+
+TEST_F(StatisticsTest, MatchesIndividualListFunctions) {
+    std::mt19937 rng(46);
+    std::normal_distribution<double> dist(10.0, 3.0);
+    const char* names[] = {"count", "sum", "product", "mean", "var", "svar", "stddev", "sstddev",
+                           "lmin", "lmax", "range", "median", "iqr"};
+    for (size_t n : {0, 1, 2, 7, 1000, 1001}) {
+        std::vector<double> data(n);
+        for (double& x : data) x = std::round(dist(rng) * 8) / 8;   // 同じ値を含む
+        librpn::registerList("stats", data);
+        librpn::ListStatistics all = librpn::computeStatistics(librpn::ListView(data));
+        for (const char* name : names) {
+            SCOPED_TRACE(std::string(name) + " of " + std::to_string(n));
+            EXPECT_EQ(all[librpn::statisticFromName(name)],
+                      librpn::calculateRPN(std::string("@stats ") + name));
+            // 1つだけ求めても同じ
+            librpn::Statistic s = librpn::statisticFromName(name);
+            EXPECT_EQ(librpn::computeStatistics(librpn::ListView(data), librpn::statisticBit(s))[s], all[s]);
+        }
+    }
+    librpn::unregisterList("stats");
+}
+
+TEST_F(StatisticsTest, StatsListFunctionAndSubsets) {
+    EXPECT_EQ(librpn::calculateRPNList("{ 2 4 4 4 5 5 7 9 } stats"),
+              (std::vector<double>{8, 5, 2, 2, 9, 4.5}));
+    EXPECT_EQ(librpn::infixToRPN("stats{x, 2, 3}"), "{ x 2 3 } stats");
+    EXPECT_EQ(librpn::evaluateList(librpn::compile("stats{x, 2, 3}"), {1.0})[5], 2.0);
+    EXPECT_EQ(librpn::calculateRPNList("1 3 5 stats"), (std::vector<double>{3, 3, std::sqrt(8.0 / 3), 1, 5, 3}));
+    EXPECT_EQ(librpn::calculateRPNList("{ 1 4 seq } stats")[0], 4.0);
+    EXPECT_FLOAT_EQ(librpn::calculateRPNAs<float>("{ 1 2 3 } stats sum"), 3 + 2 + std::sqrt(2.0f / 3) + 1 + 3 + 2);
+    EXPECT_TRUE(librpn::usesListArithmetic(librpn::compile("stats{1, 2}").code));
+    EXPECT_THROW(librpn::calculateRPN("{ 1 2 } stats"), std::runtime_error);
+
+    // 求めなかった統計量は0
+    std::vector<double> v = {3, 1, 2};
+    librpn::ListStatistics s = librpn::computeStatistics(
+        librpn::ListView(v), librpn::statisticBit(librpn::Statistic::Median) | librpn::statisticBit(librpn::Statistic::Sum));
+    EXPECT_EQ(s[librpn::Statistic::Median], 2.0);
+    EXPECT_EQ(s[librpn::Statistic::Sum], 6.0);
+    EXPECT_EQ(s[librpn::Statistic::Max], 0.0);
+    EXPECT_EQ(v, (std::vector<double>{3, 1, 2}));     // 入力は並べ替えない
+
+    EXPECT_EQ(librpn::statisticFromName("ΣLIST"), librpn::Statistic::Sum);
+    EXPECT_THROW(librpn::statisticFromName("percentile"), std::invalid_argument);
+}
+
+//==============================================================================
+// リストのレジスタ（Evaluator::storeList）のテスト
+//==============================================================================
+
+class ListRegisterTest : public ::testing::Test {};
+
+TEST_F(ListRegisterTest, StoreRecallAndPurge) {
+    librpn::Evaluator ev;
+    std::shared_ptr<const librpn::ListData> xs = ev.storeList("xs", "{ 1 10 seq } 2 *");
+    EXPECT_EQ(xs->view.size(), 10u);
+    EXPECT_EQ(ev.calculateRPN("@xs sum"), 110.0);
+    EXPECT_EQ(ev.calculate("mean{@xs} + 1"), 12.0);
+    EXPECT_EQ(ev.recallList("xs"), xs);
+    EXPECT_EQ(ev.recallList("none"), nullptr);
+
+    // スカラーは要素1個、@name だけの式は同じデータを共有する
+    EXPECT_EQ(ev.storeList("one", "2 3 +")->view.size(), 1u);
+    EXPECT_EQ(ev.storeList("alias", "@xs"), xs);
+
+    // レジスタは登録表より優先し、他の Evaluator からは見えない
+    librpn::registerList("xs", std::vector<double>{100});
+    EXPECT_EQ(ev.calculateRPN("@xs sum"), 110.0);
+    EXPECT_EQ(librpn::calculateRPN("@xs sum"), 100.0);
+    librpn::Evaluator other;
+    EXPECT_EQ(other.calculateRPN("@xs sum"), 100.0);
+    other.storeList("shared", ev.recallList("xs"));
+    EXPECT_EQ(other.recallList("shared")->view.data(), xs->view.data());     // コピーしない
+
+    ev.shrink();
+    EXPECT_EQ(ev.calculateRPN("@xs lmax"), 20.0);
+    EXPECT_TRUE(ev.purgeList("xs"));
+    EXPECT_FALSE(ev.purgeList("xs"));
+    EXPECT_EQ(ev.calculateRPN("@xs sum"), 100.0);
+    librpn::unregisterList("xs");
+
+    EXPECT_THROW(ev.storeList("bad name", "{ 1 2 }"), std::invalid_argument);
+    EXPECT_THROW(ev.storeList("missing", "@nowhere"), std::out_of_range);
+    EXPECT_EQ(ev.recallList("missing"), nullptr);
+}
+
+TEST_F(ListRegisterTest, CachedOrderStatisticsMatchListFunctions) {
+    std::mt19937 rng(47);
+    std::normal_distribution<double> dist(0.0, 5.0);
+    const char* queries[] = {"sum", "ΣLIST", "mean", "median", "iqr", "{ 0 10 50 99.9 100 } percentile",
+                             "37.5 percentile"};
+    for (size_t n : {0, 1, 2, 9, 1000, 1001}) {
+        std::vector<double> data(n);
+        for (double& x : data) x = std::round(dist(rng) * 4) / 4;   // 同じ値を含む
+        librpn::registerList("data", data);
+        librpn::Evaluator ev;
+        std::shared_ptr<const librpn::ListData> stored = ev.storeList("r", "@data");
+        for (const char* query : queries) {
+            SCOPED_TRACE(std::string(query) + " of " + std::to_string(n));
+            // @r 1 * は登録済みのリストでなくなるため、通常のリスト関数で求める
+            std::vector<double> expected = librpn::calculateRPNList(std::string("@data 1 * ") + query);
+            EXPECT_EQ(librpn::calculateRPNList(std::string("@data ") + query), expected);
+            for (int repeat = 0; repeat < 2; ++repeat) {
+                ev.storeList("result", std::string("@r ") + query);
+                std::shared_ptr<const librpn::ListData> result = ev.recallList("result");
+                EXPECT_EQ(std::vector<double>(result->view.begin(), result->view.end()), expected);
+            }
+        }
+        EXPECT_THROW(ev.calculateRPN("@r 101 percentile"), std::invalid_argument);
+
+        // 2回目からは並べ替えた複製を再利用する
+        EXPECT_EQ(stored->sorted().data(), stored->sorted().data());
+        if (n >= 1000) {
+            size_t before = heapBytes();
+            ev.calculateRPN("@r median");
+            ev.calculateRPN("@r 99 percentile");
+            EXPECT_LT(heapBytes() - before, n * sizeof(double));
+        }
+    }
+    librpn::unregisterList("data");
+}
+
+TEST_F(ListRegisterTest, SharedAcrossThreads) {
+    std::vector<double> values(20000);
+    for (size_t i = 0; i < values.size(); ++i) values[i] = static_cast<double>((i * 7919) % values.size());
+    std::shared_ptr<const librpn::ListData> data = librpn::makeListData(values);
+
+    // 最初の参照が並行しても複製は1回だけ作る
+    std::vector<double> medians(16);
+    librpn::TaskPool pool(4);
+    pool.run(medians.size(), [&](size_t i) {
+        librpn::Evaluator ev;
+        ev.storeList("shared", data);
+        medians[i] = ev.calculateRPN("@shared median") + ev.calculateRPN("@shared 50 percentile");
+    });
+    for (double m : medians) EXPECT_EQ(m, 19999.0);
+
+    librpn::registerList("global", data);
+    EXPECT_EQ(librpn::calculateRPN("@global iqr"), 9999.5);
+    librpn::unregisterList("global");
+    EXPECT_THROW(librpn::registerList("null", std::shared_ptr<const librpn::ListData>()), std::invalid_argument);
+}
+
+//==============================================================================
+// ユーザー定義関数のテスト
+//==============================================================================
+
+class FunctionLibraryTest : public ::testing::Test {};
+
+TEST_F(FunctionLibraryTest, InlinesCallsIntoPlainPrograms) {
+    librpn::FunctionLibrary f;
+    f.define("hyp(a, b) = sqrt(a^2 + b^2)");
+    f.define("norm3(x, y, z) = hyp(hyp(x, y), z)");
+    f.define("twice", {"v"}, "2 * v");
+    f.define("tau() = 2 * π");
+    EXPECT_EQ(f.size(), 4u);
+    EXPECT_TRUE(f.contains("hyp"));
+
+    // 呼び出しのない通常のプログラムになる
+    librpn::Program p = f.compile("hyp(u + 1, v) * twice(u)");
+    EXPECT_EQ(librpn::formatRPN(p.code), "u 1 + 2 ^ v 2 ^ + sqrt 2 u * *");
+    EXPECT_EQ(p.variables, (std::vector<std::string>{"u", "v"}));
+    EXPECT_EQ(librpn::evaluate(p, {2.0, 4.0}), 5.0 * 4.0);
+    EXPECT_EQ(librpn::evaluate(f.compile("norm3(a, b, 12)"), {3.0, 4.0}), 13.0);
+    EXPECT_EQ(librpn::evaluate(f.compile("hyp(max(a, 0), {1, 2} mean)"), {-1.0}), 1.5);
+
+    // 数値だけの部分式は1つの数値にまとめる
+    EXPECT_EQ(f.infixToRPN("hyp(3, 4) + x"), "5 x +");
+    EXPECT_EQ(f.infixToRPN("tau()"), "6.283185307179586");
+    EXPECT_EQ(f.infixToRPN("norm3(3, 4, 12) * norm3(x, 4, 12)"), "13 x 2 ^ 16 + sqrt 2 ^ 144 + sqrt *");
+    EXPECT_EQ(f.infixToRPN("1 / 0 + twice(1)"), "1 0 / 2 +");     // 非有限の値はまとめない
+
+    // 呼び出される関数はあとから定義・置き換えできる
+    f.define("scaled(x) = factor(x) + 1");
+    EXPECT_THROW(f.compile("scaled(1)"), std::invalid_argument);
+    f.define("factor(x) = 10 * x");
+    EXPECT_EQ(librpn::evaluate(f.compile("scaled(k)"), {2.0}), 21.0);
+    f.define("factor(x) = x");
+    EXPECT_EQ(librpn::evaluate(f.compile("scaled(k)"), {2.0}), 3.0);
+    EXPECT_TRUE(f.remove("factor"));
+    EXPECT_FALSE(f.remove("factor"));
+}
+
+TEST_F(FunctionLibraryTest, RejectsRecursionAndMalformedDefinitions) {
+    librpn::FunctionLibrary f;
+    EXPECT_THROW(f.define("loop(x) = loop(x - 1)"), std::invalid_argument);
+    f.define("even(n) = n == 0 ? 1 : odd(n - 1)");
+    EXPECT_THROW(f.define("odd(n) = n == 0 ? 0 : even(n - 1)"), std::invalid_argument);
+    f.define("odd(n) = n");
+    f.define("a(x) = b(x)");
+    f.define("b(x) = c(x) + odd(x)");
+    EXPECT_THROW(f.define("c(x) = a(x)"), std::invalid_argument);
+    EXPECT_FALSE(f.contains("c"));
+
+    EXPECT_THROW(f.define("hyp(a, b) = sqrt(a^2 + c^2)"), std::invalid_argument);    // 仮引数でない名前
+    EXPECT_THROW(f.define("hyp(a, a) = a"), std::invalid_argument);
+    EXPECT_THROW(f.define("hyp(a,) = a"), std::invalid_argument);
+    EXPECT_THROW(f.define("hyp(a b) = a"), std::invalid_argument);
+    EXPECT_THROW(f.define("sqrt(x) = x"), std::invalid_argument);                    // 組み込みの関数
+    EXPECT_THROW(f.define("x == 1"), std::invalid_argument);
+    EXPECT_THROW(f.define("f(x) = "), std::invalid_argument);
+
+    f.define("ge(a, b) = a >= b");
+    EXPECT_EQ(librpn::evaluate(f.compile("ge(x, 2)"), {3.0}), 1.0);
+    EXPECT_THROW(f.compile("ge(1)"), std::invalid_argument);
+    EXPECT_THROW(f.compile("ge(1, )"), std::invalid_argument);
+    EXPECT_THROW(f.compile("ge(1, 2"), std::invalid_argument);
+    EXPECT_THROW(f.compile("nothing(1)"), std::invalid_argument);
+}
+
+//==============================================================================
+// コストの見積もりと受け入れ判定のテスト
+//==============================================================================
+
+class CostModelTest : public ::testing::Test {};
+
+TEST_F(CostModelTest, EstimatesShapeWithoutEvaluating) {
+    librpn::CostEstimate c = librpn::estimateCost(librpn::compileRPN("{ 1 2 3 } sin sum"));
+    EXPECT_EQ(c.tokens, 7u);
+    EXPECT_EQ(c.maxStackDepth, 3u);
+    EXPECT_EQ(c.maxListSize, 3u);
+    EXPECT_EQ(c.transcendentals, 3u);
+    EXPECT_EQ(c.elementOps, 9u);                // { } の複製・sin・sum
+    EXPECT_FALSE(c.unboundedLists);
+    EXPECT_GT(c.nanoseconds, 0.0);
+
+    EXPECT_EQ(librpn::estimateCost(librpn::compileRPN("1 2 3 4 + + +")).maxStackDepth, 4u);
+
+    // 数値だけの引数なら seq の要素数が決まる。変数で決まるなら unboundedLists
+    c = librpn::estimateCost(librpn::compileRPN("1 10 100 * seq 2 ^ sum"));
+    EXPECT_EQ(c.maxListSize, 1000u);
+    EXPECT_EQ(c.transcendentals, 1000u);
+    EXPECT_FALSE(c.unboundedLists);
+    EXPECT_TRUE(librpn::estimateCost(librpn::compile("sum(seq(1, n))")).unboundedLists);
+
+    // 登録済みのリストはその要素数、未登録の名前は評価時まで分からない
+    librpn::registerList("cost_test_prices", std::vector<double>(500, 1.0));
+    c = librpn::estimateCost(librpn::compileRPN("{ @cost_test_prices } 50 percentile"));
+    EXPECT_EQ(c.maxListSize, 500u);
+    EXPECT_EQ(c.orderedElements, 500u);
+    EXPECT_FALSE(c.unboundedLists);
+    librpn::unregisterList("cost_test_prices");
+    EXPECT_TRUE(librpn::estimateCost(librpn::compileRPN("{ @cost_test_prices } median")).unboundedLists);
+
+    // 基準ディレクトリの下のファイルも、見積もりでは開かない・登録しない
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "librpn_cost_test";
+    std::filesystem::create_directories(dir);
+    std::vector<double> values(100, 1.0);
+    std::FILE* file = std::fopen((dir / "cost.f64").c_str(), "wb");
+    ASSERT_NE(file, nullptr);
+    std::fwrite(values.data(), sizeof(double), values.size(), file);
+    std::fclose(file);
+    librpn::setListFileRoot(dir.string());
+    EXPECT_TRUE(librpn::estimateCost(librpn::compileRPN("@cost.f64 sum")).unboundedLists);
+    EXPECT_EQ(librpn::findListSource("@cost.f64"), nullptr);
+    EXPECT_EQ(librpn::calculateRPN("@cost.f64 sum"), 100.0);                // 評価では開く
+    EXPECT_EQ(librpn::estimateCost(librpn::compileRPN("@cost.f64 sum")).maxListSize, 100u);
+    librpn::setListFileRoot("");
+    librpn::unregisterList("cost.f64");
+}
+
+TEST_F(CostModelTest, AdmitsIsolatesAndRejects) {
+    librpn::CostModel model = librpn::calibrateCostModel();
+    EXPECT_GT(model.tokenNs, 0.0);
+    EXPECT_TRUE(std::isfinite(model.elementNs));
+    EXPECT_TRUE(std::isfinite(model.transcendentalNs));
+    EXPECT_TRUE(std::isfinite(model.orderedNs));
+
+    librpn::CostEstimate small = librpn::estimateCost(librpn::compile("x * 2 + 1"), model);
+    librpn::CostEstimate large = librpn::estimateCost(librpn::compileRPN("0 1 1000000 linspace sin sum"), model);
+    EXPECT_LT(small.nanoseconds, large.nanoseconds);
+
+    librpn::AdmissionLimits limits;
+    limits.isolateNanoseconds = small.nanoseconds * 10;
+    limits.maxNanoseconds = large.nanoseconds * 10;
+    EXPECT_EQ(librpn::admit(small, limits), librpn::Admission::Accept);
+    EXPECT_EQ(librpn::admit(large, limits), librpn::Admission::Isolate);
+    limits.maxListSize = 1000;
+    EXPECT_EQ(librpn::admit(large, limits), librpn::Admission::Reject);
+
+    librpn::CostEstimate unbounded = librpn::estimateCost(librpn::compile("sum(seq(1, n))"), model);
+    EXPECT_EQ(librpn::admit(unbounded, limits), librpn::Admission::Reject);
+    limits.rejectUnboundedLists = false;
+    EXPECT_EQ(librpn::admit(unbounded, limits), librpn::Admission::Isolate);
+}
+
+//==============================================================================
+// 評価の予算と取り消しのテスト
+//==============================================================================
+
+class EvaluationLimitsTest : public ::testing::Test {};
+
+TEST_F(EvaluationLimitsTest, BudgetStopsLargeListWork) {
+    librpn::Program scalar = librpn::compile("x * 2 + 1");
+    EXPECT_EQ(librpn::evaluate(scalar, {3.0}, librpn::EvaluationLimits{5}), 7.0);
+    EXPECT_THROW(librpn::evaluate(scalar, {3.0}, librpn::EvaluationLimits{4}), librpn::EvaluationAborted);
+
+    // 予算内なら上限を指定しない評価と同じ結果
+    librpn::Program sum = librpn::compileRPN("1 100000 seq 3 * sum");
+    librpn::Program window = librpn::compileRPN("{ 1 5 2 4 3 } 2 movavg");
+    EXPECT_EQ(librpn::evaluate(sum, {}, librpn::EvaluationLimits{1000000}), librpn::evaluate(sum));
+    EXPECT_EQ(librpn::evaluateList(window, {}, librpn::EvaluationLimits{100}), librpn::evaluateList(window));
+
+    // 演算を始める前に差し引く（要素を作る前に打ち切る）
+    librpn::Program huge = librpn::compileRPN("1 1e12 seq sin sum");
+    try {
+        librpn::evaluate(huge, {}, librpn::EvaluationLimits{1000000});
+        FAIL() << "expected EvaluationAborted";
+    } catch (const librpn::EvaluationAborted& e) {
+        EXPECT_EQ(e.reason(), librpn::AbortReason::BudgetExceeded);
+    }
+
+    // 打ち切られたあとも Evaluator をそのまま使える
+    librpn::Evaluator ev;
+    EXPECT_THROW(ev.evaluate(sum, {}, librpn::EvaluationLimits{1000}), librpn::EvaluationAborted);
+    EXPECT_EQ(ev.evaluate(sum), librpn::evaluate(sum));
+    EXPECT_EQ(ev.evaluate(librpn::compileRPN("{ 4 1 3 } median"), {}, librpn::EvaluationLimits{20}), 3.0);
+}
+
+TEST_F(EvaluationLimitsTest, CancellationInterruptsLongReductions) {
+    librpn::CancellationToken cancel;
+    librpn::EvaluationLimits limits{0, &cancel};
+    EXPECT_EQ(librpn::evaluate(librpn::compileRPN("1 2 +"), {}, limits), 3.0);
+
+    // 取り消し済みなら、短い式でも評価を始めない
+    cancel.cancel();
+    try {
+        librpn::evaluate(librpn::compile("1+2"), {}, limits);
+        FAIL() << "expected EvaluationAborted";
+    } catch (const librpn::EvaluationAborted& e) {
+        EXPECT_EQ(e.reason(), librpn::AbortReason::Cancelled);
+    }
+    librpn::Evaluator ev;
+    EXPECT_THROW(ev.evaluate(librpn::compile("x"), {1.0}, limits), librpn::EvaluationAborted);
+    EXPECT_EQ(ev.evaluate(librpn::compile("x"), {1.0}), 1.0);
+
+    // 取り消し済みなら、長いリストの演算は始める前に打ち切る
+    try {
+        librpn::evaluate(librpn::compileRPN("0 1 10000000 linspace sum"), {}, limits);
+        FAIL() << "expected EvaluationAborted";
+    } catch (const librpn::EvaluationAborted& e) {
+        EXPECT_EQ(e.reason(), librpn::AbortReason::Cancelled);
+    }
+    EXPECT_THROW(librpn::evaluate(librpn::compileRPN("{ 0 0 1e6 seq } sqrt sum"), {}, limits),
+                 librpn::EvaluationAborted);
+
+    // 別のスレッドからの取り消し（数十秒かかる集約を途中で止める）
+    cancel.reset();
+    librpn::Program slow = librpn::compileRPN("0 1 1e10 linspace sin sum");
+    std::thread canceller([&cancel]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        cancel.cancel();
+    });
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_THROW(librpn::evaluate(slow, {}, limits), librpn::EvaluationAborted);
+    canceller.join();
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+}
+
+TEST_F(EvaluationLimitsTest, OtherEntryPointsAcceptLimits) {
+    librpn::CancellationToken cancel;
+    auto expectCancelled = [&cancel](const std::function<void()>& f) {
+        cancel.cancel();
+        try {
+            f();
+            ADD_FAILURE() << "expected EvaluationAborted";
+        } catch (const librpn::EvaluationAborted& e) {
+            EXPECT_EQ(e.reason(), librpn::AbortReason::Cancelled);
+        }
+        cancel.reset();
+    };
+
+    // calculateRPN / calculateRPNList
+    EXPECT_EQ(librpn::calculateRPN("1 2 +", librpn::EvaluationLimits{3}), 3.0);
+    EXPECT_THROW(librpn::calculateRPN("1 2 +", librpn::EvaluationLimits{2}), librpn::EvaluationAborted);
+    EXPECT_EQ(librpn::calculateRPNList("{ 1 2 3 } 2 *", librpn::EvaluationLimits{20}),
+              (std::vector<double>{2, 4, 6}));
+    EXPECT_THROW(librpn::calculateRPNList("1 1e12 seq", librpn::EvaluationLimits{1000000}),
+                 librpn::EvaluationAborted);
+    expectCancelled([&]() { librpn::calculateRPN("1 2 +", librpn::EvaluationLimits{0, &cancel}); });
+
+    // evaluateBatch（1行につきトークン数）
+    librpn::Program p = librpn::compile("x * 2 + y");
+    const size_t rows = 1000;
+    std::vector<double> x(rows), y(rows), expected(rows), out(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        x[i] = 0.5 * i;
+        y[i] = 3.0 - i;
+    }
+    librpn::evaluateBatch(p, {x.data(), y.data()}, rows, expected.data());
+    librpn::evaluateBatch(p, {x.data(), y.data()}, rows, out.data(), librpn::EvaluationLimits{5 * rows});
+    EXPECT_EQ(out, expected);
+    EXPECT_THROW(librpn::evaluateBatch(p, {x.data(), y.data()}, rows, out.data(),
+                                       librpn::EvaluationLimits{5 * rows - 1}),
+                 librpn::EvaluationAborted);
+    expectCancelled([&]() {
+        librpn::evaluateBatch(p, {x.data(), y.data()}, rows, out.data(), librpn::EvaluationLimits{0, &cancel});
+    });
+
+    // StreamEvaluator（予算は式ごと。打ち切られたあとも次の式を受け取れる）
+    librpn::StreamEvaluator stream(librpn::EvaluationLimits{5, &cancel});
+    stream.feed("1 2 + 3 *");
+    EXPECT_EQ(stream.finish(), 9.0);
+    stream.feed("1 2 3 ");
+    stream.feed("+ +");
+    EXPECT_THROW(stream.feed(" 4 * "), librpn::EvaluationAborted);
+    EXPECT_EQ(stream.depth(), 0u);
+    stream.feed("2 3 +");
+    EXPECT_EQ(stream.finish(), 5.0);
+    expectCancelled([&]() { stream.feed("1"); });
+    stream.feed("7");
+    EXPECT_EQ(stream.finish(), 7.0);
+    stream.feed("1 1e12 seq");
+    EXPECT_THROW(stream.finishList(), librpn::EvaluationAborted);
+
+    // evaluateParallel
+    std::string expr = "x * 0.5";
+    for (int i = 1; i < 2000; ++i) expr += " + x * " + std::to_string(i) + ".5";
+    librpn::Program big = librpn::compile(expr);
+    librpn::ParallelOptions options;
+    options.grain = 512;
+    librpn::ParallelProgram plan = librpn::planParallel(big, options);
+    ASSERT_TRUE(plan.parallel());
+    librpn::TaskPool pool(4);
+    EXPECT_EQ(librpn::evaluateParallel(plan, pool, {1.5}, librpn::EvaluationLimits{1000000}),
+              librpn::evaluate(big, {1.5}));
+    EXPECT_THROW(librpn::evaluateParallel(plan, pool, {1.5}, librpn::EvaluationLimits{100}),
+                 librpn::EvaluationAborted);
+    expectCancelled([&]() { librpn::evaluateParallel(plan, pool, {1.5}, librpn::EvaluationLimits{0, &cancel}); });
+}